@@ -46,8 +46,11 @@
 #include "NFmiWeatherAndCloudiness.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <fstream>
+#include <limits>
 #include <numeric>
 #include <stdexcept>
 #include <thread>
@@ -564,6 +567,576 @@ NFmiQueryData *NFmiQueryDataUtil::CreateEmptyData(NFmiQueryInfo &srcInfo,
   return data;
 }
 
+namespace
+{
+// Kopioitavan palan maksimikoko kerrallaan, ettei välipuskuri kasva koko parametrin kokoiseksi
+const size_t gMaxSlabCopyChunkSize = 4 * 1024 * 1024;
+// Säikeelle kerralla annettavan kopiointityön tavoitekoko (arvoja)
+const size_t gSlabCopyTaskSize = 1024 * 1024;
+
+const std::vector<unsigned long> &GetSlabDimensionIndexes(const NFmiSlabCopyIndexes &theIndexes,
+                                                          int theDimension)
+{
+  switch (theDimension)
+  {
+    case 0:
+      return theIndexes.itsParamIndexes;
+    case 1:
+      return theIndexes.itsLocationIndexes;
+    case 2:
+      return theIndexes.itsLevelIndexes;
+    default:
+      return theIndexes.itsTimeIndexes;
+  }
+}
+
+unsigned long GetSlabDimensionSize(NFmiFastQueryInfo &theInfo, int theDimension)
+{
+  switch (theDimension)
+  {
+    case 0:
+      return theInfo.SizeParams();
+    case 1:
+      return theInfo.SizeLocations();
+    case 2:
+      return theInfo.SizeLevels();
+    default:
+      return theInfo.SizeTimes();
+  }
+}
+
+// Onko dimensio kopioitavissa sellaisenaan, eli indeksit ovat 0, 1, 2, ... molemmissa
+bool IsFullSlabDimension(const std::vector<unsigned long> &theIndexes,
+                         unsigned long theSourceSize,
+                         unsigned long theTargetSize)
+{
+  if (theIndexes.size() != theTargetSize || theSourceSize != theTargetSize) return false;
+  for (size_t i = 0; i < theIndexes.size(); i++)
+    if (theIndexes[i] != i) return false;
+  return true;
+}
+
+// Kopioi yhtenäisen palan. NFmiQueryInfo::FloatValue(float) ei asettanut ei-äärellisiä arvoja,
+// joten ne jäävät myös tässä puuttuviksi.
+size_t CopyValueBlock(NFmiFastQueryInfo &theSourceInfo,
+                      NFmiFastQueryInfo &theTargetInfo,
+                      size_t theSourceIndex,
+                      size_t theTargetIndex,
+                      size_t theSourceStep,
+                      size_t theTargetStep,
+                      size_t theCount,
+                      std::vector<float> &theBuffer)
+{
+  size_t copiedCount = 0;
+  while (copiedCount < theCount)
+  {
+    size_t count = std::min(theCount - copiedCount, gMaxSlabCopyChunkSize);
+    if (!theSourceInfo.GetValues(
+            theSourceIndex + copiedCount * theSourceStep, theSourceStep, count, theBuffer))
+      break;
+    for (auto &value : theBuffer)
+      if (!::FmiIsValidNumber(value)) value = kFloatMissing;
+    if (!theTargetInfo.SetValues(
+            theTargetIndex + copiedCount * theTargetStep, theTargetStep, count, theBuffer))
+      break;
+    copiedCount += count;
+  }
+  return copiedCount;
+}
+
+// Peräkkäisten aika-indeksien jakso, joka voidaan kopioida yhtenäisenä palana, koska aika on
+// querydatan sisin dimensio. Samoja jaksoja käytetään myös paikoille ja leveleille, jos sisemmät
+// dimensiot ovat molemmissa datoissa samat.
+struct TimeIndexRun
+{
+  unsigned long itsSourceTimeIndex;
+  unsigned long itsTargetTimeIndex;
+  unsigned long itsCount;
+};
+
+std::vector<TimeIndexRun> MakeTimeIndexRuns(const std::vector<unsigned long> &theSourceTimeIndexes,
+                                            const std::vector<unsigned long> &theTargetTimeIndexes)
+{
+  std::vector<TimeIndexRun> runs;
+  for (size_t i = 0; i < theSourceTimeIndexes.size(); i++)
+  {
+    if (!runs.empty())
+    {
+      TimeIndexRun &last = runs.back();
+      if (theSourceTimeIndexes[i] == last.itsSourceTimeIndex + last.itsCount &&
+          theTargetTimeIndexes[i] == last.itsTargetTimeIndex + last.itsCount)
+      {
+        last.itsCount++;
+        continue;
+      }
+    }
+    TimeIndexRun run = {theSourceTimeIndexes[i], theTargetTimeIndexes[i], 1};
+    runs.push_back(run);
+  }
+  return runs;
+}
+
+// Jaksot kohdedatan indeksien mukaan tehdystä lähdeindeksitaulukosta, puuttuvat ohitetaan
+std::vector<TimeIndexRun> MakeTimeIndexRuns(const std::vector<unsigned long> &theIndexes)
+{
+  std::vector<unsigned long> sourceIndexes;
+  std::vector<unsigned long> targetIndexes;
+  for (size_t i = 0; i < theIndexes.size(); i++)
+  {
+    if (theIndexes[i] == gMissingIndex) continue;
+    sourceIndexes.push_back(theIndexes[i]);
+    targetIndexes.push_back(static_cast<unsigned long>(i));
+  }
+  return MakeTimeIndexRuns(sourceIndexes, targetIndexes);
+}
+
+class SlabCopier
+{
+ public:
+  SlabCopier(NFmiFastQueryInfo &theSourceInfo,
+             NFmiFastQueryInfo &theTargetInfo,
+             const NFmiSlabCopyIndexes &theIndexes)
+      : itsSourceInfo(theSourceInfo),
+        itsTargetInfo(theTargetInfo),
+        itsIndexes(theIndexes),
+        itsRunDimension(0),
+        itsInnerSize(1),
+        fCopyOverLocations(false),
+        itsRuns(),
+        itsLocationStart(0),
+        itsLocationEnd(0),
+        itsCopiedCount(0),
+        itsBuffer()
+  {
+    // Etsitään sisin dimensio, jota ei voi kopioida sellaisenaan. Sitä sisemmät dimensiot
+    // ovat molemmissa datoissa samat, joten sen peräkkäiset indeksit ovat yhtenäisiä paloja.
+    // Parametrit kopioidaan aina yksi kerrallaan, jotta työ voidaan jakaa säikeille.
+    for (itsRunDimension = 3; itsRunDimension > 0; itsRunDimension--)
+    {
+      unsigned long sourceSize = ::GetSlabDimensionSize(itsSourceInfo, itsRunDimension);
+      unsigned long targetSize = ::GetSlabDimensionSize(itsTargetInfo, itsRunDimension);
+      if (!::IsFullSlabDimension(
+              ::GetSlabDimensionIndexes(itsIndexes, itsRunDimension), sourceSize, targetSize))
+        break;
+      itsInnerSize *= targetSize;
+    }
+    if (itsRunDimension > 0)
+      itsRuns = ::MakeTimeIndexRuns(::GetSlabDimensionIndexes(itsIndexes, itsRunDimension));
+
+    // Jos paikat ovat samat ja aika-askeleet eivät ole peräkkäisiä, kukin aika-askel voidaan
+    // kopioida askeltaen yhdellä kutsulla kaikille paikoille.
+    fCopyOverLocations = (itsRunDimension == 3) && !HasTimeRuns() &&
+                         ::IsFullSlabDimension(itsIndexes.itsLocationIndexes,
+                                               itsSourceInfo.SizeLocations(),
+                                               itsTargetInfo.SizeLocations());
+  }
+
+  // Voiko parametrin paikat jakaa osiin (ei, jos koko parametri on yksi yhtenäinen pala)
+  bool CanSplitLocations() const { return itsRunDimension > 0; }
+
+  // Kopioi kohdedatan parametrin arvot kohdepaikoille [theLocationStart, theLocationEnd)
+  size_t Copy(unsigned long theParamIndex,
+              unsigned long theLocationStart,
+              unsigned long theLocationEnd)
+  {
+    itsCopiedCount = 0;
+    unsigned long sourceParamIndex = itsIndexes.itsParamIndexes[theParamIndex];
+    if (sourceParamIndex == gMissingIndex) return 0;
+
+    if (itsRunDimension == 0)
+      itsCopiedCount += ::CopyValueBlock(itsSourceInfo,
+                                         itsTargetInfo,
+                                         itsSourceInfo.Index(sourceParamIndex, 0, 0, 0),
+                                         itsTargetInfo.Index(theParamIndex, 0, 0, 0),
+                                         1,
+                                         1,
+                                         itsInnerSize,
+                                         itsBuffer);
+    else
+    {
+      itsLocationStart = theLocationStart;
+      itsLocationEnd = theLocationEnd;
+      CopyDimension(1, sourceParamIndex, 0, 0, theParamIndex, 0);
+    }
+    return itsCopiedCount;
+  }
+
+ private:
+  void CopyDimension(int theDimension,
+                     unsigned long sp,
+                     unsigned long sl,
+                     unsigned long sv,
+                     unsigned long tp,
+                     unsigned long tl,
+                     unsigned long tv = 0)
+  {
+    const std::vector<unsigned long> &indexes =
+        ::GetSlabDimensionIndexes(itsIndexes, theDimension);
+    unsigned long begin = 0;
+    unsigned long end = static_cast<unsigned long>(indexes.size());
+    if (theDimension == 1)
+    {
+      begin = itsLocationStart;
+      end = itsLocationEnd;
+    }
+    if (theDimension == itsRunDimension)
+    {
+      CopyRuns(begin, end, sp, sl, sv, tp, tl, tv);
+      return;
+    }
+    // Kaikkien paikkojen yhteinen kopio tehdään ensimmäisen paikan kohdalla
+    if (theDimension == 1 && fCopyOverLocations) end = std::min(end, begin + 1);
+
+    for (unsigned long i = begin; i < end; i++)
+    {
+      unsigned long s = indexes[i];
+      if (s == gMissingIndex) continue;
+      if (theDimension == 1)
+        CopyDimension(2, sp, s, 0, tp, i);
+      else
+        CopyDimension(3, sp, sl, s, tp, tl, i);
+    }
+  }
+
+  bool HasTimeRuns() const
+  {
+    for (const auto &run : ::MakeTimeIndexRuns(itsIndexes.itsTimeIndexes))
+      if (run.itsCount > 1) return true;
+    return false;
+  }
+
+  static void SetDimensionIndex(int theDimension,
+                                unsigned long theIndex,
+                                unsigned long &l,
+                                unsigned long &v,
+                                unsigned long &t)
+  {
+    if (theDimension == 1)
+      l = theIndex;
+    else if (theDimension == 2)
+      v = theIndex;
+    else
+      t = theIndex;
+  }
+
+  // Kopioi jaksot, jotka osuvat kohdeindekseille [theBegin, theEnd)
+  void CopyRuns(unsigned long theBegin,
+                unsigned long theEnd,
+                unsigned long sp,
+                unsigned long sl,
+                unsigned long sv,
+                unsigned long tp,
+                unsigned long tl,
+                unsigned long tv)
+  {
+    for (const auto &run : itsRuns)
+    {
+      unsigned long i = std::max(run.itsTargetTimeIndex, theBegin);
+      unsigned long end = std::min(run.itsTargetTimeIndex + run.itsCount, theEnd);
+      if (i >= end) continue;
+      unsigned long sourceStart = run.itsSourceTimeIndex + (i - run.itsTargetTimeIndex);
+      unsigned long runLength = end - i;
+
+      unsigned long sourceTime = 0, targetTime = 0;
+      SetDimensionIndex(itsRunDimension, sourceStart, sl, sv, sourceTime);
+      SetDimensionIndex(itsRunDimension, i, tl, tv, targetTime);
+      if (fCopyOverLocations)
+      {
+        // Yksittäinen aika-askel kopioidaan kaikille paikoille kerralla askeltaen
+        itsCopiedCount += ::CopyValueBlock(
+            itsSourceInfo,
+            itsTargetInfo,
+            itsSourceInfo.Index(sp, sl, sv, sourceTime),
+            itsTargetInfo.Index(tp, tl, tv, targetTime),
+            itsSourceInfo.SizeLevels() * itsSourceInfo.SizeTimes(),
+            itsTargetInfo.SizeLevels() * itsTargetInfo.SizeTimes(),
+            itsLocationEnd - itsLocationStart,
+            itsBuffer);
+      }
+      else
+        itsCopiedCount += ::CopyValueBlock(itsSourceInfo,
+                                           itsTargetInfo,
+                                           itsSourceInfo.Index(sp, sl, sv, sourceTime),
+                                           itsTargetInfo.Index(tp, tl, tv, targetTime),
+                                           1,
+                                           1,
+                                           runLength * itsInnerSize,
+                                           itsBuffer);
+    }
+  }
+
+  NFmiFastQueryInfo &itsSourceInfo;
+  NFmiFastQueryInfo &itsTargetInfo;
+  const NFmiSlabCopyIndexes &itsIndexes;
+  int itsRunDimension;
+  size_t itsInnerSize;
+  bool fCopyOverLocations;
+  std::vector<TimeIndexRun> itsRuns;
+  unsigned long itsLocationStart;
+  unsigned long itsLocationEnd;
+  size_t itsCopiedCount;
+  std::vector<float> itsBuffer;
+};
+
+// Yksi säikeelle annettava kopiointityö: kohdedatan parametri ja sen paikkaväli [start, end)
+struct SlabCopyTask
+{
+  unsigned long itsParamIndex;
+  unsigned long itsLocationStart;
+  unsigned long itsLocationEnd;
+};
+
+// Infoja ei liikuteta (kopiointi tehdään suoraan indekseillä raakadatasta toiseen),
+// joten säikeet voivat käyttää samoja infoja.
+void CopySlabsInThread(NFmiFastQueryInfo &theSourceInfo,
+                       NFmiFastQueryInfo &theTargetInfo,
+                       const NFmiSlabCopyIndexes &theIndexes,
+                       const std::vector<SlabCopyTask> &theTasks,
+                       NFmiLocationIndexRangeCalculator &theTaskIndexRangeCalculator,
+                       size_t &theCopiedCountOut)
+{
+  SlabCopier copier(theSourceInfo, theTargetInfo, theIndexes);
+  unsigned long startIndex = 0;
+  unsigned long endIndex = 0;
+  for (; theTaskIndexRangeCalculator.GetCurrentLocationRange(startIndex, endIndex);)
+  {
+    for (unsigned long taskIndex = startIndex; taskIndex <= endIndex; taskIndex++)
+    {
+      const SlabCopyTask &task = theTasks[taskIndex];
+      theCopiedCountOut +=
+          copier.Copy(task.itsParamIndex, task.itsLocationStart, task.itsLocationEnd);
+    }
+  }
+}
+
+void MakeSlabParamIndexes(NFmiFastQueryInfo &theSourceInfo,
+                          NFmiFastQueryInfo &theTargetInfo,
+                          NFmiSlabCopyIndexes &theIndexes)
+{
+  theIndexes.itsParamIndexes.clear();
+  for (theTargetInfo.ResetParam(); theTargetInfo.NextParam();)
+  {
+    unsigned long index = gMissingIndex;
+    if (theSourceInfo.Param(static_cast<FmiParameterName>(theTargetInfo.Param().GetParamIdent())) &&
+        !theSourceInfo.IsSubParamUsed())
+      index = theSourceInfo.ParamIndex();
+    theIndexes.itsParamIndexes.push_back(index);
+  }
+}
+
+void MakeSlabLevelIndexes(NFmiFastQueryInfo &theSourceInfo,
+                          NFmiFastQueryInfo &theTargetInfo,
+                          NFmiSlabCopyIndexes &theIndexes)
+{
+  theIndexes.itsLevelIndexes.clear();
+  bool groundData = (theSourceInfo.SizeLevels() == 1) && (theTargetInfo.SizeLevels() == 1);
+  for (theTargetInfo.ResetLevel(); theTargetInfo.NextLevel();)
+  {
+    unsigned long index = gMissingIndex;
+    if (groundData)
+      index = 0;
+    else if (theSourceInfo.Level(*theTargetInfo.Level()))
+      index = theSourceInfo.LevelIndex();
+    theIndexes.itsLevelIndexes.push_back(index);
+  }
+}
+
+void MakeSlabTimeIndexes(NFmiFastQueryInfo &theSourceInfo,
+                         NFmiFastQueryInfo &theTargetInfo,
+                         NFmiSlabCopyIndexes &theIndexes)
+{
+  theIndexes.itsTimeIndexes.clear();
+  for (theTargetInfo.ResetTime(); theTargetInfo.NextTime();)
+  {
+    unsigned long index = gMissingIndex;
+    if (theSourceInfo.Time(theTargetInfo.Time())) index = theSourceInfo.TimeIndex();
+    theIndexes.itsTimeIndexes.push_back(index);
+  }
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * Laskee kohdedatan parametreja, paikkoja, levelejä ja aikoja vastaavat lähdedatan indeksit.
+ * Parametrit etsitään id:n mukaan (aliparametreja ei oteta mukaan), levelit levelin mukaan
+ * (jos molemmissa vain yksi leveli, niitä ei verrata) ja ajat tarkalla ajalla. Saman kokoisten
+ * hilojen ja samojen asemalistojen paikat vastaavat toisiaan suoraan, muuten asemat etsitään
+ * id:n mukaan. Palauttaa false, jos paikkoja ei voi sovittaa (esim. eri kokoiset hilat).
+ */
+// ----------------------------------------------------------------------
+
+bool NFmiQueryDataUtil::MakeSlabCopyIndexes(NFmiFastQueryInfo &theSourceInfo,
+                                            NFmiFastQueryInfo &theTargetInfo,
+                                            NFmiSlabCopyIndexes &theIndexesOut)
+{
+  NFmiSlabCopyIndexes indexes;
+  ::MakeSlabParamIndexes(theSourceInfo, theTargetInfo, indexes);
+
+  bool sourceIsGrid = theSourceInfo.Grid() != nullptr;
+  bool targetIsGrid = theTargetInfo.Grid() != nullptr;
+  if (sourceIsGrid != targetIsGrid) return false;
+  if (sourceIsGrid && theSourceInfo.SizeLocations() != theTargetInfo.SizeLocations()) return false;
+  bool sameLocations = sourceIsGrid;
+  if (!sourceIsGrid && theSourceInfo.SizeLocations() == theTargetInfo.SizeLocations())
+  {
+    sameLocations = true;
+    for (theSourceInfo.ResetLocation(), theTargetInfo.ResetLocation();
+         theSourceInfo.NextLocation() && theTargetInfo.NextLocation();)
+    {
+      if (theSourceInfo.Location()->GetIdent() != theTargetInfo.Location()->GetIdent())
+      {
+        sameLocations = false;
+        break;
+      }
+    }
+  }
+  for (theTargetInfo.ResetLocation(); theTargetInfo.NextLocation();)
+  {
+    unsigned long index = gMissingIndex;
+    if (sameLocations)
+      index = theTargetInfo.LocationIndex();
+    else if (theSourceInfo.Location(theTargetInfo.Location()->GetIdent()))
+      index = theSourceInfo.LocationIndex();
+    indexes.itsLocationIndexes.push_back(index);
+  }
+
+  ::MakeSlabLevelIndexes(theSourceInfo, theTargetInfo, indexes);
+  ::MakeSlabTimeIndexes(theSourceInfo, theTargetInfo, indexes);
+
+  theIndexesOut = indexes;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * Laskee indeksit lähdehilan osa-alueen kopioimiseksi kohdehilaan. Osa-alue alkaa
+ * lähdehilan pisteestä (theLeft, theBottom) ja siitä otetaan joka theXStep:s sarake ja
+ * theYStep:s rivi kohdehilan koon verran. Parametrit, levelit ja ajat sovitetaan kuten
+ * MakeSlabCopyIndexes:issa. Palauttaa false, jos datat eivät ole hiladatoja tai osa-alue
+ * ei mahdu lähdehilaan.
+ */
+// ----------------------------------------------------------------------
+
+bool NFmiQueryDataUtil::MakeGridCropIndexes(NFmiFastQueryInfo &theSourceInfo,
+                                            NFmiFastQueryInfo &theTargetInfo,
+                                            int theLeft,
+                                            int theBottom,
+                                            int theXStep,
+                                            int theYStep,
+                                            NFmiSlabCopyIndexes &theIndexesOut)
+{
+  if (!theSourceInfo.Grid() || !theTargetInfo.Grid()) return false;
+  int sourceXSize = theSourceInfo.Grid()->XNumber();
+  int sourceYSize = theSourceInfo.Grid()->YNumber();
+  int targetXSize = theTargetInfo.Grid()->XNumber();
+  int targetYSize = theTargetInfo.Grid()->YNumber();
+  if (theLeft < 0 || theBottom < 0 || theXStep < 1 || theYStep < 1) return false;
+  if (theLeft + (targetXSize - 1) * theXStep >= sourceXSize ||
+      theBottom + (targetYSize - 1) * theYStep >= sourceYSize)
+    return false;
+
+  NFmiSlabCopyIndexes indexes;
+  ::MakeSlabParamIndexes(theSourceInfo, theTargetInfo, indexes);
+
+  // Hilan paikkaindeksi kasvaa ensin x-suunnassa vasemmalta oikealle ja sitten alhaalta ylös
+  indexes.itsLocationIndexes.reserve(static_cast<size_t>(targetXSize) * targetYSize);
+  for (int y = 0; y < targetYSize; y++)
+  {
+    unsigned long rowStart = static_cast<unsigned long>(theBottom + y * theYStep) * sourceXSize;
+    for (int x = 0; x < targetXSize; x++)
+      indexes.itsLocationIndexes.push_back(rowStart + theLeft + x * theXStep);
+  }
+
+  ::MakeSlabLevelIndexes(theSourceInfo, theTargetInfo, indexes);
+  ::MakeSlabTimeIndexes(theSourceInfo, theTargetInfo, indexes);
+
+  theIndexesOut = indexes;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * Kopioi lähdedatasta kohdedataan annettujen indeksien mukaiset arvot. Koska aika on
+ * querydatan sisin ja parametri uloin dimensio, peräkkäiset indeksit ja kokonaan kopioitavat
+ * sisemmät dimensiot yhdistetään mahdollisimman suuriksi yhtenäisiksi paloiksi, jotka
+ * kopioidaan suoraan raakadatasta toiseen (myös memory mapped tulosdataan). Esim. hilan
+ * rajauksessa kukin rivi on yksi pala. Työ jaetaan parametreittain ja paikkaväleittäin
+ * theMaxThreadCount säikeelle (0 = käytetään järkevää määrää koneen säikeistä). Palauttaa
+ * kopioitujen arvojen määrän.
+ */
+// ----------------------------------------------------------------------
+
+size_t NFmiQueryDataUtil::CopySlabs(NFmiFastQueryInfo &theSourceInfo,
+                                    NFmiFastQueryInfo &theTargetInfo,
+                                    const NFmiSlabCopyIndexes &theIndexes,
+                                    unsigned int theMaxThreadCount)
+{
+  if (theIndexes.itsParamIndexes.size() != theTargetInfo.SizeParams() ||
+      theIndexes.itsLocationIndexes.size() != theTargetInfo.SizeLocations() ||
+      theIndexes.itsLevelIndexes.size() != theTargetInfo.SizeLevels() ||
+      theIndexes.itsTimeIndexes.size() != theTargetInfo.SizeTimes())
+    throw std::runtime_error("CopySlabs: index counts don't match the target data");
+
+  // Raakadataa luetaan ja kirjoitetaan suoraan, aliparametreja ei saa olla päällä
+  theSourceInfo.ParamIndex(0);
+  theTargetInfo.ParamIndex(0);
+  SlabCopier copier(theSourceInfo, theTargetInfo, theIndexes);
+
+  unsigned long locationSize = theTargetInfo.SizeLocations();
+  unsigned long locationChunkSize = locationSize;
+  if (copier.CanSplitLocations())
+  {
+    size_t valuesPerLocation =
+        std::max<size_t>(1, theTargetInfo.SizeLevels() * theTargetInfo.SizeTimes());
+    locationChunkSize = static_cast<unsigned long>(
+        std::max<size_t>(1, gSlabCopyTaskSize / valuesPerLocation));
+  }
+
+  std::vector<SlabCopyTask> tasks;
+  for (unsigned long paramIndex = 0; paramIndex < theIndexes.itsParamIndexes.size(); paramIndex++)
+  {
+    if (theIndexes.itsParamIndexes[paramIndex] == gMissingIndex) continue;
+    for (unsigned long start = 0; start < locationSize; start += locationChunkSize)
+      tasks.push_back(
+          SlabCopyTask{paramIndex, start, std::min(start + locationChunkSize, locationSize)});
+  }
+
+  unsigned int threadCount = 1;
+  if (theMaxThreadCount != 1 && tasks.size() > 1)
+  {
+    threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+        75, static_cast<unsigned int>(tasks.size()));
+    if (theMaxThreadCount > 0) threadCount = std::min(threadCount, theMaxThreadCount);
+  }
+
+  size_t copiedCount = 0;
+  if (threadCount <= 1)
+  {
+    for (const auto &task : tasks)
+      copiedCount += copier.Copy(task.itsParamIndex, task.itsLocationStart, task.itsLocationEnd);
+    return copiedCount;
+  }
+
+  NFmiLocationIndexRangeCalculator taskIndexRangeCalculator(
+      static_cast<unsigned long>(tasks.size()), 1);
+  std::vector<size_t> copiedCounts(threadCount, 0);
+  boost::thread_group copyParts;
+  for (unsigned int i = 0; i < threadCount; i++)
+    copyParts.add_thread(new boost::thread(::CopySlabsInThread,
+                                           boost::ref(theSourceInfo),
+                                           boost::ref(theTargetInfo),
+                                           boost::cref(theIndexes),
+                                           boost::cref(tasks),
+                                           boost::ref(taskIndexRangeCalculator),
+                                           boost::ref(copiedCounts[i])));
+  copyParts.join_all();  // odotetaan että threadit lopettavat
+
+  for (auto count : copiedCounts)
+    copiedCount += count;
+  return copiedCount;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * Luo uuden QDatan, jossa on vain halutut parametrit. Voidaan käyttää
@@ -591,8 +1164,15 @@ NFmiQueryData *NFmiQueryDataUtil::ExtractParams(NFmiQueryData *theSourceData,
   {
     NFmiFastQueryInfo sourceInfo(theSourceData);
     NFmiFastQueryInfo destInfo(destData);
+    NFmiSlabCopyIndexes indexes;
+    if (MakeSlabCopyIndexes(sourceInfo, destInfo, indexes))
+      CopySlabs(sourceInfo, destInfo, indexes);
+    // Aliparametrit puretaan arvo kerrallaan
     for (destInfo.ResetParam(); destInfo.NextParam();)
     {
+      if (!indexes.itsParamIndexes.empty() &&
+          indexes.itsParamIndexes[destInfo.ParamIndex()] != gMissingIndex)
+        continue;  // kopioitu jo yllä
       if (!sourceInfo.Param(*destInfo.Param().GetParam()))  // pyytää infolta Param().GetParam(),
                                                             // jolloin palautetaan NFmiParam,
                                                             // jolloin etsittäessä parametria
@@ -1014,26 +1594,8 @@ NFmiQueryData *NFmiQueryDataUtil::ExtractTimes(const NFmiQueryData *theSourceDat
   {
     NFmiFastQueryInfo sourceInfo(const_cast<NFmiQueryData *>(theSourceData));
     NFmiFastQueryInfo destInfo(destData);
-    for (destInfo.ResetTime(); destInfo.NextTime();)
-    {
-      if (sourceInfo.Time(destInfo.Time()))
-      {
-        for (destInfo.ResetParam(), sourceInfo.ResetParam();
-             destInfo.NextParam() && sourceInfo.NextParam();)
-        {
-          for (destInfo.ResetLocation(), sourceInfo.ResetLocation();
-               destInfo.NextLocation() && sourceInfo.NextLocation();)
-          {
-            for (destInfo.ResetLevel(), sourceInfo.ResetLevel();
-                 destInfo.NextLevel() && sourceInfo.NextLevel();)
-            {
-              float value = sourceInfo.FloatValue();
-              destInfo.FloatValue(value);
-            }
-          }
-        }
-      }
-    }
+    NFmiSlabCopyIndexes indexes;
+    if (MakeSlabCopyIndexes(sourceInfo, destInfo, indexes)) CopySlabs(sourceInfo, destInfo, indexes);
     if (destData)  // lisataan tuottaja id tieto, jos lahdedatasta sita loytyy
       AddProducerIds(destInfo, sourceInfo);
   }
@@ -1093,6 +1655,408 @@ bool FillSimilarDataWithDifferentTimeEnds(NFmiFastQueryInfo *theDestination,
   return fullFill;
 }
 
+namespace
+{
+// Yhden kohdeajan aikainterpolointi 'haarukka' lähdedatassa. Lähteen aika-indeksit ja painot
+// ovat samat kaikille parametreille, paikoille ja leveleille, joten ne lasketaan vain kerran.
+// Laskut tehdään samalla tavalla kuin NFmiQueryInfo::InterpolatedValueFromTimeBag:issa ja
+// aiemmassa arvo kerrallaan tehdyssä lagrange interpoloinnissa, jotta tulokset pysyvät samoina.
+struct TimeInterpolationBracket
+{
+  TimeInterpolationBracket(const NFmiMetTime &theTime)
+      : itsTime(theTime),
+        itsExactTimeIndex(-1),
+        itsTimeOffset(0),
+        itsBackwardIndex(-1),
+        itsForwardIndex(-1),
+        itsLagrangeStartIndex(-1),
+        itsLagrangeWeights()
+  {
+  }
+
+  bool IsInside() const { return itsBackwardIndex >= 0; }
+
+  NFmiMetTime itsTime;
+  int itsExactTimeIndex;  // >= 0 jos aika löytyy suoraan lähdedatasta
+  float itsTimeOffset;    // kohdeajan paikka lähteen aika-askelina sen 1. ajasta
+  int itsBackwardIndex;   // tästä lähtien haetaan taaksepäin ei puuttuvaa arvoa, -1 jos ulkona
+  int itsForwardIndex;    // tästä lähtien haetaan eteenpäin ei puuttuvaa arvoa
+  int itsLagrangeStartIndex;  // 1. lagrange pisteen aika-indeksi, -1 jos ei laskettavissa
+  std::vector<double> itsLagrangeWeights;
+};
+
+std::vector<double> CalcLagrangeWeights(const std::vector<double> &theTimes,
+                                        double theInterpolatedTimePlace)
+{
+  // Painot saadaan NFmiLagrange:lta interpoloimalla yksikkövektoreita, jolloin summa
+  // w0*v0 + w1*v1 + ... lasketaan täsmälleen kuten NFmiLagrange::Interpolate tekisi.
+  int pointCount = static_cast<int>(theTimes.size());
+  std::vector<double> weights(pointCount);
+  std::vector<double> unitValues(pointCount, 0.);
+  NFmiLagrange lagrange;
+  for (int i = 0; i < pointCount; i++)
+  {
+    unitValues.assign(pointCount, 0.);
+    unitValues[i] = 1.;
+    lagrange.Init(&theTimes[0], &unitValues[0], pointCount);
+    weights[i] = lagrange.Interpolate(theInterpolatedTimePlace);
+  }
+  return weights;
+}
+
+void CalcLagrangeBracket(TimeInterpolationBracket &theBracket,
+                         int theSourceTimeSize,
+                         int theTimeResolution,
+                         int theMinuteOffset,
+                         int theMaxTimeSearchRangeInMinutes)
+{
+  // TimeToNearestStep(t, kBackward, maxRange) epäonnistuu jos edellinen aika on liian kaukana
+  int backwardIndex = theBracket.itsBackwardIndex;
+  long minutesFromBackwardTime = theMinuteOffset - backwardIndex * theTimeResolution;
+  auto timeRange = static_cast<unsigned long>(theMaxTimeSearchRangeInMinutes);
+  if (!(timeRange == kUnsignedLongMissing ||
+        minutesFromBackwardTime <= static_cast<long>(timeRange)))
+    return;
+
+  std::vector<double> times;
+  if (backwardIndex == 0)
+  {
+    times = {0, 1, 2};
+    theBracket.itsLagrangeStartIndex = 0;
+  }
+  else if (backwardIndex == theSourceTimeSize - 2)
+  {
+    times = {-1, 0, 1};
+    theBracket.itsLagrangeStartIndex = backwardIndex - 1;
+  }
+  else if (backwardIndex > theSourceTimeSize - 2)
+    return;
+  else
+  {
+    times = {-1, 0, 1, 2};
+    theBracket.itsLagrangeStartIndex = backwardIndex - 1;
+  }
+  double timePlace =
+      static_cast<double>(minutesFromBackwardTime) / static_cast<double>(theTimeResolution);
+  theBracket.itsLagrangeWeights = ::CalcLagrangeWeights(times, timePlace);
+}
+
+std::vector<TimeInterpolationBracket> MakeTimeInterpolationBrackets(
+    NFmiFastQueryInfo &theDestination,
+    NFmiFastQueryInfo &theSource,
+    int theMaxTimeSearchRangeInMinutes,
+    bool fUseLagrange)
+{
+  std::vector<TimeInterpolationBracket> brackets;
+  const NFmiTimeBag *timeBag = theSource.TimeDescriptor().ValidTimeBag();
+  int sourceTimeSize = static_cast<int>(theSource.SizeTimes());
+  for (theDestination.ResetTime(); theDestination.NextTime();)
+  {
+    TimeInterpolationBracket bracket(theDestination.Time());
+    if (theSource.Time(bracket.itsTime))
+      bracket.itsExactTimeIndex = static_cast<int>(theSource.TimeIndex());
+    else if (timeBag && timeBag->Resolution() != 0 && timeBag->IsInside(bracket.itsTime))
+    {
+      int timeResolution = timeBag->Resolution();
+      int minuteOffset = bracket.itsTime.DifferenceInMinutes(timeBag->FirstTime());
+      bracket.itsTimeOffset = float(minuteOffset) / timeResolution;
+      bracket.itsBackwardIndex = static_cast<int>(floor(bracket.itsTimeOffset));
+      bracket.itsForwardIndex = static_cast<int>(ceil(bracket.itsTimeOffset));
+      if (bracket.itsBackwardIndex == bracket.itsForwardIndex) bracket.itsForwardIndex++;
+      if (fUseLagrange)
+        ::CalcLagrangeBracket(bracket,
+                              sourceTimeSize,
+                              timeResolution,
+                              minuteOffset,
+                              theMaxTimeSearchRangeInMinutes);
+    }
+    brackets.push_back(bracket);
+  }
+  return brackets;
+}
+
+// Aikasarjan laskentatapa parametreittain, vrt. NFmiQueryInfo::InterpolatedValueFromTimeBag
+enum TimeInterpolationKernel
+{
+  kTimeKernelPerValue,  // yhdistelmäparametrit yms. lasketaan arvo kerrallaan infon avulla
+  kTimeKernelLinear,
+  kTimeKernelNearest,
+  kTimeKernelWindDirection,
+  kTimeKernelWaveDirection,
+  kTimeKernelWindVector
+};
+
+struct TimeInterpolationParam
+{
+  unsigned long itsParamIndex;
+  unsigned long itsWindSpeedParamIndex;
+  TimeInterpolationKernel itsKernel;
+  bool fUseLagrange;
+  NFmiQueryDataUtil::LimitChecker itsLimitChecker;
+};
+
+std::vector<TimeInterpolationParam> MakeTimeInterpolationParams(NFmiFastQueryInfo &theSource,
+                                                                bool fUseLagrange)
+{
+  unsigned long windSpeedParamIndex = gMissingIndex;
+  if (theSource.Param(kFmiWindSpeedMS) && !theSource.IsSubParamUsed())
+    windSpeedParamIndex = theSource.ParamIndex();
+
+  std::vector<TimeInterpolationParam> params;
+  for (theSource.ResetParam(); theSource.NextParam();)
+  {
+    const NFmiParam *param = theSource.Param().GetParam();
+    FmiInterpolationMethod interp = param->InterpolationMethod();
+    unsigned long paramId = param->GetIdent();
+    TimeInterpolationKernel kernel = kTimeKernelLinear;
+    if (interp == kByCombinedParam || paramId == kFmiTotalWindMS)
+      kernel = kTimeKernelPerValue;
+    else if (interp != kLinearly)
+      kernel = kTimeKernelNearest;
+    else if (paramId == kFmiWindDirection)
+      kernel = (windSpeedParamIndex != gMissingIndex) ? kTimeKernelWindDirection
+                                                      : kTimeKernelPerValue;
+    else if (paramId == kFmiWaveDirection)
+      kernel = kTimeKernelWaveDirection;
+    else if (paramId == kFmiWindVectorMS)
+      kernel = kTimeKernelWindVector;
+
+    TimeInterpolationParam timeParam = {
+        theSource.ParamIndex(),
+        windSpeedParamIndex,
+        kernel,
+        fUseLagrange && (interp == kLinearly || interp == kLagrange),
+        NFmiQueryDataUtil::LimitChecker(static_cast<float>(param->MinValue()),
+                                        static_cast<float>(param->MaxValue()),
+                                        IsParamCircularValued(param))};
+    params.push_back(timeParam);
+  }
+  return params;
+}
+
+inline bool IsValidTimeInterpolationValue(float theValue)
+{
+  return !(theValue == kFloatMissing || theValue == kTCombinedWeatherFloatMissing);
+}
+
+// Jokaiselle aika-indeksille lähin ei puuttuva arvo taaksepäin ja eteenpäin, jolloin
+// puuttuvien arvojen yli hyppääminen ei vaadi hakua jokaiselle kohdeajalle erikseen.
+void CalcNearestValidTimeIndexes(const std::vector<float> &theValues,
+                                 std::vector<int> &theBackwardIndexes,
+                                 std::vector<int> &theForwardIndexes)
+{
+  int sizeTimes = static_cast<int>(theValues.size());
+  theBackwardIndexes.resize(sizeTimes);
+  theForwardIndexes.resize(sizeTimes);
+  int lastValidIndex = -1;
+  for (int i = 0; i < sizeTimes; i++)
+  {
+    if (::IsValidTimeInterpolationValue(theValues[i])) lastValidIndex = i;
+    theBackwardIndexes[i] = lastValidIndex;
+  }
+  lastValidIndex = sizeTimes;
+  for (int i = sizeTimes - 1; i >= 0; i--)
+  {
+    if (::IsValidTimeInterpolationValue(theValues[i])) lastValidIndex = i;
+    theForwardIndexes[i] = lastValidIndex;
+  }
+}
+
+float LagrangeTimeInterpolationValue(const std::vector<float> &theValues,
+                                     const TimeInterpolationBracket &theBracket,
+                                     const NFmiQueryDataUtil::LimitChecker &theLimitChecker)
+{
+  if (theBracket.itsLagrangeStartIndex < 0) return kFloatMissing;
+  size_t startIndex = theBracket.itsLagrangeStartIndex;
+  size_t pointCount = theBracket.itsLagrangeWeights.size();
+  if (startIndex + pointCount > theValues.size()) return kFloatMissing;
+
+  double sum = 0.0;
+  for (size_t i = 0; i < pointCount; i++)
+  {
+    double value = theValues[startIndex + i];
+    if (value == kFloatMissing) return kFloatMissing;
+    sum += value * theBracket.itsLagrangeWeights[i];
+  }
+  return theLimitChecker.GetInsideLimitsValue(static_cast<float>(sum));
+}
+
+float LinearTimeInterpolationValue(const std::vector<float> &theValues,
+                                   const std::vector<float> &theWindSpeedValues,
+                                   const std::vector<int> &theBackwardIndexes,
+                                   const std::vector<int> &theForwardIndexes,
+                                   const TimeInterpolationBracket &theBracket,
+                                   TimeInterpolationKernel theKernel,
+                                   int theMaxTimeSearchRangeInMinutes,
+                                   int theTimeResolution)
+{
+  int sizeTimes = static_cast<int>(theValues.size());
+  int index1 = theBackwardIndexes[std::min(theBracket.itsBackwardIndex, sizeTimes - 1)];
+  int index2 = (theBracket.itsForwardIndex < sizeTimes)
+                   ? theForwardIndexes[theBracket.itsForwardIndex]
+                   : sizeTimes;
+  if (index1 < 0 || index2 >= sizeTimes) return kFloatMissing;
+
+  float timeOffset = theBracket.itsTimeOffset;
+  if (theMaxTimeSearchRangeInMinutes &&
+      (theMaxTimeSearchRangeInMinutes < (timeOffset - index1) * theTimeResolution ||
+       theMaxTimeSearchRangeInMinutes < (index2 - timeOffset) * theTimeResolution))
+    return kFloatMissing;
+
+  float value1 = theValues[index1];
+  float value2 = theValues[index2];
+  float offset1 = (index2 - timeOffset) / (index2 - index1);
+  switch (theKernel)
+  {
+    case kTimeKernelNearest:
+      return (offset1 > 0.5) ? value1 : value2;
+    case kTimeKernelWindDirection:
+    {
+      NFmiInterpolation::WindInterpolator windInterpolator;
+      windInterpolator(theWindSpeedValues[index1], value1, offset1);
+      windInterpolator(theWindSpeedValues[index2], value2, (1 - offset1));
+      return static_cast<float>(windInterpolator.Direction());
+    }
+    case kTimeKernelWaveDirection:
+      return static_cast<float>(NFmiInterpolation::ModLinear(offset1, value1, value2, 360));
+    case kTimeKernelWindVector:
+      return static_cast<float>(NFmiInterpolation::WindVector(offset1, value1, value2));
+    default:
+      return float(offset1 * value1 + (1.f - offset1) * value2);
+  }
+}
+
+// Laskee annetun paikkavälin kaikkien parametrien ja levelien aikasarjat. Aika on querydatan
+// sisin dimensio, joten jokainen lähde- ja kohdeaikasarja luetaan ja kirjoitetaan yhtenä palana.
+void InterpolateTimesInThread(NFmiFastQueryInfo &theDestination,
+                              NFmiFastQueryInfo &theSource,
+                              const std::vector<TimeInterpolationBracket> &theBrackets,
+                              const std::vector<TimeInterpolationParam> &theParams,
+                              NFmiLocationIndexRangeCalculator &theLocationIndexRangeCalculator,
+                              int theMaxTimeSearchRangeInMinutes,
+                              unsigned long &theMissingValueCountOut)
+{
+  const size_t sourceTimeSize = theSource.SizeTimes();
+  const size_t destinationTimeSize = theBrackets.size();
+  const NFmiTimeBag *timeBag = theSource.TimeDescriptor().ValidTimeBag();
+  int timeResolution = 0;
+  if (timeBag) timeResolution = timeBag->Resolution();
+  std::vector<float> sourceValues;
+  std::vector<float> windSpeedValues;
+  std::vector<float> resultValues(destinationTimeSize, kFloatMissing);
+  std::vector<int> backwardIndexes;
+  std::vector<int> forwardIndexes;
+
+  unsigned long startIndex = 0;
+  unsigned long endIndex = 0;
+  for (; theLocationIndexRangeCalculator.GetCurrentLocationRange(startIndex, endIndex);)
+  {
+    for (unsigned long locationIndex = startIndex; locationIndex <= endIndex; locationIndex++)
+    {
+      for (const auto &param : theParams)
+      {
+        for (unsigned long levelIndex = 0; levelIndex < theSource.SizeLevels(); levelIndex++)
+        {
+          size_t sourceIndex = theSource.Index(param.itsParamIndex, locationIndex, levelIndex, 0);
+          if (!theSource.GetValues(sourceIndex, 1, sourceTimeSize, sourceValues)) continue;
+          if (param.itsKernel == kTimeKernelWindDirection)
+            theSource.GetValues(
+                theSource.Index(param.itsWindSpeedParamIndex, locationIndex, levelIndex, 0),
+                1,
+                sourceTimeSize,
+                windSpeedValues);
+          if (param.itsKernel == kTimeKernelPerValue)
+          {
+            theSource.ParamIndex(param.itsParamIndex);
+            theSource.LocationIndex(locationIndex);
+            theSource.LevelIndex(levelIndex);
+          }
+          else if (!param.fUseLagrange)
+            ::CalcNearestValidTimeIndexes(sourceValues, backwardIndexes, forwardIndexes);
+
+          for (size_t i = 0; i < destinationTimeSize; i++)
+          {
+            const TimeInterpolationBracket &bracket = theBrackets[i];
+            float value = kFloatMissing;
+            if (bracket.itsExactTimeIndex >= 0)
+              value = sourceValues[bracket.itsExactTimeIndex];
+            else if (param.fUseLagrange)
+              value = ::LagrangeTimeInterpolationValue(
+                  sourceValues, bracket, param.itsLimitChecker);
+            else if (param.itsKernel == kTimeKernelPerValue)
+              value = theSource.InterpolatedValue(bracket.itsTime, theMaxTimeSearchRangeInMinutes);
+            else if (bracket.IsInside())
+              value = ::LinearTimeInterpolationValue(sourceValues,
+                                                     windSpeedValues,
+                                                     backwardIndexes,
+                                                     forwardIndexes,
+                                                     bracket,
+                                                     param.itsKernel,
+                                                     theMaxTimeSearchRangeInMinutes,
+                                                     timeResolution);
+            // NFmiQueryInfo::FloatValue(float) ei asettanut ei-äärellisiä arvoja
+            if (!::FmiIsValidNumber(value)) value = kFloatMissing;
+            if (!::IsValidTimeInterpolationValue(value)) theMissingValueCountOut++;
+            resultValues[i] = value;
+          }
+          theDestination.SetValues(
+              theDestination.Index(param.itsParamIndex, locationIndex, levelIndex, 0),
+              1,
+              destinationTimeSize,
+              resultValues);
+        }
+      }
+    }
+  }
+}
+
+// Interpoloi timebagillisen lähdedatan ajat kohdedatan aikoihin. Datoilla pitää olla samat
+// parametrit, paikat ja levelit. Paikat jaetaan työ-threadeille. Palauttaa true, jos kaikkiin
+// kohtiin saatiin arvo.
+bool InterpolateSimilarDataTimes(NFmiFastQueryInfo &theDestination,
+                                 NFmiFastQueryInfo &theSource,
+                                 int theMaxTimeSearchRangeInMinutes,
+                                 bool fUseLagrange)
+{
+  std::vector<TimeInterpolationBracket> brackets = ::MakeTimeInterpolationBrackets(
+      theDestination, theSource, theMaxTimeSearchRangeInMinutes, fUseLagrange);
+  std::vector<TimeInterpolationParam> params =
+      ::MakeTimeInterpolationParams(theSource, fUseLagrange);
+  unsigned long locationSize = theSource.SizeLocations();
+  if (brackets.empty() || params.empty() || locationSize == 0) return true;
+
+  const unsigned long chunkSize = 16;
+  unsigned int threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+      75, (locationSize + chunkSize - 1) / chunkSize);
+  if (threadCount == 0) threadCount = 1;
+  NFmiLocationIndexRangeCalculator locationIndexRangeCalculator(locationSize, chunkSize);
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo>> sourceInfos;
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo>> destinationInfos;
+  std::vector<unsigned long> missingValueCounts(threadCount, 0);
+  for (unsigned int i = 0; i < threadCount; i++)
+  {
+    sourceInfos.push_back(boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theSource)));
+    destinationInfos.push_back(
+        boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theDestination)));
+  }
+
+  boost::thread_group calcParts;
+  for (unsigned int i = 0; i < threadCount; i++)
+    calcParts.add_thread(new boost::thread(::InterpolateTimesInThread,
+                                           boost::ref(*destinationInfos[i]),
+                                           boost::ref(*sourceInfos[i]),
+                                           boost::cref(brackets),
+                                           boost::cref(params),
+                                           boost::ref(locationIndexRangeCalculator),
+                                           theMaxTimeSearchRangeInMinutes,
+                                           boost::ref(missingValueCounts[i])));
+  calcParts.join_all();  // odotetaan että threadit lopettavat
+
+  return std::accumulate(missingValueCounts.begin(), missingValueCounts.end(), 0ul) == 0;
+}
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  *  Ottaa kaiken minkä voi sourcesta dest:iin, jos destissä on puuttuvaa(!)
@@ -1116,48 +2080,16 @@ bool FillSimilarDataWithDifferentTimeEnds(NFmiFastQueryInfo *theDestination,
  * \todo Poista kayttamaton theTimeResolutionRatio parametri
  */
 // ----------------------------------------------------------------------
-
-bool InterpolateSimilarDataToLargerTimeResolution(NFmiFastQueryInfo *theDestination,
-                                                  NFmiFastQueryInfo *theSource,
-                                                  float /* theTimeResolutionRatio */,
-                                                  int theMaxTimeSearchRangeInMinutes)
-{
-  bool fullFill = false;
-  if (theDestination && theSource)
-  {
-    float value = kFloatMissing;
-    float sourceValue = kFloatMissing;
-    fullFill = true;
-    NFmiDataModifierMode modeModifier;
-    for (theDestination->ResetTime(); theDestination->NextTime();)
-    {
-      NFmiMetTime t(theDestination->Time());
-      theSource->Time(t);
-      for (theDestination->ResetParam(), theSource->ResetParam();
-           theDestination->NextParam() && theSource->NextParam();)
-      {
-        for (theDestination->ResetLocation(), theSource->ResetLocation();
-             theDestination->NextLocation() && theSource->NextLocation();)
-        {
-          for (theDestination->ResetLevel(), theSource->ResetLevel();
-               theDestination->NextLevel() && theSource->NextLevel();)
-          {
-            value = theDestination->FloatValue();
-            if (value == kFloatMissing || value == kTCombinedWeatherFloatMissing)
-            {
-              sourceValue = theSource->InterpolatedValue(t, theMaxTimeSearchRangeInMinutes);
-              if (sourceValue == kFloatMissing || sourceValue == kTCombinedWeatherFloatMissing)
-                fullFill = false;  // yhdenkin kerran kun menee tänne, tiedetään että jokin osa
-                                   // datasta puuttuu vielä
-              else
-                theDestination->FloatValue(sourceValue);
-            }
-          }  // for(location)-looppi
-        }    // for(param)-looppi
-      }      // for(level)-looppi
-    }        // for(time)-looppi
-  }
-  return fullFill;
+
+bool InterpolateSimilarDataToLargerTimeResolution(NFmiFastQueryInfo *theDestination,
+                                                  NFmiFastQueryInfo *theSource,
+                                                  float /* theTimeResolutionRatio */,
+                                                  int theMaxTimeSearchRangeInMinutes)
+{
+  if (theDestination && theSource)
+    return ::InterpolateSimilarDataTimes(
+        *theDestination, *theSource, theMaxTimeSearchRangeInMinutes, false);
+  return false;
 }
 
 // ----------------------------------------------------------------------
@@ -1185,94 +2117,6 @@ float GetLagrangeValue(std::vector<double> &theValueVec,
   }
 }
 
-// ----------------------------------------------------------------------
-/*!
- * TheInterpolatedTimePlace on interpoloitavan ajan paikka 0 - 1 avaruudessa
- * niiden kahden aikapisteen välissä, jotka ovat lähinnä interpoloitavaa
- * pistettä lähdedatassa.
- *
- * \param theInfo Undocumented
- * \param theTime Undocumented
- * \param theInterpolationMethod Undocumented
- * \param theMaxTimeSearchRangeInMinutes Undocumented
- * \param theOneStepBeforeTimeIndex Undocumented
- * \param theInterpolatedTimePlace Undocumented
- * \param theParamInterpMethod Undocumented
- * \param theLimitChecker Undocumented
- * \return Undocumented
- */
-// ----------------------------------------------------------------------
-
-float TimeInterpolationValue(NFmiFastQueryInfo &theInfo,
-                             const NFmiMetTime &theTime,
-                             FmiInterpolationMethod theInterpolationMethod,
-                             int theMaxTimeSearchRangeInMinutes,
-                             unsigned long theOneStepBeforeTimeIndex,
-                             double theInterpolatedTimePlace,
-                             FmiInterpolationMethod theParamInterpMethod,
-                             NFmiQueryDataUtil::LimitChecker &theLimitChecker)
-{
-  if (theInterpolationMethod != kLagrange ||
-      !(theParamInterpMethod == kLinearly || theParamInterpMethod == kLagrange))
-    return theInfo.InterpolatedValue(theTime, theMaxTimeSearchRangeInMinutes);
-  else
-  {
-    float value = kFloatMissing;
-    unsigned long oldTimeIndex = theInfo.TimeIndex();
-    theInfo.TimeIndex(theOneStepBeforeTimeIndex);
-    if (theOneStepBeforeTimeIndex ==
-        0)  // case: annettu index timebagin alku rajalla, eli tehdään interpolointi 3:lla arvolla
-    {
-      std::vector<double> valueVec(3);
-      std::vector<double> timeVec(
-          3);  // yllä olevien arvojen suhteelliset paikat aika-avaruudessa (0 - 1)
-      timeVec[0] = 0;
-      timeVec[1] = 1;
-      timeVec[2] = 2;
-      valueVec[0] = theInfo.PeekTimeValue(0);
-      valueVec[1] = theInfo.PeekTimeValue(1);
-      valueVec[2] = theInfo.PeekTimeValue(2);
-      value = GetLagrangeValue(valueVec, timeVec, theInterpolatedTimePlace);
-    }
-    else if (theOneStepBeforeTimeIndex == theInfo.SizeTimes() - 2)  // case: annettu index timebagin
-                                                                    // loppu rajalla, eli tehdään
-                                                                    // interpolointi 3:lla arvolla
-    {
-      std::vector<double> valueVec(3);
-      std::vector<double> timeVec(
-          3);  // yllä olevien arvojen suhteelliset paikat aika-avaruudessa (0 - 1)
-      timeVec[0] = -1;
-      timeVec[1] = 0;
-      timeVec[2] = 1;
-      valueVec[0] = theInfo.PeekTimeValue(-1);
-      valueVec[1] = theInfo.PeekTimeValue(0);
-      valueVec[2] = theInfo.PeekTimeValue(1);
-      value = GetLagrangeValue(valueVec, timeVec, theInterpolatedTimePlace);
-    }
-    else if (theOneStepBeforeTimeIndex >
-             theInfo.SizeTimes() - 2)  // ei voi interpoloida, annettu indeksi väärin?
-      value = kFloatMissing;
-    else  // muuten tehdään normaali 4:n pisteen interpolointi
-    {
-      std::vector<double> valueVec(4);
-      std::vector<double> timeVec(
-          4);  // yllä olevien arvojen suhteelliset paikat aika-avaruudessa (0 - 1)
-      timeVec[0] = -1;
-      timeVec[1] = 0;
-      timeVec[2] = 1;
-      timeVec[3] = 2;
-      valueVec[0] = theInfo.PeekTimeValue(-1);
-      valueVec[1] = theInfo.PeekTimeValue(0);
-      valueVec[2] = theInfo.PeekTimeValue(1);
-      valueVec[3] = theInfo.PeekTimeValue(2);
-      value = GetLagrangeValue(valueVec, timeVec, theInterpolatedTimePlace);
-    }
-    theInfo.TimeIndex(oldTimeIndex);  // palautetaan varmuuden vuoksi originaali index (vaikka
-                                      // minusta se on turhaa)
-    return theLimitChecker.GetInsideLimitsValue(value);
-  }
-}
-
 // ----------------------------------------------------------------------
 /*!
  *  Laskee muutuva aikaresoluutioiselle datalle aikainterpoloinnin.
@@ -1379,67 +2223,11 @@ bool InterpolateSimilarDataToSmallerTimeResolution(NFmiFastQueryInfo *theDestina
   bool fullFill = false;
   if (theDestination && theSource)
   {
-    float sourceValue = kFloatMissing;
-    bool useLagrange = theInterpolationMethod == kLagrange;
-    unsigned long lagrangeTimeIndex = 0;  // tähän laitetaan interpoloitavaa aikaa lähin edeltävän
-                                          // ajan aikaindeksi, joka löytyy lähdedatasta
-    double lagrangeTimePosition = 0;  // tähän laitetaan interpoloitavan ajan paikka 0 - 1
-    // avaruudessa niiden kahden aikapisteen välissä, jotka ovat
-    // lähinnä interpoloitavaa pistettä lähdedatassa.
+    ::InterpolateSimilarDataTimes(*theDestination,
+                                  *theSource,
+                                  theMaxTimeSearchRangeInMinutes,
+                                  theInterpolationMethod == kLagrange);
     fullFill = true;
-    for (theDestination->ResetTime(); theDestination->NextTime();)
-    {
-      NFmiMetTime t(theDestination->Time());
-      bool timeStatus = theSource->Time(t);
-      if (useLagrange && (!timeStatus))
-      {  // tehdään lagrange intepolointia varten tarvittavat laskut
-        theSource->TimeToNearestStep(t, kBackward, theMaxTimeSearchRangeInMinutes);
-        lagrangeTimeIndex = theSource->TimeIndex();
-        NFmiMetTime time1(theSource->Time());
-        theSource->NextTime();
-        NFmiMetTime time2(theSource->Time());
-        lagrangeTimePosition = static_cast<double>(t.DifferenceInMinutes(time1)) /
-                               static_cast<double>(time2.DifferenceInMinutes(time1));
-      }
-      for (theDestination->ResetParam(), theSource->ResetParam();
-           theDestination->NextParam() && theSource->NextParam();)
-      {
-        const NFmiParam *tmpParam = theDestination->Param().GetParam();
-        NFmiQueryDataUtil::LimitChecker checkerWithLagrangeInterpolation(
-            static_cast<float>(tmpParam->MinValue()),
-            static_cast<float>(tmpParam->MaxValue()),
-            IsParamCircularValued(tmpParam));
-        FmiInterpolationMethod paramInterpMethod =
-            theDestination->Param().GetParam()->InterpolationMethod();
-        for (theDestination->ResetLocation(), theSource->ResetLocation();
-             theDestination->NextLocation() && theSource->NextLocation();)
-        {
-          for (theDestination->ResetLevel(), theSource->ResetLevel();
-               theDestination->NextLevel() && theSource->NextLevel();)
-          {
-            sourceValue = theSource->FloatValue();  // palauttaa puuttuvaa jos aika ei ollut
-                                                    // kohdallaan vain fastqueryinfossa!!!
-            if (timeStatus &&
-                !(sourceValue == kFloatMissing || sourceValue == kTCombinedWeatherFloatMissing))
-            {
-              theDestination->FloatValue(sourceValue);
-            }
-            else  // pitää interpoloida
-            {
-              float tempV = TimeInterpolationValue(*theSource,
-                                                   t,
-                                                   theInterpolationMethod,
-                                                   theMaxTimeSearchRangeInMinutes,
-                                                   lagrangeTimeIndex,
-                                                   lagrangeTimePosition,
-                                                   paramInterpMethod,
-                                                   checkerWithLagrangeInterpolation);
-              theDestination->FloatValue(tempV);
-            }
-          }
-        }
-      }
-    }
   }
   return fullFill;
 }
@@ -3907,97 +4695,464 @@ NFmiDataModifier *CreateModifier(int theFilterId)
   }
 }
 
-// ----------------------------------------------------------------------
-/*!
- *  Tämä ohjelma lukee stdin:in annetun qdatan, luo uuden datan jossa sama
- *  rakenne. Filtteri laskee sourceDatasta tulosDataan arvot halutulla
- *  suhteellisella aikavälillä arvot halutulla filtterillä. Esim. laskee
- *  +-3 tunnin keskiarvot kaikkialle eli tasoittaa dataa jonkin verran. \par
- *  Käyttö: \par
- *  type sourceData | doTimeFiltering.exe filterId relTimeOffsetStartInMinutes
- *relTimeOffsetEndInMinutes > tulosData \par
- *
- *  Offsetit pyöristetään lähimpiin sourceDatan aika-askeleisiin. Filtteri
- *  funktiot: 0 = avg, 1 = max, 2 = min (EI VIELÄ KÄYTÖSSÄ! 3 = wavg), 4=NFmiSmoother tasoitus,
- *  5 = sum filtterit. Jos haluat tasoittaa tuntidataa laskien keskiarvon yli 7
- *  tunnin (+-3h), anna arvot seuraavasti: \par
- *  type sourceData | doTimeFiltering.exe 0 -180 180 [lisä_argumentti1=3] [lisä_argumentti2=2] ...
- *>
- *tulosData \par
- *  Lisä argumentteja saa antaa käytetystä funktiosta riippuen. \par
- *  NFmiSmoother tasoituksen lisä argumentit:
- *			1=smoother menetelmä (2=kFmiSmootherNeighbourhood,
- *3=kFmiSmootherPseudoGaussian)
- *			2=smootherFactor (1=voimakas ja mitä suurempi luku sitä heikompi)
- *
- * \param theSourceData Undocumented
- * \param theFilterId Undocumented
- * \param theTimeOffsetStartInMinutes Undocumented
- * \param theTimeOffsetEndInMinutes Undocumented
- * \param theAdditionalParam1 Mahdollinen käytettyyn filter-funktioon liittyvä parametri.
- * \param theAdditionalParam2 Mahdollinen käytettyyn filter-funktioon liittyvä parametri.
- * \return Undocumented
- */
-// ----------------------------------------------------------------------
-
-NFmiQueryData *NFmiQueryDataUtil::DoTimeFiltering(NFmiQueryData *theSourceData,
-                                                  int theFilterId,
-                                                  int theTimeOffsetStartInMinutes,
-                                                  int theTimeOffsetEndInMinutes,
-                                                  double theAdditionalParam1,
-                                                  double theAdditionalParam2)
+// ----------------------------------------------------------------------
+/*!
+ *  Tämä ohjelma lukee stdin:in annetun qdatan, luo uuden datan jossa sama
+ *  rakenne. Filtteri laskee sourceDatasta tulosDataan arvot halutulla
+ *  suhteellisella aikavälillä arvot halutulla filtterillä. Esim. laskee
+ *  +-3 tunnin keskiarvot kaikkialle eli tasoittaa dataa jonkin verran. \par
+ *  Käyttö: \par
+ *  type sourceData | doTimeFiltering.exe filterId relTimeOffsetStartInMinutes
+ *relTimeOffsetEndInMinutes > tulosData \par
+ *
+ *  Offsetit pyöristetään lähimpiin sourceDatan aika-askeleisiin. Filtteri
+ *  funktiot: 0 = avg, 1 = max, 2 = min (EI VIELÄ KÄYTÖSSÄ! 3 = wavg), 4=NFmiSmoother tasoitus,
+ *  5 = sum filtterit. Jos haluat tasoittaa tuntidataa laskien keskiarvon yli 7
+ *  tunnin (+-3h), anna arvot seuraavasti: \par
+ *  type sourceData | doTimeFiltering.exe 0 -180 180 [lisä_argumentti1=3] [lisä_argumentti2=2] ...
+ *>
+ *tulosData \par
+ *  Lisä argumentteja saa antaa käytetystä funktiosta riippuen. \par
+ *  NFmiSmoother tasoituksen lisä argumentit:
+ *			1=smoother menetelmä (2=kFmiSmootherNeighbourhood,
+ *3=kFmiSmootherPseudoGaussian)
+ *			2=smootherFactor (1=voimakas ja mitä suurempi luku sitä heikompi)
+ *
+ * \param theSourceData Undocumented
+ * \param theFilterId Undocumented
+ * \param theTimeOffsetStartInMinutes Undocumented
+ * \param theTimeOffsetEndInMinutes Undocumented
+ * \param theAdditionalParam1 Mahdollinen käytettyyn filter-funktioon liittyvä parametri.
+ * \param theAdditionalParam2 Mahdollinen käytettyyn filter-funktioon liittyvä parametri.
+ * \return Undocumented
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryData *NFmiQueryDataUtil::DoTimeFiltering(NFmiQueryData *theSourceData,
+                                                  int theFilterId,
+                                                  int theTimeOffsetStartInMinutes,
+                                                  int theTimeOffsetEndInMinutes,
+                                                  double theAdditionalParam1,
+                                                  double theAdditionalParam2)
+{
+  if (theFilterId ==
+      4)  // 4= tehdään operaatiot NFmiSmootherluokan avulla esim. pseudogaussian-tasoitus jne.
+    return DoTimeFilteringWithSmoother(theSourceData,
+                                       theTimeOffsetStartInMinutes,
+                                       theTimeOffsetEndInMinutes,
+                                       static_cast<int>(theAdditionalParam1),
+                                       theAdditionalParam2);
+
+  NFmiQueryData *data = nullptr;
+  if (theSourceData)
+  {
+    data = theSourceData->Clone();
+    NFmiDataModifier *modifier = CreateModifier(theFilterId);
+    boost::shared_ptr<NFmiDataModifier> modifierPtr(
+        modifier);  // tuhoaa automaattisesti modifier:in kun scoopista poistutaan
+    if (modifier)
+    {
+      NFmiFastQueryInfo destInfo(data);
+      NFmiSuperSmartInfo sourceInfo(theSourceData);
+      int stepNumber =
+          static_cast<int>(round((theTimeOffsetEndInMinutes - theTimeOffsetStartInMinutes) /
+                                 static_cast<int>(sourceInfo.TimeResolution()))) +
+          1;
+      int startShift = theTimeOffsetStartInMinutes / static_cast<int>(sourceInfo.TimeResolution());
+      NFmiRelativeTimeIntegrationIterator2 timeIterator(&sourceInfo, stepNumber, startShift);
+      NFmiCalculator calculator(&timeIterator, modifier);
+      sourceInfo.TimeIntegrationCalculator(&calculator);
+
+      for (destInfo.ResetParam(), sourceInfo.ResetParam();
+           destInfo.NextParam() && sourceInfo.NextParam();)
+      {
+        for (destInfo.ResetLocation(), sourceInfo.ResetLocation();
+             destInfo.NextLocation() && sourceInfo.NextLocation();)
+        {
+          for (destInfo.ResetLevel(), sourceInfo.ResetLevel();
+               destInfo.NextLevel() && sourceInfo.NextLevel();)
+          {
+            for (destInfo.ResetTime(), sourceInfo.ResetTime();
+                 destInfo.NextTime() && sourceInfo.NextTime();)
+            {
+              float value = sourceInfo.FloatValue(false, false, true, false);
+              destInfo.FloatValue(value);
+            }
+          }
+        }
+      }
+    }
+  }
+  return data;
+}
+
+namespace
+{
+// Hilalaatikko-filtterin (areaType 2) nopea toteutus keskiarvolle (0), maksimille (1),
+// minimille (2) ja summalle (5). Laatikko on erotuva (separable), joten se lasketaan ensin
+// riveittäin ja sitten sarakkeittain. Hilan ulkopuolelle menevä laatikko leikataan kuten
+// NFmiRelativeDataIterator tekee (sen peek-arvot ovat puuttuvia).
+class GridBoxFilter
+{
+ public:
+  GridBoxFilter(int theFilterId, int theXRadius, int theYRadius, size_t theXSize, size_t theYSize)
+      : itsFilterId(theFilterId),
+        itsXRadius(theXRadius),
+        itsYRadius(theYRadius),
+        itsXSize(theXSize),
+        itsYSize(theYSize)
+  {
+  }
+
+  static bool IsSupported(int theFilterId)
+  {
+    return theFilterId == 0 || theFilterId == 1 || theFilterId == 2 || theFilterId == 5;
+  }
+
+  // theValues on yksi hilakenttä riveittäin, tulos samassa järjestyksessä.
+  void Filter(const std::vector<float> &theValues, std::vector<float> &theResult)
+  {
+    theResult.resize(theValues.size());
+    if (itsFilterId == 1 || itsFilterId == 2)
+      FilterExtremes(theValues, theResult);
+    else
+      FilterSums(theValues, theResult);
+
+    // NFmiQueryInfo::FloatValue(float) ei asettanut ei-äärellisiä tuloksia, vaan kohteeseen
+    // jäi kloonattu lähdearvo.
+    for (size_t i = 0; i < theResult.size(); i++)
+      if (!::FmiIsValidNumber(theResult[i])) theResult[i] = theValues[i];
+  }
+
+ private:
+  static bool IsMissing(float theValue)
+  {
+    return theValue == kFloatMissing || theValue == kRadarPrecipitationMissing;
+  }
+
+  size_t WindowStart(size_t i, int theRadius) const
+  {
+    return i > static_cast<size_t>(theRadius) ? i - theRadius : 0;
+  }
+
+  size_t WindowEnd(size_t i, int theRadius, size_t theSize) const
+  {
+    return std::min(i + theRadius + 1, theSize);
+  }
+
+  // Summat, arvojen lukumäärät ja ei-äärellisten arvojen lukumäärät lasketaan ensin vaaka- ja
+  // sitten pystysuuntaisille laatikoille. Ei-äärelliset arvot pidetään summista erillään, koska
+  // vanhassa toteutuksessa ne tekivät tuloksesta ei-äärellisen.
+  void FilterSums(const std::vector<float> &theValues, std::vector<float> &theResult)
+  {
+    size_t size = theValues.size();
+    itsSums.resize(size);
+    itsCounts.resize(size);
+    itsInvalids.resize(size);
+    for (size_t i = 0; i < size; i++)
+    {
+      float value = theValues[i];
+      bool missing = IsMissing(value);
+      bool valid = !missing && ::FmiIsValidNumber(value);
+      itsSums[i] = valid ? value : 0;
+      itsCounts[i] = missing ? 0 : 1;
+      itsInvalids[i] = (missing || valid) ? 0 : 1;
+    }
+
+    itsBoxSums.resize(size);
+    itsBoxCounts.resize(size);
+    itsBoxInvalids.resize(size);
+    for (size_t y = 0; y < itsYSize; y++)
+    {
+      size_t offset = y * itsXSize;
+      BoxSums(&itsSums[offset], &itsBoxSums[offset], itsXSize, 1, itsXRadius);
+      BoxSums(&itsCounts[offset], &itsBoxCounts[offset], itsXSize, 1, itsXRadius);
+      BoxSums(&itsInvalids[offset], &itsBoxInvalids[offset], itsXSize, 1, itsXRadius);
+    }
+    // Pystysuunnassa kokonaiset rivit lasketaan yhteen kerralla
+    BoxSums(itsBoxSums.data(), itsSums.data(), itsYSize, itsXSize, itsYRadius);
+    BoxSums(itsBoxCounts.data(), itsCounts.data(), itsYSize, itsXSize, itsYRadius);
+    BoxSums(itsBoxInvalids.data(), itsInvalids.data(), itsYSize, itsXSize, itsYRadius);
+
+    for (size_t i = 0; i < size; i++)
+    {
+      if (itsInvalids[i] > 0)
+        theResult[i] = std::numeric_limits<float>::quiet_NaN();
+      else if (itsCounts[i] == 0)
+        theResult[i] = kFloatMissing;
+      else
+        theResult[i] =
+            static_cast<float>(itsFilterId == 0 ? itsSums[i] / itsCounts[i] : itsSums[i]);
+    }
+  }
+
+  // Laskee ikkunoiden [i-r, i+r] summat. Jokaisessa kohdassa on theWidth peräkkäistä arvoa,
+  // jotka summataan toisistaan erillään. Jono jaetaan ikkunan kokoisiin lohkoihin, joille
+  // lasketaan kumulatiiviset summat alusta ja lopusta. Ikkuna mahtuu aina enintään kahteen
+  // lohkoon, joten summa saadaan yhdellä yhteenlaskulla ilman vähennyslaskuja, joissa suuret
+  // arvot hävittäisivät pienten tarkkuuden.
+  void BoxSums(
+      const double *theValues, double *theSums, size_t theSize, size_t theWidth, int theRadius)
+  {
+    size_t blockSize = 2 * static_cast<size_t>(theRadius) + 1;
+    itsPrefixSums.resize(theSize * theWidth);
+    itsSuffixSums.resize(theSize * theWidth);
+    for (size_t blockStart = 0; blockStart < theSize; blockStart += blockSize)
+    {
+      size_t blockEnd = std::min(blockStart + blockSize, theSize);
+      for (size_t i = blockStart; i < blockEnd; i++)
+      {
+        const double *values = theValues + i * theWidth;
+        double *prefix = &itsPrefixSums[i * theWidth];
+        if (i == blockStart)
+          std::copy(values, values + theWidth, prefix);
+        else
+          for (size_t k = 0; k < theWidth; k++)
+            prefix[k] = prefix[k - theWidth] + values[k];
+      }
+      for (size_t i = blockEnd; i-- > blockStart;)
+      {
+        const double *values = theValues + i * theWidth;
+        double *suffix = &itsSuffixSums[i * theWidth];
+        if (i == blockEnd - 1)
+          std::copy(values, values + theWidth, suffix);
+        else
+          for (size_t k = 0; k < theWidth; k++)
+            suffix[k] = suffix[k + theWidth] + values[k];
+      }
+    }
+
+    for (size_t i = 0; i < theSize; i++)
+    {
+      size_t start = WindowStart(i, theRadius);
+      size_t last = WindowEnd(i, theRadius, theSize) - 1;
+      const double *prefix = &itsPrefixSums[last * theWidth];
+      const double *suffix = &itsSuffixSums[start * theWidth];
+      double *sums = theSums + i * theWidth;
+      if (start % blockSize == 0)
+        std::copy(prefix, prefix + theWidth, sums);
+      else if (start / blockSize == last / blockSize)
+        std::copy(suffix, suffix + theWidth, sums);  // leikattu ikkuna lohkon lopussa
+      else
+        for (size_t k = 0; k < theWidth; k++)
+          sums[k] = suffix[k] + prefix[k];
+    }
+  }
+
+  // Minimi ja maksimi lasketaan liukuvalla ikkunalla monotonisen jonon avulla ensin riveittäin
+  // ja sitten sarakkeittain. Arvot joita NFmiDataModifierMin/Max ei hyväksyisi korvataan
+  // niiden alkuarvolla, jolloin ne eivät vaikuta tulokseen.
+  void FilterExtremes(const std::vector<float> &theValues, std::vector<float> &theResult)
+  {
+    bool isMax = (itsFilterId == 1);
+    float initValue = isMax ? -3.4E+38f : 3.4E+38f;
+    itsExtremes.resize(theValues.size());
+    for (size_t i = 0; i < theValues.size(); i++)
+    {
+      float value = theValues[i];
+      bool accepted = !IsMissing(value) && (isMax ? value > initValue : value < initValue);
+      itsExtremes[i] = accepted ? value : initValue;
+    }
+
+    itsLine.resize(std::max(itsXSize, itsYSize));
+    for (size_t y = 0; y < itsYSize; y++)
+    {
+      float *row = &itsExtremes[y * itsXSize];
+      SlidingExtremes(row, itsXSize, itsXRadius, isMax);
+      std::copy(itsLine.begin(), itsLine.begin() + itsXSize, row);
+    }
+    std::vector<float> column(itsYSize);
+    for (size_t x = 0; x < itsXSize; x++)
+    {
+      for (size_t y = 0; y < itsYSize; y++)
+        column[y] = itsExtremes[y * itsXSize + x];
+      SlidingExtremes(column.data(), itsYSize, itsYRadius, isMax);
+      for (size_t y = 0; y < itsYSize; y++)
+      {
+        float value = itsLine[y];
+        theResult[y * itsXSize + x] = (value == initValue) ? kFloatMissing : value;
+      }
+    }
+  }
+
+  // Laskee itsLine:en ikkunoiden [i-r, i+r] ääriarvot, O(n) ikkunan koosta riippumatta
+  void SlidingExtremes(const float *theValues, size_t theSize, int theRadius, bool isMax)
+  {
+    itsQueue.resize(theSize);
+    size_t head = 0;
+    size_t tail = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < theSize; i++)
+    {
+      size_t end = WindowEnd(i, theRadius, theSize);
+      for (; next < end; next++)
+      {
+        float value = theValues[next];
+        while (tail > head && (isMax ? theValues[itsQueue[tail - 1]] <= value
+                                     : theValues[itsQueue[tail - 1]] >= value))
+          tail--;
+        itsQueue[tail++] = next;
+      }
+      size_t start = WindowStart(i, theRadius);
+      while (itsQueue[head] < start)
+        head++;
+      itsLine[i] = theValues[itsQueue[head]];
+    }
+  }
+
+  int itsFilterId;
+  int itsXRadius;
+  int itsYRadius;
+  size_t itsXSize;
+  size_t itsYSize;
+  std::vector<double> itsSums;
+  std::vector<double> itsCounts;
+  std::vector<double> itsInvalids;
+  std::vector<double> itsBoxSums;
+  std::vector<double> itsBoxCounts;
+  std::vector<double> itsBoxInvalids;
+  std::vector<double> itsPrefixSums;
+  std::vector<double> itsSuffixSums;
+  std::vector<float> itsExtremes;
+  std::vector<float> itsLine;
+  std::vector<size_t> itsQueue;
+};
+
+// Yksi hilakenttä on parametrin, levelin ja ajan yhdistelmä. Kenttäindeksi on
+// (parametri * levelien määrä + level) * aikojen määrä + aika.
+void DoAreaFilteringInThread(NFmiFastQueryInfo &theSourceInfo,
+                             NFmiFastQueryInfo &theTargetInfo,
+                             int theFilterId,
+                             int theXRadius,
+                             int theYRadius,
+                             const std::vector<bool> &theFilteredParams,
+                             NFmiLocationIndexRangeCalculator &theFieldIndexRangeCalculator)
+{
+  size_t gridSizeX = theSourceInfo.GridXNumber();
+  size_t gridSizeY = theSourceInfo.GridYNumber();
+  size_t locationCount = gridSizeX * gridSizeY;
+  unsigned long levelSize = theSourceInfo.SizeLevels();
+  unsigned long timeSize = theSourceInfo.SizeTimes();
+  size_t locationStep = static_cast<size_t>(levelSize) * timeSize;
+
+  GridBoxFilter filter(theFilterId, theXRadius, theYRadius, gridSizeX, gridSizeY);
+  std::vector<float> values;
+  std::vector<float> result;
+  unsigned long startIndex = 0;
+  unsigned long endIndex = 0;
+  for (; theFieldIndexRangeCalculator.GetCurrentLocationRange(startIndex, endIndex);)
+  {
+    for (unsigned long fieldIndex = startIndex; fieldIndex <= endIndex; fieldIndex++)
+    {
+      unsigned long timeIndex = fieldIndex % timeSize;
+      unsigned long levelIndex = (fieldIndex / timeSize) % levelSize;
+      unsigned long paramIndex = fieldIndex / timeSize / levelSize;
+      if (!theFilteredParams[paramIndex]) continue;
+      size_t sourceIndex = theSourceInfo.Index(paramIndex, 0, levelIndex, timeIndex);
+      size_t targetIndex = theTargetInfo.Index(paramIndex, 0, levelIndex, timeIndex);
+      if (!theSourceInfo.GetValues(sourceIndex, locationStep, locationCount, values)) continue;
+      filter.Filter(values, result);
+      theTargetInfo.SetValues(targetIndex, locationStep, locationCount, result);
+    }
+  }
+}
+
+// Kentät ovat toisistaan riippumattomia, joten ne jaetaan säikeille. Yhdistelmäparametreja
+// (esim. TotalWind ja WeatherAndCloudiness) ei lasketa tässä, koska niiden pakattuja arvoja ei
+// voi suodattaa sellaisenaan, vaan ne jätetään DoIteratorAreaFiltering:ille.
+void DoGridBoxFiltering(NFmiFastQueryInfo &theSourceInfo,
+                        NFmiFastQueryInfo &theTargetInfo,
+                        int theFilterId,
+                        int theXRadius,
+                        int theYRadius,
+                        unsigned int theMaxThreadCount)
 {
-  if (theFilterId ==
-      4)  // 4= tehdään operaatiot NFmiSmootherluokan avulla esim. pseudogaussian-tasoitus jne.
-    return DoTimeFilteringWithSmoother(theSourceData,
-                                       theTimeOffsetStartInMinutes,
-                                       theTimeOffsetEndInMinutes,
-                                       static_cast<int>(theAdditionalParam1),
-                                       theAdditionalParam2);
+  unsigned long fieldCount =
+      theSourceInfo.SizeParams() * theSourceInfo.SizeLevels() * theSourceInfo.SizeTimes();
+  if (fieldCount == 0) return;
 
-  NFmiQueryData *data = nullptr;
-  if (theSourceData)
+  std::vector<bool> filteredParams;
+  for (theSourceInfo.ResetParam(); theSourceInfo.NextParam();)
+    filteredParams.push_back(!theSourceInfo.Param().HasDataParams());
+
+  unsigned int threadCount = 1;
+  if (theMaxThreadCount != 1 && fieldCount > 1)
   {
-    data = theSourceData->Clone();
-    NFmiDataModifier *modifier = CreateModifier(theFilterId);
-    boost::shared_ptr<NFmiDataModifier> modifierPtr(
-        modifier);  // tuhoaa automaattisesti modifier:in kun scoopista poistutaan
-    if (modifier)
-    {
-      NFmiFastQueryInfo destInfo(data);
-      NFmiSuperSmartInfo sourceInfo(theSourceData);
-      int stepNumber =
-          static_cast<int>(round((theTimeOffsetEndInMinutes - theTimeOffsetStartInMinutes) /
-                                 static_cast<int>(sourceInfo.TimeResolution()))) +
-          1;
-      int startShift = theTimeOffsetStartInMinutes / static_cast<int>(sourceInfo.TimeResolution());
-      NFmiRelativeTimeIntegrationIterator2 timeIterator(&sourceInfo, stepNumber, startShift);
-      NFmiCalculator calculator(&timeIterator, modifier);
-      sourceInfo.TimeIntegrationCalculator(&calculator);
+    threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+        75, static_cast<unsigned int>(fieldCount));
+    if (theMaxThreadCount > 0) threadCount = std::min(threadCount, theMaxThreadCount);
+  }
 
-      for (destInfo.ResetParam(), sourceInfo.ResetParam();
-           destInfo.NextParam() && sourceInfo.NextParam();)
+  NFmiLocationIndexRangeCalculator fieldIndexRangeCalculator(fieldCount, 1);
+  if (threadCount <= 1)
+  {
+    ::DoAreaFilteringInThread(theSourceInfo,
+                              theTargetInfo,
+                              theFilterId,
+                              theXRadius,
+                              theYRadius,
+                              filteredParams,
+                              fieldIndexRangeCalculator);
+    return;
+  }
+
+  boost::thread_group filterParts;
+  for (unsigned int i = 0; i < threadCount; i++)
+    filterParts.add_thread(new boost::thread(::DoAreaFilteringInThread,
+                                             boost::ref(theSourceInfo),
+                                             boost::ref(theTargetInfo),
+                                             theFilterId,
+                                             theXRadius,
+                                             theYRadius,
+                                             boost::cref(filteredParams),
+                                             boost::ref(fieldIndexRangeCalculator)));
+  filterParts.join_all();  // odotetaan että threadit lopettavat
+}
+
+// Alkuperäinen iteraattoreihin perustuva suodatus. Jos onlyCombinedParams on true, lasketaan vain
+// yhdistelmäparametrit, jotka DoGridBoxFiltering on jättänyt väliin.
+void DoIteratorAreaFiltering(NFmiQueryData *theSourceData,
+                             NFmiQueryData *theTargetData,
+                             int theFilterId,
+                             int theXCount,
+                             int theYCount,
+                             bool onlyCombinedParams)
+{
+  NFmiDataModifier *modifier = ::CreateModifier(theFilterId);
+  boost::shared_ptr<NFmiDataModifier> modifierPtr(
+      modifier);  // tuhoaa automaattisesti modifier:in kun scoopista poistutaan
+  if (modifier)
+  {
+    NFmiFastQueryInfo destInfo(theTargetData);
+    NFmiSuperSmartInfo sourceInfo(theSourceData);
+    NFmiRelativeDataIterator areaIterator(&sourceInfo, theXCount, theYCount);
+    NFmiCalculator calculator(&areaIterator, modifier);
+    sourceInfo.SetCalculator(&calculator);
+
+    for (destInfo.ResetParam(), sourceInfo.ResetParam();
+         destInfo.NextParam() && sourceInfo.NextParam();)
+    {
+      if (onlyCombinedParams && !sourceInfo.Param().HasDataParams()) continue;
+      for (destInfo.ResetLocation(), sourceInfo.ResetLocation();
+           destInfo.NextLocation() && sourceInfo.NextLocation();)
       {
-        for (destInfo.ResetLocation(), sourceInfo.ResetLocation();
-             destInfo.NextLocation() && sourceInfo.NextLocation();)
+        for (destInfo.ResetLevel(), sourceInfo.ResetLevel();
+             destInfo.NextLevel() && sourceInfo.NextLevel();)
         {
-          for (destInfo.ResetLevel(), sourceInfo.ResetLevel();
-               destInfo.NextLevel() && sourceInfo.NextLevel();)
+          for (destInfo.ResetTime(), sourceInfo.ResetTime();
+               destInfo.NextTime() && sourceInfo.NextTime();)
           {
-            for (destInfo.ResetTime(), sourceInfo.ResetTime();
-                 destInfo.NextTime() && sourceInfo.NextTime();)
-            {
-              float value = sourceInfo.FloatValue(false, false, true, false);
-              destInfo.FloatValue(value);
-            }
+            float value = sourceInfo.FloatValue(false, true, false, false);
+            destInfo.FloatValue(value);
           }
         }
       }
     }
   }
-  return data;
 }
 
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  *  Tämä ohjelma lukee stdin:in annetun qdatan, luo uuden datan jossa sama
@@ -4031,6 +5186,8 @@ NFmiQueryData *NFmiQueryDataUtil::DoTimeFiltering(NFmiQueryData *theSourceData,
  * \param theAreaType Undocumented
  * \param theAdditionalParam1 Mahdollinen käytettyyn filter-funktioon liittyvä parametri.
  * \param theAdditionalParam2 Mahdollinen käytettyyn filter-funktioon liittyvä parametri.
+ * \param theMaxThreadCount Hiladatan avg/max/min/sum -laskennan säikeiden maksimimäärä,
+ * 0 = kohtuullinen määrä koneen ytimistä.
  * \return Undocumented
  */
 // ----------------------------------------------------------------------
@@ -4039,45 +5196,27 @@ NFmiQueryData *NFmiQueryDataUtil::DoAreaFiltering(NFmiQueryData *theSourceData,
                                                   int theFilterId,
                                                   int theAreaType,
                                                   double theAdditionalParam1,
-                                                  double theAdditionalParam2)
+                                                  double theAdditionalParam2,
+                                                  unsigned int theMaxThreadCount)
 {
   if (theAreaType != 2) return nullptr;
   NFmiQueryData *data = nullptr;
   if (theSourceData)
   {
     data = theSourceData->Clone();
-    NFmiDataModifier *modifier = CreateModifier(theFilterId);
-    boost::shared_ptr<NFmiDataModifier> modifierPtr(
-        modifier);  // tuhoaa automaattisesti modifier:in kun scoopista poistutaan
-    if (modifier)
+    auto xCount = static_cast<int>(theAdditionalParam1 / 2);
+    auto yCount = static_cast<int>(theAdditionalParam2 / 2);
+    if (GridBoxFilter::IsSupported(theFilterId) && xCount >= 0 && yCount >= 0 &&
+        data->Info()->IsGrid())
     {
       NFmiFastQueryInfo destInfo(data);
-      NFmiSuperSmartInfo sourceInfo(theSourceData);
-      auto xCount = static_cast<int>(theAdditionalParam1 / 2);
-      auto yCount = static_cast<int>(theAdditionalParam2 / 2);
-      NFmiRelativeDataIterator areaIterator(&sourceInfo, xCount, yCount);
-      NFmiCalculator calculator(&areaIterator, modifier);
-      sourceInfo.SetCalculator(&calculator);
-
-      for (destInfo.ResetParam(), sourceInfo.ResetParam();
-           destInfo.NextParam() && sourceInfo.NextParam();)
-      {
-        for (destInfo.ResetLocation(), sourceInfo.ResetLocation();
-             destInfo.NextLocation() && sourceInfo.NextLocation();)
-        {
-          for (destInfo.ResetLevel(), sourceInfo.ResetLevel();
-               destInfo.NextLevel() && sourceInfo.NextLevel();)
-          {
-            for (destInfo.ResetTime(), sourceInfo.ResetTime();
-                 destInfo.NextTime() && sourceInfo.NextTime();)
-            {
-              float value = sourceInfo.FloatValue(false, true, false, false);
-              destInfo.FloatValue(value);
-            }
-          }
-        }
-      }
+      NFmiFastQueryInfo sourceInfo(theSourceData);
+      ::DoGridBoxFiltering(sourceInfo, destInfo, theFilterId, xCount, yCount, theMaxThreadCount);
+      ::DoIteratorAreaFiltering(theSourceData, data, theFilterId, xCount, yCount, true);
+      return data;
     }
+
+    ::DoIteratorAreaFiltering(theSourceData, data, theFilterId, xCount, yCount, false);
   }
   return data;
 }
@@ -4116,39 +5255,6 @@ static NFmiArea *CreateCropArea(const NFmiGrid *theGrid,
   return area;
 }
 
-// sitten päästään itse croppaukseen!!!!
-static void CropData(NFmiFastQueryInfo &theSource,
-                     NFmiFastQueryInfo &theResult,
-                     int theLeft,
-                     int theBottom)
-{
-  for (theResult.ResetParam(), theSource.ResetParam();
-       theResult.NextParam() && theSource.NextParam();)
-  {
-    for (theResult.ResetLevel(), theSource.ResetLevel();
-         theResult.NextLevel() && theSource.NextLevel();)
-    {
-      for (theResult.ResetTime(), theSource.ResetTime();
-           theResult.NextTime() && theSource.NextTime();)
-      {
-        theResult.Bottom();
-        theSource.Bottom();
-        theSource.MoveUp(theBottom);  // liikutetaan sourcea haluttuun cropin alkupisteeseen
-        do
-        {
-          theResult.Left();
-          theSource.Left();
-          theSource.MoveRight(theLeft);  // liikutetaan sourcea haluttuun cropin alkupisteeseen
-          do
-          {
-            theResult.FloatValue(theSource.FloatValue());
-          } while (theResult.MoveRight() && theSource.MoveRight());
-        } while (theResult.MoveUp() && theSource.MoveUp());
-      }
-    }
-  }
-}
-
 // ----------------------------------------------------------------------
 /*!
  * Tämä funktio luo uuden datan joka on cropattu halutulla tavalla
@@ -4168,12 +5274,20 @@ static void CropData(NFmiFastQueryInfo &theSource,
  * \param theTop Cropin ylä reuna hilapiste indeksinä (bottom < top).
  * \param theRight Cropin oikea reuna hilapiste indeksinä.
  * \param theBottom Cropin ala reuna hilapiste indeksinä.
+ * \param theMemoryMappedFileName Jos annettu, tulos kirjoitetaan suoraan tähän memory mapped
+ * tiedostoon.
+ * \param theMaxThreadCount Kopioinnissa käytettävien säikeiden maksimimäärä (0 = järkevä määrä).
  * \return Metodissa luotu NFmiQueryData olio, tai 0-pointteri jos jokin meni pieleen.
  */
 // ----------------------------------------------------------------------
 
-NFmiQueryData *NFmiQueryDataUtil::QDCrop(
-    NFmiFastQueryInfo &theInfo, int theLeft, int theTop, int theRight, int theBottom)
+NFmiQueryData *NFmiQueryDataUtil::QDCrop(NFmiFastQueryInfo &theInfo,
+                                         int theLeft,
+                                         int theTop,
+                                         int theRight,
+                                         int theBottom,
+                                         const std::string &theMemoryMappedFileName,
+                                         unsigned int theMaxThreadCount)
 {
   NFmiQueryData *data = nullptr;
   if (theInfo.Grid())
@@ -4195,11 +5309,18 @@ NFmiQueryData *NFmiQueryDataUtil::QDCrop(
       NFmiHPlaceDescriptor hPlace(grid);
       NFmiQueryInfo innerInfo(
           theInfo.ParamDescriptor(), theInfo.TimeDescriptor(), hPlace, theInfo.VPlaceDescriptor());
-      data = NFmiQueryDataUtil::CreateEmptyData(innerInfo);
+      // Kaikki arvot kopioidaan, joten memory mapped dataa ei tarvitse alustaa
+      if (theMemoryMappedFileName.empty())
+        data = NFmiQueryDataUtil::CreateEmptyData(innerInfo);
+      else
+        data = NFmiQueryDataUtil::CreateEmptyData(innerInfo, theMemoryMappedFileName, false);
       if (data)
       {
+        // Jokaisen parametrin hilarivi (kaikkine leveleineen ja aikoineen) kopioidaan yhtenä palana
         NFmiFastQueryInfo tulosInfo(data);
-        CropData(theInfo, tulosInfo, theLeft, theBottom);
+        NFmiSlabCopyIndexes indexes;
+        if (MakeGridCropIndexes(theInfo, tulosInfo, theLeft, theBottom, 1, 1, indexes))
+          CopySlabs(theInfo, tulosInfo, indexes, theMaxThreadCount);
       }
     }
   }
@@ -4781,6 +5902,126 @@ NFmiQueryData *NFmiQueryDataUtil::CombineQueryDatas(bool fDoRebuildCheck,
                            &theFileFilter);
 }
 
+// Reads only the header part of the given querydata file (descriptors), the raw data
+// is not read. Returns false if the file isn't readable querydata.
+bool NFmiQueryDataUtil::ReadQueryInfoHeader(const std::string &theFileName,
+                                            NFmiQueryInfo &theInfoOut)
+{
+  try
+  {
+    std::ifstream in(theFileName.c_str(), std::ios::in | std::ios::binary);
+    if (!in) return false;
+    in >> theInfoOut;
+    return true;
+  }
+  catch (...)
+  {
+    // korruptoituneet tiedostot ohitetaan
+  }
+  return false;
+}
+
+bool NFmiQueryDataUtil::CopyTimeSteps(NFmiFastQueryInfo &theSourceInfo,
+                                      NFmiFastQueryInfo &theTargetInfo,
+                                      const std::vector<unsigned long> &theSourceTimeIndexes,
+                                      const std::vector<unsigned long> &theTargetTimeIndexes)
+{
+  if (theSourceTimeIndexes.size() != theTargetTimeIndexes.size())
+    throw std::runtime_error("CopyTimeSteps: source and target time index counts differ");
+  if (theSourceTimeIndexes.empty()) return false;
+
+  NFmiSlabCopyIndexes indexes;
+  if (!MakeSlabCopyIndexes(theSourceInfo, theTargetInfo, indexes)) return false;
+  indexes.itsTimeIndexes.assign(theTargetInfo.SizeTimes(), gMissingIndex);
+  for (size_t i = 0; i < theSourceTimeIndexes.size(); i++)
+    indexes.itsTimeIndexes.at(theTargetTimeIndexes[i]) = theSourceTimeIndexes[i];
+  return CopySlabs(theSourceInfo, theTargetInfo, indexes) > 0;
+}
+
+namespace
+{
+void CopyTimeStepsFromFilesInThread(std::vector<NFmiTimeStepCopyTask> &theTasks,
+                                    NFmiFastQueryInfo &theTargetInfo,
+                                    NFmiTimeIndexCalculator &theTaskIndexCalculator,
+                                    NFmiStopFunctor *theStopFunctor,
+                                    NFmiQueryDataUtil::LoggingFunction *loggingFunction,
+                                    boost::mutex &theErrorMutex,
+                                    std::string &theErrorMessage)
+{
+  // NFmiTimeIndexCalculator toimii tässä yleisenä työ-indeksien jakajana (tiedostoindeksit)
+  unsigned long taskIndex = 0;
+  for (; theTaskIndexCalculator.GetCurrentTimeIndex(taskIndex);)
+  {
+    if (theStopFunctor && theStopFunctor->Stop()) return;
+    {
+      // Jos jokin tiedosto on jo epäonnistunut, tulos on joka tapauksessa vajaa
+      boost::mutex::scoped_lock lock(theErrorMutex);
+      if (!theErrorMessage.empty()) return;
+    }
+
+    const NFmiTimeStepCopyTask &task = theTasks[taskIndex];
+    try
+    {
+      // Data luetaan vasta tässä ja vapautetaan heti kopioinnin jälkeen
+      NFmiQueryData data(task.itsFileName, true);
+      NFmiFastQueryInfo sourceInfo(&data);
+      if (!NFmiQueryDataUtil::CopyTimeSteps(
+              sourceInfo, theTargetInfo, task.itsSourceTimeIndexes, task.itsTargetTimeIndexes))
+        throw std::runtime_error("nothing copied, grid or locations do not match the target data");
+    }
+    catch (std::exception &e)
+    {
+      std::string message = "Failed to copy data from '" + task.itsFileName + "': " + e.what();
+      boost::mutex::scoped_lock lock(theErrorMutex);
+      if (loggingFunction) (*loggingFunction)(message);
+      if (theErrorMessage.empty()) theErrorMessage = message;
+    }
+  }
+}
+
+}  // namespace
+
+// Kopioi annettujen tiedostojen aika-askeleet kohdedataan. Tiedostot luetaan työ-threadeissa
+// yksi kerrallaan ja vapautetaan heti, joten muistissa on kerrallaan korkeintaan threadien
+// määrän verran lähdedatoja. Tehtävien kohde-aika-indeksien pitää olla erillisiä.
+// Jos jonkin tiedoston luku tai kopiointi epäonnistuu, heitetään poikkeus, koska kohdedata
+// jäisi muuten vajaaksi.
+void NFmiQueryDataUtil::CopyTimeStepsFromFiles(std::vector<NFmiTimeStepCopyTask> &theTasks,
+                                               NFmiQueryData &theTargetData,
+                                               unsigned int theMaxUsedThreadCount,
+                                               NFmiStopFunctor *theStopFunctor,
+                                               LoggingFunction *loggingFunction)
+{
+  if (theTasks.empty()) return;
+
+  unsigned int usedThreadCount = theMaxUsedThreadCount;
+  if (usedThreadCount == 0) usedThreadCount = GetReasonableWorkingThreadCount();
+  usedThreadCount =
+      std::max(1u, std::min(usedThreadCount, static_cast<unsigned int>(theTasks.size())));
+
+  NFmiTimeIndexCalculator taskIndexCalculator(0, static_cast<unsigned long>(theTasks.size() - 1));
+  boost::mutex errorMutex;
+  std::string errorMessage;
+  NFmiFastQueryInfo targetInfo(&theTargetData);
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo>> targetInfos(usedThreadCount);
+  for (unsigned int i = 0; i < usedThreadCount; i++)
+    targetInfos[i] = boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(targetInfo));
+
+  boost::thread_group calcParts;
+  for (unsigned int i = 0; i < usedThreadCount; i++)
+    calcParts.add_thread(new boost::thread(::CopyTimeStepsFromFilesInThread,
+                                           boost::ref(theTasks),
+                                           boost::ref(*targetInfos[i]),
+                                           boost::ref(taskIndexCalculator),
+                                           theStopFunctor,
+                                           loggingFunction,
+                                           boost::ref(errorMutex),
+                                           boost::ref(errorMessage)));
+  calcParts.join_all();
+  NFmiQueryDataUtil::CheckIfStopped(theStopFunctor);
+  if (!errorMessage.empty()) throw std::runtime_error(errorMessage);
+}
+
 static void FillGridDataInThread(NFmiFastQueryInfo &theSourceInfo,
                                  NFmiFastQueryInfo &theTargetInfo,
                                  NFmiDataMatrix<NFmiLocationCache> &theLocationCacheMatrix,
@@ -5421,3 +6662,356 @@ unsigned int NFmiQueryDataUtil::GetReasonableWorkingThreadCount(double wantedHar
   else
     return CalcOptimalThreadCount(threadCount, separateTaskCount);
 }
+
+size_t NFmiMissingValueCounts::ParamMissingCount(unsigned long theParam) const
+{
+  auto begin = itsTimeCounts.begin() + theParam * itsTimeSize;
+  return std::accumulate(begin, begin + itsTimeSize, static_cast<size_t>(0));
+}
+
+namespace
+{
+inline bool IsScannedMissingValue(float theValue, bool fCountNaN)
+{
+  return fCountNaN ? std::isnan(theValue) : theValue == kFloatMissing;
+}
+
+// Käy läpi annetun blokin aika-askeleet tai paikat. Jokaisella threadilla on omat kopiot
+// parametrien infoista, koska aliparametrien arvojen purku ei ole thread safe. Käsiteltävän
+// yksikön omat laskurit kirjoitetaan suoraan tulokseen, toisen ulottuvuuden laskurit
+// kerätään ensin paikallisesti ja lisätään lopuksi mutexin suojassa.
+void CountMissingValuesInThread(
+    const std::vector<boost::shared_ptr<NFmiFastQueryInfo>> &theParamInfos,
+    bool fCountNaN,
+    bool fByTimes,
+    NFmiMissingValueCounts &theCounts,
+    NFmiLocationIndexRangeCalculator &theUnitRange,
+    boost::mutex &theMutex)
+{
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo>> infos;
+  for (const auto &info : theParamInfos)
+    infos.emplace_back(info ? new NFmiFastQueryInfo(*info) : nullptr);
+
+  const unsigned long locationSize = theCounts.itsLocationSize;
+  const unsigned long levelSize = theCounts.itsLevelSize;
+  const unsigned long timeSize = theCounts.itsTimeSize;
+  std::vector<size_t> otherCounts(infos.size() * (fByTimes ? locationSize : timeSize), 0);
+  std::vector<float> values;
+
+  unsigned long startIndex = 0;
+  unsigned long endIndex = 0;
+  while (theUnitRange.GetCurrentLocationRange(startIndex, endIndex))
+  {
+    for (unsigned long unit = startIndex; unit <= endIndex; unit++)
+    {
+      for (size_t param = 0; param < infos.size(); param++)
+      {
+        const NFmiFastQueryInfo *info = infos[param].get();
+        if (!info) continue;
+
+        size_t count = 0;
+        if (fByTimes)
+        {
+          // Aika-askeleen arvot ovat levelin sisällä paikkojen välillä levelSize * timeSize välein
+          size_t *locationCounts = &otherCounts[param * locationSize];
+          for (unsigned long level = 0; level < levelSize; level++)
+          {
+            if (!info->GetValues(info->Index(info->ParamIndex(), 0, level, unit),
+                                 levelSize * timeSize,
+                                 locationSize,
+                                 values))
+              throw std::runtime_error("CountMissingValues: failed to read the values");
+            for (unsigned long location = 0; location < locationSize; location++)
+            {
+              if (IsScannedMissingValue(values[location], fCountNaN))
+              {
+                ++count;
+                ++locationCounts[location];
+              }
+            }
+          }
+          theCounts.itsTimeCounts[param * timeSize + unit] = count;
+        }
+        else
+        {
+          // Paikan kaikkien levelien ja aikojen arvot ovat peräkkäin
+          size_t *timeCounts = &otherCounts[param * timeSize];
+          if (!info->GetValues(
+                  info->Index(info->ParamIndex(), unit, 0, 0), 1, levelSize * timeSize, values))
+            throw std::runtime_error("CountMissingValues: failed to read the values");
+          for (size_t i = 0; i < values.size(); i++)
+          {
+            if (IsScannedMissingValue(values[i], fCountNaN))
+            {
+              ++count;
+              ++timeCounts[i % timeSize];
+            }
+          }
+          theCounts.itsLocationCounts[param * locationSize + unit] = count;
+        }
+      }
+    }
+  }
+
+  std::vector<size_t> &totalCounts =
+      (fByTimes ? theCounts.itsLocationCounts : theCounts.itsTimeCounts);
+  boost::mutex::scoped_lock lock(theMutex);
+  for (size_t i = 0; i < otherCounts.size(); i++)
+    totalCounts[i] += otherCounts[i];
+}
+
+}  // namespace
+
+void NFmiQueryDataUtil::CountMissingValues(NFmiFastQueryInfo &theInfo,
+                                           const std::vector<FmiParameterName> &theParams,
+                                           bool fCountNaN,
+                                           bool fByTimes,
+                                           NFmiMissingValueCounts &theCountsOut,
+                                           const MissingValueScanFunction &theContinueFunction,
+                                           unsigned int theMaxThreadCount)
+{
+  // Jokaiselle tulosriville oma info, jossa rivin parametri (tai aliparametri) on valittuna
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo>> paramInfos;
+  if (theParams.empty())
+  {
+    for (theInfo.ResetParam(); theInfo.NextParam(false);)
+      paramInfos.emplace_back(new NFmiFastQueryInfo(theInfo));
+  }
+  else
+  {
+    for (auto param : theParams)
+    {
+      if (theInfo.Param(param))
+        paramInfos.emplace_back(new NFmiFastQueryInfo(theInfo));
+      else
+        paramInfos.emplace_back();
+    }
+  }
+
+  NFmiMissingValueCounts &counts = theCountsOut;
+  counts.itsLocationSize = theInfo.SizeLocations();
+  counts.itsLevelSize = theInfo.SizeLevels();
+  counts.itsTimeSize = theInfo.SizeTimes();
+  counts.itsParamFound.assign(paramInfos.size(), false);
+  for (size_t i = 0; i < paramInfos.size(); i++)
+    counts.itsParamFound[i] = (paramInfos[i] != nullptr);
+  counts.itsTimeCounts.assign(paramInfos.size() * counts.itsTimeSize, 0);
+  counts.itsLocationCounts.assign(paramInfos.size() * counts.itsLocationSize, 0);
+  counts.itsScannedCount = 0;
+
+  const unsigned long unitCount = (fByTimes ? counts.itsTimeSize : counts.itsLocationSize);
+  const size_t unitValueCount = paramInfos.size() * counts.itsLevelSize *
+                                (fByTimes ? counts.itsLocationSize : counts.itsTimeSize);
+  if (unitCount == 0 || unitValueCount == 0)
+  {
+    counts.itsScannedCount = unitCount;
+    return;
+  }
+
+  // Jos skannaus voidaan keskeyttää, data käydään läpi noin miljoonan arvon blokeissa.
+  // Threadit ottavat blokista kerrallaan noin 64k arvon palan.
+  const size_t blockValueCount = 1000000;
+  const size_t chunkValueCount = 65536;
+  unsigned long blockSize = unitCount;
+  if (theContinueFunction)
+    blockSize = static_cast<unsigned long>(
+        std::max<size_t>(1, std::min<size_t>(unitCount, blockValueCount / unitValueCount)));
+  const unsigned long chunkSize = static_cast<unsigned long>(
+      std::max<size_t>(1, std::min<size_t>(blockSize, chunkValueCount / unitValueCount)));
+  unsigned int threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+      75, static_cast<unsigned int>((blockSize + chunkSize - 1) / chunkSize));
+  if (theMaxThreadCount > 0) threadCount = std::min(threadCount, theMaxThreadCount);
+
+  boost::mutex mutex;
+  for (unsigned long blockStart = 0; blockStart < unitCount; blockStart += blockSize)
+  {
+    const unsigned long blockEnd = std::min(unitCount, blockStart + blockSize);
+    NFmiLocationIndexRangeCalculator unitRange(blockStart, blockEnd - 1, chunkSize);
+
+    if (threadCount <= 1)
+      ::CountMissingValuesInThread(paramInfos, fCountNaN, fByTimes, counts, unitRange, mutex);
+    else
+    {
+      boost::thread_group calcParts;
+      for (unsigned int i = 0; i < threadCount; i++)
+        calcParts.add_thread(new boost::thread(::CountMissingValuesInThread,
+                                               boost::cref(paramInfos),
+                                               fCountNaN,
+                                               fByTimes,
+                                               boost::ref(counts),
+                                               boost::ref(unitRange),
+                                               boost::ref(mutex)));
+      calcParts.join_all();
+    }
+
+    counts.itsScannedCount = blockEnd;
+    if (theContinueFunction && !theContinueFunction(counts)) return;
+  }
+}
+
+namespace
+{
+// Vertailee threadille annettujen paikkojen arvot. Paikan jokaisen parametrin ja levelin
+// aikasarja luetaan kummastakin datasta kerralla (ajat ovat raakadatassa sisimpänä), ja
+// tulokset kerätään ensin paikallisesti ja lisätään lopuksi mutexin suojassa. Muutettuja
+// aikoja haettaessa verrataan vain vielä avoimia aikoja, ja kun kaikki ajat ovat muuttuneet,
+// lopetetaan kaikki threadit.
+void CompareValuesInThread(const NFmiQueryDataUtil::ValueComparisonParams &theParams,
+                           const std::vector<unsigned long> &theTimeIndexes,
+                           const std::vector<unsigned long> &theLevelIndexes,
+                           bool fFindChangedTimes,
+                           std::vector<NFmiValueDifference> &theResults,
+                           NFmiLocationIndexRangeCalculator &theLocationRange,
+                           std::atomic<bool> &fAllTimesChanged,
+                           boost::mutex &theMutex)
+{
+  NFmiQueryDataUtil::ValueComparisonParams infos;
+  std::vector<bool> windDirections;
+  for (const auto &params : theParams)
+  {
+    infos.emplace_back(boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(*params.first)),
+                       boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(*params.second)));
+    windDirections.push_back(params.first->Param().GetParamIdent() == kFmiWindDirection);
+  }
+
+  const size_t timeSize = theTimeIndexes.size();
+  std::vector<NFmiValueDifference> results(theResults.size());
+  std::vector<unsigned long> openTimes;
+  if (fFindChangedTimes)
+  {
+    for (unsigned long time = 0; time < timeSize; time++)
+      if (theTimeIndexes[time] != gMissingIndex) openTimes.push_back(time);
+  }
+  std::vector<float> values1;
+  std::vector<float> values2;
+
+  unsigned long startIndex = 0;
+  unsigned long endIndex = 0;
+  bool finished = (fFindChangedTimes && openTimes.empty());
+  while (!finished && theLocationRange.GetCurrentLocationRange(startIndex, endIndex))
+  {
+    for (unsigned long location = startIndex; !finished && location <= endIndex; location++)
+    {
+      for (size_t param = 0; !finished && param < infos.size(); param++)
+      {
+        const NFmiFastQueryInfo &info1 = *infos[param].first;
+        const NFmiFastQueryInfo &info2 = *infos[param].second;
+        NFmiValueDifference *paramResults = &results[param * timeSize];
+        for (unsigned long level = 0; !finished && level < theLevelIndexes.size(); level++)
+        {
+          const unsigned long level1 = theLevelIndexes[level];
+          if (level1 == gMissingIndex) continue;
+          if (!info1.GetValues(info1.Index(info1.ParamIndex(), location, level1, 0),
+                               1,
+                               info1.SizeTimes(),
+                               values1) ||
+              !info2.GetValues(info2.Index(info2.ParamIndex(), location, level, 0),
+                               1,
+                               info2.SizeTimes(),
+                               values2))
+            throw std::runtime_error("CompareValues: failed to read the values");
+
+          if (fFindChangedTimes)
+          {
+            auto changedBegin = std::remove_if(
+                openTimes.begin(),
+                openTimes.end(),
+                [&](unsigned long time)
+                {
+                  if (values1[theTimeIndexes[time]] == values2[time]) return false;
+                  paramResults[time].itsDifferentCount++;
+                  return true;
+                });
+            openTimes.erase(changedBegin, openTimes.end());
+            if (openTimes.empty()) fAllTimesChanged = true;
+            finished = fAllTimesChanged;
+          }
+          else
+          {
+            for (size_t time = 0; time < timeSize; time++)
+            {
+              const unsigned long time1 = theTimeIndexes[time];
+              if (time1 == gMissingIndex) continue;
+              double value1 = values1[time1];
+              double value2 = values2[time];
+              double diff = std::abs(value2 - value1);
+              if (windDirections[param]) diff = std::min(diff, std::abs(diff - 360));
+
+              NFmiValueDifference &result = paramResults[time];
+              result.itsValueCount++;
+              if (diff != 0.0) result.itsDifferentCount++;
+              if (std::isnan(diff))
+                result.fNaNDifference = true;
+              else if (diff > result.itsMaxDifference)
+                result.itsMaxDifference = diff;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  boost::mutex::scoped_lock lock(theMutex);
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    NFmiValueDifference &result = theResults[i];
+    result.itsMaxDifference = std::max(result.itsMaxDifference, results[i].itsMaxDifference);
+    result.itsValueCount += results[i].itsValueCount;
+    result.itsDifferentCount += results[i].itsDifferentCount;
+    result.fNaNDifference = result.fNaNDifference || results[i].fNaNDifference;
+  }
+}
+
+}  // namespace
+
+std::vector<NFmiValueDifference> NFmiQueryDataUtil::CompareValues(
+    const ValueComparisonParams &theParams,
+    const std::vector<unsigned long> &theTimeIndexes,
+    const std::vector<unsigned long> &theLevelIndexes,
+    bool fFindChangedTimes,
+    unsigned int theMaxThreadCount)
+{
+  std::vector<NFmiValueDifference> results(theParams.size() * theTimeIndexes.size());
+  if (results.empty() || theLevelIndexes.empty()) return results;
+  const unsigned long locationSize = std::min(theParams.front().first->SizeLocations(),
+                                              theParams.front().second->SizeLocations());
+  if (locationSize == 0) return results;
+
+  // Threadit ottavat kerrallaan noin 64k arvoparin palan paikkoja
+  const size_t locationValueCount =
+      theParams.size() * theLevelIndexes.size() * theTimeIndexes.size();
+  const unsigned long chunkSize = static_cast<unsigned long>(
+      std::max<size_t>(1, std::min<size_t>(locationSize, 65536 / locationValueCount)));
+  unsigned int threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+      75, static_cast<unsigned int>((locationSize + chunkSize - 1) / chunkSize));
+  if (theMaxThreadCount > 0) threadCount = std::min(threadCount, theMaxThreadCount);
+
+  NFmiLocationIndexRangeCalculator locationRange(locationSize, chunkSize - 1);
+  std::atomic<bool> allTimesChanged(false);
+  boost::mutex mutex;
+  if (threadCount <= 1)
+    ::CompareValuesInThread(theParams,
+                            theTimeIndexes,
+                            theLevelIndexes,
+                            fFindChangedTimes,
+                            results,
+                            locationRange,
+                            allTimesChanged,
+                            mutex);
+  else
+  {
+    boost::thread_group calcParts;
+    for (unsigned int i = 0; i < threadCount; i++)
+      calcParts.add_thread(new boost::thread(::CompareValuesInThread,
+                                             boost::cref(theParams),
+                                             boost::cref(theTimeIndexes),
+                                             boost::cref(theLevelIndexes),
+                                             fFindChangedTimes,
+                                             boost::ref(results),
+                                             boost::ref(locationRange),
+                                             boost::ref(allTimesChanged),
+                                             boost::ref(mutex)));
+    calcParts.join_all();
+  }
+  return results;
+}
@@ -34,6 +34,7 @@
 
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 class NFmiFastQueryInfo;
@@ -177,6 +178,51 @@ struct GridRecordData
   NFmiParam itsOrigParam;
 };
 
+// Yhden tiedoston aika-askeleet, jotka kopioidaan kohdedatan annettuihin aika-indekseihin.
+// Käytetään NFmiQueryDataUtil::CopyTimeStepsFromFiles -funktion kanssa.
+struct NFmiTimeStepCopyTask
+{
+  std::string itsFileName;
+  std::vector<unsigned long> itsSourceTimeIndexes;
+  std::vector<unsigned long> itsTargetTimeIndexes;
+};
+
+// Kohdedatan parametri-, paikka-, level- ja aika-indekseille vastaavat lähdedatan indeksit
+// (gMissingIndex, jos vastinetta ei ole). Käytetään NFmiQueryDataUtil::CopySlabs -funktion kanssa.
+struct NFmiSlabCopyIndexes
+{
+  std::vector<unsigned long> itsParamIndexes;
+  std::vector<unsigned long> itsLocationIndexes;
+  std::vector<unsigned long> itsLevelIndexes;
+  std::vector<unsigned long> itsTimeIndexes;
+};
+
+// Puuttuvien arvojen määrät parametreittain aika-askelittain ja paikoittain. Parametrin yhdessä
+// aika-askeleessa on paikkojen * levelien verran arvoja ja yhdessä paikassa levelien * aikojen
+// verran. Täytetään NFmiQueryDataUtil::CountMissingValues -funktiolla.
+struct NFmiMissingValueCounts
+{
+  size_t ParamMissingCount(unsigned long theParam) const;
+
+  unsigned long itsLocationSize = 0;
+  unsigned long itsLevelSize = 0;
+  unsigned long itsTimeSize = 0;
+  std::vector<bool> itsParamFound;        // false, jos pyydettyä parametria ei ole datassa
+  std::vector<size_t> itsTimeCounts;      // [param * itsTimeSize + time]
+  std::vector<size_t> itsLocationCounts;  // [param * itsLocationSize + location]
+  unsigned long itsScannedCount = 0;      // läpikäydyt aika-askeleet tai paikat alusta lähtien
+};
+
+// Kahden datan yhden parametrin yhden aika-askeleen arvojen vertailun tulos (kaikki paikat ja
+// levelit). Täytetään NFmiQueryDataUtil::CompareValues -funktiolla.
+struct NFmiValueDifference
+{
+  double itsMaxDifference = 0;    // suurin itseisarvoinen ero, tuulen suunnalle kulmaero
+  size_t itsValueCount = 0;       // verratut arvoparit
+  size_t itsDifferentCount = 0;   // eroavat arvoparit
+  bool fNaNDifference = false;    // jokin ero oli NaN, sitä ei ole otettu maksimiin mukaan
+};
+
 class NFmiStopFunctor
 {
  public:
@@ -491,7 +537,8 @@ class NFmiQueryDataUtil
                                         int theFilterId,
                                         int theAreaType,
                                         double theAdditionalParam1 = 1,
-                                        double theAdditionalParam2 = 1);
+                                        double theAdditionalParam2 = 1,
+                                        unsigned int theMaxThreadCount = 0);
 
   // ********************************************************************************
   // ***************  NowcastFilter osuus on nyt täällä!  ***************************
@@ -511,8 +558,13 @@ class NFmiQueryDataUtil
 
   static const NFmiString &GetOfficialQueryDataProdIdsKey();
 
-  static NFmiQueryData *QDCrop(
-      NFmiFastQueryInfo &theInfo, int theLeft, int theTop, int theRight, int theBottom);
+  static NFmiQueryData *QDCrop(NFmiFastQueryInfo &theInfo,
+                               int theLeft,
+                               int theTop,
+                               int theRight,
+                               int theBottom,
+                               const std::string &theMemoryMappedFileName = std::string(),
+                               unsigned int theMaxThreadCount = 0);
 
   static std::string GetFileFilterDirectory(const std::string &theFileFilter);
   using LoggingFunction = std::function<void(const std::string &)>;
@@ -532,6 +584,67 @@ class NFmiQueryDataUtil
                                           int theMaxTimeStepsInData = 0,
                                           NFmiStopFunctor *theStopFunctor = nullptr,
                                           LoggingFunction *loggingFunction = nullptr);
+  // Copies the given time steps from source to target. Parameters, levels and locations are
+  // matched as in MakeSlabCopyIndexes and the values are copied with CopySlabs.
+  static bool CopyTimeSteps(NFmiFastQueryInfo &theSourceInfo,
+                            NFmiFastQueryInfo &theTargetInfo,
+                            const std::vector<unsigned long> &theSourceTimeIndexes,
+                            const std::vector<unsigned long> &theTargetTimeIndexes);
+  static void CopyTimeStepsFromFiles(std::vector<NFmiTimeStepCopyTask> &theTasks,
+                                     NFmiQueryData &theTargetData,
+                                     unsigned int theMaxUsedThreadCount = 0,
+                                     NFmiStopFunctor *theStopFunctor = nullptr,
+                                     LoggingFunction *loggingFunction = nullptr);
+  static bool ReadQueryInfoHeader(const std::string &theFileName, NFmiQueryInfo &theInfoOut);
+  // Matches target params, locations, levels and times to source indexes for CopySlabs.
+  // Returns false if the locations can't be matched (e.g. different sized grids).
+  static bool MakeSlabCopyIndexes(NFmiFastQueryInfo &theSourceInfo,
+                                  NFmiFastQueryInfo &theTargetInfo,
+                                  NFmiSlabCopyIndexes &theIndexesOut);
+  // Matches a sub grid of the source starting from (theLeft, theBottom) with the given steps
+  // to the target grid, other dimensions as in MakeSlabCopyIndexes.
+  static bool MakeGridCropIndexes(NFmiFastQueryInfo &theSourceInfo,
+                                  NFmiFastQueryInfo &theTargetInfo,
+                                  int theLeft,
+                                  int theBottom,
+                                  int theXStep,
+                                  int theYStep,
+                                  NFmiSlabCopyIndexes &theIndexesOut);
+  // Copies the mapped values as large contiguous raw data blocks, returns the copied count.
+  // The work is split by parameters and location ranges, 0 threads = reasonable count.
+  static size_t CopySlabs(NFmiFastQueryInfo &theSourceInfo,
+                          NFmiFastQueryInfo &theTargetInfo,
+                          const NFmiSlabCopyIndexes &theIndexes,
+                          unsigned int theMaxThreadCount = 1);
+  using MissingValueScanFunction = std::function<bool(const NFmiMissingValueCounts &)>;
+  // Counts kFloatMissing (or NaN if fCountNaN) values of the given params (empty = all params
+  // and sub params) per time step and per location in one pass. The data is scanned in blocks of
+  // time steps (fByTimes) or locations in ascending order, theContinueFunction is called after
+  // each block and the scan stops if it returns false. 0 threads = reasonable count.
+  static void CountMissingValues(
+      NFmiFastQueryInfo &theInfo,
+      const std::vector<FmiParameterName> &theParams,
+      bool fCountNaN,
+      bool fByTimes,
+      NFmiMissingValueCounts &theCountsOut,
+      const MissingValueScanFunction &theContinueFunction = MissingValueScanFunction(),
+      unsigned int theMaxThreadCount = 0);
+  // Pairs of infos (data 1, data 2) with the compared param or sub param selected
+  using ValueComparisonParams = std::vector<
+      std::pair<boost::shared_ptr<NFmiFastQueryInfo>, boost::shared_ptr<NFmiFastQueryInfo>>>;
+  // Compares the param pair values of two datas in location order with bulk reads of whole
+  // time series. Data 2 times and levels are compared with the data 1 indexes given in
+  // theTimeIndexes and theLevelIndexes (sizes = data 2 sizes, gMissingIndex = not compared),
+  // locations index by index up to the smaller location count. Returns a [param * data 2 time
+  // size + time] table. If fFindChangedTimes, values are only tested for inequality and a time
+  // is not compared any further after its first changed value in any param, so only the
+  // itsDifferentCount > 0 information of the time is reliable. 0 threads = reasonable count.
+  static std::vector<NFmiValueDifference> CompareValues(
+      const ValueComparisonParams &theParams,
+      const std::vector<unsigned long> &theTimeIndexes,
+      const std::vector<unsigned long> &theLevelIndexes,
+      bool fFindChangedTimes,
+      unsigned int theMaxThreadCount = 0);
   static int CalcOptimalThreadCount(int maxAvailableThreads, int separateTaskCount);
   static unsigned int GetReasonableWorkingThreadCount(double wantedHardwareThreadPercent = 50.,
                                                       unsigned int separateTaskCount = 0);
@@ -25,6 +25,7 @@
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
@@ -464,6 +465,13 @@ bool NFmiRawData::Pimple::GetValues(size_t startIndex,
   {
     ReadLock lock(itsMutex);
 
+    // Contiguous runs (for example a time series or a slab of params) are plain memory copies
+    if (step == 1)
+    {
+      std::copy(ptr + startIndex, ptr + startIndex + count, values.begin());
+      return true;
+    }
+
     size_t i = 0;
     std::generate(values.begin(), values.end(), [&] { return ptr[startIndex + (i++) * step]; });
 
@@ -497,8 +505,13 @@ bool NFmiRawData::Pimple::SetValues(size_t startIndex,
   {
     WriteLock lock(itsMutex);
 
-    for (size_t i = 0; i < count; i++)
-      ptr[startIndex + i * step] = values[i];
+    if (step == 1)
+      std::copy(values.begin(), values.begin() + count, ptr + startIndex);
+    else
+    {
+      for (size_t i = 0; i < count; i++)
+        ptr[startIndex + i * step] = values[i];
+    }
   }
 
   return true;
@@ -12,7 +12,6 @@
 #include "NFmiSoundingFunctions.h"
 
 #include <boost/algorithm/string.hpp>
-#include <boost/format.hpp>
 #include <newbase/NFmiAngle.h>
 #include <newbase/NFmiDataModifierAvg.h>
 #include <newbase/NFmiFastInfoUtils.h>
@@ -66,6 +65,80 @@ bool NFmiGroundLevelValue::IsBelowGroundLevelCase(float P) const
   return false;
 }
 
+// ********************************************
+// ******  NFmiSoundingColumnBlock ************
+// ********************************************
+
+// Parametrit, joita FillSoundingData lukee useFastFill -tapauksessa
+static const FmiParameterName gColumnBlockParams[] = {kFmiTemperature,
+                                                      kFmiDewPoint,
+                                                      kFmiHumidity,
+                                                      kFmiPressure,
+                                                      kFmiGeomHeight,
+                                                      kFmiGeopHeight,
+                                                      kFmiWindSpeedMS,
+                                                      kFmiWindDirection,
+                                                      kFmiWindUMS,
+                                                      kFmiWindVMS,
+                                                      kFmiWindVectorMS,
+                                                      kFmiTotalCloudCover};
+static const int gColumnBlockParamCount =
+    sizeof(gColumnBlockParams) / sizeof(gColumnBlockParams[0]);
+
+void NFmiSoundingColumnBlock::Fill(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo,
+                                   unsigned long theStartLocationIndex,
+                                   unsigned long theEndLocationIndex)
+{
+  itsColumnCount = theEndLocationIndex - theStartLocationIndex + 1;
+  itsLevelCount = theInfo->SizeLevels();
+  itsSlabs.resize(gColumnBlockParamCount);
+  for (int slabIndex = 0; slabIndex < gColumnBlockParamCount; slabIndex++)
+  {
+    std::vector<float> &slab = itsSlabs[slabIndex];
+    if (!theInfo->Param(gColumnBlockParams[slabIndex]))
+    {
+      slab.clear();
+      continue;
+    }
+    slab.resize(itsLevelCount * itsColumnCount);
+    unsigned long levelIndex = 0;
+    for (theInfo->ResetLevel(); theInfo->NextLevel(); levelIndex++)
+    {
+      float *levelValues = &slab[levelIndex * itsColumnCount];
+      for (unsigned long column = 0; column < itsColumnCount; column++)
+      {
+        theInfo->LocationIndex(theStartLocationIndex + column);
+        levelValues[column] = theInfo->FloatValue();
+      }
+    }
+  }
+  itsMetaWindParamUsage = NFmiFastInfoUtils::CheckMetaWindParamUsage(theInfo);
+}
+
+int NFmiSoundingColumnBlock::SlabIndex(FmiParameterName theId) const
+{
+  for (int slabIndex = 0; slabIndex < gColumnBlockParamCount; slabIndex++)
+  {
+    if (gColumnBlockParams[slabIndex] == theId)
+      return slabIndex;
+  }
+  return -1;
+}
+
+bool NFmiSoundingColumnBlock::HasParam(FmiParameterName theId) const
+{
+  int slabIndex = SlabIndex(theId);
+  return slabIndex >= 0 && static_cast<size_t>(slabIndex) < itsSlabs.size() &&
+         !itsSlabs[slabIndex].empty();
+}
+
+float NFmiSoundingColumnBlock::Value(FmiParameterName theId,
+                                     unsigned long theLevel,
+                                     unsigned long theColumn) const
+{
+  return itsSlabs[SlabIndex(theId)][theLevel * itsColumnCount + theColumn];
+}
+
 // ********************************************
 // ********  NFmiSoundingData *****************
 // ********************************************
@@ -81,7 +154,8 @@ NFmiSoundingData::NFmiSoundingData()
       fPressureDataAvailable(false),
       fHeightDataAvailable(false),
       itsLFCIndexCache(),
-      itsLiftedAirParcelCache()
+      itsLiftedAirParcelCache(),
+      itsLiftedAirParcelStartCache()
 {
 }
 
@@ -907,6 +981,28 @@ bool NFmiSoundingData::FastFillParamData(const boost::shared_ptr<NFmiFastQueryIn
   return status;
 }
 
+// Kuten FastFillParamData, mutta arvot otetaan tiilen sarakkeesta.
+bool NFmiSoundingData::BlockFillParamData(const NFmiSoundingColumnBlock &theBlock,
+                                          unsigned long theColumn,
+                                          FmiParameterName theId)
+{
+  bool status = false;
+  std::deque<float> &data = GetParamData(theId);
+  data.resize(theBlock.LevelCount(), kFloatMissing);  // alustetaan vektori puuttuvalla
+  if (theBlock.HasParam(theId))
+  {
+    for (unsigned long levelIndex = 0; levelIndex < theBlock.LevelCount(); levelIndex++)
+    {
+      auto value = theBlock.Value(theId, levelIndex, theColumn);
+      data[levelIndex] = value;
+      if (value != kFloatMissing)
+        status = true;
+    }
+  }
+
+  return status;
+}
+
 bool NFmiSoundingData::FillPressureDataFromLevels(
     const boost::shared_ptr<NFmiFastQueryInfo> &theInfo)
 {
@@ -1179,6 +1275,43 @@ bool NFmiSoundingData::FillSoundingData(
   return false;
 }
 
+bool NFmiSoundingData::FillSoundingData(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo,
+                                        NFmiSoundingColumnBlock &theBlock,
+                                        unsigned long theColumn,
+                                        const NFmiMetTime &theTime,
+                                        const NFmiMetTime &theOriginTime,
+                                        const NFmiLocation &theLocation,
+                                        const boost::shared_ptr<NFmiFastQueryInfo> &theGroundDataInfo)
+{
+  ClearDatas();
+  if (theInfo && theInfo->IsGrid())
+  {
+    fMovingSounding = NFmiFastInfoUtils::IsMovingSoundingData(theInfo);
+    fObservationData = false;
+    itsLocation = theLocation;
+    itsTime = theTime;
+    itsOriginTime = theOriginTime;
+
+    BlockFillParamData(theBlock, theColumn, kFmiTemperature);
+    fDewPointHadValuesFromData = BlockFillParamData(theBlock, theColumn, kFmiDewPoint);
+    fHumidityHadValuesFromData = BlockFillParamData(theBlock, theColumn, kFmiHumidity);
+    if (!BlockFillParamData(theBlock, theColumn, kFmiPressure))
+      FillPressureDataFromLevels(theInfo);
+    if (!BlockFillParamData(theBlock, theColumn, kFmiGeomHeight))
+    {
+      // eri datoissa on geom ja geop heightia, kokeillaan molempia tarvittaessa
+      if (!BlockFillParamData(theBlock, theColumn, kFmiGeopHeight))
+        FillHeightDataFromLevels(theInfo);
+    }
+    BlockFillWindData(theBlock, theColumn);
+    BlockFillParamData(theBlock, theColumn, kFmiTotalCloudCover);
+
+    MakeFillDataPostChecks(theInfo, theGroundDataInfo, NFmiGroundLevelValue());
+    return true;
+  }
+  return false;
+}
+
 void NFmiSoundingData::MakeFillDataPostChecks(
     const boost::shared_ptr<NFmiFastQueryInfo> &theInfo,
     const boost::shared_ptr<NFmiFastQueryInfo> &theGroundDataInfo,
@@ -1563,6 +1696,10 @@ void NFmiSoundingData::ClearDatas()
   fPressureDataAvailable = false;
   fHeightDataAvailable = false;
   itsLFCIndexCache.Clear();
+  // Cachet ovat arvojen avaimilla, mutta tyhjennetään ne ettei muisti kasva kun samaa oliota
+  // käytetään kokonaisen hilan laskuihin.
+  itsLiftedAirParcelCache.clear();
+  itsLiftedAirParcelStartCache.clear();
   fMovingSounding = false;
 }
 
@@ -1642,7 +1779,7 @@ bool NFmiSoundingData::ModifyTd2MoistAdiapaticBelowGivenP(double P, double Td)
       currentP = pV[i];
       if (currentP >= P)
       {  // muutoksia siis tehtiin niin kauan kuin oltiin alle annetun paineen
-        float ATSA = static_cast<float>(NFmiSoundingFunctions::TSA(AOS, currentP));
+        float ATSA = static_cast<float>(NFmiSoundingFunctions::TSAFast(AOS, currentP));
         tdV[i] = ATSA;
       }
       else
@@ -1814,11 +1951,12 @@ bool NFmiSoundingData::HasRealSoundingData(
 double NFmiSoundingData::CalcSHOWIndex()
 {
   double indexValue = kFloatMissing;
-  double T_850 = GetValueAtPressure(kFmiTemperature, 850);
-  double Td_850 = GetValueAtPressure(kFmiDewPoint, 850);
-  if (T_850 != kFloatMissing && Td_850 != kFloatMissing)
+  double T_850 = kFloatMissing;
+  double Td_850 = kFloatMissing;
+  double P_850 = kFloatMissing;
+  if (GetSHOWParcelValues(T_850, Td_850, P_850))
   {
-    double Tparcel_from850to500 = CalcTOfLiftedAirParcel(T_850, Td_850, 850, 500);
+    double Tparcel_from850to500 = CalcTOfLiftedAirParcel(T_850, Td_850, P_850, 500);
     // 3. SHOW = T500 - Tparcel_from850to500
     double T500 = GetValueAtPressure(kFmiTemperature, 500);
     if (T500 != kFloatMissing && Tparcel_from850to500 != kFloatMissing)
@@ -1827,6 +1965,14 @@ double NFmiSoundingData::CalcSHOWIndex()
   return indexValue;
 }
 
+bool NFmiSoundingData::GetSHOWParcelValues(double &T, double &Td, double &P)
+{
+  T = GetValueAtPressure(kFmiTemperature, 850);
+  Td = GetValueAtPressure(kFmiDewPoint, 850);
+  P = 850;
+  return (T != kFloatMissing && Td != kFloatMissing);
+}
+
 // LIFT Lifted index
 // LIFT	= T500 - Tparcel
 // T500 = temperature in Celsius of the environment at 500 mb
@@ -1839,11 +1985,7 @@ double NFmiSoundingData::CalcLIFTIndex()
   double T_500m_avg = kFloatMissing;
   double Td_500m_avg = kFloatMissing;
 
-  // HUOM! Pitää ottaa huomioon aseman korkeus kun tehdään laskuja!!!!
-  double h1 = 0 + ZeroHeight();
-  double h2 = 500 + ZeroHeight();
-
-  if (CalcLCLAvgValues(h1, h2, T_500m_avg, Td_500m_avg, P_500m_avg, false))
+  if (GetLIFTParcelValues(T_500m_avg, Td_500m_avg, P_500m_avg))
   {
     double Tparcel_from500mAvgTo500 =
         CalcTOfLiftedAirParcel(T_500m_avg, Td_500m_avg, P_500m_avg, 500);
@@ -1855,6 +1997,15 @@ double NFmiSoundingData::CalcLIFTIndex()
   return indexValue;
 }
 
+bool NFmiSoundingData::GetLIFTParcelValues(double &T, double &Td, double &P)
+{
+  // HUOM! Pitää ottaa huomioon aseman korkeus kun tehdään laskuja!!!!
+  double h1 = 0 + ZeroHeight();
+  double h2 = 500 + ZeroHeight();
+
+  return CalcLCLAvgValues(h1, h2, T, Td, P, false);
+}
+
 // KINX K index
 // KINX = ( T850 - T500 ) + TD850 - ( T700 - TD700 )
 //	T850 = Temperature in Celsius at 850 mb
@@ -2746,53 +2897,66 @@ double NFmiSoundingData::CalcWSatHeightIndex(double theH)
   return GetValueAtHeight(kFmiWindSpeedMS, static_cast<float>(theH));
 }
 
-std::string NFmiSoundingData::MakeCacheString(double T, double Td, double fromP, double toP)
-{
-  return (boost::format("%f,%f,%f,%f") % T % Td % fromP % toP).str();
-}
-
 // Laske ilmapaketin lämpötila nostamalla ilmapakettia
 // Nosta kuiva-adiapaattisesti LCL-korkeuteen ja siitä eteenpäin kostea-adiapaattisesti
 double NFmiSoundingData::CalcTOfLiftedAirParcel(double T, double Td, double fromP, double toP)
 {
-  std::string cacheKeyStr = MakeCacheString(T, Td, fromP, toP);
-  LiftedAirParcelCacheType::iterator it = itsLiftedAirParcelCache.find(cacheKeyStr);
+  LiftedAirParcelKey cacheKey{T, Td, fromP, toP};
+  LiftedAirParcelCacheType::iterator it = itsLiftedAirParcelCache.find(cacheKey);
   if (it != itsLiftedAirParcelCache.end())
     return it->second;  // palautetaan arvo cachesta
 
+  // LCL ja kostea-adiabaatti riippuvat vain lähtöpisteestä, joten ne lasketaan kerran per
+  // ilmapaketti, vaikka samaa pakettia nostetaan jokaiselle luotauksen painepinnalle.
+  LiftedAirParcelKey startKey{T, Td, fromP, 0};
+  LiftedAirParcelStartCacheType::iterator startIt = itsLiftedAirParcelStartCache.find(startKey);
+  if (startIt == itsLiftedAirParcelStartCache.end())
+    startIt = itsLiftedAirParcelStartCache.emplace(startKey, CalcLiftedAirParcelStart(T, Td, fromP))
+                  .first;
+  const LiftedAirParcelStart &start = startIt->second;
+
   double Tparcel = kFloatMissing;
+  if (start.itsLCLPressure != kFloatMissing && start.itsTpot != kFloatMissing)
+  {
+    if (start.itsLCLPressure <= toP)  // jos lcl oli yli toP:n mb (eli pienempi kuin toP)
+    {                                 // nyt riittää pelkkä kuiva-adiapaattinen nosto fromP -> toP
+      Tparcel = NFmiSoundingFunctions::Tpot2t(start.itsTpot, toP);
+    }
+    else if (start.itsMoistOS != kFloatMissing)
+    {
+      // Sitten lasketaan lämpötila viimein 500 mb:hen
+      Tparcel = NFmiSoundingFunctions::TSAFast(start.itsMoistOS, toP);
+    }
+  }
+  itsLiftedAirParcelCache[cacheKey] = Tparcel;
+  return Tparcel;
+}
+
+NFmiSoundingData::LiftedAirParcelStart NFmiSoundingData::CalcLiftedAirParcelStart(double T,
+                                                                                double Td,
+                                                                                double fromP)
+{
+  LiftedAirParcelStart start;
   // 1. laske LCL kerroksen paine alkaen fromP:stä
-  double lclPressure = NFmiSoundingFunctions::CalcLCLPressureFast(T, Td, fromP);
-  if (lclPressure != kFloatMissing)
+  start.itsLCLPressure = NFmiSoundingFunctions::CalcLCLPressureFast(T, Td, fromP);
+  if (start.itsLCLPressure != kFloatMissing)
   {
     // Laske aloitus korkeuden lämpötilan potentiaali lämpötila.
-    double TpotStart = NFmiSoundingFunctions::T2tpot(T, fromP);
-    if (TpotStart != kFloatMissing)
+    start.itsTpot = NFmiSoundingFunctions::T2tpot(T, fromP);
+    if (start.itsTpot != kFloatMissing)
     {
-      if (lclPressure <= toP)  // jos lcl oli yli toP:n mb (eli pienempi kuin toP)
-      {                        // nyt riittää pelkkä kuiva-adiapaattinen nosto fromP -> toP
-        Tparcel = NFmiSoundingFunctions::Tpot2t(TpotStart, toP);
-      }
-      else
-      {
-        // Laske ilmapaketin lämpö lcl-korkeudella  kuiva-adiapaattisesti nostettuna
-        double Tparcel_LCL = NFmiSoundingFunctions::Tpot2t(TpotStart, lclPressure);
-        // laske kyseiselle korkeudelle vastaava kostea-adiapaatti arvo
-        double TmoistLCL = NFmiSoundingFunctions::CalcMoistT(Tparcel_LCL, lclPressure);
-        // kyseinen kostea-adiapaatti pitää konvertoida vielä (ADL-kielestä kopioitua koodia, ks.
-        // OS- ja
-        // TSA-funtioita) jotenkin 1000 mb:hen.
-        if (TmoistLCL != kFloatMissing)
-        {
-          double AOS = NFmiSoundingFunctions::OS(TmoistLCL, 1000.);
-          // Sitten lasketaan lämpötila viimein 500 mb:hen
-          Tparcel = NFmiSoundingFunctions::TSA(AOS, toP);
-        }
-      }
+      // Laske ilmapaketin lämpö lcl-korkeudella  kuiva-adiapaattisesti nostettuna
+      double Tparcel_LCL = NFmiSoundingFunctions::Tpot2t(start.itsTpot, start.itsLCLPressure);
+      // laske kyseiselle korkeudelle vastaava kostea-adiapaatti arvo
+      double TmoistLCL = NFmiSoundingFunctions::CalcMoistTFast(Tparcel_LCL, start.itsLCLPressure);
+      // kyseinen kostea-adiapaatti pitää konvertoida vielä (ADL-kielestä kopioitua koodia, ks.
+      // OS- ja
+      // TSA-funtioita) jotenkin 1000 mb:hen.
+      if (TmoistLCL != kFloatMissing)
+        start.itsMoistOS = NFmiSoundingFunctions::OS(TmoistLCL, 1000.);
     }
   }
-  itsLiftedAirParcelCache[cacheKeyStr] = Tparcel;
-  return Tparcel;
+  return start;
 }
 
 // Haetaan minimi lämpötilan arvo ja sen korkeuden paine.
@@ -3046,6 +3210,34 @@ void NFmiSoundingData::FastFillWindData(const boost::shared_ptr<NFmiFastQueryInf
   }
 }
 
+void NFmiSoundingData::BlockFillWindData(NFmiSoundingColumnBlock &theBlock, unsigned long theColumn)
+{
+  auto &metaWindParamUsage = theBlock.MetaWindParamUsage();
+  if (metaWindParamUsage.NoWindMetaParamsNeeded())
+  {
+    // Normal case with totalWind parameter in data
+    BlockFillParamData(theBlock, theColumn, kFmiWindSpeedMS);
+    BlockFillParamData(theBlock, theColumn, kFmiWindDirection);
+    BlockFillParamData(theBlock, theColumn, kFmiWindUMS);
+    BlockFillParamData(theBlock, theColumn, kFmiWindVMS);
+    BlockFillParamData(theBlock, theColumn, kFmiWindVectorMS);
+  }
+  else
+  {
+    if (metaWindParamUsage.HasWsAndWd())
+    {
+      BlockFillParamData(theBlock, theColumn, kFmiWindSpeedMS);
+      BlockFillParamData(theBlock, theColumn, kFmiWindDirection);
+    }
+    if (metaWindParamUsage.HasWindComponents())
+    {
+      BlockFillParamData(theBlock, theColumn, kFmiWindUMS);
+      BlockFillParamData(theBlock, theColumn, kFmiWindVMS);
+    }
+    FillRestOfWindData(metaWindParamUsage);
+  }
+}
+
 void NFmiSoundingData::FillRestOfWindData(NFmiFastInfoUtils::MetaWindParamUsage &metaWindParamUsage)
 {
   if (metaWindParamUsage.MakeMetaWsAndWdParams())
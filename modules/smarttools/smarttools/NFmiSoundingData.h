@@ -17,6 +17,7 @@
 
 #include <deque>
 #include <unordered_map>
+#include <vector>
 
 class NFmiFastQueryInfo;
 
@@ -44,6 +45,35 @@ struct NFmiGroundLevelValue
   float itsStationPressureInMilliBars = kFloatMissing;
 };
 
+// Joukko peräkkäisiä hilapisteitä (tiili) luettuna datasta kerralla level-laatoittain.
+// Kunkin parametrin arvot ovat taulukossa [level][sarake], jolloin yhden levelin arvot luetaan
+// peräkkäisistä locationeista eikä infon parametria ja leveliä tarvitse etsiä jokaiselle
+// hilapisteelle erikseen. NFmiSoundingData täytetään tästä sarake kerrallaan.
+class NFmiSoundingColumnBlock
+{
+ public:
+  // Oletus: theInfo on jo oikeassa ajassa. Luetaan locationit theStartLocationIndex ...
+  // theEndLocationIndex (mukaanlukien).
+  void Fill(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo,
+            unsigned long theStartLocationIndex,
+            unsigned long theEndLocationIndex);
+  unsigned long ColumnCount() const { return itsColumnCount; }
+  unsigned long LevelCount() const { return itsLevelCount; }
+  bool HasParam(FmiParameterName theId) const;
+  float Value(FmiParameterName theId, unsigned long theLevel, unsigned long theColumn) const;
+  NFmiFastInfoUtils::MetaWindParamUsage &MetaWindParamUsage() { return itsMetaWindParamUsage; }
+
+ private:
+  int SlabIndex(FmiParameterName theId) const;
+
+  unsigned long itsColumnCount = 0;
+  unsigned long itsLevelCount = 0;
+  // Parametrien laatat samassa järjestyksessä kuin NFmiSoundingData.cpp:n
+  // parametrilista, tyhjä laatta tarkoittaa että parametria ei ole datassa
+  std::vector<std::vector<float>> itsSlabs;
+  NFmiFastInfoUtils::MetaWindParamUsage itsMetaWindParamUsage;
+};
+
 class NFmiSoundingData
 {
  public:
@@ -103,6 +133,15 @@ class NFmiSoundingData
                         const boost::shared_ptr<NFmiFastQueryInfo> &theGroundDataInfo,
                         bool useFastFill = false,
                         const NFmiGroundLevelValue &theGroundLevelValue = NFmiGroundLevelValue());
+  // Kuten useFastFill -tapaus, mutta arvot otetaan theBlock:in sarakkeesta theColumn,
+  // theInfo:sta käytetään vain level- ja parametritietoja.
+  bool FillSoundingData(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo,
+                        NFmiSoundingColumnBlock &theBlock,
+                        unsigned long theColumn,
+                        const NFmiMetTime &theTime,
+                        const NFmiMetTime &theOriginTime,
+                        const NFmiLocation &theLocation,
+                        const boost::shared_ptr<NFmiFastQueryInfo> &theGroundDataInfo);
   bool FillSoundingData(const std::vector<FmiParameterName> &parametersInServerData,
                         const std::string &theServerDataAsciiFormat,
                         const NFmiMetTime &theTime,
@@ -157,6 +196,9 @@ class NFmiSoundingData
 
   double CalcSHOWIndex();
   double CalcLIFTIndex();
+  // SHOW- ja LIFT-indeksien 500 mb:hen nostettavan ilmapaketin lähtöarvot
+  bool GetSHOWParcelValues(double &T, double &Td, double &P);
+  bool GetLIFTParcelValues(double &T, double &Td, double &P);
   double CalcKINXIndex();
   double CalcCTOTIndex();
   double CalcVTOTIndex();
@@ -200,6 +242,38 @@ class NFmiSoundingData
   void FillRestOfWindData(NFmiFastInfoUtils::MetaWindParamUsage &metaWindParamUsage);
 
  private:
+  // Nostetun ilmapaketin cache-avain, lähtöpisteen cachessa toP on 0
+  struct LiftedAirParcelKey
+  {
+    double T;
+    double Td;
+    double fromP;
+    double toP;
+    bool operator==(const LiftedAirParcelKey &other) const
+    {
+      return T == other.T && Td == other.Td && fromP == other.fromP && toP == other.toP;
+    }
+  };
+  struct LiftedAirParcelKeyHash
+  {
+    std::size_t operator()(const LiftedAirParcelKey &key) const
+    {
+      std::hash<double> hasher;
+      std::size_t h = hasher(key.T);
+      h = h * 31 + hasher(key.Td);
+      h = h * 31 + hasher(key.fromP);
+      return h * 31 + hasher(key.toP);
+    }
+  };
+  // Ilmapaketin nostosta se osa, joka ei riipu kohdepaineesta
+  struct LiftedAirParcelStart
+  {
+    double itsLCLPressure = kFloatMissing;
+    double itsTpot = kFloatMissing;
+    double itsMoistOS = kFloatMissing;  // LCL:n kautta kulkevan kostea-adiabaatin OS-arvo
+  };
+
+  LiftedAirParcelStart CalcLiftedAirParcelStart(double T, double Td, double fromP);
   bool CheckLFCIndexCache(FmiLCLCalcType theLCLCalcTypeIn,
                           double &theLfcIndexValueOut,
                           double &theELValueOut);
@@ -227,9 +301,12 @@ class NFmiSoundingData
                     const NFmiMetTime &theTime,
                     const NFmiPoint &theLatlon);
   void FastFillWindData(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo);
+  bool BlockFillParamData(const NFmiSoundingColumnBlock &theBlock,
+                          unsigned long theColumn,
+                          FmiParameterName theId);
+  void BlockFillWindData(NFmiSoundingColumnBlock &theBlock, unsigned long theColumn);
   void InitZeroHeight();  // tätä kutsutaan FillParamData-metodeista
   void CalculateHumidityData();
-  std::string MakeCacheString(double T, double Td, double fromP, double toP);
   bool FillHeightDataFromLevels(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo);
   bool FillPressureDataFromLevels(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo);
   bool LookForFilledParamFromInfo(const boost::shared_ptr<NFmiFastQueryInfo> &theInfo,
@@ -289,8 +366,12 @@ class NFmiSoundingData
   bool fHeightDataAvailable;
 
   LFCIndexCache itsLFCIndexCache;
-  typedef std::unordered_map<std::string, double> LiftedAirParcelCacheType;
+  typedef std::unordered_map<LiftedAirParcelKey, double, LiftedAirParcelKeyHash>
+      LiftedAirParcelCacheType;
   LiftedAirParcelCacheType itsLiftedAirParcelCache;
+  typedef std::unordered_map<LiftedAirParcelKey, LiftedAirParcelStart, LiftedAirParcelKeyHash>
+      LiftedAirParcelStartCacheType;
+  LiftedAirParcelStartCacheType itsLiftedAirParcelStartCache;
   bool fMovingSounding = false;
   // Jos datassa on suoraan ei-missing arvoja kyseiselle parametrille, ei sitä enää lasketa toisten
   // parametrien avulla. Tämä koskee siis Td joka voidaan laskea T:n ja RH:n avulla ja RH joka
@@ -12,6 +12,8 @@
 #include <newbase/NFmiInterpolation.h>
 #include <newbase/NFmiValueString.h>
 
+#include <vector>
+
 namespace NFmiSoundingFunctions
 {
 // Funktio laskee kastepisteen (DP) lämpötilan (T) ja suhteellisen
@@ -230,6 +232,118 @@ double TSA(double OS, double P)
   return TSA - 273.16;  // Muutetaan takaisin celsiuksiksi
 }
 
+// Jos tosi, TSAFast ja CalcMoistTFast käyttävät suoraan iteratiivisia ratkaisijoita taulukoiden
+// sijasta. Asetetaan ennen kuin laskentasäikeet käynnistetään.
+static bool gUseExactSolvers = false;
+
+void UseExactSolvers(bool newValue) { gUseExactSolvers = newValue; }
+bool UseExactSolvers() { return gUseExactSolvers; }
+
+namespace
+{
+// Kostea-adiabaattien taulukko: akselit ovat OS (celsiuksina) ja ln(P). Taulukkoon talletetaan
+// TSA:n lämpötila potentiaalilämpötilana (T * (1000/P)^0.286), koska se muuttuu paineen mukana
+// paljon tasaisemmin kuin itse lämpötila ja bilineaarinen interpolointi on siksi tarkempaa.
+const double gTsaTableOSMin = -80.;
+const double gTsaTableOSMax = 80.;
+const double gTsaTableOSStep = 0.5;
+const double gTsaTablePMin = 50.;
+const double gTsaTablePMax = 1100.;
+const int gTsaTablePCount = 128;
+const double gLog1000 = 6.907755278982137;
+
+// Ratkaisee TSA:n yhtälön puolitushaulla loppuun asti (TSA-funktio lopettaa 0.01 asteen
+// tarkkuuteen tai 11 kierrokseen). Hakuväli on sama, jonka TSA:n iteraatio voi saavuttaa.
+double TSAConverged(double OS, double P)
+{
+  double A = OS + 273.16;
+  double k = ::pow((1000. / P), .286);
+  double lo = 253.16 - 119.94140625;
+  double hi = 253.16 + 119.94140625;
+  for (int i = 0; i < 50; i++)
+  {
+    double TQ = 0.5 * (lo + hi);
+    double X = A * ::exp(-2.6518986 * MIXR_SAT(TQ, P) / TQ) - TQ * k;
+    if (X > 0)
+      lo = TQ;
+    else
+      hi = TQ;
+  }
+  return 0.5 * (lo + hi) - 273.16;
+}
+
+class MoistAdiabatTable
+{
+ public:
+  MoistAdiabatTable()
+      : itsOSCount(static_cast<int>((gTsaTableOSMax - gTsaTableOSMin) / gTsaTableOSStep) + 1),
+        itsLogPMin(::log(gTsaTablePMin)),
+        itsLogPStep((::log(gTsaTablePMax) - itsLogPMin) / (gTsaTablePCount - 1)),
+        itsThetas(static_cast<size_t>(itsOSCount) * gTsaTablePCount)
+  {
+    for (int i = 0; i < itsOSCount; i++)
+    {
+      double os = gTsaTableOSMin + i * gTsaTableOSStep;
+      for (int j = 0; j < gTsaTablePCount; j++)
+      {
+        double logP = itsLogPMin + j * itsLogPStep;
+        double P = ::exp(logP);
+        itsThetas[static_cast<size_t>(i) * gTsaTablePCount + j] = static_cast<float>(
+            (TSAConverged(os, P) + 273.16) * ::exp(.286 * (gLog1000 - logP)));
+      }
+    }
+  }
+
+  // Palauttaa false, jos OS tai P on taulukon ulkopuolella.
+  bool Value(double OS, double P, double &theTemperature) const
+  {
+    if (!(P > 0))
+      return false;
+    double logP = ::log(P);
+    double x = (OS - gTsaTableOSMin) / gTsaTableOSStep;
+    double y = (logP - itsLogPMin) / itsLogPStep;
+    if (!(x >= 0 && y >= 0))
+      return false;
+    int i = static_cast<int>(x);
+    int j = static_cast<int>(y);
+    if (i >= itsOSCount - 1 || j >= gTsaTablePCount - 1)
+      return false;
+    double fx = x - i;
+    double fy = y - j;
+    const float *row0 = &itsThetas[static_cast<size_t>(i) * gTsaTablePCount + j];
+    const float *row1 = row0 + gTsaTablePCount;
+    double theta = (1 - fx) * ((1 - fy) * row0[0] + fy * row0[1]) +
+                   fx * ((1 - fy) * row1[0] + fy * row1[1]);
+    theTemperature = theta * ::exp(.286 * (logP - gLog1000)) - 273.16;
+    return true;
+  }
+
+ private:
+  int itsOSCount;
+  double itsLogPMin;
+  double itsLogPStep;
+  std::vector<float> itsThetas;
+};
+
+const MoistAdiabatTable &GetMoistAdiabatTable()
+{
+  // C++11:n mukaan funktion staattinen olio alustetaan säieturvallisesti
+  static const MoistAdiabatTable table;
+  return table;
+}
+}  // namespace
+
+// Taulukoitu versio TSA:sta. Tulos poikkeaa iteratiivisesta TSA:sta alle 0.1 astetta (TSA
+// itse lopettaa iteroinnin 0.01 asteen tarkkuuteen OS-yhtälössä). Taulukon ulkopuolella ja
+// UseExactSolvers(true) -tilassa lasketaan TSA:lla.
+double TSAFast(double OS, double P)
+{
+  double value = 0;
+  if (!gUseExactSolvers && GetMoistAdiabatTable().Value(OS, P, value))
+    return value;
+  return TSA(OS, P);
+}
+
 static const double gTpot2tConstant1 = 0.2854;
 static const double gKelvinChange = 273.16;
 
@@ -462,6 +576,50 @@ double CalcLCLPressureFast(double T, double Td, double P)
   return lclPressure;
 }
 
+// Laskee saman kuin NFmiSoundingData::CalcTOfLiftedAirParcel, mutta monelle ilmapaketille
+// kerralla. Laskut tehdään vaiheittain koko taulukolle (LCL, potentiaalilämpötila, kostea-adiabaatti
+// ja lopuksi lämpötila toP:ssä), ja kostea-adiabaatti lasketaan vain paketeille, joiden LCL on
+// toP:n alapuolella.
+void CalcTOfLiftedAirParcels(const double *T,
+                             const double *Td,
+                             const double *fromP,
+                             double toP,
+                             double *theTparcel,
+                             std::size_t theCount)
+{
+  std::vector<double> lclPressures(theCount, kFloatMissing);
+  std::vector<double> tpots(theCount, kFloatMissing);
+
+  // 1. LCL:n paine ja lähtöpisteen potentiaalilämpötila
+  for (std::size_t i = 0; i < theCount; i++)
+  {
+    theTparcel[i] = kFloatMissing;
+    if (T[i] == kFloatMissing || Td[i] == kFloatMissing || fromP[i] == kFloatMissing)
+      continue;
+    lclPressures[i] = CalcLCLPressureFast(T[i], Td[i], fromP[i]);
+    if (lclPressures[i] != kFloatMissing)
+      tpots[i] = T2tpot(T[i], fromP[i]);
+  }
+
+  // 2. Jos LCL on toP:n yläpuolella, riittää kuiva-adiabaattinen nosto
+  for (std::size_t i = 0; i < theCount; i++)
+  {
+    if (tpots[i] != kFloatMissing && lclPressures[i] <= toP)
+      theTparcel[i] = Tpot2t(tpots[i], toP);
+  }
+
+  // 3. Muuten nostetaan LCL:stä eteenpäin kostea-adiabaattisesti
+  for (std::size_t i = 0; i < theCount; i++)
+  {
+    if (tpots[i] == kFloatMissing || lclPressures[i] <= toP)
+      continue;
+    double Tparcel_LCL = Tpot2t(tpots[i], lclPressures[i]);
+    double TmoistLCL = CalcMoistTFast(Tparcel_LCL, lclPressures[i]);
+    if (TmoistLCL != kFloatMissing)
+      theTparcel[i] = TSAFast(OS(TmoistLCL, 1000.), toP);
+  }
+}
+
 // etsii monotonisen 'funktion' juurta kun sille on annettu kaksi funktion pistettä
 double FindRoot(double x1, double x2, double y1, double y2)
 {
@@ -515,6 +673,16 @@ double CalcMoistT(double T, double P)
   return kFloatMissing;
 }
 
+// CalcMoistT:n nopea versio. CalcMoistT hakee 1000 mb:n lämpötilaa Tm, jolle pätee
+// TSA(OS(Tm, 1000), P) = T. Koska OS on kostea-adiabaatilla vakio, sama adiabaatti saadaan
+// suoraan OS(T, P):stä ja sen lämpötila 1000 mb:ssä taulukosta.
+double CalcMoistTFast(double T, double P)
+{
+  if (gUseExactSolvers)
+    return CalcMoistT(T, P);
+  return TSAFast(OS(T, P), 1000.);
+}
+
 // Laskee logaritmisessa asteikossa interpoloidun arvon.
 // Käytetään esim. logaritmisen paine asteikon kanssa.
 // Palauttaa x:ää vastaavan y:n, kun x1 arvoa vastaa y1 ja x2:n arvoa vastaa y2.
@@ -12,6 +12,7 @@
 
 #include <newbase/NFmiGlobals.h>
 #include <cmath>
+#include <cstddef>
 
 namespace NFmiSoundingFunctions
 {
@@ -21,8 +22,13 @@ double CalcRH(double T, double Td);
 double TMR(double W, double P);
 double OS(double T, double P);
 double TSA(double OS, double P);
+double TSAFast(double OS, double P);
 double T2tpot(double T, double P);
 double CalcMoistT(double T, double P);
+double CalcMoistTFast(double T, double P);
+// Oletuksena kostea-adiabaatit lasketaan taulukoista, true palauttaa iteratiiviset ratkaisijat
+void UseExactSolvers(bool newValue);
+bool UseExactSolvers();
 double CalcThetaE(double T, double Td, double P);
 double CalcMixingRatio(double T, double Td, double P);
 double CalcMixingRatioUsingKelvinsAndRH(double RH, double T, double P);
@@ -31,6 +37,13 @@ double CalcDewPoint(double T, double w, double P);
 double CalcDP(double T, double RH);
 double CalcLCLPressure(double T, double Td, double P);
 double CalcLCLPressureFast(double T, double Td, double P);
+// Nostaa theCount ilmapakettia (T, Td, fromP -taulukot) paineeseen toP, tulokset theTparcel:iin
+void CalcTOfLiftedAirParcels(const double *T,
+                             const double *Td,
+                             const double *fromP,
+                             double toP,
+                             double *theTparcel,
+                             std::size_t theCount);
 double Calc_shear_unit_v_vector(double shr_0_6_v, double shr_0_6_u);
 double CalcU_ID_left(double u0_6, double shr_0_6_v_n);
 double CalcV_ID_left(double v0_6, double shr_0_6_u_n);
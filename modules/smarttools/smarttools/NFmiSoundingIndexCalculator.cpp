@@ -17,6 +17,9 @@
 #include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiValueString.h>
 
+#include <algorithm>
+#include <vector>
+
 #ifndef BOOST_DISABLE_THREADS
 
 #ifdef _MSC_VER
@@ -111,56 +114,149 @@ static void CheckIfStopped(NFmiStopFunctor *theStopFunctor)
     throw NFmiStopThreadException();
 }
 
-static void CalcAllSoundingIndexParamFields(
-    boost::shared_ptr<NFmiFastQueryInfo> &theSourceInfo,
-    boost::shared_ptr<NFmiFastQueryInfo> &theResultInfo,
-    const boost::shared_ptr<NFmiFastQueryInfo> &thePossibleGroundInfo,
-    bool useFastFill,
-    NFmiStopFunctor *theStopFunctor)
+// Tiilen koko hilapisteinä. Tiilen data luetaan useFastFill -tapauksessa lähdedatasta kerralla
+// level-laatoittain ja tulokset kirjoitetaan tulosdataan parametri kerrallaan.
+static const unsigned long gSoundingTileSize = 128;
+
+// Tiilen SHOW- ja LIFT-indeksien ilmapaketit kerätään sarakkeittain [paketti] -taulukoihin ja
+// nostetaan 500 mb:hen kerralla, kun kaikki tiilen sarakkeet on käyty läpi.
+struct LiftedParcelBlock
 {
-  // bool fObsDataFound = false; // toistaiseksi ei käytössä
-  // bool useAnalyzeData = false; // toistaiseksi ei käytössä
+  std::vector<double> itsT;
+  std::vector<double> itsTd;
+  std::vector<double> itsP;
+  std::vector<double> itsT500;
+  std::vector<size_t> itsValueIndices;
 
-  NFmiSoundingData soundingData;
-  unsigned long counter = 0;
-  for (theResultInfo->ResetLocation(); theResultInfo->NextLocation();)
+  void Clear()
+  {
+    itsT.clear();
+    itsTd.clear();
+    itsP.clear();
+    itsT500.clear();
+    itsValueIndices.clear();
+  }
+};
+
+static bool IsLiftedParcelIndex(FmiSoundingParameters theParam)
+{
+  return theParam == kSoundingParSHOW || theParam == kSoundingParLIFT;
+}
+
+static void AddLiftedParcel(NFmiSoundingData &theSoundingData,
+                            FmiSoundingParameters theParam,
+                            size_t theValueIndex,
+                            LiftedParcelBlock &theParcels)
+{
+  double T = kFloatMissing;
+  double Td = kFloatMissing;
+  double P = kFloatMissing;
+  bool status = (theParam == kSoundingParSHOW) ? theSoundingData.GetSHOWParcelValues(T, Td, P)
+                                               : theSoundingData.GetLIFTParcelValues(T, Td, P);
+  if (status)
+  {
+    double T500 = theSoundingData.GetValueAtPressure(kFmiTemperature, 500);
+    if (T500 != kFloatMissing)
+    {
+      theParcels.itsT.push_back(T);
+      theParcels.itsTd.push_back(Td);
+      theParcels.itsP.push_back(P);
+      theParcels.itsT500.push_back(T500);
+      theParcels.itsValueIndices.push_back(theValueIndex);
+    }
+  }
+}
+
+// SHOW/LIFT = T500 - Tparcel, missä Tparcel on 500 mb:hen nostetun ilmapaketin lämpötila
+static void CalcLiftedParcelIndices(LiftedParcelBlock &theParcels, std::vector<float> &theValues)
+{
+  const size_t parcelCount = theParcels.itsValueIndices.size();
+  if (parcelCount == 0)
+    return;
+  std::vector<double> Tparcels(parcelCount);
+  NFmiSoundingFunctions::CalcTOfLiftedAirParcels(&theParcels.itsT[0],
+                                                 &theParcels.itsTd[0],
+                                                 &theParcels.itsP[0],
+                                                 500,
+                                                 &Tparcels[0],
+                                                 parcelCount);
+  for (size_t i = 0; i < parcelCount; i++)
+  {
+    if (Tparcels[i] != kFloatMissing)
+      theValues[theParcels.itsValueIndices[i]] =
+          static_cast<float>(theParcels.itsT500[i] - Tparcels[i]);
+  }
+}
+
+// Laskee kaikki tulosdatan parametrit tiilen hilapisteille theStartLocationIndex ...
+// theEndLocationIndex. Infot ovat jo oikeassa ajassa.
+static void CalcSoundingIndexTile(boost::shared_ptr<NFmiFastQueryInfo> &theSourceInfo,
+                                  boost::shared_ptr<NFmiFastQueryInfo> &theResultInfo,
+                                  const boost::shared_ptr<NFmiFastQueryInfo> &thePossibleGroundInfo,
+                                  unsigned long theStartLocationIndex,
+                                  unsigned long theEndLocationIndex,
+                                  bool useFastFill,
+                                  NFmiSoundingData &theSoundingData,
+                                  NFmiSoundingColumnBlock &theColumnBlock,
+                                  LiftedParcelBlock &theParcels,
+                                  unsigned long &theCounter,
+                                  NFmiStopFunctor *theStopFunctor)
+{
+  theParcels.Clear();
+  if (useFastFill)
+    theColumnBlock.Fill(theSourceInfo, theStartLocationIndex, theEndLocationIndex);
+
+  const unsigned long columnCount = theEndLocationIndex - theStartLocationIndex + 1;
+  const unsigned long paramCount = theResultInfo->SizeParams();
+  // tulokset [parametri][sarake], calculated kertoo mitkä arvot on laskettu
+  std::vector<float> values(paramCount * columnCount, kFloatMissing);
+  std::vector<char> calculated(paramCount * columnCount, 0);
+  bool stopped = false;
+  for (unsigned long column = 0; column < columnCount && !stopped; column++)
   {
     try
     {
-      // bool surfaceBaseStatus = false;
+      theResultInfo->LocationIndex(theStartLocationIndex + column);
       if (useFastFill)
-        theSourceInfo->LocationIndex(theResultInfo->LocationIndex());
-      ::FillSoundingData(theSourceInfo,
-                         soundingData,
-                         thePossibleGroundInfo,
-                         theResultInfo->Time(),
-                         theResultInfo->LatLon(),
-                         useFastFill);
-      if (theSourceInfo->Grid() && !soundingData.IsDataGood())
+        theSoundingData.FillSoundingData(theSourceInfo,
+                                         theColumnBlock,
+                                         column,
+                                         theResultInfo->Time(),
+                                         theSourceInfo->OriginTime(),
+                                         NFmiLocation(theResultInfo->LatLon()),
+                                         thePossibleGroundInfo);
+      else
+        ::FillSoundingData(theSourceInfo,
+                           theSoundingData,
+                           thePossibleGroundInfo,
+                           theResultInfo->Time(),
+                           theResultInfo->LatLon(),
+                           false);
+      if (theSourceInfo->Grid() && !theSoundingData.IsDataGood())
         continue;  // jos oltiin mallidatassa ja datassa oli tiettyjä puutteita, ei tehdä laskentoja
 
-      for (theResultInfo->ResetParam(); theResultInfo->NextParam();)
+      unsigned long paramIndex = 0;
+      for (theResultInfo->ResetParam(); theResultInfo->NextParam(); paramIndex++)
       {
-        counter++;
-        if (counter % 20 == 0)
+        theCounter++;
+        if (theCounter % 20 == 0)
           ::CheckIfStopped(
               theStopFunctor);  // joka 20 hila/paramtrilla -pisteellä katsotaan, pitääkö lopettaa
 
         FmiSoundingParameters soundingParameter =
             static_cast<FmiSoundingParameters>(theResultInfo->Param().GetParamIdent());
-        // bool surfaceBasedCalculation =
-        // NFmiSoundingIndexCalculator::IsSurfaceBasedSoundingIndex(soundingParameter); // onko
-        // surfacebased???
-
-        // HUOM!!!! muista muuttaa luotaus-parametri pelkäksi surface arvoksi, koska loppu menee
-        // itsestään sitten
-        float value = NFmiSoundingIndexCalculator::Calc(soundingData, soundingParameter);
-        theResultInfo->FloatValue(value);
+        size_t valueIndex = paramIndex * columnCount + column;
+        if (::IsLiftedParcelIndex(soundingParameter))
+          ::AddLiftedParcel(theSoundingData, soundingParameter, valueIndex, theParcels);
+        else
+          values[valueIndex] =
+              NFmiSoundingIndexCalculator::Calc(theSoundingData, soundingParameter);
+        calculated[valueIndex] = 1;
       }
     }
     catch (NFmiStopThreadException &)
     {
-      break;
+      stopped = true;
     }
     catch (...)
     {
@@ -169,70 +265,36 @@ static void CalcAllSoundingIndexParamFields(
       // tässä ei tehdä mitään, mutta laskennat jatkuvat ainakin seuraavasta pisteestä...
     }
   }
-}
 
-static void CalculatePartOfSoundingData(
-    boost::shared_ptr<NFmiFastQueryInfo> &theSourceInfo,
-    boost::shared_ptr<NFmiFastQueryInfo> &theResultInfo,
-    const boost::shared_ptr<NFmiFastQueryInfo> &thePossibleGroundInfo,
-    unsigned long startTimeIndex,
-    unsigned long endTimeIndex,
-    bool useFastFill,
-    NFmiStopFunctor *theStopFunctor,
-    int index,
-    bool fDoCerrReporting)
-{
-  try
-  {
-    if (theSourceInfo->IsGrid() == false || theResultInfo->IsGrid() == false)
-      throw std::runtime_error(
-          "Error in CalculatePartOfSoundingData, source or result data was non grid-data.");
+  ::CalcLiftedParcelIndices(theParcels, values);
 
-    for (unsigned long i = startTimeIndex; i <= endTimeIndex; i++)
+  unsigned long paramIndex = 0;
+  for (theResultInfo->ResetParam(); theResultInfo->NextParam(); paramIndex++)
+  {
+    for (unsigned long column = 0; column < columnCount; column++)
     {
-      if (theResultInfo->TimeIndex(i))
+      size_t valueIndex = paramIndex * columnCount + column;
+      if (calculated[valueIndex])
       {
-        if (useFastFill == false ||
-            theSourceInfo->TimeIndex(
-                theResultInfo->TimeIndex()))  // optimointia, molemmissa samat ajat!!!
-        {
-          if (fDoCerrReporting)
-            std::cerr << "thread nro: " << index << " starting time step nro: " << i << std::endl;
-          ::CheckIfStopped(theStopFunctor);
-          ::CalcAllSoundingIndexParamFields(
-              theSourceInfo, theResultInfo, thePossibleGroundInfo, useFastFill, theStopFunctor);
-        }
+        theResultInfo->LocationIndex(theStartLocationIndex + column);
+        theResultInfo->FloatValue(values[valueIndex]);
       }
     }
   }
-  catch (NFmiStopThreadException & /* stopException */)
-  {
-    // lopetetaan sitten kun on niin haluttu
-    if (fDoCerrReporting)
-      std::cerr << "thread nro: " << index << " stops because it was told to do so." << std::endl;
-  }
-  catch (std::exception &e)
-  {
-    // lopetetaan muutenkin, jos tulee poikkeus
-    if (fDoCerrReporting)
-      std::cerr << "thread nro: " << index << " stops because exception was thrown:\n"
-                << e.what() << std::endl;
-  }
-  catch (...)
-  {
-    // lopetetaan muutenkin, jos tulee poikkeus
-    if (fDoCerrReporting)
-      std::cerr << "thread nro: " << index << " stops because unknown error." << std::endl;
-  }
-  if (fDoCerrReporting)
-    std::cerr << "thread nro: " << index << " end here." << std::endl;
+
+  if (stopped)
+    throw NFmiStopThreadException();
 }
 
-static void CalculateSoundingDataOneTimeStepAtTime(
+// Työyksikkö on yksi tiili yhdessä aikaaskeleessa. Työyksiköt jaetaan säikeille
+// theWorkIndexCalculator:in avulla sitä mukaa kun säikeet vapautuvat, joten myös yhden
+// aika-askeleen data saadaan laskettua kaikilla säikeillä.
+static void CalculateSoundingDataTiles(
     boost::shared_ptr<NFmiFastQueryInfo> &theSourceInfo,
     boost::shared_ptr<NFmiFastQueryInfo> &theResultInfo,
     const boost::shared_ptr<NFmiFastQueryInfo> &thePossibleGroundInfo,
-    NFmiTimeIndexCalculator &theTimeIndexCalculator,
+    NFmiTimeIndexCalculator &theWorkIndexCalculator,
+    unsigned long theTileCount,
     bool useFastFill,
     NFmiStopFunctor *theStopFunctor,
     int index,
@@ -244,21 +306,40 @@ static void CalculateSoundingDataOneTimeStepAtTime(
       throw std::runtime_error(
           "Error in CalculatePartOfSoundingData, source or result data was non grid-data.");
 
-    unsigned long workedTimeIndex = 0;
-    for (; theTimeIndexCalculator.GetCurrentTimeIndex(workedTimeIndex);)
+    NFmiSoundingData soundingData;
+    NFmiSoundingColumnBlock columnBlock;
+    LiftedParcelBlock parcels;
+    unsigned long counter = 0;
+    const unsigned long locationSize = theResultInfo->SizeLocations();
+    unsigned long workIndex = 0;
+    for (; theWorkIndexCalculator.GetCurrentTimeIndex(workIndex);)
     {
-      if (theResultInfo->TimeIndex(workedTimeIndex))
+      unsigned long timeIndex = workIndex / theTileCount;
+      unsigned long tileIndex = workIndex % theTileCount;
+      if (theResultInfo->TimeIndex(timeIndex))
       {
         if (useFastFill == false ||
             theSourceInfo->TimeIndex(
                 theResultInfo->TimeIndex()))  // optimointia, molemmissa samat ajat!!!
         {
-          if (fDoCerrReporting)
-            std::cerr << "thread nro: " << index << " starting time step nro: " << workedTimeIndex
+          if (fDoCerrReporting && tileIndex == 0)
+            std::cerr << "thread nro: " << index << " starting time step nro: " << timeIndex
                       << std::endl;
           ::CheckIfStopped(theStopFunctor);
-          ::CalcAllSoundingIndexParamFields(
-              theSourceInfo, theResultInfo, thePossibleGroundInfo, useFastFill, theStopFunctor);
+          unsigned long startLocationIndex = tileIndex * gSoundingTileSize;
+          unsigned long endLocationIndex =
+              std::min(startLocationIndex + gSoundingTileSize, locationSize) - 1;
+          ::CalcSoundingIndexTile(theSourceInfo,
+                                  theResultInfo,
+                                  thePossibleGroundInfo,
+                                  startLocationIndex,
+                                  endLocationIndex,
+                                  useFastFill,
+                                  soundingData,
+                                  columnBlock,
+                                  parcels,
+                                  counter,
+                                  theStopFunctor);
         }
       }
     }
@@ -306,6 +387,11 @@ void NFmiSoundingIndexCalculator::CalculateWholeSoundingData(NFmiQueryData &theS
   // alustetaan ensimmäisellä kerralla ja multi-threaddaavassa jutussa se voisi olla ongelma.
 
   unsigned long timeSize = theResultData.Info()->SizeTimes();
+  unsigned long tileCount =
+      (theResultData.Info()->SizeLocations() + gSoundingTileSize - 1) / gSoundingTileSize;
+  unsigned long workSize = timeSize * tileCount;
+  if (workSize == 0)
+    return;
   unsigned int usedThreadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(40);
   if (theMaxThreadCount > 0 && usedThreadCount > static_cast<unsigned int>(theMaxThreadCount))
     usedThreadCount = static_cast<unsigned int>(theMaxThreadCount);  // jos on haluttu säätää maksim
@@ -313,10 +399,10 @@ void NFmiSoundingIndexCalculator::CalculateWholeSoundingData(NFmiQueryData &theS
   // maksimia jos usedThreadCount
   // olisi muuten ylittänyt sen.
 
-  usedThreadCount = NFmiQueryDataUtil::CalcOptimalThreadCount(usedThreadCount, timeSize);
+  usedThreadCount = NFmiQueryDataUtil::CalcOptimalThreadCount(usedThreadCount, workSize);
 
   if (fUseOnlyOneThread || usedThreadCount < 2)
-  {  // jos aikoja oli alle kaksi, lasketaan data yhdessä funktiossa
+  {  // jos tiiliä oli alle kaksi, lasketaan data yhdessä funktiossa
 
     if (fDoCerrReporting)
       std::cerr << "making data in single thread" << std::endl;
@@ -324,15 +410,16 @@ void NFmiSoundingIndexCalculator::CalculateWholeSoundingData(NFmiQueryData &theS
     boost::shared_ptr<NFmiFastQueryInfo> resultInfo(new NFmiFastQueryInfo(&theResultData));
     boost::shared_ptr<NFmiFastQueryInfo> possibleGroundInfo(
         thePossibleGroundData ? new NFmiFastQueryInfo(thePossibleGroundData) : nullptr);
-    ::CalculatePartOfSoundingData(sourceInfo,
-                                  resultInfo,
-                                  possibleGroundInfo,
-                                  0,
-                                  timeSize - 1,
-                                  useFastFill,
-                                  theStopFunctor,
-                                  1,
-                                  fDoCerrReporting);
+    NFmiTimeIndexCalculator workIndexCalculator(0, workSize - 1);
+    ::CalculateSoundingDataTiles(sourceInfo,
+                                 resultInfo,
+                                 possibleGroundInfo,
+                                 workIndexCalculator,
+                                 tileCount,
+                                 useFastFill,
+                                 theStopFunctor,
+                                 1,
+                                 fDoCerrReporting);
   }
   else
   {
@@ -359,14 +446,16 @@ void NFmiSoundingIndexCalculator::CalculateWholeSoundingData(NFmiQueryData &theS
             boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(thePossibleGroundData));
     }
 
-    NFmiTimeIndexCalculator timeIndexCalculator(0, timeSize - 1);
+    // aika-askel ja tiili -parit jaetaan säikeille yksi kerrallaan
+    NFmiTimeIndexCalculator workIndexCalculator(0, workSize - 1);
     boost::thread_group calcParts;
     for (unsigned int i = 0; i < usedThreadCount; i++)
-      calcParts.add_thread(new boost::thread(::CalculateSoundingDataOneTimeStepAtTime,
+      calcParts.add_thread(new boost::thread(::CalculateSoundingDataTiles,
                                              sourceInfos[i],
                                              resultInfos[i],
                                              possibleGroundInfos[i],
-                                             boost::ref(timeIndexCalculator),
+                                             boost::ref(workIndexCalculator),
+                                             tileCount,
                                              useFastFill,
                                              theStopFunctor,
                                              i + 1,
@@ -5,12 +5,17 @@
 
 #include <string>
 #include <cstdio>
+#include <vector>
 
 #include <newbase/NFmiQueryData.h>
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiRotatedLatLonArea.h>
 
 #include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+
+class GDALRasterBand;
+class NFmiTimeIndexCalculator;
 
 using namespace std;
 
@@ -43,6 +48,7 @@ class GeoTiffQD
                                    double scale);
   void DestinationProjection(NFmiArea *destProjection);
   void SetTestMode(bool testMode);
+  void SetTiledOutput(bool tiled, const string &compression, unsigned int threadCount);
 
  private:
   void getregllbbox(const NFmiRotatedLatLonArea *a);
@@ -64,17 +70,49 @@ class GeoTiffQD
                         NFmiFastQueryInfo *theExternal,
                         GeomDefinedType geomDefinedType);
 
+  void writeTiledBands(const std::vector<GDALRasterBand *> &theBands,
+                       const std::vector<NFmiFastQueryInfo *> &theDatas,
+                       const std::vector<NFmiFastQueryInfo *> &theSecondDatas,
+                       int width,
+                       int height,
+                       const NFmiArea *area);
+  void writeTilesInThread(const std::vector<GDALRasterBand *> &theBands,
+                          const std::vector<NFmiFastQueryInfo *> &theDatas,
+                          const std::vector<NFmiFastQueryInfo *> &theSecondDatas,
+                          int width,
+                          int height,
+                          const NFmiArea *area,
+                          NFmiTimeIndexCalculator &theCalculator,
+                          boost::mutex &theGdalMutex);
+  template <typename T>
+  void fillTile(NFmiFastQueryInfo &theData,
+                NFmiFastQueryInfo *theSecondData,
+                int width,
+                int height,
+                const NFmiArea *area,
+                int x0,
+                int y0,
+                int nx,
+                int ny,
+                std::vector<T> &theTile);
+
  private:
   int itsCode;
   bool isIntDataType;
   double itsScale;
   bool isDrawGridLines;
+  bool isTiled;
+  string itsCompression;
+  unsigned int itsThreadCount;
 
  public:
   NFmiArea *itsDestProjection;
 };
 
-inline GeoTiffQD::GeoTiffQD(const int code) : itsCode(code) {}
+inline GeoTiffQD::GeoTiffQD(const int code)
+    : itsCode(code), isTiled(false), itsCompression(), itsThreadCount(0)
+{
+}
 inline void GeoTiffQD::DestinationProjection(NFmiArea *destProjection)
 {
   itsDestProjection = destProjection;
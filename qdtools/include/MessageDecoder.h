@@ -0,0 +1,164 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Interface of namespace MessageDecoder
+ */
+// ======================================================================
+/*!
+ * \namespace MessageDecoder
+ *
+ * Parallel decoding for the message based observation converters
+ * (synop2qd, metar2qd, temp2qd and bufrtoqd).
+ *
+ * The input is split into independent units, usually files, which
+ * are decoded in worker threads into buffers of their own. Each
+ * buffer is sorted in its worker thread, and the sorted buffers are
+ * then merged in unit order. Both the sort and the merge are stable,
+ * hence messages for the same station and time stay in input order
+ * and later messages override earlier ones exactly as in serial
+ * decoding.
+ *
+ * The merged stations and times give the final descriptors at once,
+ * so that the querydata can be created in its final size and filled
+ * in a single pass.
+ */
+// ======================================================================
+
+#ifndef MESSAGEDECODER_H
+#define MESSAGEDECODER_H
+
+#include <boost/function.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+namespace MessageDecoder
+{
+unsigned int ThreadCount(unsigned int theWantedCount, unsigned long theUnitCount);
+
+void Decode(unsigned long theUnitCount,
+            const boost::function<void(unsigned long)> &theDecoder,
+            unsigned int theThreadCount);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove duplicates from sorted values
+ *
+ * Of equivalent values the first one is kept.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T, typename Less>
+void Unique(std::vector<T> &theValues, Less theLess)
+{
+  theValues.erase(std::unique(theValues.begin(),
+                              theValues.end(),
+                              [&theLess](const T &a, const T &b)
+                              { return !theLess(a, b) && !theLess(b, a); }),
+                  theValues.end());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sort values and remove duplicates
+ *
+ * Of equivalent values the first one in input order is kept.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T, typename Less>
+void SortUnique(std::vector<T> &theValues, Less theLess)
+{
+  std::stable_sort(theValues.begin(), theValues.end(), theLess);
+  Unique(theValues, theLess);
+}
+
+template <typename T>
+void SortUnique(std::vector<T> &theValues)
+{
+  SortUnique(theValues, std::less<T>());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Merge sorted buffers into one sorted vector
+ *
+ * Neighbouring buffers are merged pairwise in parallel until one
+ * buffer remains. Of equivalent values the ones from earlier buffers
+ * come first. The input buffers are consumed.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T, typename Less>
+std::vector<T> Merge(std::vector<std::vector<T> > &theBuffers,
+                     Less theLess,
+                     unsigned int theThreadCount)
+{
+  while (theBuffers.size() > 1)
+  {
+    std::vector<std::vector<T> > merged((theBuffers.size() + 1) / 2);
+
+    Decode(theBuffers.size() / 2,
+           [&](unsigned long i)
+           {
+             std::vector<T> &first = theBuffers[2 * i];
+             std::vector<T> &second = theBuffers[2 * i + 1];
+             merged[i].reserve(first.size() + second.size());
+             std::merge(std::make_move_iterator(first.begin()),
+                        std::make_move_iterator(first.end()),
+                        std::make_move_iterator(second.begin()),
+                        std::make_move_iterator(second.end()),
+                        std::back_inserter(merged[i]),
+                        theLess);
+             std::vector<T>().swap(first);
+             std::vector<T>().swap(second);
+           },
+           theThreadCount);
+
+    if (theBuffers.size() % 2 == 1) merged.back().swap(theBuffers.back());
+    theBuffers.swap(merged);
+  }
+
+  std::vector<T> result;
+  if (!theBuffers.empty()) result.swap(theBuffers.front());
+  theBuffers.clear();
+  return result;
+}
+
+template <typename T>
+std::vector<T> Merge(std::vector<std::vector<T> > &theBuffers, unsigned int theThreadCount)
+{
+  return Merge(theBuffers, std::less<T>(), theThreadCount);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Merge sorted unique buffers into one sorted unique vector
+ *
+ * Of equivalent values the one from the earliest buffer is kept.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T, typename Less>
+std::vector<T> MergeUnique(std::vector<std::vector<T> > &theBuffers,
+                           Less theLess,
+                           unsigned int theThreadCount)
+{
+  std::vector<T> result = Merge(theBuffers, theLess, theThreadCount);
+  Unique(result, theLess);
+  return result;
+}
+
+template <typename T>
+std::vector<T> MergeUnique(std::vector<std::vector<T> > &theBuffers, unsigned int theThreadCount)
+{
+  return MergeUnique(theBuffers, std::less<T>(), theThreadCount);
+}
+
+}  // namespace MessageDecoder
+
+#endif  // MESSAGEDECODER_H
+
+// ======================================================================
@@ -88,6 +88,7 @@ class NFmiQueryDataChecker
   bool DoIndexRandomizing(void) { return fDoIndexRandomizing; }
  private:
   bool DoMissingDataCheck(void);
+  bool ScanMissingData(void);
   bool DoStraightDataCheck(void);
   bool DoOutOfLimitsDataCheck(void);
   void MakeRandomLocationIndexies(void);
@@ -11,6 +11,16 @@
  * querydata sources simultaneously, and to return the queryinfo
  * containing the desired station number or coordinate.
  *
+ * Copies share the querydata files and their lazily loaded data but
+ * have their own query infos, so that each thread can use its own
+ * copy of the manager. A file loaded by one copy is shared by all.
+ *
+ * The station numbers and coordinates of point data files are stored
+ * in a hidden index file next to each data file, so that a file
+ * needs to be loaded only when a query actually resolves to it.
+ * An index is rebuilt when the modification time of its data file
+ * changes.
+ *
  */
 // ======================================================================
 
@@ -18,11 +28,15 @@
 #define QUERYDATAMANAGER_H
 
 #include <newbase/NFmiFastQueryInfo.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/tuple/tuple.hpp>
 
+#include <ctime>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 class QueryDataManager
@@ -30,6 +44,7 @@ class QueryDataManager
  public:
   ~QueryDataManager();
   QueryDataManager();
+  QueryDataManager(const QueryDataManager &theManager);
 
   void multimode() { itsMultiMode = true; }
   std::set<int> stations();
@@ -37,6 +52,8 @@ class QueryDataManager
   void searchpath(const std::string &theSearchPath);
   void addfile(const std::string &theFile);
   void addfiles(const std::vector<std::string> &theFiles);
+  void load();
+  bool modified() const;
 
   void setstation(int theWmoNumber);
   void setpoint(const NFmiPoint &thePoint, double theMaxDistance);
@@ -50,19 +67,46 @@ class QueryDataManager
                                 bool theCheckingFlag);
 
  private:
-  QueryDataManager(const QueryDataManager &theManager);
   QueryDataManager &operator=(const QueryDataManager &theManager);
 
   std::string itsSearchPath;
   bool itsMultiMode;
 
-  typedef boost::tuple<std::string, NFmiQueryData *, NFmiFastQueryInfo *> value_type;
+  // Station numbers and coordinates of a point data file
+  struct StationIndex
+  {
+    bool grid;
+    std::vector<std::pair<long, NFmiPoint> > stations;
+
+    bool read(const std::string &theFile, std::time_t theModTime);
+    void write(const std::string &theFile, std::time_t theModTime) const;
+  };
+
+  // The resolved querydata file, its data and its station index,
+  // shared by all copies of the manager
+  struct DataFile
+  {
+    DataFile() : mutex(), file(), modtime(0), data(), index() {}
+    boost::mutex mutex;
+    std::string file;
+    std::time_t modtime;
+    boost::shared_ptr<NFmiQueryData> data;
+    boost::shared_ptr<const StationIndex> index;
+  };
+
+  // file name, shared file data and own query info
+  typedef boost::tuple<std::string,
+                       boost::shared_ptr<DataFile>,
+                       boost::shared_ptr<NFmiFastQueryInfo> >
+      value_type;
 
   typedef std::vector<value_type> storage_type;
   storage_type itsData;
   storage_type::const_iterator itsCurrentData;
 
+  void resolve(const std::string &theName, DataFile &theFile) const;
   NFmiFastQueryInfo &require(storage_type::iterator it);
+  const StationIndex &index(storage_type::iterator it);
 
 };  // class QueryDataManager
 
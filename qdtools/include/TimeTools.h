@@ -17,6 +17,10 @@ namespace TimeTools
 const NFmiTime toLocalTime(const NFmiTime& theUtcTime);
 
 const NFmiTime timezone_time(const NFmiTime& theUTCTime, const std::string& theZone);
+
+const NFmiTime local_time(const NFmiMetTime& theUtcTime);
+
+bool is_dst(const NFmiTime& theUtcTime);
 }
 
 #endif  // TIMETOOLS_H
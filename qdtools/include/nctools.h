@@ -5,6 +5,7 @@
 #include <netcdfcpp.h>
 #include <list>
 #include <map>
+#include <vector>
 #include <newbase/NFmiEnumConverter.h>
 
 #define DEBUG_PRINT 0
@@ -116,6 +117,8 @@ void copy_values(const Options &options,
                  const ParamConversions &paramconvs,
                  bool useAutoGeneratedIds = false);
 bool is_name_in_list(const std::list<std::string> &nameList, const std::string name);
+bool read_record(NcVar *var, long index, std::vector<float> &values);
+void set_record_values(NFmiFastQueryInfo &info, const std::vector<float> &values);
 
 #if DEBUG_PRINT
 void print_att(const NcAtt &att);
@@ -41,6 +41,7 @@ This file is part of libECBUFR.
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread/mutex.hpp>
 #include <fmt/format.h>
 #include <macgyver/CsvReader.h>
 #include <macgyver/StringConversion.h>
@@ -59,6 +60,7 @@ This file is part of libECBUFR.
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiVPlaceDescriptor.h>
 #include <smarttools/NFmiAviationStationInfoSystem.h>
+#include "MessageDecoder.h"
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
@@ -231,6 +233,7 @@ struct Options
   bool autoproducer = false;                                       // -a --autoproducer
   int messagenumber = 0;                                           // -m --message
   int roundtohours = 0;                                            // --roundtohours
+  unsigned int threads = 0;                                        // -j --threads
 };
 
 Options options;
@@ -271,6 +274,9 @@ bool parse_options(int argc, char *argv[], Options &options)
       "roundtohours",
       po::value(&options.roundtohours),
       "round times to multiples of the given number of hours")(
+      "threads,j",
+      po::value(&options.threads),
+      "number of threads reading the files (default: 0 = most of the cores)")(
       "config,c", po::value(&options.conffile), msg1.c_str())(
       "stations,s", po::value(&options.stationsfile), msg2.c_str())(
       "infile,i", po::value(&options.infile), "input BUFR file or directory")(
@@ -607,57 +613,106 @@ bool message_is_significant(const Message &msg)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Append records from a dataset to a list
+ * \brief A descriptor extracted from a dataset
  */
 // ----------------------------------------------------------------------
 
-static bool replicating = false;  // set to true if FLAG_CLASS31 is encountered
+struct descriptor_record
+{
+  bool class31 = false;  // FLAG_CLASS31
+  bool skipped = false;  // FLAG_SKIPPED
+  int desc = 0;
+  record rec;
+};
+
+typedef std::vector<descriptor_record> Subset;
+typedef std::vector<Subset> Subsets;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the descriptors of a dataset
+ *
+ * libECBUFR is not thread safe, hence everything needed from the
+ * dataset is copied while holding the library lock, and the records
+ * are collected into messages after releasing it.
+ */
+// ----------------------------------------------------------------------
 
-void append_message(Messages &messages, BUFR_Dataset *dts, BUFR_Tables *tables)
+void extract_subsets(Subsets &subsets, BUFR_Dataset *dts, BUFR_Tables *tables)
 {
   int nsubsets = bufr_count_datasubset(dts);
 
-  int replication_count = -1;  // value of that descriptor
-  int replicating_desc = -1;   // the id of the descriptor following above
-  Message replicated_message;  // the message when replication starts
-
   int nmax = (options.subsets ? nsubsets : 1);
 
   for (int i = 0; i < nmax; i++)
   {
-    Message message;
+    subsets.push_back(Subset());
+    Subset &descriptors = subsets.back();
+
     DataSubset *subset = bufr_get_datasubset(dts, i);
     int ndescriptors = bufr_datasubset_count_descriptor(subset);
 
     if (options.debug)
       std::cout << "Subset " << i + 1 << " has " << ndescriptors << " descriptors" << std::endl;
 
-    // Loop over the descriptors
+    descriptors.resize(ndescriptors);
 
     for (int j = 0; j < ndescriptors; j++)
     {
       BufrDescriptor *bufr = bufr_datasubset_get_descriptor(subset, j);
+      descriptor_record &d = descriptors[j];
+
+      d.class31 = ((bufr->flags & FLAG_CLASS31) != 0);
+      d.skipped = ((bufr->flags & FLAG_SKIPPED) != 0);
+
+      if (d.skipped) continue;
+
+      d.desc = (bufr->s_descriptor != 0 ? bufr->s_descriptor : bufr->descriptor);
+      extract_record_name_and_units(d.rec, d.desc, bufr, tables);
+      extract_record_value(d.rec, bufr);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append records from a dataset to a list
+ *
+ * The replication state continues from one dataset to the next
+ * within the same file.
+ */
+// ----------------------------------------------------------------------
+
+void append_message(Messages &messages, const Subsets &subsets, bool &replicating)
+{
+  int replication_count = -1;  // value of that descriptor
+  int replicating_desc = -1;   // the id of the descriptor following above
+  Message replicated_message;  // the message when replication starts
+
+  BOOST_FOREACH (const Subset &subset, subsets)
+  {
+    Message message;
+
+    // Loop over the descriptors
 
-      if (bufr->flags & FLAG_CLASS31)
+    BOOST_FOREACH (const descriptor_record &d, subset)
+    {
+      if (d.class31)
       {
         replicating = true;
         replicated_message = message;
       }
 
-      if (bufr->flags & FLAG_SKIPPED) continue;
-
-      int desc = (bufr->s_descriptor != 0 ? bufr->s_descriptor : bufr->descriptor);
+      if (d.skipped) continue;
 
-      // Begin recording the info
-      record rec;
-      extract_record_name_and_units(rec, desc, bufr, tables);
-      extract_record_value(rec, bufr);
+      const int desc = d.desc;
+      const record &rec = d.rec;
 
       // std::cout << desc << " " << rec.name << " = " << rec.value << std::endl;
 
       if (replicating && replicating_desc < 0)
       {
-        if (!(bufr->flags & FLAG_CLASS31))
+        if (!d.class31)
         {
           replicating_desc = desc;
         }
@@ -699,17 +754,33 @@ void append_message(Messages &messages, BUFR_Dataset *dts, BUFR_Tables *tables)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Lock for libECBUFR calls
+ *
+ * libECBUFR uses global state and the tables list is shared by all
+ * files, hence only one thread may call the library at a time.
+ */
+// ----------------------------------------------------------------------
+
+boost::mutex bufr_mutex;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Read one bufr message
+ *
+ * If merge_tables is false, reading stops at the first message which
+ * carries local tables and false is returned. The tables would affect
+ * the decoding of the files that follow.
  */
 // ----------------------------------------------------------------------
 
-void read_message(const std::string &filename,
+bool read_message(const std::string &filename,
                   Messages &messages,
                   BUFR_Tables *file_tables,
                   LinkedList *tables_list,
-                  std::set<int> &datacategories)
+                  std::set<int> &datacategories,
+                  bool merge_tables)
 {
   // Open the file
 
@@ -728,8 +799,16 @@ void read_message(const std::string &filename,
 
   BUFR_Message *msg = nullptr;
 
-  while (bufr_read_message(bufr, &msg) > 0)
+  bool replicating = false;  // set to true if FLAG_CLASS31 is encountered
+
+  bool embedded_tables = false;
+
+  while (true)
   {
+    boost::unique_lock<boost::mutex> lock(bufr_mutex);
+
+    if (bufr_read_message(bufr, &msg) <= 0) break;
+
     ++count;
 
     // If a particular message is wanted, skip all other messages
@@ -814,6 +893,13 @@ void read_message(const std::string &filename,
 
       if (bufr_contains_tables(dts))
       {
+        if (!merge_tables)
+        {
+          bufr_free_dataset(dts);
+          bufr_free_message(msg);
+          embedded_tables = true;
+          break;
+        }
         BUFR_Tables *tables = bufr_extract_tables(dts);
         if (tables != nullptr)
         {
@@ -822,12 +908,17 @@ void read_message(const std::string &filename,
         }
       }
 
-      append_message(messages, dts, file_tables);
+      Subsets subsets;
+      extract_subsets(subsets, dts, file_tables);
 
       // Done with the current message
 
       bufr_free_dataset(dts);
       bufr_free_message(msg);
+
+      lock.unlock();
+
+      append_message(messages, subsets, replicating);
     }
     catch (std::exception &e)
     {
@@ -837,6 +928,7 @@ void read_message(const std::string &filename,
   }
 
   fclose(bufr);
+  return !embedded_tables;
 }
 
 // ----------------------------------------------------------------------
@@ -881,31 +973,81 @@ std::pair<BufrDataCategory, Messages> read_messages(const std::list<std::string>
     bufr_tables_list_addlocal(tables_list, tableB, tableD);
   }
 
-  // Process the files
+  // Process the files in parallel. The messages of each file are
+  // collected separately and appended in file order, since the order
+  // of the messages matters for instance for sounding levels.
+
+  struct FileBuffer
+  {
+    Messages messages;
+    std::set<int> datacategories;
+    bool ok = false;
+    bool embedded_tables = false;
+  };
+
+  const std::vector<std::string> filenames(files.begin(), files.end());
+  std::vector<FileBuffer> buffers(filenames.size());
+
+  // Verbose output is printed per message and would get mixed
+  unsigned int threads = (options.verbose || options.debug ? 1 : options.threads);
+
+  auto decode = [&](unsigned int theThreads)
+  {
+    // Local tables must be merged in file order, which only a serial run guarantees
+    const bool merge_tables = (MessageDecoder::ThreadCount(theThreads, filenames.size()) == 1);
+    bool embedded_tables = false;
+    MessageDecoder::Decode(
+        filenames.size(),
+        [&](unsigned long i)
+        {
+          const std::string &file = filenames[i];
+          FileBuffer &buffer = buffers[i];
+          try
+          {
+            buffer.embedded_tables = !read_message(file,
+                                                   buffer.messages,
+                                                   file_tables,
+                                                   tables_list,
+                                                   buffer.datacategories,
+                                                   merge_tables);
+            buffer.ok = true;
+          }
+          catch (std::exception &e)
+          {
+            std::cerr << "Warning: " << e.what() << std::endl;
+          }
+          catch (...)
+          {
+            std::cerr << "Warning: Failed to interpret message '" << file << "'" << std::endl;
+          }
+        },
+        theThreads);
+    BOOST_FOREACH (const FileBuffer &buffer, buffers)
+      embedded_tables |= buffer.embedded_tables;
+    return embedded_tables;
+  };
+
+  if (decode(threads))
+  {
+    // Some file carries local tables. Decode everything again serially so
+    // that the tables affect only the files after it, as in file order.
+    if (options.verbose)
+      std::cout << "Messages contain local tables, decoding files serially" << std::endl;
+    buffers.assign(filenames.size(), FileBuffer());
+    decode(1);
+  }
 
   int succesful_parse_events = 0;
   int errorneous_parse_events = 0;
 
-  BOOST_FOREACH (const std::string &file, files)
+  BOOST_FOREACH (FileBuffer &buffer, buffers)
   {
-    // Reset for each file
-    replicating = false;
-
-    try
-    {
-      read_message(file, messages, file_tables, tables_list, datacategories);
+    if (buffer.ok)
       succesful_parse_events++;
-    }
-    catch (std::exception &e)
-    {
-      errorneous_parse_events++;
-      std::cerr << "Warning: " << e.what() << std::endl;
-    }
-    catch (...)
-    {
+    else
       errorneous_parse_events++;
-      std::cerr << "Warning: Failed to interpret message '" << file << "'" << std::endl;
-    }
+    messages.splice(messages.end(), buffer.messages);
+    datacategories.insert(buffer.datacategories.begin(), buffer.datacategories.end());
   }
 
   if (datacategories.size() == 0)
@@ -29,6 +29,7 @@
  *  - -o require same origintime from each candidate
  *  - -O memory mapped output file
  *  - -r use oldest origin time instead of newest for output data
+ *  - -j maximum number of input files read concurrently
  *
  * If the set of times formed by the options is not available in
  * any forecast, all data for that moment will consist of missing values.
@@ -40,6 +41,11 @@
  *
  *   - There are no query files
  *   - No queryfile has times in the requested range
+ *   - A queryfile selected for the output cannot be read
+ *
+ * The -O output is written under a temporary name and renamed only
+ * after all times have been copied, so a failed run does not leave
+ * a partial file behind.
  *
  * Example:
  * \code
@@ -56,9 +62,11 @@
 #include <newbase/NFmiQueryInfo.h>
 #include <newbase/NFmiTimeList.h>
 
+#include <boost/filesystem/operations.hpp>
 #include <boost/lexical_cast.hpp>
 
-#include <fstream>
+#include <iostream>
+#include <map>
 
 using namespace std;
 
@@ -85,6 +93,7 @@ void Usage(void)
        << "\t-1\t\ttake only latest file from each directory" << endl
        << "\t-N <name>\tset new producer name" << endl
        << "\t-D <id>\t\tset new producer id" << endl
+       << "\t-j <threads>\tmaximum number of files read concurrently" << endl
        << endl;
 }
 
@@ -119,13 +128,15 @@ static bool ConvertTimeList2TimeBag(NFmiTimeList &theTimeList, NFmiTimeBag &theT
  *  -# read command line arguments
  *  -# check command line arguments
  *  -# establish all queryfiles
- *  -# read all queryfiles, starting from newest
+ *  -# read all queryfile headers, starting from newest
  *     -# if firstnewest queryfile queryfile
  *         -# initialize new querydata with new time descriptor
  *            and copies for parameter etc descriptors
  *     -# for each time that is in the queryfile
  *         -# if the time is to be output and it has not been output yet,
- *            copy the grid to the output
+ *            mark the time to be copied from the file
+ *  -# read the marked files concurrently and copy the marked times
+ *     to the output, releasing each file immediately
  *  -# output the result
  *
  * \param argc The number of arguments
@@ -145,8 +156,9 @@ int main(int argc, const char *argv[])
   bool sameorigin = false;   // do not require same origintime
   bool newestorigin = true;  // pick newest origin time
   std::string outfile = "-";
+  unsigned int threadcount = 0;  // 0 = reasonable default
 
-  NFmiCmdLine cmdline(argc, argv, "vp!f!1otN!D!rO!");
+  NFmiCmdLine cmdline(argc, argv, "vp!f!1otN!D!rO!j!");
 
   if (cmdline.Status().IsError())
   {
@@ -184,6 +196,9 @@ int main(int argc, const char *argv[])
 
   if (cmdline.isOption('O')) outfile = cmdline.OptionValue('O');
 
+  if (cmdline.isOption('j'))
+    threadcount = boost::lexical_cast<unsigned int>(cmdline.OptionValue('j'));
+
   // Check arguments
 
   for (list<string>::const_iterator it = datapaths.begin(); it != datapaths.end(); ++it)
@@ -259,6 +274,10 @@ int main(int argc, const char *argv[])
 
   multimap<NFmiMetTime, string> accepted_files;
 
+  // The headers of the accepted files, the second pass needs nothing else
+
+  map<string, NFmiQueryInfo> accepted_headers;
+
   NFmiMetTime origintime;
 
   // First collect all times and parameters in the requested time range
@@ -272,17 +291,7 @@ int main(int argc, const char *argv[])
     if (verbose) cerr << "Reading " << filename << " header" << endl;
 
     NFmiQueryInfo qi;
-    try
-    {
-      ifstream in(filename.c_str(), ios::in | ios::binary);
-      if (!in) continue;
-      in >> qi;
-      in.close();
-    }
-    catch (...)
-    {
-      continue;
-    }
+    if (!NFmiQueryDataUtil::ReadQueryInfoHeader(filename, qi)) continue;
 
     // discard files with different origin time
     if (sameorigin && !accepted_files.empty())
@@ -330,6 +339,7 @@ int main(int argc, const char *argv[])
     if (accepted_count > 0)
     {
       accepted_files.insert(make_pair(qi.OriginTime(), filename));
+      accepted_headers.insert(make_pair(filename, qi));
       pbag = pbag.Combine(*qi.ParamDescriptor().ParamBag());
     }
   }
@@ -342,21 +352,24 @@ int main(int argc, const char *argv[])
     return 1;
   }
 
-  // Now a second pass reads all files which contained valid time stamps
+  // Now a second pass decides from the headers which file provides each
+  // time step. The data itself is read only when it is copied.
 
   NFmiQueryData *outqd = 0;
   NFmiFastQueryInfo *outqi = 0;
+  std::string tmpfile;
 
   // This will contain all times that have already been handled
   set<NFmiMetTime> handled_times;
 
+  std::vector<NFmiTimeStepCopyTask> tasks;
+
   for (auto it = accepted_files.rbegin(); it != accepted_files.rend(); ++it)
   {
     const string &filename = it->second;
-    if (verbose) cerr << "Reading " << filename << endl;
+    if (verbose) cerr << "Selecting times from " << filename << endl;
 
-    NFmiQueryData qd(filename);
-    NFmiFastQueryInfo qi(&qd);
+    NFmiFastQueryInfo qi(accepted_headers.find(filename)->second);
 
     // If first file, create output file
 
@@ -384,96 +397,57 @@ int main(int argc, const char *argv[])
       if (outfile == "-")
         outqd = NFmiQueryDataUtil::CreateEmptyData(tmpInfo);
       else
-        outqd = NFmiQueryDataUtil::CreateEmptyData(tmpInfo, outfile, true);
-      outqi = new NFmiFastQueryInfo(outqd);
-    }
-
-    // Check whether point data must be combined slowly
-
-    bool slowcopy = false;
-    {
-      if (!outqi->IsGrid() && !qi.IsGrid())
       {
-        for (outqi->ResetLocation(), qi.ResetLocation();
-             outqi->NextLocation() && qi.NextLocation();)
-        {
-          if (outqi->Location()->GetIdent() != qi.Location()->GetIdent())
-          {
-            slowcopy = true;
-            break;
-          }
-        }
+        tmpfile =
+            boost::filesystem::unique_path(outfile + ".%%%%-%%%%-%%%%-%%%%.tmp").string();
+        outqd = NFmiQueryDataUtil::CreateEmptyData(tmpInfo, tmpfile, true);
       }
+      outqi = new NFmiFastQueryInfo(outqd);
     }
 
-    if (verbose && slowcopy) cerr << "Must perform slow copy of point data, locations differ\n";
-
     // Collect time indexes which will be copied, from and to
 
-    std::vector<unsigned long> input_time_indexes;
-    std::vector<unsigned long> output_time_indexes;
+    NFmiTimeStepCopyTask task;
+    task.itsFileName = filename;
 
     for (qi.ResetTime(); qi.NextTime();)
     {
       if (timelist.Find(qi.ValidTime()) &&
           handled_times.find(qi.ValidTime()) == handled_times.end() && outqi->Time(qi.ValidTime()))
       {
-        input_time_indexes.push_back(qi.TimeIndex());
-        output_time_indexes.push_back(outqi->TimeIndex());
+        task.itsSourceTimeIndexes.push_back(qi.TimeIndex());
+        task.itsTargetTimeIndexes.push_back(outqi->TimeIndex());
         handled_times.insert(qi.ValidTime());
         if (verbose) cerr << "\ttaking " << qi.ValidTime().ToStr(kYYYYMMDDHHMM).CharPtr() << endl;
       }
     }
 
-    // Copy
-
-    for (qi.ResetParam(); qi.NextParam();)
+    if (verbose)
     {
-      if (outqi->Param(qi.Param()))
-      {
-        if (!slowcopy)
-        {
-          for (outqi->ResetLocation(), qi.ResetLocation();
-               outqi->NextLocation() && qi.NextLocation();)
-          {
-            for (outqi->ResetLevel(), qi.ResetLevel(); outqi->NextLevel() && qi.NextLevel();)
-            {
-              for (size_t i = 0; i < input_time_indexes.size(); i++)
-              {
-                qi.TimeIndex(input_time_indexes[i]);
-                outqi->TimeIndex(output_time_indexes[i]);
-                outqi->FloatValue(qi.FloatValue());
-              }
-            }
-          }
-        }
-
-        else  // slow copy
-        {
-          // Resolution changes cause slow copies until
-          // old data has been forgotten
-          for (outqi->ResetLocation(); outqi->NextLocation();)
-          {
-            if (qi.Location(outqi->Location()->GetIdent()))
-            {
-              for (outqi->ResetLevel(), qi.ResetLevel(); outqi->NextLevel() && qi.NextLevel();)
-              {
-                for (size_t i = 0; i < input_time_indexes.size(); i++)
-                {
-                  qi.TimeIndex(input_time_indexes[i]);
-                  outqi->TimeIndex(output_time_indexes[i]);
-                  outqi->FloatValue(qi.FloatValue());
-                }
-              }
-            }
-          }
-        }
-      }
-      else if (verbose)
-      {
-        cerr << "Warning: Parameter " << qi.Param() << " is not available in all datas" << endl;
-      }
+      for (qi.ResetParam(); qi.NextParam();)
+        if (!outqi->Param(qi.Param()))
+          cerr << "Warning: Parameter " << qi.Param() << " is not available in all datas" << endl;
     }
+
+    if (!task.itsSourceTimeIndexes.empty()) tasks.push_back(task);
+  }
+
+  // Copy. Each file provides different output times, hence the files are
+  // read and copied concurrently, and each one is released right after use.
+  // A file which cannot be read would leave holes in the output, hence it
+  // is an error.
+
+  try
+  {
+    NFmiQueryDataUtil::CopyTimeStepsFromFiles(tasks, *outqd, threadcount);
+  }
+  catch (std::exception &e)
+  {
+    cerr << "Error: " << e.what() << endl;
+    delete outqi;
+    delete outqd;
+    if (!tmpfile.empty()) NFmiFileSystem::RemoveFile(tmpfile);
+    return 1;
   }
 
   // Done
@@ -484,6 +458,13 @@ int main(int argc, const char *argv[])
 
   delete outqi;
   delete outqd;
+
+  if (!tmpfile.empty() && !NFmiFileSystem::RenameFile(tmpfile, outfile))
+  {
+    cerr << "Error: Could not rename " << tmpfile << " to " << outfile << endl;
+    NFmiFileSystem::RemoveFile(tmpfile);
+    return 1;
+  }
 }
 
 // ======================================================================
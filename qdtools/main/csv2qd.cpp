@@ -21,8 +21,10 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread.hpp>
 #include <macgyver/CsvReader.h>
 #include <macgyver/TimeParser.h>
 #include <macgyver/TimeZoneFactory.h>
@@ -36,7 +38,13 @@
 #include <newbase/NFmiTimeDescriptor.h>
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiVPlaceDescriptor.h>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <set>
 #include <stdexcept>
@@ -87,6 +95,9 @@ struct Options
   string timezone = "UTC";
 
   int leveltype = 5000;
+
+  bool stream = false;
+  unsigned int threads = 0;
 };
 
 Options options;
@@ -139,7 +150,9 @@ bool parse_options(int argc, char* argv[], Options& options)
       ("allstations,A",po::bool_switch(&options.allstations),"store all stations in station file into output")
       ("origintime", po::value(&options.origintime), "origin time")
       ("timezone,t", po::value(&options.timezone))
-      ("leveltype", po::value(&options.leveltype), "leveltype as number");
+      ("leveltype", po::value(&options.leveltype), "leveltype as number")
+      ("stream,s", po::bool_switch(&options.stream), "memory map the input and parse it in parallel without storing the CSV table (quoted fields may not contain line breaks)")
+      ("threads,j", po::value(&options.threads), "number of threads in stream mode (default=most available cores)");
   // clang-format on
 
   po::positional_options_description p;
@@ -433,22 +446,8 @@ Stations parse_stations(const CsvTable& csv)
  */
 // ----------------------------------------------------------------------
 
-NFmiHPlaceDescriptor create_hdesc(const CsvTable& csv, const Stations& stations)
+NFmiHPlaceDescriptor create_hdesc(const set<string>& used, const Stations& stations)
 {
-  // List all stations
-
-  set<string> used;
-  string last_id = "";
-  BOOST_FOREACH (const CsvTable::value_type& row, csv)
-  {
-    const string& id = row[options.stationcolumn];
-    if (id != last_id)
-    {
-      used.insert(id);
-      last_id = id;
-    }
-  }
-
   if (options.verbose) cout << "Found " << used.size() << " stations from input" << endl;
 
   // Build LocationBag
@@ -484,18 +483,56 @@ NFmiHPlaceDescriptor create_hdesc(const CsvTable& csv, const Stations& stations)
   return NFmiHPlaceDescriptor(lbag);
 }
 
+NFmiHPlaceDescriptor create_hdesc(const CsvTable& csv, const Stations& stations)
+{
+  // List all stations
+
+  set<string> used;
+  string last_id = "";
+  BOOST_FOREACH (const CsvTable::value_type& row, csv)
+  {
+    const string& id = row[options.stationcolumn];
+    if (id != last_id)
+    {
+      used.insert(id);
+      last_id = id;
+    }
+  }
+
+  return create_hdesc(used, stations);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Create VPlaceDescriptor
  */
 // ----------------------------------------------------------------------
 
-NFmiVPlaceDescriptor create_vdesc(const CsvTable& csv)
+NFmiVPlaceDescriptor create_vdesc(const set<int>& used)
 {
   // default is sufficient for point data
 
   if (options.levelcolumn < 0) return NFmiVPlaceDescriptor();
 
+  if (options.verbose) cout << "Found " << used.size() << " levels from input" << endl;
+
+  // Build LevelBag
+
+  FmiLevelType ltype = static_cast<FmiLevelType>(options.leveltype);
+  NFmiLevelBag lbag;
+  BOOST_FOREACH (int value, used)
+  {
+    NFmiLevel tmp(ltype, value);
+    lbag.AddLevel(tmp);
+  }
+
+  return NFmiVPlaceDescriptor(lbag);
+}
+
+NFmiVPlaceDescriptor create_vdesc(const CsvTable& csv)
+{
+  if (options.levelcolumn < 0) return NFmiVPlaceDescriptor();
+
   // List all unique levels
 
   set<int> used;
@@ -512,19 +549,7 @@ NFmiVPlaceDescriptor create_vdesc(const CsvTable& csv)
     }
   }
 
-  if (options.verbose) cout << "Found " << used.size() << " levels from input" << endl;
-
-  // Build LevelBag
-
-  FmiLevelType ltype = static_cast<FmiLevelType>(options.leveltype);
-  NFmiLevelBag lbag;
-  BOOST_FOREACH (int value, used)
-  {
-    NFmiLevel tmp(ltype, value);
-    lbag.AddLevel(tmp);
-  }
-
-  return NFmiVPlaceDescriptor(lbag);
+  return create_vdesc(used);
 }
 
 // ----------------------------------------------------------------------
@@ -593,24 +618,11 @@ NFmiMetTime tomettime(const boost::posix_time::ptime& t)
  */
 // ----------------------------------------------------------------------
 
-NFmiTimeDescriptor create_tdesc(const CsvTable& csv, const boost::local_time::time_zone_ptr& tz)
+NFmiTimeDescriptor create_tdesc(const set<boost::posix_time::ptime>& used,
+                                const boost::local_time::time_zone_ptr& tz)
 {
   using boost::posix_time::ptime;
 
-  // List all times
-
-  set<ptime> used;
-  string last_t = "";
-  BOOST_FOREACH (const CsvTable::value_type& row, csv)
-  {
-    const string& t = row[options.timecolumn];
-    if (t != last_t)
-    {
-      used.insert(Fmi::TimeParser::parse(t, tz).utc_time());
-      last_t = t;
-    }
-  }
-
   if (options.verbose) cout << "Found " << used.size() << " unique times from input" << endl;
 
   // Build TimeList
@@ -632,6 +644,27 @@ NFmiTimeDescriptor create_tdesc(const CsvTable& csv, const boost::local_time::ti
   return NFmiTimeDescriptor(origintime, tlist);
 }
 
+NFmiTimeDescriptor create_tdesc(const CsvTable& csv, const boost::local_time::time_zone_ptr& tz)
+{
+  using boost::posix_time::ptime;
+
+  // List all times
+
+  set<ptime> used;
+  string last_t = "";
+  BOOST_FOREACH (const CsvTable::value_type& row, csv)
+  {
+    const string& t = row[options.timecolumn];
+    if (t != last_t)
+    {
+      used.insert(Fmi::TimeParser::parse(t, tz).utc_time());
+      last_t = t;
+    }
+  }
+
+  return create_tdesc(used, tz);
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Make location index
@@ -731,7 +764,7 @@ void copy_values(NFmiFastQueryInfo& info,
  */
 // ----------------------------------------------------------------------
 
-void validate_csv(const CsvTable& csv)
+unsigned int expected_columns()
 {
   // Each row must contain time,id and params
 
@@ -739,6 +772,12 @@ void validate_csv(const CsvTable& csv)
   if (options.levelcolumn >= 0) ++columns;
   if (options.timecolumn >= 0) ++columns;
   if (options.stationcolumn >= 0) ++columns;
+  return columns;
+}
+
+void validate_csv(const CsvTable& csv)
+{
+  const unsigned int columns = expected_columns();
 
   int rownum = 0;
   BOOST_FOREACH (const CsvTable::value_type& row, csv)
@@ -783,6 +822,650 @@ void write_querydata(const CsvTable& csv, const Params& params, const Stations&
   out << *data;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief A part of memory mapped CSV input ending at a line boundary
+ */
+// ----------------------------------------------------------------------
+
+struct CsvChunk
+{
+  const char* begin;
+  const char* end;
+  unsigned long firstrow;  // number of the first row in the chunk
+};
+
+typedef vector<CsvChunk> CsvChunks;
+
+const std::size_t csv_chunk_size = 16 * 1024 * 1024;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Split memory mapped input into chunks at line boundaries
+ */
+// ----------------------------------------------------------------------
+
+void split_chunks(const char* begin, const char* end, CsvChunks& chunks)
+{
+  while (begin < end)
+  {
+    const char* pos = end;
+    if (static_cast<std::size_t>(end - begin) > csv_chunk_size)
+    {
+      pos = static_cast<const char*>(memchr(begin + csv_chunk_size, '\n', end - begin - csv_chunk_size));
+      pos = (pos == nullptr ? end : pos + 1);
+    }
+    CsvChunk chunk = {begin, pos, 0};
+    chunks.push_back(chunk);
+    begin = pos;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the next line from a chunk
+ *
+ * Returns false when the chunk ends. Trailing carriage returns are removed.
+ */
+// ----------------------------------------------------------------------
+
+bool next_line(const char*& pos, const char* end, const char*& linebegin, const char*& lineend)
+{
+  if (pos >= end) return false;
+
+  linebegin = pos;
+  const char* newline = static_cast<const char*>(memchr(pos, '\n', end - pos));
+  lineend = (newline == nullptr ? end : newline);
+  pos = (newline == nullptr ? end : newline + 1);
+
+  if (lineend > linebegin && lineend[-1] == '\r') --lineend;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether a line contains a CSV record
+ *
+ * As in Fmi::CsvReader, blank lines and lines whose first non-blank
+ * character is '#' are skipped.
+ */
+// ----------------------------------------------------------------------
+
+bool is_record(const char* begin, const char* end)
+{
+  while (begin < end && isspace(static_cast<unsigned char>(*begin)))
+    ++begin;
+  return (begin < end && *begin != '#');
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Split one CSV line into fields
+ *
+ * Quoted fields may contain separators and doubled quotes, but not
+ * line breaks. Unquoted fields are trimmed as in Fmi::CsvReader.
+ */
+// ----------------------------------------------------------------------
+
+void split_line(const char* begin, const char* end, Fmi::CsvReader::row_type& row)
+{
+  row.clear();
+
+  const char* pos = begin;
+  while (true)
+  {
+    row.push_back(string());
+    string& field = row.back();
+
+    while (pos < end && isspace(static_cast<unsigned char>(*pos)))
+      ++pos;
+
+    if (pos < end && *pos == '"')
+    {
+      for (++pos; pos < end; ++pos)
+      {
+        if (*pos == '"')
+        {
+          if (pos + 1 < end && pos[1] == '"')
+            ++pos;
+          else
+          {
+            ++pos;
+            break;
+          }
+        }
+        field += *pos;
+      }
+      // Anything between the closing quote and the separator is kept as is
+      const char* sep = static_cast<const char*>(memchr(pos, ',', end - pos));
+      field.append(pos, sep == nullptr ? end : sep);
+      pos = sep;
+    }
+    else
+    {
+      const char* sep = static_cast<const char*>(memchr(pos, ',', end - pos));
+      const char* fieldend = (sep == nullptr ? end : sep);
+      while (fieldend > pos && isspace(static_cast<unsigned char>(fieldend[-1])))
+        --fieldend;
+      field.assign(pos, fieldend);
+      pos = sep;
+    }
+
+    if (pos == nullptr) break;
+    ++pos;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Strict number parsing equivalent to boost::lexical_cast
+ */
+// ----------------------------------------------------------------------
+
+bool parse_number(const string& str, double& value)
+{
+  if (str.empty() || isspace(static_cast<unsigned char>(str[0]))) return false;
+  char* end = nullptr;
+  value = strtod(str.c_str(), &end);
+  return end == str.c_str() + str.size();
+}
+
+bool parse_number(const string& str, int& value)
+{
+  if (str.empty() || isspace(static_cast<unsigned char>(str[0]))) return false;
+  char* end = nullptr;
+  long tmp = strtol(str.c_str(), &end, 10);
+  if (end != str.c_str() + str.size() || tmp != static_cast<int>(tmp)) return false;
+  value = static_cast<int>(tmp);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Unique stations, times and levels found from one chunk
+ *
+ * The first error is recorded with the row number relative to the
+ * start of the chunk, since the absolute row number is known only
+ * after all chunks have been scanned.
+ */
+// ----------------------------------------------------------------------
+
+struct CsvChunkSummary
+{
+  unsigned long rows = 0;
+  set<string> stations;
+  set<string> times;
+  set<int> levels;
+  unsigned long errorrow = 0;
+  string error;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Scan the stations, times and levels of one chunk
+ */
+// ----------------------------------------------------------------------
+
+void scan_chunk(const CsvChunk& chunk, CsvChunkSummary& summary)
+{
+  const unsigned int columns = expected_columns();
+
+  Fmi::CsvReader::row_type row;
+  string last_id, last_t;
+  int last_level = 0;
+
+  const char* pos = chunk.begin;
+  const char *linebegin, *lineend;
+  while (next_line(pos, chunk.end, linebegin, lineend))
+  {
+    if (!is_record(linebegin, lineend)) continue;
+
+    split_line(linebegin, lineend, row);
+
+    if (row.size() != columns)
+    {
+      summary.errorrow = summary.rows;
+      summary.error = " contains " + boost::lexical_cast<string>(row.size()) +
+                      " elements but should contain " + boost::lexical_cast<string>(columns);
+      return;
+    }
+
+    const string& id = row[options.stationcolumn];
+    if (id != last_id || summary.stations.empty())
+    {
+      summary.stations.insert(id);
+      last_id = id;
+    }
+
+    const string& t = row[options.timecolumn];
+    if (t != last_t || summary.times.empty())
+    {
+      summary.times.insert(t);
+      last_t = t;
+    }
+
+    if (options.levelcolumn >= 0)
+    {
+      int level;
+      if (!parse_number(row[options.levelcolumn], level))
+      {
+        summary.errorrow = summary.rows;
+        summary.error = " contains an invalid level '" + row[options.levelcolumn] + "'";
+        return;
+      }
+      if (level != last_level || summary.levels.empty())
+      {
+        summary.levels.insert(level);
+        last_level = level;
+      }
+    }
+
+    ++summary.rows;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Querydata indices of the stations, times and levels of the input
+ */
+// ----------------------------------------------------------------------
+
+struct CsvIndex
+{
+  map<string, unsigned long> locations;
+  map<string, unsigned long> times;
+  map<int, unsigned long> levels;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Chunks which have copied values to each station, time and level
+ *
+ * A cell is 0 if unused, the chunk number + 1 if only one chunk has
+ * rows for it, and shared_cell if several chunks have rows for it.
+ */
+// ----------------------------------------------------------------------
+
+typedef vector<std::atomic<unsigned int> > CsvCellOwners;
+
+const unsigned int shared_cell = std::numeric_limits<unsigned int>::max();
+
+void mark_cell(std::atomic<unsigned int>& cell, unsigned int chunknum)
+{
+  const unsigned int owner = chunknum + 1;
+  unsigned int current = cell.load(std::memory_order_relaxed);
+  while (current != owner && current != shared_cell)
+  {
+    const unsigned int next = (current == 0 ? owner : shared_cell);
+    if (cell.compare_exchange_weak(current, next, std::memory_order_relaxed)) break;
+  }
+}
+
+unsigned long cell_index(const NFmiFastQueryInfo& info)
+{
+  return ((info.TimeIndex() * info.SizeLocations() + info.LocationIndex()) * info.SizeLevels() +
+          info.LevelIndex());
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sets the station, time and level of successive rows
+ *
+ * Rows with unknown stations have already been warned about when
+ * creating the HPlaceDescriptor and are skipped.
+ */
+// ----------------------------------------------------------------------
+
+class CsvRowLocator
+{
+ public:
+  CsvRowLocator(NFmiFastQueryInfo& info, const CsvIndex& index)
+      : itsInfo(info), itsIndex(index), itsLocationOk(false)
+  {
+    // first level activate by default
+    itsInfo.FirstLevel();
+  }
+
+  bool locate(const Fmi::CsvReader::row_type& row)
+  {
+    const string& t = row[options.timecolumn];
+    if (t != itsLastTime)
+    {
+      itsInfo.TimeIndex(itsIndex.times.find(t)->second);
+      itsLastTime = t;
+    }
+
+    const string& id = row[options.stationcolumn];
+    if (id != itsLastId || itsLastId.empty())
+    {
+      map<string, unsigned long>::const_iterator it = itsIndex.locations.find(id);
+      itsLocationOk = (it != itsIndex.locations.end());
+      if (itsLocationOk) itsInfo.LocationIndex(it->second);
+      itsLastId = id;
+    }
+    if (!itsLocationOk) return false;
+
+    if (options.levelcolumn >= 0)
+    {
+      int value = 0;
+      parse_number(row[options.levelcolumn], value);
+      itsInfo.LevelIndex(itsIndex.levels.find(value)->second);
+    }
+    return true;
+  }
+
+ private:
+  NFmiFastQueryInfo& itsInfo;
+  const CsvIndex& itsIndex;
+  string itsLastId;
+  string itsLastTime;
+  bool itsLocationOk;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the values of a located row into querydata
+ */
+// ----------------------------------------------------------------------
+
+void copy_row(NFmiFastQueryInfo& info, const Fmi::CsvReader::row_type& row, unsigned long rownum)
+{
+  info.ResetParam();
+  for (unsigned int i = options.datacolumn; i < row.size(); i++)
+  {
+    info.NextParam();
+    if (row[i] == options.missingvalue) continue;
+
+    double value;
+    if (!parse_number(row[i], value))
+      throw runtime_error("Invalid number at row " + boost::lexical_cast<string>(rownum) + ": " +
+                          row[i]);
+    info.FloatValue(value);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the values of one chunk into querydata
+ *
+ * The rows of the chunk are copied in order, so within a chunk the last
+ * duplicate row wins. The cells the chunk writes to are marked so that
+ * the cells shared with other chunks can be copied again in input order.
+ */
+// ----------------------------------------------------------------------
+
+void copy_chunk(NFmiFastQueryInfo& info,
+                const CsvChunk& chunk,
+                unsigned int chunknum,
+                const CsvIndex& index,
+                CsvCellOwners& owners)
+{
+  Fmi::CsvReader::row_type row;
+  CsvRowLocator locator(info, index);
+
+  unsigned long rownum = chunk.firstrow - 1;
+
+  const char* pos = chunk.begin;
+  const char *linebegin, *lineend;
+  while (next_line(pos, chunk.end, linebegin, lineend))
+  {
+    if (!is_record(linebegin, lineend)) continue;
+    ++rownum;
+
+    split_line(linebegin, lineend, row);
+    if (!locator.locate(row)) continue;
+
+    mark_cell(owners[cell_index(info)], chunknum);
+    copy_row(info, row, rownum);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A row of a memory mapped CSV file
+ */
+// ----------------------------------------------------------------------
+
+struct CsvRow
+{
+  const char* begin;
+  const char* end;
+  unsigned long rownum;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect the rows of one chunk whose cells are shared with other chunks
+ */
+// ----------------------------------------------------------------------
+
+void collect_shared_rows(NFmiFastQueryInfo& info,
+                         const CsvChunk& chunk,
+                         const CsvIndex& index,
+                         const CsvCellOwners& owners,
+                         vector<CsvRow>& rows)
+{
+  Fmi::CsvReader::row_type row;
+  CsvRowLocator locator(info, index);
+
+  unsigned long rownum = chunk.firstrow - 1;
+
+  const char* pos = chunk.begin;
+  const char *linebegin, *lineend;
+  while (next_line(pos, chunk.end, linebegin, lineend))
+  {
+    if (!is_record(linebegin, lineend)) continue;
+    ++rownum;
+
+    split_line(linebegin, lineend, row);
+    if (!locator.locate(row)) continue;
+
+    if (owners[cell_index(info)].load(std::memory_order_relaxed) == shared_cell)
+    {
+      CsvRow shared = {linebegin, lineend, rownum};
+      rows.push_back(shared);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Process all chunks in worker threads
+ *
+ * The first exception thrown by a worker is rethrown once all threads
+ * have finished.
+ */
+// ----------------------------------------------------------------------
+
+void process_chunks_in_thread(NFmiTimeIndexCalculator& calculator,
+                              const boost::function<void(unsigned long)>& process,
+                              boost::mutex& mutex,
+                              std::exception_ptr& error)
+{
+  unsigned long i = 0;
+  while (calculator.GetCurrentTimeIndex(i))
+  {
+    try
+    {
+      process(i);
+    }
+    catch (...)
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      if (!error) error = std::current_exception();
+      return;
+    }
+  }
+}
+
+void process_chunks(unsigned long count, const boost::function<void(unsigned long)>& process)
+{
+  if (count == 0) return;
+
+  unsigned int threadcount = options.threads;
+  if (threadcount == 0)
+    threadcount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75, count);
+
+  NFmiTimeIndexCalculator calculator(count);
+  boost::mutex mutex;
+  std::exception_ptr error;
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadcount; i++)
+    threads.add_thread(new boost::thread(process_chunks_in_thread,
+                                         boost::ref(calculator),
+                                         boost::cref(process),
+                                         boost::ref(mutex),
+                                         boost::ref(error)));
+  threads.join_all();
+
+  if (error) std::rethrow_exception(error);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create and write querydata from memory mapped CSV files
+ *
+ * The input is scanned twice in parallel chunks: first to find all
+ * stations, times and levels for the descriptors, then to copy the
+ * values directly into the querydata. The CSV table is never stored.
+ * Duplicate rows in different chunks are resolved in input order.
+ */
+// ----------------------------------------------------------------------
+
+void write_streamed_querydata(const Params& params, const Stations& stations)
+{
+  using boost::posix_time::ptime;
+
+  boost::local_time::time_zone_ptr tz =
+      Fmi::TimeZoneFactory::instance().time_zone_from_string(options.timezone);
+
+  vector<boost::iostreams::mapped_file_source> files;
+  CsvChunks chunks;
+
+  BOOST_FOREACH (const string& infile, options.files)
+  {
+    if (boost::filesystem::file_size(infile) == 0) continue;
+    files.push_back(boost::iostreams::mapped_file_source(infile));
+    split_chunks(files.back().data(), files.back().data() + files.back().size(), chunks);
+  }
+
+  // Scan stations, times and levels
+
+  vector<CsvChunkSummary> summaries(chunks.size());
+  process_chunks(chunks.size(), [&](unsigned long i) { scan_chunk(chunks[i], summaries[i]); });
+
+  set<string> used_stations;
+  set<string> used_times;
+  set<int> used_levels;
+
+  unsigned long rows = 0;
+  for (std::size_t i = 0; i < chunks.size(); i++)
+  {
+    chunks[i].firstrow = rows + 1;
+    const CsvChunkSummary& summary = summaries[i];
+    if (!summary.error.empty())
+      throw runtime_error("Row " + boost::lexical_cast<string>(rows + summary.errorrow + 1) +
+                          summary.error);
+    rows += summary.rows;
+    used_stations.insert(summary.stations.begin(), summary.stations.end());
+    used_times.insert(summary.times.begin(), summary.times.end());
+    used_levels.insert(summary.levels.begin(), summary.levels.end());
+  }
+  summaries.clear();
+
+  if (options.verbose) cout << "Scanned " << rows << " rows from input" << endl;
+
+  map<string, ptime> times;
+  set<ptime> used_ptimes;
+  BOOST_FOREACH (const string& t, used_times)
+  {
+    ptime pt = Fmi::TimeParser::parse(t, tz).utc_time();
+    times[t] = pt;
+    used_ptimes.insert(pt);
+  }
+
+  NFmiHPlaceDescriptor hdesc = create_hdesc(used_stations, stations);
+  NFmiVPlaceDescriptor vdesc = create_vdesc(used_levels);
+  NFmiParamDescriptor pdesc = create_pdesc(params);
+  NFmiTimeDescriptor tdesc = create_tdesc(used_ptimes, tz);
+
+  NFmiFastQueryInfo qi(pdesc, tdesc, hdesc, vdesc);
+  unique_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(qi));
+
+  if (data.get() == 0) throw runtime_error("Could not allocate memory for result data");
+
+  NFmiFastQueryInfo info(data.get());
+  info.SetProducer(NFmiProducer(options.producernumber, options.producername));
+
+  // Build the querydata indices
+
+  CsvIndex index;
+
+  BOOST_FOREACH (const string& id, used_stations)
+  {
+    Stations::const_iterator station = stations.find(id);
+    if (station != stations.end() && info.Location(station->second.number))
+      index.locations[id] = info.LocationIndex();
+  }
+
+  for (map<string, ptime>::const_iterator it = times.begin(); it != times.end(); ++it)
+  {
+    info.Time(tomettime(it->second));
+    index.times[it->first] = info.TimeIndex();
+  }
+
+  BOOST_FOREACH (int value, used_levels)
+  {
+    info.Level(NFmiLevel(static_cast<FmiLevelType>(options.leveltype), value));
+    index.levels[value] = info.LevelIndex();
+  }
+
+  // Copy the values, each thread uses its own iterator
+
+  CsvCellOwners owners(info.SizeLocations() * info.SizeTimes() * info.SizeLevels());
+
+  process_chunks(chunks.size(),
+                 [&](unsigned long i)
+                 {
+                   NFmiFastQueryInfo threadinfo(info);
+                   copy_chunk(threadinfo, chunks[i], static_cast<unsigned int>(i), index, owners);
+                 });
+
+  // Duplicate rows in different chunks were copied in thread dependent order.
+  // Their cells are copied again in input order, so that the last row wins
+  // just like without streaming.
+
+  bool shared = false;
+  for (std::size_t i = 0; !shared && i < owners.size(); i++)
+    shared = (owners[i].load(std::memory_order_relaxed) == shared_cell);
+
+  if (shared)
+  {
+    vector<vector<CsvRow> > shared_rows(chunks.size());
+    process_chunks(chunks.size(),
+                   [&](unsigned long i)
+                   {
+                     NFmiFastQueryInfo threadinfo(info);
+                     collect_shared_rows(threadinfo, chunks[i], index, owners, shared_rows[i]);
+                   });
+
+    Fmi::CsvReader::row_type row;
+    CsvRowLocator locator(info, index);
+    for (std::size_t i = 0; i < shared_rows.size(); i++)
+    {
+      BOOST_FOREACH (const CsvRow& shared_row, shared_rows[i])
+      {
+        split_line(shared_row.begin, shared_row.end, row);
+        if (locator.locate(row)) copy_row(info, row, shared_row.rownum);
+      }
+    }
+  }
+
+  ofstream out(options.outfile.c_str());
+  out << *data;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Main program without exception handling
@@ -796,14 +1479,21 @@ int run(int argc, char* argv[])
   Csv csv, csvparams, csvstations;
   Fmi::CsvReader::read(options.paramsfile, boost::bind(&Csv::addrow, &csvparams, _1));
   Fmi::CsvReader::read(options.stationsfile, boost::bind(&Csv::addrow, &csvstations, _1));
+
+  Params params = parse_params(csvparams.table);
+  Stations stations = parse_stations(csvstations.table);
+
+  if (options.stream)
+  {
+    write_streamed_querydata(params, stations);
+    return 0;
+  }
+
   BOOST_FOREACH (const string& infile, options.files)
   {
     Fmi::CsvReader::read(infile, boost::bind(&Csv::addrow, &csv, _1));
   }
 
-  Params params = parse_params(csvparams.table);
-  Stations stations = parse_stations(csvstations.table);
-
   write_querydata(csv.table, params, stations);
 
   return 0;
@@ -5,6 +5,7 @@
 #endif
 
 #include "GribTools.h"
+#include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
@@ -30,9 +31,12 @@
 #include <newbase/NFmiTotalWind.h>
 #include <newbase/NFmiValueString.h>
 #include <cstdlib>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <grib_api.h>
 #include <iomanip>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <stdexcept>
@@ -123,7 +127,9 @@ struct GribFilterOptions
         itsInputFileNameStr(),
         itsInputFile(0),
         itsStepRangeCheckedParams(),
-        itsWantedStepRange(0)
+        itsWantedStepRange(0),
+        itsMaxThreadCount(1),
+        fUseMemoryMappedOutput(false)
   {
   }
 
@@ -189,10 +195,14 @@ struct GribFilterOptions
                                                       // on kakksi eri jaksoista parametria datassa)
   int itsWantedStepRange;  // Jos tm on 3, valitaan NAM:in tapauksessa se 3h-sade, jos tm on -3,
                            // valitaan se toinen (hidden feature).
+  unsigned int itsMaxThreadCount;  // -j optio, gribien purkuun kytettvien sikeiden maksimimr
+                                   // (oletus 1 eli ei rinnakkaisuutta, 0 = kohtuullinen mr)
+  bool fUseMemoryMappedOutput;  // -M optio, kaksivaiheinen muunnos suoraan muistikartoitettuihin
+                                // tulostiedostoihin, jolloin kaikkia kentti ei pidet muistissa
 };
 
-// Poistin TotalQDataCollector -luokan, koska ainakaan grib_api ei tue multi-threaddausta nihin
-// aikoihin ja se sekoitti koodia
+// Poistin TotalQDataCollector -luokan, koska se sekoitti koodia. Rinnakkaisuutta kytetn vain
+// yhden tiedoston kenttien purussa (-j optio), ja se vaatii sieturvallisen grib_api:n.
 
 struct LevelLessThan
 {
@@ -211,6 +221,8 @@ struct LevelLessThan
 namespace
 {
 vector<boost::shared_ptr<NFmiQueryData> > gTotalQDataCollector;
+// -M optio: muistikartoitettujen tulostiedostojen tilapiset ja lopulliset nimet
+vector<pair<string, string> > gMemoryMappedFileNames;
 }
 
 static const unsigned long gMissLevelValue =
@@ -639,21 +651,25 @@ static void HandleProjectionString(const string &theProjStr, GridSettingsPackage
   }
 }
 
-static bool IsDifferentGridFileNamesUsed(vector<boost::shared_ptr<NFmiQueryData> > &theDatas)
+static bool IsDifferentGridFileNamesUsed(const vector<FmiLevelType> &theLevelTypes)
 {
-  size_t ssize = theDatas.size();
+  size_t ssize = theLevelTypes.size();
   if (ssize > 1)
   {
-    std::set<FmiLevelType> levels;
-    for (size_t i = 0; i < ssize; i++)
-    {
-      levels.insert(theDatas[i]->Info()->Level()->LevelType());
-    }
+    std::set<FmiLevelType> levels(theLevelTypes.begin(), theLevelTypes.end());
     if (levels.size() != ssize) return true;
   }
   return false;
 }
 
+static bool IsDifferentGridFileNamesUsed(vector<boost::shared_ptr<NFmiQueryData> > &theDatas)
+{
+  vector<FmiLevelType> levelTypes;
+  for (size_t i = 0; i < theDatas.size(); i++)
+    levelTypes.push_back(theDatas[i]->Info()->Level()->LevelType());
+  return ::IsDifferentGridFileNamesUsed(levelTypes);
+}
+
 static bool GetIgnoreLevelList(NFmiCmdLine &theCmdLine, NFmiLevelBag &theIgnoredLevelListOut)
 {
   if (theCmdLine.isOption('l'))
@@ -757,6 +773,37 @@ static long GetLevelType(boost::shared_ptr<NFmiQueryData> &theQData)
     return -1;
 }
 
+// Tekee i:nnen tulosdatan tiedostonimen -o optiolla annetusta nimest.
+static string MakeOutputFileName(const GribFilterOptions &theGribFilterOptions,
+                                 int theIndex,
+                                 long theLevelType,
+                                 const NFmiArea *theArea,
+                                 bool useDifferentFileNamesOnDifferentGrids)
+{
+  string usedFileName(theGribFilterOptions.itsOutputFileName);
+  if (theGribFilterOptions.fUseLevelTypeFileNaming)
+  {
+    usedFileName += "_levelType_";
+    usedFileName += NFmiStringTools::Convert(theLevelType);
+    // TM PIT viel korjata, jos saman level tyypill on erilaisia hila/area mrityksi,
+    // pit ne nimet!!!
+    if (useDifferentFileNamesOnDifferentGrids)
+    {
+      string areaStr = GetFileNameAreaStr(theArea);
+      usedFileName += areaStr;
+    }
+  }
+  else
+  {
+    if (theIndex > 0)
+    {
+      usedFileName += "_";
+      usedFileName += NFmiStringTools::Convert(theIndex);
+    }
+  }
+  return usedFileName;
+}
+
 static void StoreQueryDatas(GribFilterOptions &theGribFilterOptions)
 {
   int returnStatus = 0;  // 0 = ok
@@ -768,31 +815,18 @@ static void StoreQueryDatas(GribFilterOptions &theGribFilterOptions)
     for (int i = 0; i < ssize; i++)
     {
       NFmiStreamQueryData streamData;
-      if (theGribFilterOptions.fUseOutputFile)
+      if (theGribFilterOptions.fUseMemoryMappedOutput)
       {
-        string usedFileName(theGribFilterOptions.itsOutputFileName);
-        if (theGribFilterOptions.fUseLevelTypeFileNaming)
-        {
-          usedFileName += "_levelType_";
-          usedFileName +=
-              NFmiStringTools::Convert(::GetLevelType(theGribFilterOptions.itsGeneratedDatas[i]));
-          // TM PIT viel korjata, jos saman level tyypill on erilaisia hila/area mrityksi,
-          // pit ne nimet!!!
-          if (useDifferentFileNamesOnDifferentGrids)
-          {
-            string areaStr =
-                GetFileNameAreaStr(theGribFilterOptions.itsGeneratedDatas[i]->Info()->Area());
-            usedFileName += areaStr;
-          }
-        }
-        else
-        {
-          if (i > 0)
-          {
-            usedFileName += "_";
-            usedFileName += NFmiStringTools::Convert(i);
-          }
-        }
+        // data on kirjoitettu jo suoraan muistikartoitettuun tulostiedostoon
+      }
+      else if (theGribFilterOptions.fUseOutputFile)
+      {
+        string usedFileName =
+            ::MakeOutputFileName(theGribFilterOptions,
+                                 i,
+                                 ::GetLevelType(theGribFilterOptions.itsGeneratedDatas[i]),
+                                 theGribFilterOptions.itsGeneratedDatas[i]->Info()->Area(),
+                                 useDifferentFileNamesOnDifferentGrids);
         if (!streamData.WriteData(usedFileName, theGribFilterOptions.itsGeneratedDatas[i].get()))
         {
           cerr << "could not open qd-file to write: " << theGribFilterOptions.itsOutputFileName
@@ -2482,7 +2516,10 @@ static void ProjectData(GridRecordData *theGridRecordData,
                         NFmiDataMatrix<float> &theOrigValues,
                         const GribFilterOptions &theOptions)
 {
-  static std::map<std::string, NFmiDataMatrix<NFmiLocationCache> > locationCacheMap;
+  // Vlimuisti on jaettu purkusikeiden kesken, matriisit jaetaan kopioimatta.
+  typedef boost::shared_ptr<NFmiDataMatrix<NFmiLocationCache> > LocationCacheMatrixPtr;
+  static std::map<std::string, LocationCacheMatrixPtr> locationCacheMap;
+  static boost::mutex locationCacheMutex;
 
   if (theOptions.fVerbose) cerr << " p";
 
@@ -2496,16 +2533,18 @@ static void ProjectData(GridRecordData *theGridRecordData,
   std::string sourceStr = ::MakeGridStr(sourceGrid);
 
   std::string mapKeyStr = targetStr + "+" + sourceStr;
-  std::map<std::string, NFmiDataMatrix<NFmiLocationCache> >::iterator it =
-      locationCacheMap.find(mapKeyStr);
-  NFmiDataMatrix<NFmiLocationCache> locationCacheMatrix;
-  if (it == locationCacheMap.end())
+  LocationCacheMatrixPtr locationCacheMatrixPtr;
   {
-    sourceGrid.CalcLatlonCachePoints(targetGrid, locationCacheMatrix);
-    locationCacheMap.insert(std::make_pair(mapKeyStr, locationCacheMatrix));
+    boost::mutex::scoped_lock lock(locationCacheMutex);
+    LocationCacheMatrixPtr &cachedMatrix = locationCacheMap[mapKeyStr];
+    if (!cachedMatrix)
+    {
+      cachedMatrix.reset(new NFmiDataMatrix<NFmiLocationCache>());
+      sourceGrid.CalcLatlonCachePoints(targetGrid, *cachedMatrix);
+    }
+    locationCacheMatrixPtr = cachedMatrix;
   }
-  else
-    locationCacheMatrix = (*it).second;
+  const NFmiDataMatrix<NFmiLocationCache> &locationCacheMatrix = *locationCacheMatrixPtr;
 
   int targetXSize = theGridRecordData->itsGrid.itsNX;
   int targetYSize = theGridRecordData->itsGrid.itsNY;
@@ -2516,7 +2555,7 @@ static void ProjectData(GridRecordData *theGridRecordData,
   FmiInterpolationMethod interp = theGridRecordData->itsParam.GetParam()->InterpolationMethod();
   for (targetGrid.Reset(); targetGrid.Next(); counter++)
   {
-    NFmiLocationCache &locCache =
+    const NFmiLocationCache &locCache =
         locationCacheMatrix[targetGrid.Index() % targetXSize][targetGrid.Index() / targetXSize];
     int destX = counter % theGridRecordData->itsGrid.itsNX;
     int destY = counter / theGridRecordData->itsGrid.itsNX;
@@ -2950,6 +2989,15 @@ NFmiTimeDescriptor GetTimeDesc(vector<GridRecordData *> &theGribRecordDatas,
     return NFmiTimeDescriptor(theGribRecordDatas[0]->itsOrigTime, timeList);
 }
 
+// Asettaa infon gribi-kentn hilan, ajan, levelin ja parametrin kohdalle, jos ne lytyvt datasta.
+static bool SetGridRecordPosition(NFmiFastQueryInfo &theInfo, GridRecordData &theGridRecordData)
+{
+  // vain samanlaisia hiloja laitetaan samaan qdataan
+  return theGridRecordData.itsGrid == *theInfo.Grid() &&
+         theInfo.Time(theGridRecordData.itsValidTime) &&
+         theInfo.Level(theGridRecordData.itsLevel) && theInfo.Param(theGridRecordData.itsParam);
+}
+
 bool FillQDataWithGribRecords(boost::shared_ptr<NFmiQueryData> &theQData,
                               vector<GridRecordData *> &theGribRecordDatas,
                               bool verbose)
@@ -2962,15 +3010,12 @@ bool FillQDataWithGribRecords(boost::shared_ptr<NFmiQueryData> &theQData,
   for (int i = 0; i < gribCount; i++)
   {
     tmp = theGribRecordDatas[i];
-    if (tmp->itsGrid == *info.Grid())  // vain samanlaisia hiloja laitetaan samaan qdataan
+    if (::SetGridRecordPosition(info, *tmp))
     {
-      if (info.Time(tmp->itsValidTime) && info.Level(tmp->itsLevel) && info.Param(tmp->itsParam))
-      {
-        if (!info.SetValues(tmp->itsGridData))
-          throw runtime_error("qdatan tytt gribi datalla eponnistui, lopetetaan...");
-        filledGridCount++;
-        if (verbose) cerr << NFmiStringTools::Convert(filledGridCount) << " ";
-      }
+      if (!info.SetValues(tmp->itsGridData))
+        throw runtime_error("qdatan tytt gribi datalla eponnistui, lopetetaan...");
+      filledGridCount++;
+      if (verbose) cerr << NFmiStringTools::Convert(filledGridCount) << " ";
     }
   }
   if (verbose) cerr << endl;
@@ -3335,8 +3380,717 @@ static bool IsStepRangeCorrect(grib_handle *theGribHandle,
   return true;  // Jos tnne pstn, on parametri ok
 }
 
+// Lukee kentn parametri-, level-, hila- ja aikatiedot gribist, itse hila-arvot puretaan vasta
+// FillGridData:ssa.
+static void ReadGribFieldInfo(grib_handle *theGribHandle,
+                              GridRecordData *theData,
+                              GribFilterOptions &theGribFilterOptions,
+                              map<int, pair<double, double> > &theVerticalCoordinateMap)
+{
+  theGribFilterOptions.fDoYAxisFlip = jscan_is_negative(theGribHandle);
+
+  theData->itsLatlonCropRect = theGribFilterOptions.itsLatlonCropRect;
+  // param ja level tiedot pit hanskata ennen hilan koon mrityst
+  //                PrintAllParamInfo_forDebugging(gribHandle);
+  theData->itsParam = ::GetParam(theGribHandle, theGribFilterOptions.itsWantedSurfaceProducer);
+  theData->itsLevel = ::GetLevel(theGribHandle);
+  ::FillGridInfoFromGribHandle(
+      theGribHandle, theData, theGribFilterOptions, theGribFilterOptions.itsGridSettings);
+  theData->itsOrigTime = ::GetOrigTime(theGribHandle);
+  theData->itsValidTime = ::GetValidTime(theGribHandle);
+  theData->itsMissingValue = ::GetMissingValue(theGribHandle);
+  ::GetLevelVerticalCoordinates(theGribHandle, *theData, theVerticalCoordinateMap);
+}
+
+// Tarkastaa optioiden mukaiset suodatukset ja palauttaa true, jos kentt halutaan mukaan dataan.
+static bool IsGribFieldWanted(grib_handle *theGribHandle,
+                              GridRecordData *theData,
+                              GribFilterOptions &theGribFilterOptions)
+{
+  // filtteri jtt huomiotta ns. kontrolli hilan, joka on ainakin hirlam datassa 1.. se on
+  // muista poikkeava 2x2 hila latlon-area.
+  // Aiheuttaisi turhia ongelmia jatkossa monessakin paikassa.
+  if (theData->itsOrigGrid.itsNX <= 2 && theData->itsOrigGrid.itsNY <= 2) return false;
+  if (::IgnoreThisLevel(theData, theGribFilterOptions.itsIgnoredLevelList)) return false;
+  if (::AcceptThisLevelType(theData, theGribFilterOptions.itsAcceptOnlyLevelTypes) == false)
+    return false;
+  if (::CropParam(theData,
+                  theGribFilterOptions.fCropParamsNotMensionedInTable,
+                  theGribFilterOptions.itsParamChangeTable))
+    return false;
+  if (::IsStepRangeCorrect(theGribHandle,
+                           theData->itsParam,
+                           theGribFilterOptions.itsStepRangeCheckedParams,
+                           theGribFilterOptions.itsWantedStepRange) == false)
+  {
+    if (theGribFilterOptions.fVerbose)
+    {
+      cerr << "\nWarning: Parameter was discarded due stepRange check" << endl;
+    }
+    return false;
+  }
+  return true;
+}
+
+// Rinnakkainen purku: lukijasie pilkkoo tiedoston grib-viesteiksi, tysikeet purkavat viestit
+// omilla grib_handle:illaan ja psie kokoaa tulokset tiedoston mukaisessa jrjestyksess.
+
+// Tiedostosta luettu grib-viesti raakatavuina.
+struct GribMessage
+{
+  GribMessage(void) : itsCounter(0), itsBytes() {}
+  int itsCounter;  // viestin jrjestysnumero tiedostossa (1, 2, ...)
+  vector<unsigned char> itsBytes;
+};
+
+// Tysikeen purkama grib-kentt.
+struct DecodedGribField
+{
+  DecodedGribField(void)
+      : itsCounter(0),
+        itsData(),
+        fInfoRead(false),
+        fUsed(false),
+        fDoYAxisFlip(false),
+        fReducedLL(false),
+        itsError(),
+        itsVerticalCoordinates()
+  {
+  }
+
+  int itsCounter;
+  std::unique_ptr<GridRecordData> itsData;
+  bool fInfoRead;  // param, level ja hila tiedot saatiin luettua, parametri-tarkastelu tehdn
+  bool fUsed;      // kentt lpisi suodatukset ja sen arvot on purettu
+  bool fDoYAxisFlip;
+  bool fReducedLL;
+  std::exception_ptr itsError;  // purussa tapahtunut poikkeus, ksitelln psikeess
+  map<int, pair<double, double> > itsVerticalCoordinates;
+};
+
+// Lukija-, ty- ja kokoojasikeiden yhteinen jono. Luettuja mutta viel kokoamattomia viestej
+// pidetn muistissa enintn itsMaxInFlight kpl.
+class GribDecodeQueue
+{
+ public:
+  GribDecodeQueue(size_t theMaxInFlight)
+      : itsMutex(),
+        itsCondition(),
+        itsMessages(),
+        itsResults(),
+        itsInFlight(0),
+        itsMaxInFlight(theMaxInFlight),
+        itsMessageCount(0),
+        itsReadError(0),
+        fOpenFailed(false),
+        fReadingFinished(false),
+        fStopped(false)
+  {
+  }
+
+  bool PushMessage(GribMessage &theMessage)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    while (itsInFlight >= itsMaxInFlight && !fStopped)
+      itsCondition.wait(lock);
+    if (fStopped) return false;
+    itsMessages.push_back(GribMessage());
+    itsMessages.back().itsCounter = theMessage.itsCounter;
+    itsMessages.back().itsBytes.swap(theMessage.itsBytes);
+    itsInFlight++;
+    itsMessageCount = theMessage.itsCounter;
+    itsCondition.notify_all();
+    return true;
+  }
+
+  void ReadingFinished(int theReadError, bool fOpenFailedIn)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    itsReadError = theReadError;
+    fOpenFailed = fOpenFailedIn;
+    fReadingFinished = true;
+    itsCondition.notify_all();
+  }
+
+  bool PopMessage(GribMessage &theMessage)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    while (itsMessages.empty() && !fReadingFinished && !fStopped)
+      itsCondition.wait(lock);
+    if (fStopped || itsMessages.empty()) return false;
+    theMessage.itsCounter = itsMessages.front().itsCounter;
+    theMessage.itsBytes.swap(itsMessages.front().itsBytes);
+    itsMessages.pop_front();
+    return true;
+  }
+
+  void PushResult(DecodedGribField &theField)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    DecodedGribField &field = itsResults[theField.itsCounter];
+    field = std::move(theField);
+    itsCondition.notify_all();
+  }
+
+  // Odottaa annetun jrjestysnumeron tulosta, palauttaa false, kun viestit on kyty lpi.
+  bool PopResult(int theCounter, DecodedGribField &theField)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    for (;;)
+    {
+      if (fStopped) return false;
+      map<int, DecodedGribField>::iterator it = itsResults.find(theCounter);
+      if (it != itsResults.end())
+      {
+        theField = std::move(it->second);
+        itsResults.erase(it);
+        itsInFlight--;
+        itsCondition.notify_all();
+        return true;
+      }
+      if (fReadingFinished && theCounter > itsMessageCount) return false;
+      itsCondition.wait(lock);
+    }
+  }
+
+  void Stop(void)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    fStopped = true;
+    itsCondition.notify_all();
+  }
+
+  int ReadError(void)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    return itsReadError;
+  }
+
+  bool OpenFailed(void)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    return fOpenFailed;
+  }
+
+ private:
+  boost::mutex itsMutex;
+  boost::condition_variable itsCondition;
+  std::deque<GribMessage> itsMessages;
+  map<int, DecodedGribField> itsResults;
+  size_t itsInFlight;
+  size_t itsMaxInFlight;
+  int itsMessageCount;
+  int itsReadError;
+  bool fOpenFailed;
+  bool fReadingFinished;
+  bool fStopped;
+};
+
+// Lukijasie: grib_api hoitaa tiedoston pilkkomisen viesteihin, viestin tavut kopioidaan talteen
+// ja handle vapautetaan heti.
+static void ReadGribMessages(FILE *theInputFile, GribDecodeQueue &theQueue)
+{
+  grib_context *gribContext = grib_context_get_default();
+  grib_handle *gribHandle = nullptr;
+  int err = 0;
+  int counter = 0;
+  bool openFailed = false;
+  while ((gribHandle = grib_handle_new_from_file(gribContext, theInputFile, &err)) != nullptr)
+  {
+    if (err != GRIB_SUCCESS)
+    {
+      grib_handle_delete(gribHandle);
+      openFailed = true;
+      break;
+    }
+
+    GribMessage message;
+    message.itsCounter = ++counter;
+    const void *messageData = nullptr;
+    size_t messageLength = 0;
+    if (grib_get_message(gribHandle, &messageData, &messageLength) == GRIB_SUCCESS)
+    {
+      const unsigned char *bytes = static_cast<const unsigned char *>(messageData);
+      message.itsBytes.assign(bytes, bytes + messageLength);
+    }
+    grib_handle_delete(gribHandle);
+
+    if (theQueue.PushMessage(message) == false) break;  // purku keskeytetty
+  }
+  theQueue.ReadingFinished(err, openFailed);
+}
+
+// Purkaa yhden gribin ja tekee kaiken kenttkohtaisen tyn (hilainfo, suodatukset, arvojen purku,
+// projisointi ja croppaus). Virheet talletetaan kenttn, jotta ne ksitelln tiedoston
+// mukaisessa jrjestyksess.
+static void DecodeGribField(grib_handle *theGribHandle,
+                            GribFilterOptions &theOptions,
+                            DecodedGribField &theField)
+{
+  try
+  {
+    if (theGribHandle == nullptr)
+      throw runtime_error("Failed to create grib handle from message in file " +
+                          theOptions.itsInputFileNameStr);
+
+    theField.itsData.reset(new GridRecordData);
+    GridRecordData *tmpData = theField.itsData.get();
+    ::ReadGribFieldInfo(theGribHandle, tmpData, theOptions, theField.itsVerticalCoordinates);
+    theField.fDoYAxisFlip = theOptions.fDoYAxisFlip;
+    ::ChangeParamSettingsIfNeeded(theOptions.itsParamChangeTable, tmpData, false);
+    theField.fInfoRead = true;
+
+    if (::IsGribFieldWanted(theGribHandle, tmpData, theOptions))
+    {
+      ::FillGridData(theGribHandle, tmpData, theOptions);
+      theField.fUsed = true;
+    }
+  }
+  catch (Reduced_ll_grib_exception &)
+  {
+    theField.fReducedLL = true;
+  }
+  catch (...)
+  {
+    theField.itsError = std::current_exception();
+  }
+}
+
+// Optioista tehdn purkukohtainen kopio, koska kenttkohtaiset asetukset (fDoYAxisFlip) ja
+// ohitettavien levelien listan lpikynti muuttavat niit.
+static GribFilterOptions MakeDecodingOptions(const GribFilterOptions &theGribFilterOptions)
+{
+  GribFilterOptions options(theGribFilterOptions);
+  options.itsInputFile = nullptr;  // tiedosto suljetaan alkuperisen optio-olion mukana
+  options.fVerbose = false;        // kenttkohtaiset tulosteet sekoittuisivat sikeiden kesken
+  return options;
+}
+
+// Tysie: purkaa lukijasikeen viestit omalla handlella.
+static void DecodeGribMessages(const GribFilterOptions &theGribFilterOptions,
+                               GribDecodeQueue &theQueue)
+{
+  GribFilterOptions options(::MakeDecodingOptions(theGribFilterOptions));
+
+  grib_context *gribContext = grib_context_get_default();
+  GribMessage message;
+  while (theQueue.PopMessage(message))
+  {
+    DecodedGribField field;
+    field.itsCounter = message.itsCounter;
+    grib_handle *gribHandle = nullptr;
+    if (message.itsBytes.empty() == false)
+      gribHandle = grib_handle_new_from_message(
+          gribContext, &message.itsBytes[0], message.itsBytes.size());
+    ::DecodeGribField(gribHandle, options, field);
+    if (gribHandle) grib_handle_delete(gribHandle);
+    message.itsBytes.clear();
+
+    theQueue.PushResult(field);
+  }
+}
+
+typedef std::function<void(DecodedGribField &)> DecodedGribFieldHandler;
+
+// Purkaa tiedoston gribit lukija- ja tysikeill ja antaa puretut kentt theFieldHandler:ille
+// tiedoston mukaisessa jrjestyksess. Palauttaa grib_api:n lukuvirheen koodin (0 = ok).
+// Yhdell sikeell gribit luetaan ja puretaan kutsuvassa sikeess, jolloin grib_api:a ei
+// kytet koskaan kahdesta sikeest yht aikaa (ks. GetDecodingThreadCount).
+static int DecodeGribMessagesInParallel(GribFilterOptions &theGribFilterOptions,
+                                        unsigned int theThreadCount,
+                                        const DecodedGribFieldHandler &theFieldHandler)
+{
+  grib_multi_support_on(0);
+  if (theThreadCount <= 1)
+  {
+    GribFilterOptions options(::MakeDecodingOptions(theGribFilterOptions));
+    grib_context *gribContext = grib_context_get_default();
+    grib_handle *gribHandle = nullptr;
+    int err = 0;
+    int counter = 0;
+    while ((gribHandle = grib_handle_new_from_file(
+                gribContext, theGribFilterOptions.itsInputFile, &err)) != nullptr)
+    {
+      if (err != GRIB_SUCCESS)
+      {
+        grib_handle_delete(gribHandle);
+        throw runtime_error("Failed to open grib handle in file  " +
+                            theGribFilterOptions.itsInputFileNameStr);
+      }
+      DecodedGribField field;
+      field.itsCounter = ++counter;
+      ::DecodeGribField(gribHandle, options, field);
+      grib_handle_delete(gribHandle);
+      theFieldHandler(field);
+    }
+    return err;
+  }
+
+  GribDecodeQueue queue(4 * theThreadCount);
+  boost::thread_group threads;
+  try
+  {
+    threads.add_thread(new boost::thread(
+        ::ReadGribMessages, theGribFilterOptions.itsInputFile, boost::ref(queue)));
+    for (unsigned int i = 0; i < theThreadCount; i++)
+      threads.add_thread(new boost::thread(
+          ::DecodeGribMessages, boost::cref(theGribFilterOptions), boost::ref(queue)));
+
+    DecodedGribField field;
+    for (int counter = 1; queue.PopResult(counter, field); counter++)
+      theFieldHandler(field);
+    threads.join_all();
+  }
+  catch (...)
+  {
+    queue.Stop();
+    threads.join_all();
+    throw;
+  }
+
+  if (queue.OpenFailed())
+    throw runtime_error("Failed to open grib handle in file  " +
+                        theGribFilterOptions.itsInputFileNameStr);
+  return queue.ReadError();
+}
+
+static void ConvertGrib2QDataInParallel(GribFilterOptions &theGribFilterOptions,
+                                        unsigned int theThreadCount)
+{
+  vector<GridRecordData *> gribRecordDatas;
+  bool executionStoppingError = false;
+  map<int, pair<double, double> > verticalCoordinateMap;
+  map<unsigned long, pair<NFmiParam, NFmiParam> > changedParams;
+  map<unsigned long, NFmiParam> unchangedParams;
+
+  try
+  {
+    // Kentt ksitelln samassa jrjestyksess kuin sarjallisessa purussa, jolloin
+    // parametri-tarkastelut, virheilmoitukset ja tulosdata pysyvt samoina.
+    int err = ::DecodeGribMessagesInParallel(
+        theGribFilterOptions, theThreadCount, [&](DecodedGribField &field) {
+          verticalCoordinateMap.insert(field.itsVerticalCoordinates.begin(),
+                                       field.itsVerticalCoordinates.end());
+          theGribFilterOptions.fDoYAxisFlip = field.fDoYAxisFlip;
+          try
+          {
+            if (field.fReducedLL) throw Reduced_ll_grib_exception();
+            if (field.fInfoRead)
+              ::DoParamChecking(
+                  *field.itsData, changedParams, unchangedParams, executionStoppingError);
+            if (field.itsError) std::rethrow_exception(field.itsError);
+            if (field.fUsed) gribRecordDatas.push_back(field.itsData.release());
+          }
+          catch (Reduced_ll_grib_exception &)
+          {
+            if (theGribFilterOptions.fIgnoreReducedLLData == false) throw;
+          }
+          catch (exception &e)
+          {
+            if (executionStoppingError)
+              throw;
+            else
+              cerr << "\nProblem with grib field " << NFmiStringTools::Convert(field.itsCounter)
+                   << ":" << e.what() << endl;
+          }
+          catch (...)
+          {
+            if (executionStoppingError)
+              throw;
+            else
+              cerr << "\nUnknown problem with grib field "
+                   << NFmiStringTools::Convert(field.itsCounter) << endl;
+          }
+        });
+
+    ::CreateQueryDatas(gribRecordDatas, theGribFilterOptions, &verticalCoordinateMap);
+
+    if (err) throw runtime_error(grib_get_error_message(err));
+  }
+  catch (...)
+  {
+    ::FreeDatas(gribRecordDatas);
+    throw;
+  }
+
+  ::FreeDatas(gribRecordDatas);
+}
+
+// Rinnakkainen purku otetaan kyttn vain -j optiolla, koska se vaatii sieturvallisesti
+// knnetyn grib_api:n. Verbose-tilassa kenttien tiedot tulostetaan purun aikana, joten silloin
+// puretaan aina yhdell sikeell, jotta tulosteet pysyvt luettavina.
+static unsigned int GetDecodingThreadCount(const GribFilterOptions &theGribFilterOptions)
+{
+  if (theGribFilterOptions.fVerbose || theGribFilterOptions.itsMaxThreadCount == 1) return 1;
+  unsigned int threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75);
+  if (theGribFilterOptions.itsMaxThreadCount > 0)
+    threadCount = std::min(threadCount, theGribFilterOptions.itsMaxThreadCount);
+  return std::max(threadCount, 1u);
+}
+
+// Kaksivaiheisen muunnoksen 1. kierros: kydn lpi vain gribien metatiedot ja kertn
+// hyvksyttyjen kenttien tiedot (ilman hila-arvoja) ja niiden jrjestysnumerot tiedostossa.
+static void ScanGribFieldInfos(GribFilterOptions &theGribFilterOptions,
+                               vector<GridRecordData *> &theGribRecordDatas,
+                               vector<int> &theGribRecordCounters,
+                               map<int, pair<double, double> > &theVerticalCoordinateMap)
+{
+  grib_handle *gribHandle = nullptr;
+  grib_context *gribContext = grib_context_get_default();
+  grib_multi_support_on(0);
+
+  int err = 0;
+  int counter = 0;
+  bool executionStoppingError = false;
+  map<unsigned long, pair<NFmiParam, NFmiParam> > changedParams;
+  map<unsigned long, NFmiParam> unchangedParams;
+
+  while ((gribHandle = grib_handle_new_from_file(
+              gribContext, theGribFilterOptions.itsInputFile, &err)) != nullptr)
+  {
+    if (err != GRIB_SUCCESS)
+    {
+      grib_handle_delete(gribHandle);
+      throw runtime_error("Failed to open grib handle in file  " +
+                          theGribFilterOptions.itsInputFileNameStr);
+    }
+
+    counter++;
+    if (theGribFilterOptions.fVerbose) cerr << counter << " ";
+    std::unique_ptr<GridRecordData> tmpData(new GridRecordData);
+    try
+    {
+      ::ReadGribFieldInfo(
+          gribHandle, tmpData.get(), theGribFilterOptions, theVerticalCoordinateMap);
+      ::ChangeParamSettingsIfNeeded(
+          theGribFilterOptions.itsParamChangeTable, tmpData.get(), theGribFilterOptions.fVerbose);
+      ::DoParamChecking(*tmpData, changedParams, unchangedParams, executionStoppingError);
+      if (::IsGribFieldWanted(gribHandle, tmpData.get(), theGribFilterOptions))
+      {
+        if (theGribFilterOptions.fVerbose)
+          cerr << static_cast<long>(tmpData->itsParam.GetParamIdent()) << endl;
+        theGribRecordDatas.push_back(tmpData.release());
+        theGribRecordCounters.push_back(counter);
+      }
+      else if (theGribFilterOptions.fVerbose)
+        cerr << static_cast<long>(tmpData->itsParam.GetParamIdent()) << " (skipped)" << endl;
+    }
+    catch (Reduced_ll_grib_exception &)
+    {
+      if (theGribFilterOptions.fIgnoreReducedLLData == false)
+      {
+        grib_handle_delete(gribHandle);
+        throw;
+      }
+    }
+    catch (exception &e)
+    {
+      if (executionStoppingError)
+      {
+        grib_handle_delete(gribHandle);
+        throw;
+      }
+      cerr << "\nProblem with grib field " << NFmiStringTools::Convert(counter) << ":" << e.what()
+           << endl;
+    }
+    catch (...)
+    {
+      if (executionStoppingError)
+      {
+        grib_handle_delete(gribHandle);
+        throw;
+      }
+      cerr << "\nUnknown problem with grib field " << NFmiStringTools::Convert(counter) << endl;
+    }
+    grib_handle_delete(gribHandle);
+  }
+
+  if (err) throw runtime_error(grib_get_error_message(err));
+}
+
+// Luo 1. kierroksen metatietojen perusteella lopulliset querydatat suoraan muistikartoitettuihin
+// tulostiedostoihin. Datat ja niiden tiedostonimet ovat samat kuin tavallisessa muunnoksessa,
+// paitsi jos jonkin kentn hila-arvojen purku eponnistuu 2. kierroksella: tavallisessa
+// muunnoksessa kentt jtetn pois ennen kuin descriptorit tehdn, mutta tss sen paikka on
+// jo varattu 1. kierroksen metatietojen perusteella ja j dataan puuttuvaksi.
+// Tiedostot luodaan tilapisill nimill, ja ne nimetn lopullisiksi vasta kun koko muunnos on
+// onnistunut (FinishMemoryMappedFiles), jotta keskeytynyt ajo ei jt vajaita tiedostoja.
+static void CreateMemoryMappedQueryDatas(vector<GridRecordData *> &theGribRecordDatas,
+                                         GribFilterOptions &theGribFilterOptions)
+{
+  if (theGribFilterOptions.fVerbose) cerr << "Creating memory mapped querydatas" << endl;
+  if (theGribRecordDatas.empty()) return;
+
+  vector<NFmiHPlaceDescriptor> hPlaceDescriptors =
+      GetAllHPlaceDescriptors(theGribRecordDatas, theGribFilterOptions.fUseOutputFile);
+  vector<NFmiVPlaceDescriptor> vPlaceDescriptors =
+      GetAllVPlaceDescriptors(theGribRecordDatas, theGribFilterOptions.fUseOutputFile);
+  vector<NFmiFastQueryInfo> innerInfos;
+  for (unsigned int j = 0; j < vPlaceDescriptors.size(); j++)
+  {
+    for (unsigned int i = 0; i < hPlaceDescriptors.size(); i++)
+    {
+      NFmiParamDescriptor params(GetParamDesc(
+          theGribRecordDatas, hPlaceDescriptors[i], vPlaceDescriptors[j], theGribFilterOptions));
+      NFmiTimeDescriptor times(
+          GetTimeDesc(theGribRecordDatas, hPlaceDescriptors[i], vPlaceDescriptors[j]));
+      if (params.Size() == 0 || times.Size() == 0) continue;
+      NFmiFastQueryInfo innerInfo(params, times, hPlaceDescriptors[i], vPlaceDescriptors[j]);
+      // Tavallisessa muunnoksessa data hyltn, jos siihen ei saatu tytetty yhtn kentt
+      for (size_t k = 0; k < theGribRecordDatas.size(); k++)
+      {
+        if (::SetGridRecordPosition(innerInfo, *theGribRecordDatas[k]))
+        {
+          innerInfos.push_back(innerInfo);
+          break;
+        }
+      }
+    }
+  }
+
+  vector<FmiLevelType> levelTypes;
+  for (size_t i = 0; i < innerInfos.size(); i++)
+  {
+    innerInfos[i].FirstLevel();
+    levelTypes.push_back(innerInfos[i].Level()->LevelType());
+  }
+  bool useDifferentFileNamesOnDifferentGrids = ::IsDifferentGridFileNamesUsed(levelTypes);
+
+  for (size_t i = 0; i < innerInfos.size(); i++)
+  {
+    string usedFileName = ::MakeOutputFileName(theGribFilterOptions,
+                                               static_cast<int>(i),
+                                               levelTypes[i],
+                                               innerInfos[i].Area(),
+                                               useDifferentFileNamesOnDifferentGrids);
+    string tmpFileName =
+        boost::filesystem::unique_path(usedFileName + ".%%%%-%%%%-%%%%-%%%%.tmp").string();
+    gMemoryMappedFileNames.push_back(make_pair(tmpFileName, usedFileName));
+    theGribFilterOptions.itsGeneratedDatas.push_back(boost::shared_ptr<NFmiQueryData>(
+        NFmiQueryDataUtil::CreateEmptyData(innerInfos[i], tmpFileName, true)));
+  }
+}
+
+// -M optio: nimetn onnistuneen muunnoksen tulostiedostot lopullisiksi tai poistetaan
+// eponnistuneen muunnoksen tilapiset tiedostot.
+static void FinishMemoryMappedFiles(GribFilterOptions &theGribFilterOptions, bool fSuccess)
+{
+  if (gMemoryMappedFileNames.empty()) return;
+
+  // Datat vapautetaan ensin, jotta muistikartoitukset puretaan ja tiedostot voi nimet uudelleen
+  theGribFilterOptions.itsGeneratedDatas.clear();
+  gTotalQDataCollector.clear();
+
+  string errorStr;
+  for (size_t i = 0; i < gMemoryMappedFileNames.size(); i++)
+  {
+    const string &tmpFileName = gMemoryMappedFileNames[i].first;
+    const string &fileName = gMemoryMappedFileNames[i].second;
+    if (!fSuccess || !errorStr.empty())
+      NFmiFileSystem::RemoveFile(tmpFileName);
+    else if (!NFmiFileSystem::RenameFile(tmpFileName, fileName))
+    {
+      errorStr = "could not rename " + tmpFileName + " to " + fileName;
+      NFmiFileSystem::RemoveFile(tmpFileName);
+    }
+  }
+  gMemoryMappedFileNames.clear();
+
+  if (!errorStr.empty()) throw runtime_error(errorStr);
+}
+
+// -M optio: kaksivaiheinen muunnos. 1. kierroksella luetaan vain metatiedot ja niiden avulla
+// tehdn valmiit muistikartoitetut tulosdatat. 2. kierroksella kentt puretaan rinnakkain ja
+// kirjoitetaan suoraan paikoilleen, jolloin muistissa on kerrallaan vain purettavana olevat kentt.
+static void ConvertGrib2QDataInTwoPasses(GribFilterOptions &theGribFilterOptions)
+{
+  vector<GridRecordData *> gribRecordDatas;
+  vector<int> gribRecordCounters;
+  map<int, pair<double, double> > verticalCoordinateMap;
+
+  try
+  {
+    ::ScanGribFieldInfos(
+        theGribFilterOptions, gribRecordDatas, gribRecordCounters, verticalCoordinateMap);
+    ::CreateMemoryMappedQueryDatas(gribRecordDatas, theGribFilterOptions);
+
+    vector<NFmiFastQueryInfo> infos;
+    for (size_t i = 0; i < theGribFilterOptions.itsGeneratedDatas.size(); i++)
+      infos.push_back(NFmiFastQueryInfo(theGribFilterOptions.itsGeneratedDatas[i].get()));
+
+    if (infos.empty() == false)
+    {
+      if (theGribFilterOptions.fVerbose) cerr << "Filling qdata grids" << endl;
+      ::rewind(theGribFilterOptions.itsInputFile);
+      size_t recordIndex = 0;
+      ::DecodeGribMessagesInParallel(
+          theGribFilterOptions,
+          ::GetDecodingThreadCount(theGribFilterOptions),
+          [&](DecodedGribField &field) {
+            if (recordIndex >= gribRecordCounters.size() ||
+                field.itsCounter != gribRecordCounters[recordIndex])
+              return;  // kentt hylttiin jo 1. kierroksella
+            recordIndex++;
+            if (field.fUsed == false)
+            {
+              // Hila-arvojen purku eponnistui. Descriptorit on jo tehty 1. kierroksen
+              // metatiedoista, joten kentn kohta j dataan puuttuvaksi (tavallisessa
+              // muunnoksessa kentt jisi kokonaan pois).
+              string errorStr("values could not be decoded");
+              try
+              {
+                if (field.itsError) std::rethrow_exception(field.itsError);
+              }
+              catch (exception &e)
+              {
+                errorStr = e.what();
+              }
+              catch (...)
+              {
+              }
+              cerr << "\nProblem with grib field " << NFmiStringTools::Convert(field.itsCounter)
+                   << ":" << errorStr << endl;
+              return;
+            }
+            for (size_t i = 0; i < infos.size(); i++)
+            {
+              if (::SetGridRecordPosition(infos[i], *field.itsData))
+              {
+                if (!infos[i].SetValues(field.itsData->itsGridData))
+                  throw runtime_error("qdatan tytt gribi datalla eponnistui, lopetetaan...");
+              }
+            }
+          });
+    }
+
+    ::CalcHybridPressureData(theGribFilterOptions.itsGeneratedDatas,
+                             verticalCoordinateMap,
+                             theGribFilterOptions.itsHybridPressureInfo);
+  }
+  catch (...)
+  {
+    ::FreeDatas(gribRecordDatas);
+    throw;
+  }
+
+  ::FreeDatas(gribRecordDatas);
+}
+
 void ConvertGrib2QData(GribFilterOptions &theGribFilterOptions)
 {
+  if (theGribFilterOptions.fUseMemoryMappedOutput)
+  {
+    ::ConvertGrib2QDataInTwoPasses(theGribFilterOptions);
+    return;
+  }
+
+  unsigned int threadCount = ::GetDecodingThreadCount(theGribFilterOptions);
+  if (threadCount > 1)
+  {
+    ::ConvertGrib2QDataInParallel(theGribFilterOptions, threadCount);
+    return;
+  }
+
   vector<GridRecordData *> gribRecordDatas;
   bool executionStoppingError = false;
   map<int, pair<double, double> > verticalCoordinateMap;
@@ -3364,22 +4118,9 @@ void ConvertGrib2QData(GribFilterOptions &theGribFilterOptions)
 
       if (theGribFilterOptions.fVerbose) cerr << counter << " ";
       GridRecordData *tmpData = new GridRecordData;
-
-      theGribFilterOptions.fDoYAxisFlip = jscan_is_negative(gribHandle);
-
-      tmpData->itsLatlonCropRect = theGribFilterOptions.itsLatlonCropRect;
       try
       {
-        // param ja level tiedot pit hanskata ennen hilan koon mrityst
-        //                PrintAllParamInfo_forDebugging(gribHandle);
-        tmpData->itsParam = ::GetParam(gribHandle, theGribFilterOptions.itsWantedSurfaceProducer);
-        tmpData->itsLevel = ::GetLevel(gribHandle);
-        ::FillGridInfoFromGribHandle(
-            gribHandle, tmpData, theGribFilterOptions, theGribFilterOptions.itsGridSettings);
-        tmpData->itsOrigTime = ::GetOrigTime(gribHandle);
-        tmpData->itsValidTime = ::GetValidTime(gribHandle);
-        tmpData->itsMissingValue = ::GetMissingValue(gribHandle);
-        ::GetLevelVerticalCoordinates(gribHandle, *tmpData, verticalCoordinateMap);
+        ::ReadGribFieldInfo(gribHandle, tmpData, theGribFilterOptions, verticalCoordinateMap);
 
         if (theGribFilterOptions.fVerbose)
         {
@@ -3393,40 +4134,13 @@ void ConvertGrib2QData(GribFilterOptions &theGribFilterOptions)
 
         ::DoParamChecking(*tmpData, changedParams, unchangedParams, executionStoppingError);
 
-        // filtteri jtt huomiotta ns. kontrolli hilan, joka on ainakin hirlam datassa 1.. se on
-        // muista poikkeava 2x2 hila latlon-area.
-        // Aiheuttaisi turhia ongelmia jatkossa monessakin paikassa.
         bool gribFieldUsed = false;
-        if (!(tmpData->itsOrigGrid.itsNX <= 2 && tmpData->itsOrigGrid.itsNY <= 2))
+        if (::IsGribFieldWanted(gribHandle, tmpData, theGribFilterOptions))
         {
-          if (::IgnoreThisLevel(tmpData, theGribFilterOptions.itsIgnoredLevelList) == false)
-          {
-            if (::AcceptThisLevelType(tmpData, theGribFilterOptions.itsAcceptOnlyLevelTypes))
-            {
-              if (::CropParam(tmpData,
-                              theGribFilterOptions.fCropParamsNotMensionedInTable,
-                              theGribFilterOptions.itsParamChangeTable) == false)
-              {
-                if (::IsStepRangeCorrect(gribHandle,
-                                         tmpData->itsParam,
-                                         theGribFilterOptions.itsStepRangeCheckedParams,
-                                         theGribFilterOptions.itsWantedStepRange))
-                {
-                  ::FillGridData(gribHandle, tmpData, theGribFilterOptions);
-                  gribRecordDatas.push_back(tmpData);  // taman voisi optimoida, luomalla aluksi
-                                                       // niin iso vektori kuin tarvitaan
-                  gribFieldUsed = true;
-                }
-                else
-                {
-                  if (theGribFilterOptions.fVerbose)
-                  {
-                    cerr << "\nWarning: Parameter was discarded due stepRange check" << endl;
-                  }
-                }
-              }
-            }
-          }
+          ::FillGridData(gribHandle, tmpData, theGribFilterOptions);
+          gribRecordDatas.push_back(tmpData);  // taman voisi optimoida, luomalla aluksi
+                                               // niin iso vektori kuin tarvitaan
+          gribFieldUsed = true;
         }
         if (gribFieldUsed == false)
         {
@@ -4723,6 +5437,12 @@ static void MakeTotalCombineQDatas(
         theTotalQDataCollector;  // Jos vain yhdest grib-tiedostosta dataa, laitetaan ne
                                  // sellaisenaan output-datoiksi
   }
+  else if (theGribFilterOptionsOut.fUseMemoryMappedOutput)
+  {
+    // -M optio: datat ovat jo muistikartoitetuissa tulostiedostoissa, joten niist ei tehd
+    // kokooma-datoja, vaan ne talletetaan sellaisenaan ja RH lasketaan suoraan niihin.
+    theGribFilterOptionsOut.itsGeneratedDatas = theTotalQDataCollector;
+  }
   else
   {  // Jos useita grib-lhteit, yritetn muodostaan tss niist kokooma-qdatoja.
     // Tss luodaan luultavasti aikayhdistelmi, jos lhde gribit ovat olleet per aika-askel
@@ -4776,38 +5496,44 @@ static int BuildAndStoreAllDatas(vector<string> &theFileList,
                                  GribFilterOptions &theGribFilterOptions)
 {
   size_t fileCount = theFileList.size();
+  if (theGribFilterOptions.fUseMemoryMappedOutput &&
+      (fileCount > 1 || theGribFilterOptions.fTryAreaCombination))
+  {
+    // Useiden tiedostojen datat ja alueyhdistelmt tehdn vasta lopuksi uusiksi datoiksi, joten
+    // niit ei voi purkaa suoraan tulostiedostoihin.
+    cerr << "Warning: option -M works only with one input file and without -C, using normal "
+            "conversion"
+         << endl;
+    theGribFilterOptions.fUseMemoryMappedOutput = false;
+  }
+
+  // Tiedostot muunnetaan perkkin, vain yhden tiedoston kenttien purku voi olla rinnakkaista
   try
   {
-    for (size_t i = 0; i < fileCount; i++)
-      ::ConvertSingleGribFile(theGribFilterOptions, theFileList[i]);
+    try
+    {
+      for (size_t i = 0; i < fileCount; i++)
+        ::ConvertSingleGribFile(theGribFilterOptions, theFileList[i]);
+    }
+    catch (Reduced_ll_grib_exception &)
+    {  // wgrib-kirjastoa kytetn vain jos grib_api ei hanskaa dataa (kuten reduced_ll dataa)
+      theGribFilterOptions.fUseMemoryMappedOutput = false;  // wgrib-muunnos tehdn muistissa
+      for (size_t i = 0; i < fileCount; i++)
+        wgrib2qd::ConvertSingleGribFile(theGribFilterOptions, theFileList[i]);
+    }
+
+    ::MakeTotalCombineQDatas(gTotalQDataCollector, theGribFilterOptions);
+    ::StoreQueryDatas(theGribFilterOptions);
   }
-  catch (Reduced_ll_grib_exception &)
-  {  // wgrib-kirjastoa kytetn vain jos grib_api ei hanskaa dataa (kuten reduced_ll dataa)
-    for (size_t i = 0; i < fileCount; i++)
-      wgrib2qd::ConvertSingleGribFile(theGribFilterOptions, theFileList[i]);
+  catch (...)
+  {
+    ::FinishMemoryMappedFiles(theGribFilterOptions, false);
+    throw;
   }
 
-  /* // Multi-threaddaava versio ei toimi, koska grib_api ei ilmeisesti toimi, jos kydn lpi
-     samaan aikaan useita grib-tiedostoja
-          for(size_t i=0; i < fileCount; )
-          {
-                  boost::thread_group calcFiles;
-                  calcFiles.add_thread(new boost::thread(::ConvertSingleGribFile,
-     theGribFilterOptions, theFileList[i++]));
-                  if(i < fileCount)
-                          calcFiles.add_thread(new boost::thread(::ConvertSingleGribFile,
-     theGribFilterOptions, theFileList[i++]));
-                  if(i < fileCount)
-                          calcFiles.add_thread(new boost::thread(::ConvertSingleGribFile,
-     theGribFilterOptions, theFileList[i++]));
-                  if(i < fileCount)
-                          calcFiles.add_thread(new boost::thread(::ConvertSingleGribFile,
-     theGribFilterOptions, theFileList[i++]));
-                  calcFiles.join_all(); // odotetaan ett threadit lopettavat
-          }
-  */
-  ::MakeTotalCombineQDatas(gTotalQDataCollector, theGribFilterOptions);
-  ::StoreQueryDatas(theGribFilterOptions);
+  ::FinishMemoryMappedFiles(theGribFilterOptions,
+                            theGribFilterOptions.fUseMemoryMappedOutput &&
+                                theGribFilterOptions.itsReturnStatus == 0);
 
   return theGribFilterOptions.itsReturnStatus;
 }
@@ -4841,7 +5567,16 @@ void Usage(void)
        << "\t-S   Swap left and right hand halves in the data" << endl
        << "\t-n   Names output files by level type. E.g. output.sqd_levelType_100" << endl
        << "\t-t   Reports run-time to the stderr at the end of execution" << endl
-       << "\t-v   verbose mode" << endl
+       << "\t-v   verbose mode (grib fields are then decoded in one thread)" << endl
+       << "\t-j <threads>\tMaximum number of threads used in grib decoding" << endl
+       << "\t\t(default: 1, 0 = a reasonable number). Parallel decoding" << endl
+       << "\t\trequires a thread-safe grib_api build." << endl
+       << "\t-M   Convert in two passes: scan the grib metadata first and then" << endl
+       << "\t\tdecode the fields directly into memory mapped output files." << endl
+       << "\t\tSaves memory with large files. Requires -o and works with one" << endl
+       << "\t\tinput file without -C, otherwise normal conversion is used." << endl
+       << "\t\tFields whose values fail to decode are left missing in the" << endl
+       << "\t\toutput instead of being dropped." << endl
        << "\t-C   try to combine larger areas" << endl
        << "\t-z   read data lines in zig-zag fashion, starting left to rigth" << endl
        << "\t-i   Ignore reduced_ll data, keep using grib_api for conversion" << endl
@@ -5038,6 +5773,17 @@ static int GetOptions(NFmiCmdLine &theCmdLine, GribFilterOptions &theGribFilterO
 
   if (theCmdLine.isOption('v')) theGribFilterOptions.fVerbose = true;
 
+  if (theCmdLine.isOption('M'))
+  {
+    if (theGribFilterOptions.fUseOutputFile == false)
+      throw runtime_error("Option -M requires an output filename (-o)");
+    theGribFilterOptions.fUseMemoryMappedOutput = true;
+  }
+
+  if (theCmdLine.isOption('j'))
+    theGribFilterOptions.itsMaxThreadCount =
+        std::max(::GetIntegerOptionValue(theCmdLine, 'j'), 0);
+
   ::GetStepRangeOptions(theCmdLine, theGribFilterOptions);
 
   return 0;  // 0 on ok paluuarvo
@@ -5048,7 +5794,7 @@ int Run(int argc, const char **argv, bool &fReportExecutionTime)
   // Optiot:
   GribFilterOptions gribFilterOptions;
 
-  NFmiCmdLine cmdline(argc, argv, "o!m!l!g!p!aASnL!G!c!dvP!D!tH!r!yzCiR!");
+  NFmiCmdLine cmdline(argc, argv, "o!m!l!g!p!aASnL!G!c!dvP!D!tH!r!yzCiR!j!M");
 
   // Jonkin nist avulla muodostetaan lista, jossa voi olla 0-n kpl tiedoston nimi.
   if (::DoCommandLineCheck(cmdline) == false) return 1;
@@ -18,6 +18,7 @@
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <macgyver/StringConversion.h>
 #include <macgyver/TimeParser.h>
 #include <newbase/NFmiAreaFactory.h>
@@ -35,6 +36,7 @@
 #include <newbase/NFmiTimeDescriptor.h>
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiVPlaceDescriptor.h>
+#include <exception>
 #include <iostream>
 #include <numeric>
 #include <string>
@@ -48,6 +50,10 @@
 
 NFmiEnumConverter converter;
 
+// HDF5 reads are serialized, datasets are otherwise copied in parallel
+
+boost::mutex hdf_mutex;
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Container for command line options
@@ -1451,6 +1457,96 @@ double apply_gain_offset(double value,
   return value;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Numeric transformation of dataset values
+ *
+ * The optional nodata, undetect, gain and offset settings are resolved
+ * once so that whole rows can be converted in a tight loop. The results
+ * are identical to those of apply_gain_offset.
+ */
+// ----------------------------------------------------------------------
+
+class ValueTransform
+{
+ public:
+  ValueTransform(const boost::optional<double> &nodata,
+                 const boost::optional<double> &undetect,
+                 const boost::optional<double> &gain,
+                 const boost::optional<double> &offset)
+      : itsHasNodata(static_cast<bool>(nodata)),
+        itsHasUndetect(static_cast<bool>(undetect)),
+        itsHasGain(static_cast<bool>(gain)),
+        itsHasOffset(static_cast<bool>(offset)),
+        itsNodata(nodata ? *nodata : 0),
+        itsUndetect(undetect ? *undetect : 0),
+        itsGain(gain ? *gain : 1),
+        itsOffset(offset ? *offset : 0),
+        itsUndetectValue(static_cast<float>(apply_gain_offset(0, gain, offset)))
+  {
+  }
+
+  float operator()(int value) const
+  {
+    if (itsHasNodata && value == itsNodata) return kFloatMissing;
+    if (itsHasUndetect && value == itsUndetect) return itsUndetectValue;
+    double result = value;
+    if (itsHasGain) result *= itsGain;
+    if (itsHasOffset) result += itsOffset;
+    return static_cast<float>(result);
+  }
+
+  void operator()(const int *values, std::size_t count, float *result) const
+  {
+    for (std::size_t i = 0; i < count; i++)
+      result[i] = (*this)(values[i]);
+  }
+
+ private:
+  bool itsHasNodata;
+  bool itsHasUndetect;
+  bool itsHasGain;
+  bool itsHasOffset;
+  double itsNodata;
+  double itsUndetect;
+  double itsGain;
+  double itsOffset;
+  float itsUndetectValue;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy grid values into the active param, level and time
+ *
+ * The HDF5 grid is upside down compared to newbase, hence the rows
+ * are copied in reverse order.
+ */
+// ----------------------------------------------------------------------
+
+void copy_grid(NFmiFastQueryInfo &info,
+               const std::vector<int> &values,
+               const ValueTransform &transform)
+{
+  const unsigned long width = info.Grid()->XNumber();
+  const unsigned long height = info.Grid()->YNumber();
+
+  if (values.size() < width * height)
+    throw std::runtime_error("Dataset size does not match the size of the grid");
+
+  const std::size_t idx = info.Index(info.ParamIndex(), 0, info.LevelIndex(), info.TimeIndex());
+  const std::size_t step =
+      info.Index(info.ParamIndex(), 1, info.LevelIndex(), info.TimeIndex()) - idx;
+
+  std::vector<float> row(width);
+
+  for (unsigned long j = 0; j < height; j++)
+  {
+    transform(&values[width * (height - j - 1)], width, &row[0]);
+    if (!info.SetValues(idx + j * width * step, step, width, row))
+      throw std::runtime_error("Failed to copy values into the output querydata");
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Copy one dataset
@@ -1459,6 +1555,8 @@ double apply_gain_offset(double value,
 
 void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
 {
+  boost::unique_lock<boost::mutex> hdf_lock(hdf_mutex);
+
   std::string prefix = options.datasetname + boost::lexical_cast<std::string>(datanum);
 
   // Set level
@@ -1514,33 +1612,9 @@ void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
       if (H5Lite::readVectorDataset(hid, iprefix + "/data", values) != 0)
         throw std::runtime_error("Failed to read " + iprefix + "/data");
 
-      const unsigned long width = info.Grid()->XNumber();
-      const unsigned long height = info.Grid()->YNumber();
-
-      unsigned long pos = 0;
-
-      for (info.ResetLocation(); info.NextLocation();)
-      {
-        // Newbase grid location
-        unsigned long i = pos % width;
-        unsigned long j = pos / width;
-        // HDF5 grid location is inverted
-        j = height - j - 1;
-        // Respective vector position
-        unsigned long k = i + width * j;
-
-        // And copy the value
-        int value = values[k];
-
-        if (nodata && value == *nodata)
-          info.FloatValue(kFloatMissing);
-        else if (undetect && value == *undetect)
-          info.FloatValue(apply_gain_offset(0, gain, offset));
-        else
-          info.FloatValue(apply_gain_offset(value, gain, offset));
-
-        ++pos;
-      }
+      hdf_lock.unlock();
+      copy_grid(info, values, ValueTransform(nodata, undetect, gain, offset));
+      hdf_lock.lock();
     }
   }
   else
@@ -1589,53 +1663,8 @@ void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
     if (H5Lite::readVectorDataset(hid, prefix + "/data", values) != 0)
       throw std::runtime_error("Failed to read " + prefix + "/data");
 
-      // Copy values into querydata. Unfortunately a simple loop
-      // will not do, the data would go upside down. Hence we need
-      // to index the data directly.
-
-#if 1
-    const unsigned long width = info.Grid()->XNumber();
-    const unsigned long height = info.Grid()->YNumber();
-
-    unsigned long pos = 0;
-
-    for (info.ResetLocation(); info.NextLocation();)
-    {
-      // Newbase grid location
-      unsigned long i = pos % width;
-      unsigned long j = pos / width;
-      // HDF5 grid location is inverted
-      j = height - j - 1;
-      // Respective vector position
-      unsigned long k = i + width * j;
-
-      // And copy the value
-      int value = values[k];
-
-      if (nodata && value == *nodata)
-        info.FloatValue(kFloatMissing);
-      else if (undetect && value == *undetect)
-        info.FloatValue(apply_gain_offset(0, gain, offset));
-      else
-        info.FloatValue(apply_gain_offset(value, gain, offset));
-
-      ++pos;
-    }
-#else
-    // Does not work
-    info.ResetLocation();
-
-    BOOST_FOREACH (int value, values)
-    {
-      info.NextLocation();
-      if (nodata && value == *nodata)
-        info.FloatValue(kFloatMissing);
-      else if (undetect && value == *undetect)
-        info.FloatValue(apply_gain_offset(0, gain, offset));
-      else
-        info.FloatValue(apply_gain_offset(value, gain, offset));
-    }
-#endif
+    hdf_lock.unlock();
+    copy_grid(info, values, ValueTransform(nodata, undetect, gain, offset));
   }
 }
 
@@ -1647,6 +1676,8 @@ void copy_dataset(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
 
 void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
 {
+  boost::unique_lock<boost::mutex> hdf_lock(hdf_mutex);
+
   std::string prefix = options.datasetname + boost::lexical_cast<std::string>(datanum);
 
   // Set time
@@ -1708,6 +1739,10 @@ void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
   if (H5Lite::readVectorDataset(hid, prefix + "/data1/data", values) != 0)
     throw std::runtime_error("Failed to read " + prefix + "/data");
 
+  hdf_lock.unlock();
+
+  const ValueTransform transform(nodata, undetect, gain, offset);
+
   // Center location in meters
 
   NFmiPoint center = info.Area()->LatLonToWorldXY(NFmiPoint(lon, lat));
@@ -1741,14 +1776,7 @@ void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
       if (info.NearestPoint(latlon))
       {
         // And copy the value
-        int value = values[ray * nbins + bin];
-
-        if (nodata && value == *nodata)
-          info.FloatValue(kFloatMissing);
-        else if (undetect && value == *undetect)
-          info.FloatValue(apply_gain_offset(0, gain, offset));
-        else
-          info.FloatValue(apply_gain_offset(value, gain, offset));
+        info.FloatValue(transform(values[ray * nbins + bin]));
       }
       else
         std::runtime_error("Internal error when projecting PVOL data to cartesian coordinates");
@@ -1765,18 +1793,61 @@ void copy_dataset_pvol(const hid_t &hid, NFmiFastQueryInfo &info, int datanum)
  */
 // ----------------------------------------------------------------------
 
+void copy_datasets_in_thread(const hid_t &hid,
+                             const NFmiFastQueryInfo &info,
+                             bool pvol,
+                             NFmiTimeIndexCalculator &calculator,
+                             std::exception_ptr &error)
+{
+  // Each thread activates the params, levels and times in its own info
+  NFmiFastQueryInfo threadinfo(info);
+
+  unsigned long datanum = 0;
+  while (calculator.GetCurrentTimeIndex(datanum))
+  {
+    try
+    {
+      if (pvol)
+        copy_dataset_pvol(hid, threadinfo, static_cast<int>(datanum));
+      else
+        copy_dataset(hid, threadinfo, static_cast<int>(datanum));
+    }
+    catch (...)
+    {
+      boost::lock_guard<boost::mutex> lock(hdf_mutex);
+      if (!error) error = std::current_exception();
+      return;
+    }
+  }
+}
+
 void copy_datasets(const hid_t &hid, NFmiFastQueryInfo &info)
 {
   std::string obj = get_attribute_value<std::string>(hid, "/what", "object");
 
   const int n = count_datasets(hid);
-  for (int i = 1; i <= n; i++)
-  {
-    if (obj == "PVOL")
-      copy_dataset_pvol(hid, info, i);
-    else
-      copy_dataset(hid, info, i);
-  }
+  if (n <= 0) return;
+
+  // Verbose output is kept in order by using a single thread
+
+  unsigned int threadcount = 1;
+  if (!options.verbose)
+    threadcount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75, n);
+
+  NFmiTimeIndexCalculator calculator(1, n);
+  std::exception_ptr error;
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadcount; i++)
+    threads.add_thread(new boost::thread(copy_datasets_in_thread,
+                                         boost::cref(hid),
+                                         boost::cref(info),
+                                         obj == "PVOL",
+                                         boost::ref(calculator),
+                                         boost::ref(error)));
+  threads.join_all();
+
+  if (error) std::rethrow_exception(error);
 }
 
 // ----------------------------------------------------------------------
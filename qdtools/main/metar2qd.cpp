@@ -32,6 +32,7 @@ RJTT 242030Z 36010KT 6000 -RA FEW007 SCT010 BKN015 12/11 Q1008 RMK
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiFastQueryInfo.h>
@@ -44,6 +45,8 @@ RJTT 242030Z 36010KT 6000 -RA FEW007 SCT010 BKN015 12/11 Q1008 RMK
 #include <newbase/NFmiTimeList.h>
 #include <smarttools/NFmiAviationStationInfoSystem.h>
 
+#include "MessageDecoder.h"
+
 extern "C"
 {
 #include "metar_structs.h"
@@ -230,6 +233,58 @@ struct MetarData
   bool fIsCorrected;
 };
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Order METAR data by station and time
+ *
+ * The sort is stable, hence messages for the same station and time
+ * stay in input order and corrections are applied as before.
+ */
+// ----------------------------------------------------------------------
+
+struct MetarCellLess
+{
+  bool operator()(const MetarData &theData1, const MetarData &theData2) const
+  {
+    if (theData1.itsStationId != theData2.itsStationId)
+      return theData1.itsStationId < theData2.itsStationId;
+    return theData1.itsTime < theData2.itsTime;
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decoded METAR data of one file
+ */
+// ----------------------------------------------------------------------
+
+struct MetarBuffer
+{
+  vector<MetarData> itsDataBlocks;  // sorted by MetarCellLess
+  vector<string> itsIcaoNames;      // sorted and unique
+  vector<NFmiMetTime> itsTimes;     // sorted and unique
+  std::set<std::string> itsIcaoIdUnknownSet;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sort the data of one file and collect its stations and times
+ */
+// ----------------------------------------------------------------------
+
+static void SortMetarBuffer(MetarBuffer &theBuffer)
+{
+  const vector<MetarData> &dataBlocks = theBuffer.itsDataBlocks;
+  for (size_t i = 0; i < dataBlocks.size(); i++)
+  {
+    theBuffer.itsIcaoNames.push_back(dataBlocks[i].itsIcaoName);
+    theBuffer.itsTimes.push_back(dataBlocks[i].itsTime);
+  }
+  MessageDecoder::SortUnique(theBuffer.itsIcaoNames);
+  MessageDecoder::SortUnique(theBuffer.itsTimes);
+  std::stable_sort(theBuffer.itsDataBlocks.begin(), theBuffer.itsDataBlocks.end(), MetarCellLess());
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Extract time information
@@ -330,15 +385,11 @@ static bool ConvertTimeList2TimeBag(NFmiTimeList &theTimeList, NFmiTimeBag &theT
  */
 // ----------------------------------------------------------------------
 
-static NFmiTimeDescriptor MakeTimeDesc(const vector<MetarData> &dataBlocks)
+static NFmiTimeDescriptor MakeTimeDesc(const vector<NFmiMetTime> &times)
 {
-  set<NFmiMetTime> times;  // ker eri ajat settiin ensin, sitten tee timelist jne.
-  for (size_t i = 0; i < dataBlocks.size(); i++)
-    times.insert(dataBlocks[i].itsTime);
-
   // Tehdaan aluksi timelist, koska se on helpompi,
   NFmiTimeList timeList;
-  set<NFmiMetTime>::iterator it = times.begin();
+  vector<NFmiMetTime>::const_iterator it = times.begin();
   if (it != times.end())
   {
     NFmiMetTime origTime(*it);
@@ -367,14 +418,10 @@ static NFmiTimeDescriptor MakeTimeDesc(const vector<MetarData> &dataBlocks)
 // ----------------------------------------------------------------------
 
 static NFmiHPlaceDescriptor MakeHPlaceDesc(NFmiAviationStationInfoSystem &theStationInfoSystem,
-                                           const vector<MetarData> &dataBlocks)
+                                           const vector<string> &icaoNames)
 {
-  set<string> icaoStrSet;  // ker eri icao tunnukset settiin ensin, sitten tee locationbag jne.
-  for (size_t i = 0; i < dataBlocks.size(); i++)
-    icaoStrSet.insert(dataBlocks[i].itsIcaoName);
-
   NFmiLocationBag locations;
-  for (set<string>::iterator it = icaoStrSet.begin(); it != icaoStrSet.end(); ++it)
+  for (vector<string>::const_iterator it = icaoNames.begin(); it != icaoNames.end(); ++it)
   {
     NFmiAviationStation *aviationStation = theStationInfoSystem.FindStation(*it);
     if (aviationStation)
@@ -413,13 +460,23 @@ static void FillInfoFromMetarData(NFmiFastQueryInfo &info, const vector<MetarDat
   int paramErrorCount = 0;
   int stationErrorCount = 0;
   info.First();
+
+  // The data is sorted by station, hence the station is searched only when it changes
+  unsigned long lastStationId = 0;
+  bool stationFound = false;
+
   for (size_t i = 0; i < datas.size(); i++)
   {
     const MetarData &data = datas[i];
     bool correctedOverRide = data.fIsCorrected;
     if (info.Time(data.itsTime))
     {
-      if (info.Location(data.itsStationId))
+      if (i == 0 || data.itsStationId != lastStationId)
+      {
+        stationFound = info.Location(data.itsStationId);
+        lastStationId = data.itsStationId;
+      }
+      if (stationFound)
       {
         for (size_t j = 0; j < data.itsParamIds.size(); j++)
         {
@@ -471,11 +528,12 @@ static void FillInfoFromMetarData(NFmiFastQueryInfo &info, const vector<MetarDat
 
 static NFmiQueryInfo MakeQueryInfo(NFmiParamDescriptor &params,
                                    NFmiAviationStationInfoSystem &theStationInfoSystem,
-                                   const vector<MetarData> &dataBlocks)
+                                   const vector<string> &icaoNames,
+                                   const vector<NFmiMetTime> &times)
 {
-  NFmiTimeDescriptor times(::MakeTimeDesc(dataBlocks));
-  NFmiHPlaceDescriptor hplace(::MakeHPlaceDesc(theStationInfoSystem, dataBlocks));
-  NFmiQueryInfo info(params, times, hplace, NFmiVPlaceDescriptor());
+  NFmiTimeDescriptor timeDesc(::MakeTimeDesc(times));
+  NFmiHPlaceDescriptor hplace(::MakeHPlaceDesc(theStationInfoSystem, icaoNames));
+  NFmiQueryInfo info(params, timeDesc, hplace, NFmiVPlaceDescriptor());
   return info;
 }
 
@@ -487,9 +545,11 @@ static NFmiQueryInfo MakeQueryInfo(NFmiParamDescriptor &params,
 
 static NFmiQueryData *MakeQueryDataFromBlocks(NFmiParamDescriptor &params,
                                               NFmiAviationStationInfoSystem &theStationInfoSystem,
-                                              const vector<MetarData> &dataBlocks)
+                                              const vector<MetarData> &dataBlocks,
+                                              const vector<string> &icaoNames,
+                                              const vector<NFmiMetTime> &times)
 {
-  NFmiQueryInfo info = ::MakeQueryInfo(params, theStationInfoSystem, dataBlocks);
+  NFmiQueryInfo info = ::MakeQueryInfo(params, theStationInfoSystem, icaoNames, times);
   NFmiQueryData *data = NFmiQueryDataUtil::CreateEmptyData(info);
   if (!data)
     throw runtime_error(
@@ -530,6 +590,7 @@ void Usage(const std::string &theExecutableName)
        << endl
        << "\t-n <NOAA-format=false>\tTry reading NOAA metar format files." << endl
        << "\t-W \tDon't create Wind combined parameter to result data." << endl
+       << "\t-j threads\tNumber of decoding threads (default=0, use most of the cores)." << endl
        << endl;
 }
 
@@ -625,6 +686,16 @@ static bool IsMetarNilOrEmptyReport(const string &str)
  */
 // ----------------------------------------------------------------------
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Serializes calls to decode_metar
+ *
+ * The DcdMETAR library tokenizes with strtok and is not thread safe.
+ */
+// ----------------------------------------------------------------------
+
+static boost::mutex gDecodeMetarMutex;
+
 static const int MDSP_missing_int = MAXINT;
 static const float MDSP_missing_float = static_cast<float>(MAXINT);
 
@@ -1122,13 +1193,10 @@ static void FillMetarDataWeatherSection(MetarData &data,
                                         const string &theMetarStr,
                                         const string &theMetarFileName)
 {
+  // Files are decoded in parallel, the tables are initialized only once in a thread safe manner
   static map<string, float> ww_symbols;
-  static bool ww_symbols_initialized = false;
-  if (ww_symbols_initialized == false)
-  {
-    ww_symbols_initialized = true;
-    ::InitWWSymbols(ww_symbols);
-  }
+  static const bool ww_symbols_initialized = (::InitWWSymbols(ww_symbols), true);
+  (void)ww_symbols_initialized;
 
   ::FillMetarDataWeatherSection2(data,
                                  ww_symbols,
@@ -1272,12 +1340,9 @@ static void FillMetarDataCloudSection(MetarData &data,
 {
   static map<string, float> cloudCover_symbols;
   static map<string, float> cloudType_symbols;
-  static bool cloud_symbols_initialized = false;
-  if (cloud_symbols_initialized == false)
-  {
-    cloud_symbols_initialized = true;
-    ::InitCloudSymbols(cloudCover_symbols, cloudType_symbols);
-  }
+  static const bool cloud_symbols_initialized =
+      (::InitCloudSymbols(cloudCover_symbols, cloudType_symbols), true);
+  (void)cloud_symbols_initialized;
 
   ::FillMetarDataCloudSection2(data,
                                cloudCover_symbols,
@@ -1341,8 +1406,12 @@ static void DecodeMetar(NFmiAviationStationInfoSystem &theStationInfoSystem,
     return;
 
   Decoded_METAR metarStruct;
-  if (decode_metar(const_cast<char *>(theMetarStr.c_str()), &metarStruct) ==
-      0)  // DcdMETAR palauttaa 0:n jos ok
+  int decodeStatus = 0;
+  {
+    boost::mutex::scoped_lock lock(gDecodeMetarMutex);
+    decodeStatus = decode_metar(const_cast<char *>(theMetarStr.c_str()), &metarStruct);
+  }
+  if (decodeStatus == 0)  // DcdMETAR palauttaa 0:n jos ok
   {
     string icaoStr = metarStruct.stnid;
     NFmiAviationStation *aviationStation = theStationInfoSystem.FindStation(icaoStr);
@@ -1779,7 +1848,7 @@ void run(int argc, const char *argv[])
   // HUOM!! VC++ 2012 (Update 3) -versiolla x64-debug versio toimii debuggerissa ihan oudosti,
   // ohjelman steppaus ei mene oikein (win32 debug kyttytyy oikein).
   // Ohjelma tuottaa kuitenkin oikean tuloksen kaikilla kombinaatioilla win32/x64 + debug/release
-  NFmiCmdLine cmdline(argc, argv, "s!vFr!nW");
+  NFmiCmdLine cmdline(argc, argv, "s!vFr!nWj!");
 
   // Tarkistetaan optioiden oikeus:
   if (cmdline.Status().IsError())
@@ -1844,6 +1913,10 @@ void run(int argc, const char *argv[])
   bool makeTotalWindParameter = true;  // Oletuksena luodaan TotalWind parametri
   if (cmdline.isOption('W')) makeTotalWindParameter = false;
 
+  unsigned int threadCount = 0;
+  if (cmdline.isOption('j'))
+    threadCount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   //	1. Lue n kpl filefiltereit listaan
   vector<string> fileFilterList;
   for (int i = 1; i <= numOfParams; i++)
@@ -1857,42 +1930,71 @@ void run(int argc, const char *argv[])
 
   metarfiles = SortMetarFiles(metarfiles);
 
-  // Process them
+  // Process them in parallel, each file into a buffer of its own
+
+  vector<string> filenames(metarfiles.begin(), metarfiles.end());
+  vector<MetarBuffer> buffers(filenames.size());
+
+  MessageDecoder::Decode(
+      filenames.size(),
+      [&](unsigned long i)
+      {
+        const string &filename = filenames[i];
+        MetarBuffer &buffer = buffers[i];
+        if (fVerboseMode)
+          std::cerr << "Processing file no: " + NFmiStringTools::Convert(i + 1) + " (" + filename +
+                           ")\n";
+        bool noaaFormatRead = false;
+        if (tryNoaaFileFormat)
+          noaaFormatRead = ::DoNoaaFormatRead(stationInfoSystem,
+                                              buffer.itsDataBlocks,
+                                              filename,
+                                              timeRoundingResolution,
+                                              buffer.itsIcaoIdUnknownSet);
+        if (!noaaFormatRead)
+        {
+          string metarFileContent;
+          if (NFmiFileSystem::ReadFile2String(filename, metarFileContent) == false)
+            cerr << "Failed to read file: " + filename + "\nContinuing with other files...\n";
+          else
+          {
+            ::MakeDataBlocks(stationInfoSystem,
+                             metarFileContent,
+                             buffer.itsDataBlocks,
+                             filename,
+                             timeRoundingResolution,
+                             buffer.itsIcaoIdUnknownSet);
+          }
+        }
+        ::SortMetarBuffer(buffer);
+      },
+      threadCount);
+
+  // Merge the buffers in processing order so that newer messages still override older ones
 
   std::set<std::string> icaoIdUnknownSet;  // thn kertn kaikki tuntemattomat icao-id:t jotka
                                            // ovat tulleet metar-sanomista
-  vector<MetarData> dataBlocks;
-
-  int debugCounter = 0;
-  BOOST_FOREACH (const string &filename, metarfiles)
+  vector<vector<MetarData> > dataBuffers(buffers.size());
+  vector<vector<string> > icaoBuffers(buffers.size());
+  vector<vector<NFmiMetTime> > timeBuffers(buffers.size());
+  for (size_t i = 0; i < buffers.size(); i++)
   {
-    if (fVerboseMode)
-      std::cerr << "Processing file no: " << ++debugCounter << " (" << filename << ")" << std::endl;
-    if (tryNoaaFileFormat)
-    {
-      if (::DoNoaaFormatRead(
-              stationInfoSystem, dataBlocks, filename, timeRoundingResolution, icaoIdUnknownSet))
-        continue;  // jos tiedosto oli NOAA formaattia, se luettiin jo, mennn seuraavaan
-                   // tiedostoon
-    }
-    string metarFileContent;
-    if (NFmiFileSystem::ReadFile2String(filename, metarFileContent) == false)
-      cerr << "Failed to read file: " << filename.c_str() << endl
-           << "Continuing with other files..." << endl;
-    else
-    {
-      ::MakeDataBlocks(stationInfoSystem,
-                       metarFileContent,
-                       dataBlocks,
-                       filename,
-                       timeRoundingResolution,
-                       icaoIdUnknownSet);
-    }
+    dataBuffers[i].swap(buffers[i].itsDataBlocks);
+    icaoBuffers[i].swap(buffers[i].itsIcaoNames);
+    timeBuffers[i].swap(buffers[i].itsTimes);
+    icaoIdUnknownSet.insert(buffers[i].itsIcaoIdUnknownSet.begin(),
+                            buffers[i].itsIcaoIdUnknownSet.end());
   }
+  buffers.clear();
+
+  vector<MetarData> dataBlocks = MessageDecoder::Merge(dataBuffers, MetarCellLess(), threadCount);
+  vector<string> icaoNames = MessageDecoder::MergeUnique(icaoBuffers, threadCount);
+  vector<NFmiMetTime> times = MessageDecoder::MergeUnique(timeBuffers, threadCount);
 
   // Build querydata from the contents
 
-  NFmiQueryData *newQData = ::MakeQueryDataFromBlocks(params, stationInfoSystem, dataBlocks);
+  NFmiQueryData *newQData =
+      ::MakeQueryDataFromBlocks(params, stationInfoSystem, dataBlocks, icaoNames, times);
 
   if (newQData == 0)
     throw runtime_error("Error: Unable to create querydata from METAR data, stopping program...");
@@ -18,11 +18,18 @@
  */
 // ======================================================================
 
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
 
 #include <newbase/NFmiEnumConverter.h>
+#include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiStreamQueryData.h>
 
 using namespace std;
@@ -81,6 +88,94 @@ const string makename(const NFmiFastQueryInfo& theQ)
   return name.str();
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format all rows of the active station into a buffer
+ *
+ * The time series of each printed column is read with a single call,
+ * and the numbers are formatted with snprintf using the same %g format
+ * the default iostream formatting would produce.
+ */
+// ----------------------------------------------------------------------
+
+void format_station(NFmiFastQueryInfo& theQ,
+                    const vector<bool>& theOkVariables,
+                    const vector<string>& theTimes,
+                    string& theBuffer)
+{
+  theBuffer.clear();
+
+  const unsigned long ntimes = theQ.SizeTimes();
+  if (ntimes == 0) return;
+
+  // Read the time series of the printed columns
+
+  vector<vector<float> > columns;
+
+  int column = 0;
+  for (theQ.ResetLevel(); theQ.NextLevel();)
+    for (theQ.ResetParam(); theQ.NextParam();)
+    {
+      if (theOkVariables[column++])
+      {
+        const size_t idx =
+            theQ.Index(theQ.ParamIndex(), theQ.LocationIndex(), theQ.LevelIndex(), 0);
+        const size_t step =
+            (ntimes > 1
+                 ? theQ.Index(theQ.ParamIndex(), theQ.LocationIndex(), theQ.LevelIndex(), 1) - idx
+                 : 1);
+        columns.push_back(vector<float>());
+        if (!theQ.GetValues(idx, step, ntimes, columns.back()))
+          columns.back().assign(ntimes, kFloatMissing);
+      }
+    }
+
+  if (columns.empty()) return;
+
+  const string id = to_string(theQ.Location()->GetIdent());
+
+  char tmp[32];
+  for (unsigned long t = 0; t < ntimes; t++)
+  {
+    theBuffer += id;
+    theBuffer += ',';
+    theBuffer += theTimes[t];
+    for (size_t i = 0; i < columns.size(); i++)
+    {
+      theBuffer += ',';
+      float value = columns[i][t];
+      if (value == kFloatMissing)
+        theBuffer += "NA";
+      else
+        theBuffer.append(tmp, snprintf(tmp, sizeof(tmp), "%g", value));
+    }
+    theBuffer += '\n';
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format a block of stations in a worker thread
+ */
+// ----------------------------------------------------------------------
+
+void format_stations_in_thread(const NFmiFastQueryInfo& theQ,
+                               NFmiTimeIndexCalculator& theCalculator,
+                               unsigned long theFirstLocation,
+                               const vector<bool>& theOkVariables,
+                               const vector<string>& theTimes,
+                               vector<string>& theBuffers)
+{
+  NFmiFastQueryInfo q(theQ);
+
+  unsigned long i = 0;
+  while (theCalculator.GetCurrentTimeIndex(i))
+  {
+    if (q.LocationIndex(theFirstLocation + i))
+      format_station(q, theOkVariables, theTimes, theBuffers[i]);
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Main algorithm
@@ -130,38 +225,44 @@ int domain(int argc, const char* argv[])
         cout << ",\"" << name << '"';
       }
     }
-  cout << endl;
+  cout << '\n';
+
+  // Then the data columns. Blocks of stations are formatted in parallel
+  // and written in order.
+
+  vector<string> times;
+  for (q->ResetTime(); q->NextTime();)
+    times.push_back(q->ValidTime().ToStr(kYYYYMMDDHH).CharPtr());
+
+  const unsigned long nlocations = q->SizeLocations();
+  const unsigned int threadcount =
+      NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75, nlocations);
+  const unsigned long blocksize = 16 * threadcount;
 
-  // Then the data columns
+  vector<string> buffers(blocksize);
 
-  for (q->ResetLocation(); q->NextLocation();)
+  for (unsigned long first = 0; first < nlocations; first += blocksize)
   {
-    for (q->ResetTime(); q->NextTime();)
-    {
-      NFmiString timestr = q->ValidTime().ToStr(kYYYYMMDDHH);
-
-      int column = 0;
-      int printedcolumns = 0;
-      for (q->ResetLevel(); q->NextLevel();)
-        for (q->ResetParam(); q->NextParam();)
-        {
-          if (okvariables[column])
-          {
-            if (++printedcolumns == 1)
-              cout << q->Location()->GetIdent() << ',' << timestr.CharPtr();
-            cout << ',';
-            float value = q->FloatValue();
-            if (value == kFloatMissing)
-              cout << "NA";
-            else
-              cout << value;
-          }
-          ++column;
-        }
-      if (printedcolumns > 0) cout << endl;
-    }
+    const unsigned long count = std::min(blocksize, nlocations - first);
+
+    NFmiTimeIndexCalculator calculator(count);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < threadcount; i++)
+      threads.add_thread(new boost::thread(format_stations_in_thread,
+                                           boost::cref(*q),
+                                           boost::ref(calculator),
+                                           first,
+                                           boost::cref(okvariables),
+                                           boost::cref(times),
+                                           boost::ref(buffers)));
+    threads.join_all();
+
+    for (unsigned long i = 0; i < count; i++)
+      cout.write(buffers[i].data(), buffers[i].size());
   }
 
+  cout.flush();
+
   return 0;
 }
 
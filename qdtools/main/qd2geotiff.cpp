@@ -1,5 +1,6 @@
 #include "GeoTiffQD.h"
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <gdal_priv.h>
 #include <ogr_spatialref.h>
 #include <newbase/NFmiArea.h>
@@ -7,18 +8,31 @@
 #include <newbase/NFmiLambertEqualArea.h>
 #include <newbase/NFmiLatLonArea.h>
 #include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiRotatedLatLonArea.h>
 #include <newbase/NFmiStereographicArea.h>
 #include <newbase/NFmiYKJArea.h>
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <stdio.h>
+#include <vector>
+
+// Tile width and height of tiled output
+static const int tileSize = 256;
 
 // float * fillFloatRasterByQD(NFmiFastQueryInfo * theData, int width, int height);
 // int * fillIntRasterByQD(NFmiFastQueryInfo * theData, int width, int height);
 // NFmiArea * CreteEpsgArea(string epsgCode);
 
 void GeoTiffQD::SetTestMode(bool testMode) { isDrawGridLines = testMode; }
+void GeoTiffQD::SetTiledOutput(bool tiled, const string &compression, unsigned int threadCount)
+{
+  isTiled = tiled;
+  itsCompression = compression;
+  itsThreadCount = threadCount;
+}
+
 GeomDefinedType GeoTiffQD::ConverQD2GeoTiff(string aNameVersion,
                                             NFmiFastQueryInfo *theData,
                                             NFmiFastQueryInfo *theExternal,
@@ -181,6 +195,25 @@ void GeoTiffQD::ConvertToGeoTiff(string aNameVersion,
 
   char **papszOptions = nullptr;
   // papszOptions = CSLSetNameValue( papszOptions, "COMPRESS", "PACKBITS" );
+  if (isTiled)
+  {
+    ostringstream tileSizeStr;
+    tileSizeStr << tileSize;
+    papszOptions = CSLSetNameValue(papszOptions, "TILED", "YES");
+    papszOptions = CSLSetNameValue(papszOptions, "BLOCKXSIZE", tileSizeStr.str().c_str());
+    papszOptions = CSLSetNameValue(papszOptions, "BLOCKYSIZE", tileSizeStr.str().c_str());
+    if (!itsCompression.empty())
+    {
+      // GDAL compresses the tiles in parallel
+      ostringstream threadsStr;
+      if (itsThreadCount > 0)
+        threadsStr << itsThreadCount;
+      else
+        threadsStr << "ALL_CPUS";
+      papszOptions = CSLSetNameValue(papszOptions, "COMPRESS", itsCompression.c_str());
+      papszOptions = CSLSetNameValue(papszOptions, "NUM_THREADS", threadsStr.str().c_str());
+    }
+  }
 
   // GDT_Int32 -or- GDT_Float32  1/4
   if (isIntDataType)
@@ -190,6 +223,8 @@ void GeoTiffQD::ConvertToGeoTiff(string aNameVersion,
     poDstDS =
         poDriver->Create(aNameVersion.c_str(), width, height, paramSize, GDT_Float32, papszOptions);
 
+  CSLDestroy(papszOptions);
+
   // Metadata **************************
 
   double adfGeoTransform[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
@@ -288,8 +323,14 @@ void GeoTiffQD::ConvertToGeoTiff(string aNameVersion,
   // abyRaster = fillIntRasterByQD(theData, theExternal, width, height, area);
   void *abyRaster;
 
-  CPLErr err;
-  if (isIntDataType)
+  std::vector<GDALRasterBand *> tiledBands(1, poBand);
+
+  CPLErr err = CE_None;
+  if (isTiled)
+  {
+    // Written below once all bands are known
+  }
+  else if (isIntDataType)
   {
     abyRaster = fillIntRasterByQD(theData, theExternal, width, height, area);
     // GDT_Int32   3/4
@@ -311,7 +352,13 @@ void GeoTiffQD::ConvertToGeoTiff(string aNameVersion,
     poBand->SetMetadataItem("FmiName", theExternal->Param().GetParamName());
     // GDT_Int32 -or- GDT_Float32  4/4
 
-    if (isIntDataType)
+    tiledBands.push_back(poBand);
+
+    if (isTiled)
+    {
+      // Written below together with the first band
+    }
+    else if (isIntDataType)
     {
       abyRaster = fillIntRasterByQD(theExternal, theData, width, height, area);
       // GDT_Int32   3/4
@@ -333,10 +380,230 @@ void GeoTiffQD::ConvertToGeoTiff(string aNameVersion,
     //	abyRaster, width, height, GDT_Float32 , 0, 0 );
   }
 
+  if (isTiled)
+  {
+    std::vector<NFmiFastQueryInfo *> datas(1, theData);
+    std::vector<NFmiFastQueryInfo *> secondDatas(1, theExternal);
+    if (theExternal != 0)
+    {
+      datas.push_back(theExternal);
+      secondDatas.push_back(theData);
+    }
+    writeTiledBands(tiledBands, datas, secondDatas, width, height, area);
+  }
+
   // Close
   GDALClose((GDALDatasetH)poDstDS);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fill one output tile
+ *
+ * The logic equals fillIntRasterByQD/fillFloatRasterByQD, but only the
+ * source values covering the tile are read and latlon coordinates are
+ * calculated only when needed.
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+void GeoTiffQD::fillTile(NFmiFastQueryInfo &theData,
+                         NFmiFastQueryInfo *theSecondData,
+                         int width,
+                         int height,
+                         const NFmiArea *area,
+                         int x0,
+                         int y0,
+                         int nx,
+                         int ny,
+                         std::vector<T> &theTile)
+{
+  NFmiArea *destArea = itsDestProjection;
+  const NFmiArea *rotArea = dynamic_cast<const NFmiRotatedLatLonArea *>(area);
+  const long paramId = theData.Param().GetParamIdent();
+
+  // Querydata rows are numbered from the bottom, tiff rows from the top
+  const int sy1 = height - y0 - 1;
+  const int sy0 = sy1 - ny + 1;
+
+  NFmiDataMatrix<float> data;
+  theData.CroppedValues(data, x0, sy0, x0 + nx - 1, sy1);
+
+  // Second data for u/v - component
+  NFmiDataMatrix<float> dataSecond;
+  if (theSecondData != 0) theSecondData->CroppedValues(dataSecond, x0, sy0, x0 + nx - 1, sy1);
+
+  theTile.resize(nx * ny);
+
+  NFmiPoint xy(0, 0);
+
+  for (int j = 0; j < ny; j++)
+  {
+    const int sy = sy1 - j;
+    for (int i = 0; i < nx; i++)
+    {
+      const int x = x0 + i;
+      double value = data[i][sy - sy0];
+      T &pixel = theTile[j * nx + i];
+
+      xy.X((x / (double)(width - 1)));
+      xy.Y(1.0 - sy / (double)(height - 1));
+
+      if (paramId == 23 || paramId == 24)
+      {  // kFmiWindUMS||kFmiWindVMS
+        if (area != 0 && value != 32700)
+        {
+          // The components are not rotated yet, other projections are not fixed yet
+          if (rotArea == 0) value = kFloatMissing;
+        }
+        pixel = (value != 32700 ? static_cast<T>(value * itsScale) : static_cast<T>(32700));
+      }
+      else if (paramId == 20)
+      {  // kFmiWindDirection
+        if (value != 32700)
+        {
+          const NFmiPoint latLon = area->ToLatLon(xy);
+          value = calculateTrueNorthAzimuthValue(value, destArea, &latLon);
+        }
+        pixel = static_cast<T>(isIntDataType ? value * itsScale : value);
+      }
+      else
+      {
+        if (value != 32700)
+        {
+          if (isDrawGridLines)
+          {
+            const NFmiPoint latLon = area->ToLatLon(xy);
+            drawGridLines(latLon, value);
+          }
+          pixel = static_cast<T>(value * itsScale);
+        }
+        else
+        {
+          pixel = static_cast<T>(32700);
+        }
+      }
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate and write tiles in a worker thread
+ *
+ * Work items are numbered band by band. GDAL datasets are not thread
+ * safe, so the writes are serialized. With compression enabled GDAL
+ * compresses the finished tiles in its own worker threads.
+ */
+// ----------------------------------------------------------------------
+
+void GeoTiffQD::writeTilesInThread(const std::vector<GDALRasterBand *> &theBands,
+                                   const std::vector<NFmiFastQueryInfo *> &theDatas,
+                                   const std::vector<NFmiFastQueryInfo *> &theSecondDatas,
+                                   int width,
+                                   int height,
+                                   const NFmiArea *area,
+                                   NFmiTimeIndexCalculator &theCalculator,
+                                   boost::mutex &theGdalMutex)
+{
+  const int tilesX = (width + tileSize - 1) / tileSize;
+  const int tilesY = (height + tileSize - 1) / tileSize;
+  const unsigned long tilesPerBand = tilesX * tilesY;
+
+  // Each thread uses its own iterators
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo> > datas;
+  std::vector<boost::shared_ptr<NFmiFastQueryInfo> > secondDatas;
+  for (size_t i = 0; i < theDatas.size(); i++)
+  {
+    datas.push_back(boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(*theDatas[i])));
+    if (theSecondDatas[i] != 0)
+      secondDatas.push_back(
+          boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(*theSecondDatas[i])));
+    else
+      secondDatas.push_back(boost::shared_ptr<NFmiFastQueryInfo>());
+  }
+
+  std::vector<int> intTile;
+  std::vector<float> floatTile;
+
+  unsigned long work = 0;
+  while (theCalculator.GetCurrentTimeIndex(work))
+  {
+    const size_t band = work / tilesPerBand;
+    const int tile = work % tilesPerBand;
+
+    const int x0 = (tile % tilesX) * tileSize;
+    const int y0 = (tile / tilesX) * tileSize;
+    const int nx = std::min(tileSize, width - x0);
+    const int ny = std::min(tileSize, height - y0);
+
+    CPLErr err;
+    if (isIntDataType)
+    {
+      fillTile(*datas[band], secondDatas[band].get(), width, height, area, x0, y0, nx, ny, intTile);
+      boost::mutex::scoped_lock lock(theGdalMutex);
+      err = theBands[band]->RasterIO(
+          GF_Write, x0, y0, nx, ny, &intTile[0], nx, ny, GDT_Int32, 0, 0);
+    }
+    else
+    {
+      fillTile(*datas[band], secondDatas[band].get(), width, height, area, x0, y0, nx, ny, floatTile);
+      boost::mutex::scoped_lock lock(theGdalMutex);
+      err = theBands[band]->RasterIO(
+          GF_Write, x0, y0, nx, ny, &floatTile[0], nx, ny, GDT_Float32, 0, 0);
+    }
+
+    if (err) std::cout << "Warning: Encountered problems in raster band conversions\n";
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write all bands tile by tile using worker threads
+ *
+ * Only a few tiles per thread are held in memory instead of full rasters.
+ */
+// ----------------------------------------------------------------------
+
+void GeoTiffQD::writeTiledBands(const std::vector<GDALRasterBand *> &theBands,
+                                const std::vector<NFmiFastQueryInfo *> &theDatas,
+                                const std::vector<NFmiFastQueryInfo *> &theSecondDatas,
+                                int width,
+                                int height,
+                                const NFmiArea *area)
+{
+  const int tilesX = (width + tileSize - 1) / tileSize;
+  const int tilesY = (height + tileSize - 1) / tileSize;
+  const unsigned long tileCount = theBands.size() * tilesX * tilesY;
+
+  if (tileCount == 0) return;
+
+  for (size_t i = 0; i < theDatas.size(); i++)
+    printf("Processing (%s, tiled) with scale %f, QD to Gtiff raster convert for parameter %li\n",
+           isIntDataType ? "int" : "float",
+           itsScale,
+           theDatas[i]->Param().GetParamIdent());
+
+  unsigned int threadCount = itsThreadCount;
+  if (threadCount == 0)
+    threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75, tileCount);
+
+  NFmiTimeIndexCalculator calculator(tileCount);
+  boost::mutex gdalMutex;
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadCount; i++)
+    threads.add_thread(new boost::thread(
+        [&]()
+        {
+          writeTilesInThread(
+              theBands, theDatas, theSecondDatas, width, height, area, calculator, gdalMutex);
+        }));
+  threads.join_all();
+
+  printf("Procesed \n");
+}
+
 int *GeoTiffQD::fillIntRasterByQD(NFmiFastQueryInfo *theData,
                                   NFmiFastQueryInfo *theSecondData,
                                   int width,
@@ -713,6 +980,9 @@ static void usage()
       "    -params 4,20,.. (if not use, make all params from qd)\n"
       "    -levels 10,11,12 -or- 700,850,925,... (if not use, make all level from qd)\n"
       "    -gdal_params gdal_par_def  ( \"-r bilinear\" )\n"
+      "    -tiled (write 256x256 tiles using worker threads)\n"
+      "    -compress method (DEFLATE, LZW, ..., implies -tiled)\n"
+      "    -threads n (tiled output worker threads, default all cores)\n"
       "    [srcfile]\n"
       " \n"
       "example -params 4,20:21,47		param 20 and 21 yhdistetään samaan tif"
@@ -900,6 +1170,9 @@ int main(int argc, char *argv[])
 
   bool isIntDataType = false;
   bool isTest = false;
+  bool isTiled = false;
+  string compression;
+  unsigned int threadCount = 0;
 
   int i;
 
@@ -1034,6 +1307,19 @@ int main(int argc, char *argv[])
     {
       gdalParams = argv[++i];
     }
+    else if (EQUAL(argv[i], "-tiled"))
+    {
+      isTiled = true;
+    }
+    else if (EQUAL(argv[i], "-compress"))
+    {
+      compression = argv[++i];
+      isTiled = true;
+    }
+    else if (EQUAL(argv[i], "-threads"))
+    {
+      threadCount = atoi(argv[++i]);
+    }
     else
     {
       qdName = argv[i];
@@ -1048,6 +1334,7 @@ int main(int argc, char *argv[])
     if (qd != 0)
     {
       geoTiffQD.SetTestMode(isTest);
+      geoTiffQD.SetTiledOutput(isTiled, compression, threadCount);
 
       if (tsrs == "EPSG:3035")
       {
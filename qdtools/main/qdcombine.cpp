@@ -15,7 +15,12 @@
 #include <newbase/NFmiTimeList.h>
 #include <newbase/NFmiTotalWind.h>
 #include <newbase/NFmiWeatherAndCloudiness.h>
+#include <boost/filesystem/operations.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <utility>
 
 using namespace std;
@@ -46,6 +51,9 @@ void Usage(void)
        << "   -o outfile           Output filename (default = stdout)" << endl
        << "   -O outfile           Memory mapped output filename" << endl
        << "   -P                   Combine point data instead of grid data" << endl
+       << "   -j threads           Maximum number of files read concurrently (default = 0 = a "
+          "reasonable number)"
+       << endl
        << "   -l levelType[,value] Set level type and value (e.g. 5000,0 would be normal ground "
           "data)."
        << endl
@@ -66,9 +74,12 @@ static void ReadGridData(vector<string> &theDataFileNames, MyGrid &theUsedGrid)
 {
   for (unsigned int i = 0; i < theDataFileNames.size(); i++)
   {
-    NFmiQueryData qd(theDataFileNames[i]);
+    NFmiQueryInfo qi;
+    if (!NFmiQueryDataUtil::ReadQueryInfoHeader(theDataFileNames[i], qi))
+      throw std::runtime_error("Failed to read querydata header from '" + theDataFileNames[i] +
+                               "'");
 
-    const NFmiGrid *grid = qd.Info()->Grid();
+    const NFmiGrid *grid = qi.Grid();
 
     if (grid)
     {
@@ -79,139 +90,276 @@ static void ReadGridData(vector<string> &theDataFileNames, MyGrid &theUsedGrid)
   }
 }
 
-static void FillCombinedData(const vector<string> &theDataFileNames,
-                             NFmiFastQueryInfo &theInfo,
-                             NFmiLevel *theForcedLevel)
+// Yhdist yhden hiladatan kohdedataan. Kohteeseen tytetn vain puuttuvat arvot, joten
+// aiemmin yhdistetyn datan arvot jvt voimaan.
+static void MergeGridData(NFmiFastQueryInfo &sourceInfo,
+                          NFmiFastQueryInfo &theInfo,
+                          NFmiLevel *theForcedLevel)
 {
-  MyGrid usedGrid(*theInfo.Grid());
-  for (unsigned int i = 0; i < theDataFileNames.size(); i++)
+  typedef std::pair<unsigned int, unsigned int> IndexPair;
+  typedef std::vector<IndexPair> Indexes;
+  Indexes params, times, levels;
+
+  // Collect indexes for common parameters, times and levels
+  for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
+    if (theInfo.Param(*(sourceInfo.Param().GetParam())))
+      params.push_back(IndexPair(sourceInfo.ParamIndex(), theInfo.ParamIndex()));
+
+  for (sourceInfo.ResetTime(); sourceInfo.NextTime();)
+    if (theInfo.Time(sourceInfo.Time()))
+      times.push_back(IndexPair(sourceInfo.TimeIndex(), theInfo.TimeIndex()));
+
+  for (sourceInfo.ResetLevel(); sourceInfo.NextLevel();)
+    if (theForcedLevel || theInfo.Level(*sourceInfo.Level()))
+      levels.push_back(IndexPair(sourceInfo.LevelIndex(), theInfo.LevelIndex()));
+
+  // Whole grids are merged at once, the raw data is read one
+  // param/level/time slab at a time instead of value by value.
+  // Non-finite values are not copied, just like FloatValue(float)
+  // refuses to set them.
+
+  std::vector<float> sourceValues;
+  std::vector<float> targetValues;
+  const size_t locationCount = theInfo.SizeLocations();
+  const size_t sourceStep = sourceInfo.SizeLevels() * sourceInfo.SizeTimes();
+  const size_t targetStep = theInfo.SizeLevels() * theInfo.SizeTimes();
+
+  for (const IndexPair &param : params)
   {
-    NFmiQueryData qd(theDataFileNames[i]);
-    NFmiFastQueryInfo sourceInfo(&qd);
-
-    if (sourceInfo.Grid() && usedGrid == *sourceInfo.Grid())
+    for (const IndexPair &level : levels)
     {
-      typedef std::pair<unsigned int, unsigned int> IndexPair;
-      typedef std::vector<IndexPair> Indexes;
-      Indexes params, times, levels;
+      for (const IndexPair &time : times)
+      {
+        size_t sourceIndex = sourceInfo.Index(param.first, 0, level.first, time.first);
+        size_t targetIndex = theInfo.Index(param.second, 0, level.second, time.second);
+
+        if (!sourceInfo.GetValues(sourceIndex, sourceStep, locationCount, sourceValues) ||
+            !theInfo.GetValues(targetIndex, targetStep, locationCount, targetValues))
+          continue;
+
+        bool changed = false;
+        for (size_t i = 0; i < locationCount; i++)
+        {
+          if (targetValues[i] == kFloatMissing && sourceValues[i] != kFloatMissing &&
+              ::FmiIsValidNumber(sourceValues[i]))
+          {
+            targetValues[i] = sourceValues[i];
+            changed = true;
+          }
+        }
+        if (changed) theInfo.SetValues(targetIndex, targetStep, locationCount, targetValues);
+      }  // times
+    }    // levels
+  }      // params
+}
+
+// Yhdist yhden asemadatan kohdedataan, asemat etsitn id:n mukaan.
+static void MergePointData(NFmiFastQueryInfo &sourceInfo,
+                           NFmiFastQueryInfo &theInfo,
+                           NFmiLevel *theForcedLevel)
+{
+  typedef std::pair<unsigned int, unsigned int> IndexPair;
+  typedef std::vector<IndexPair> Indexes;
+  Indexes params, times, levels, locations;
+
+  // Collect indexes for common parameters, times, levels and locations
+  for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
+    if (theInfo.Param(*(sourceInfo.Param().GetParam())))
+      params.push_back(IndexPair(sourceInfo.ParamIndex(), theInfo.ParamIndex()));
 
-      // Collect indexes for common parameters, times and levels
-      for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
-        if (theInfo.Param(*(sourceInfo.Param().GetParam())))
-          params.push_back(IndexPair(sourceInfo.ParamIndex(), theInfo.ParamIndex()));
+  for (sourceInfo.ResetTime(); sourceInfo.NextTime();)
+    if (theInfo.Time(sourceInfo.Time()))
+      times.push_back(IndexPair(sourceInfo.TimeIndex(), theInfo.TimeIndex()));
 
-      for (sourceInfo.ResetTime(); sourceInfo.NextTime();)
-        if (theInfo.Time(sourceInfo.Time()))
-          times.push_back(IndexPair(sourceInfo.TimeIndex(), theInfo.TimeIndex()));
+  for (sourceInfo.ResetLevel(); sourceInfo.NextLevel();)
+    if (theForcedLevel || theInfo.Level(*sourceInfo.Level()))
+      levels.push_back(IndexPair(sourceInfo.LevelIndex(), theInfo.LevelIndex()));
 
-      for (sourceInfo.ResetLevel(); sourceInfo.NextLevel();)
-        if (theForcedLevel || theInfo.Level(*sourceInfo.Level()))
-          levels.push_back(IndexPair(sourceInfo.LevelIndex(), theInfo.LevelIndex()));
+  for (sourceInfo.ResetLocation(); sourceInfo.NextLocation();)
+    if (theInfo.Location(sourceInfo.Location()->GetIdent()))
+      locations.push_back(IndexPair(sourceInfo.LocationIndex(), theInfo.LocationIndex()));
 
-      // We avoid unnecessary location loops with this extra test
+  // We avoid unnecessary location loops with this extra test
+
+  if (params.empty() || times.empty() || levels.empty() || locations.empty()) return;
+
+  for (const IndexPair &param : params)
+  {
+    sourceInfo.ParamIndex(param.first);
+    theInfo.ParamIndex(param.second);
+
+    for (const IndexPair &loc : locations)
+    {
+      sourceInfo.LocationIndex(loc.first);
+      theInfo.LocationIndex(loc.second);
 
-      if (!params.empty() && !times.empty() && !levels.empty())
+      for (const IndexPair &level : levels)
       {
-        for (const IndexPair &param : params)
-        {
-          sourceInfo.ParamIndex(param.first);
-          theInfo.ParamIndex(param.second);
+        sourceInfo.LevelIndex(level.first);
+        theInfo.LevelIndex(level.second);
 
-          for (sourceInfo.ResetLocation(), theInfo.ResetLocation();
-               sourceInfo.NextLocation() && theInfo.NextLocation();)
-          {
-            for (const IndexPair &level : levels)
-            {
-              sourceInfo.LevelIndex(level.first);
-              theInfo.LevelIndex(level.second);
-
-              for (const IndexPair &time : times)
-              {
-                sourceInfo.TimeIndex(time.first);
-                theInfo.TimeIndex(time.second);
-
-                if (theInfo.FloatValue() == kFloatMissing)
-                  theInfo.FloatValue(sourceInfo.FloatValue());
-              }  // times
-            }    // levels
-          }      // locations
-        }        // params
-      }          // if !empty
-    }            // if same grid
-  }              // for files
+        for (const IndexPair &time : times)
+        {
+          sourceInfo.TimeIndex(time.first);
+          theInfo.TimeIndex(time.second);
+
+          if (theInfo.FloatValue() == kFloatMissing)
+            theInfo.FloatValue(sourceInfo.FloatValue());
+        }  // times
+      }    // levels
+    }      // locations
+  }        // params
 }
 
-static void FillCombinedData(const vector<string> &theDataFileNames,
-                             bool use_point_data,
-                             NFmiFastQueryInfo &theInfo,
-                             NFmiLevel *theForcedLevel)
+// Yhden tiedoston yhdistmisty. Tiedosto saa tytt kohdedataa vasta kun kaikki aiemmat
+// tiedostot, joilla on samoja kohdedatan parametri/aika -paikkoja, on yhdistetty. Nin
+// ensimmisen tiedoston arvot jvt voimaan kuten perkkisess yhdistmisess.
+struct CombineTask
 {
-  if (!use_point_data)
-    FillCombinedData(theDataFileNames, theInfo, theForcedLevel);
-  else
+  string itsFileName;
+  vector<size_t> itsDependencies;  // aiempien pllekkisten tehtvien indeksit
+};
+
+struct CombineState
+{
+  CombineState(size_t theTaskCount) : itsNextTask(0), itsFinished(theTaskCount, false) {}
+
+  boost::mutex itsMutex;
+  boost::condition_variable itsCondition;
+  size_t itsNextTask;
+  vector<bool> itsFinished;
+  string itsErrorMessage;
+};
+
+// Rakentaa tehtvt pelkkien otsikoiden perusteella. Yhdistettvksi kelpaamattomat tiedostot
+// (eri hila tai piste/hila -ero) ohitetaan kuten ennenkin.
+static vector<CombineTask> MakeCombineTasks(const vector<string> &theDataFileNames,
+                                            bool use_point_data,
+                                            NFmiFastQueryInfo &theInfo)
+{
+  std::unique_ptr<MyGrid> usedGrid;
+  if (!use_point_data) usedGrid.reset(new MyGrid(*theInfo.Grid()));
+
+  const size_t timeSize = theInfo.SizeTimes();
+  const size_t noWriter = static_cast<size_t>(-1);
+  vector<size_t> lastWriters(theInfo.SizeParams() * timeSize, noWriter);
+
+  vector<CombineTask> tasks;
+  for (const string &filename : theDataFileNames)
   {
-    for (unsigned int i = 0; i < theDataFileNames.size(); i++)
-    {
-      NFmiQueryData qd(theDataFileNames[i]);
-      NFmiFastQueryInfo sourceInfo(&qd);
+    NFmiQueryInfo header;
+    if (!NFmiQueryDataUtil::ReadQueryInfoHeader(filename, header))
+      throw std::runtime_error("Failed to read querydata header from '" + filename + "'");
+    NFmiFastQueryInfo sourceInfo(header);
+
+    bool ok = false;
+    if (use_point_data)
+      ok = !sourceInfo.Grid();
+    else
+      ok = (sourceInfo.Grid() && *usedGrid == *sourceInfo.Grid());
+    if (!ok) continue;
+
+    vector<unsigned long> timeIndexes;
+    for (sourceInfo.ResetTime(); sourceInfo.NextTime();)
+      if (theInfo.Time(sourceInfo.Time())) timeIndexes.push_back(theInfo.TimeIndex());
 
-      if (!sourceInfo.Grid())
+    set<size_t> dependencies;
+    for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
+    {
+      if (!theInfo.Param(*(sourceInfo.Param().GetParam()))) continue;
+      for (unsigned long timeIndex : timeIndexes)
       {
-        typedef std::pair<unsigned int, unsigned int> IndexPair;
-        typedef std::vector<IndexPair> Indexes;
-        Indexes params, times, levels, locations;
+        size_t &lastWriter = lastWriters[theInfo.ParamIndex() * timeSize + timeIndex];
+        if (lastWriter != noWriter) dependencies.insert(lastWriter);
+        lastWriter = tasks.size();
+      }
+    }
 
-        // Collect indexes for common parameters, times, levels and locations
-        for (sourceInfo.ResetParam(); sourceInfo.NextParam();)
-          if (theInfo.Param(*(sourceInfo.Param().GetParam())))
-            params.push_back(IndexPair(sourceInfo.ParamIndex(), theInfo.ParamIndex()));
+    CombineTask task;
+    task.itsFileName = filename;
+    task.itsDependencies.assign(dependencies.begin(), dependencies.end());
+    tasks.push_back(task);
+  }
+  return tasks;
+}
+
+static void FillCombinedDataInThread(const vector<CombineTask> &theTasks,
+                                     bool use_point_data,
+                                     NFmiFastQueryInfo &theInfo,
+                                     NFmiLevel *theForcedLevel,
+                                     CombineState &theState)
+{
+  for (;;)
+  {
+    size_t taskIndex = 0;
+    {
+      boost::mutex::scoped_lock lock(theState.itsMutex);
+      if (theState.itsNextTask >= theTasks.size() || !theState.itsErrorMessage.empty()) return;
+      taskIndex = theState.itsNextTask++;
+      // Riippuvuudet ovat aiempia tehtvi, jotka on jo annettu muille sikeille
+      for (size_t dependency : theTasks[taskIndex].itsDependencies)
+        while (!theState.itsFinished[dependency] && theState.itsErrorMessage.empty())
+          theState.itsCondition.wait(lock);
+      if (!theState.itsErrorMessage.empty()) return;
+    }
 
-        for (sourceInfo.ResetTime(); sourceInfo.NextTime();)
-          if (theInfo.Time(sourceInfo.Time()))
-            times.push_back(IndexPair(sourceInfo.TimeIndex(), theInfo.TimeIndex()));
+    const CombineTask &task = theTasks[taskIndex];
+    try
+    {
+      // Data luetaan vasta tss ja vapautetaan heti yhdistmisen jlkeen
+      NFmiQueryData qd(task.itsFileName, true);
+      NFmiFastQueryInfo sourceInfo(&qd);
+      if (use_point_data)
+        ::MergePointData(sourceInfo, theInfo, theForcedLevel);
+      else
+        ::MergeGridData(sourceInfo, theInfo, theForcedLevel);
+    }
+    catch (std::exception &e)
+    {
+      boost::mutex::scoped_lock lock(theState.itsMutex);
+      if (theState.itsErrorMessage.empty())
+        theState.itsErrorMessage = "Failed to combine '" + task.itsFileName + "': " + e.what();
+      theState.itsCondition.notify_all();
+      return;
+    }
 
-        for (sourceInfo.ResetLevel(); sourceInfo.NextLevel();)
-          if (theForcedLevel || theInfo.Level(*sourceInfo.Level()))
-            levels.push_back(IndexPair(sourceInfo.LevelIndex(), theInfo.LevelIndex()));
+    boost::mutex::scoped_lock lock(theState.itsMutex);
+    theState.itsFinished[taskIndex] = true;
+    theState.itsCondition.notify_all();
+  }
+}
 
-        for (sourceInfo.ResetLocation(); sourceInfo.NextLocation();)
-          if (theInfo.Location(sourceInfo.Location()->GetIdent()))
-            locations.push_back(IndexPair(sourceInfo.LocationIndex(), theInfo.LocationIndex()));
+// Tiedostot luetaan ja yhdistetn useassa sikeess, ja kukin vapautetaan heti kytn jlkeen,
+// joten muistissa on kerrallaan korkeintaan sikeiden mrn verran lhdedatoja.
+static void FillCombinedData(const vector<string> &theDataFileNames,
+                             bool use_point_data,
+                             NFmiFastQueryInfo &theInfo,
+                             NFmiLevel *theForcedLevel,
+                             unsigned int theMaxThreadCount)
+{
+  vector<CombineTask> tasks = ::MakeCombineTasks(theDataFileNames, use_point_data, theInfo);
+  if (tasks.empty()) return;
 
-        // We avoid unnecessary location loops with this extra test
+  unsigned int threadCount = theMaxThreadCount;
+  if (threadCount == 0) threadCount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount();
+  threadCount = std::max(1u, std::min(threadCount, static_cast<unsigned int>(tasks.size())));
 
-        if (!params.empty() && !times.empty() && !levels.empty() && !locations.empty())
-        {
-          for (const IndexPair &param : params)
-          {
-            sourceInfo.ParamIndex(param.first);
-            theInfo.ParamIndex(param.second);
-
-            for (const IndexPair &loc : locations)
-            {
-              sourceInfo.LocationIndex(loc.first);
-              theInfo.LocationIndex(loc.second);
-
-              for (const IndexPair &level : levels)
-              {
-                sourceInfo.LevelIndex(level.first);
-                theInfo.LevelIndex(level.second);
-
-                for (const IndexPair &time : times)
-                {
-                  sourceInfo.TimeIndex(time.first);
-                  theInfo.TimeIndex(time.second);
-
-                  if (theInfo.FloatValue() == kFloatMissing)
-                    theInfo.FloatValue(sourceInfo.FloatValue());
-                }  // times
-              }    // levels
-            }      // locations
-          }        // params
-        }          // if !empty
-      }            // if same grid
-    }              // for files
+  CombineState state(tasks.size());
+  vector<boost::shared_ptr<NFmiFastQueryInfo>> infos(threadCount);
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadCount; i++)
+  {
+    infos[i] = boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theInfo));
+    threads.add_thread(new boost::thread(::FillCombinedDataInThread,
+                                         boost::cref(tasks),
+                                         use_point_data,
+                                         boost::ref(*infos[i]),
+                                         theForcedLevel,
+                                         boost::ref(state)));
   }
+  threads.join_all();
+
+  if (!state.itsErrorMessage.empty()) throw std::runtime_error(state.itsErrorMessage);
 }
 
 struct LevelLessThan
@@ -240,8 +388,10 @@ static NFmiQueryInfo MakeCombinedInnerInfo(const vector<string> &dataFileNames,
   if (theForcedLevel) allLevels.insert(*theForcedLevel);
   // otetaan 1. datasta tuottaja ellei ole annettu pakotettua tuottajaa
 
-  NFmiQueryData qd(dataFileNames[0]);
-  NFmiFastQueryInfo qi(&qd);
+  NFmiQueryInfo firstHeader;
+  if (!NFmiQueryDataUtil::ReadQueryInfoHeader(dataFileNames[0], firstHeader))
+    throw std::runtime_error("Failed to read querydata header from '" + dataFileNames[0] + "'");
+  NFmiFastQueryInfo qi(firstHeader);
 
   NFmiMetTime originTime = qi.OriginTime();
 
@@ -257,10 +407,14 @@ static NFmiQueryInfo MakeCombinedInnerInfo(const vector<string> &dataFileNames,
 
   std::set<NFmiStation> stations;  // for point data only
 
+  // Only the headers are needed to build the combined descriptors
+
   for (unsigned int i = 0; i < dataFileNames.size(); i++)
   {
-    NFmiQueryData data(dataFileNames[i]);
-    NFmiFastQueryInfo info(&data);
+    NFmiQueryInfo header;
+    if (!NFmiQueryDataUtil::ReadQueryInfoHeader(dataFileNames[i], header))
+      throw std::runtime_error("Failed to read querydata header from '" + dataFileNames[i] + "'");
+    NFmiFastQueryInfo info(header);
 
     bool ok = false;
     if (use_point_data)
@@ -362,7 +516,7 @@ static NFmiQueryInfo MakeCombinedInnerInfo(const vector<string> &dataFileNames,
 
 int Run(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "l!p!o!O!P");
+  NFmiCmdLine cmdline(argc, argv, "l!p!o!O!Pj!");
 
   // Tarkistetaan optioiden oikeus:
 
@@ -384,6 +538,10 @@ int Run(int argc, const char *argv[])
 
   bool use_point_data = cmdline.isOption('P');
 
+  unsigned int threadcount = 0;  // 0 = reasonable default
+  if (cmdline.isOption('j'))
+    threadcount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   NFmiLevel *forcedLevel = 0;
   if (cmdline.isOption('l'))
   {
@@ -468,17 +626,35 @@ int Run(int argc, const char *argv[])
     if (newData)
     {
       NFmiFastQueryInfo info(newData);
-      ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel);
+      ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel, threadcount);
       newData->Write(outfile);
     }
     delete newData;
   }
   else
   {
-    NFmiQueryData *newData = NFmiQueryDataUtil::CreateEmptyData(innerInfo, outfile, true);
-    NFmiFastQueryInfo info(newData);
-    ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel);
+    // Muistikartoitettu data tehdn tilapisell nimell, jotta eponnistunut ajo ei jt
+    // vajaata tiedostoa lopulliselle nimelle
+    std::string tmpfile =
+        boost::filesystem::unique_path(outfile + ".%%%%-%%%%-%%%%-%%%%.tmp").string();
+    NFmiQueryData *newData = NFmiQueryDataUtil::CreateEmptyData(innerInfo, tmpfile, true);
+    try
+    {
+      NFmiFastQueryInfo info(newData);
+      ::FillCombinedData(dataFileNames, use_point_data, info, forcedLevel, threadcount);
+    }
+    catch (...)
+    {
+      delete newData;
+      NFmiFileSystem::RemoveFile(tmpfile);
+      throw;
+    }
     delete newData;
+    if (!NFmiFileSystem::RenameFile(tmpfile, outfile))
+    {
+      NFmiFileSystem::RemoveFile(tmpfile);
+      throw runtime_error("Failed to rename '" + tmpfile + "' to '" + outfile + "'");
+    }
   }
 
   return 0;
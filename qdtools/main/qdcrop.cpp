@@ -111,6 +111,7 @@
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiEnumConverter.h>
 #include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiFileSystem.h>
 #include <newbase/NFmiGrid.h>
 #include <newbase/NFmiMultiQueryInfo.h>
 #include <newbase/NFmiQueryData.h>
@@ -119,6 +120,7 @@
 #include <newbase/NFmiTimeList.h>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/math/special_functions/round.hpp>
@@ -159,6 +161,11 @@ void usage()
        << "-R" << endl
        << "\tRead all files in the input directory." << endl
        << endl
+       << "-D" << endl
+       << "\tWrite the output directly into a memory mapped output file." << endl
+       << "\tThe file is renamed to its final name once the crop succeeds." << endl
+       << "\tCannot be used with options -m and -n." << endl
+       << endl
        << "-g <geometry>" << endl
        << endl
        << "\tThe area to be cropped in a form similar to ImageMagick." << endl
@@ -894,6 +901,94 @@ NFmiTimeDescriptor MakeTimeDescriptor(NFmiFastQueryInfo& theQ, const set<NFmiMet
   return NFmiTimeDescriptor(origintime, datatimes);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Establish the source indexes for copying values to the output
+ *
+ * Missing levels are an error, missing times only if so requested.
+ */
+// ----------------------------------------------------------------------
+
+NFmiSlabCopyIndexes MakeCopyIndexes(NFmiFastQueryInfo& theSrc,
+                                    NFmiFastQueryInfo& theDst,
+                                    bool theTimesRequired)
+{
+  NFmiSlabCopyIndexes indexes;
+  if (!NFmiQueryDataUtil::MakeSlabCopyIndexes(theSrc, theDst, indexes))
+    throw runtime_error("Locations of the output do not match the querydata");
+
+  for (auto index : indexes.itsLevelIndexes)
+    if (index == gMissingIndex) throw runtime_error("Level not available in querydata");
+
+  if (theTimesRequired)
+    for (auto index : indexes.itsTimeIndexes)
+      if (index == gMissingIndex) throw runtime_error("Time not available in querydata");
+
+  return indexes;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy values one by one using the established indexes
+ *
+ * Subparameters are calculated from their combined parameter and
+ * multifile input switches the underlying data based on the time,
+ * hence neither can be copied directly from the raw data.
+ */
+// ----------------------------------------------------------------------
+
+void CopyValuesOneByOne(NFmiFastQueryInfo& theSrc,
+                        NFmiFastQueryInfo& theDst,
+                        const NFmiSlabCopyIndexes& theIndexes,
+                        bool theSubParamsOnly)
+{
+  for (theDst.ResetParam(); theDst.NextParam();)
+  {
+    if (theSubParamsOnly && theIndexes.itsParamIndexes[theDst.ParamIndex()] != gMissingIndex)
+      continue;
+    if (!theSrc.Param(theDst.Param())) continue;
+
+    for (unsigned long loc = 0; loc < theIndexes.itsLocationIndexes.size(); loc++)
+    {
+      if (theIndexes.itsLocationIndexes[loc] == gMissingIndex) continue;
+      theDst.LocationIndex(loc);
+      theSrc.LocationIndex(theIndexes.itsLocationIndexes[loc]);
+      for (unsigned long lev = 0; lev < theIndexes.itsLevelIndexes.size(); lev++)
+      {
+        if (theIndexes.itsLevelIndexes[lev] == gMissingIndex) continue;
+        theDst.LevelIndex(lev);
+        theSrc.LevelIndex(theIndexes.itsLevelIndexes[lev]);
+        for (unsigned long t = 0; t < theIndexes.itsTimeIndexes.size(); t++)
+        {
+          if (theIndexes.itsTimeIndexes[t] == gMissingIndex) continue;
+          theDst.TimeIndex(t);
+          theSrc.TimeIndex(theIndexes.itsTimeIndexes[t]);
+          theDst.FloatValue(theSrc.FloatValue());
+        }
+      }
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy values using the established indexes
+ */
+// ----------------------------------------------------------------------
+
+void CopyValues(NFmiFastQueryInfo& theSrc,
+                NFmiFastQueryInfo& theDst,
+                const NFmiSlabCopyIndexes& theIndexes)
+{
+  if (dynamic_cast<NFmiMultiQueryInfo*>(&theSrc) != nullptr)
+    CopyValuesOneByOne(theSrc, theDst, theIndexes, false);
+  else
+  {
+    NFmiQueryDataUtil::CopySlabs(theSrc, theDst, theIndexes, 0);
+    CopyValuesOneByOne(theSrc, theDst, theIndexes, true);
+  }
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Remove bad times from the querydata and write the result
@@ -922,15 +1017,8 @@ void RemoveBadTimes(NFmiQueryData& theQD,
   if (data2 == 0) throw runtime_error("Could not allocate memory for result data");
   NFmiFastQueryInfo dstinfo(data2);
 
-  for (dstinfo.ResetParam(), theQ.ResetParam(); dstinfo.NextParam() && theQ.NextParam();)
-    for (dstinfo.ResetLevel(), theQ.ResetLevel(); dstinfo.NextLevel() && theQ.NextLevel();)
-      for (dstinfo.ResetTime(); dstinfo.NextTime();)
-      {
-        theQ.Time(dstinfo.ValidTime());
-        for (dstinfo.ResetLocation(), theQ.ResetLocation();
-             dstinfo.NextLocation() && theQ.NextLocation();)
-          dstinfo.FloatValue(theQ.FloatValue());
-      }
+  NFmiSlabCopyIndexes indexes(MakeCopyIndexes(theQ, dstinfo, true));
+  NFmiQueryDataUtil::CopySlabs(theQ, dstinfo, indexes, 0);
 
   data2->Write(theOutFile);
 }
@@ -941,41 +1029,11 @@ void RemoveBadTimes(NFmiQueryData& theQD,
  */
 // ----------------------------------------------------------------------
 
-void CopyNonGridData(NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst, bool samePoints)
+void CopyNonGridData(NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst)
 {
-  for (theDst.ResetParam(); theDst.NextParam();)
-  {
-    if (theSrc.Param(theDst.Param()))
-    {
-      for (theDst.ResetLevel(); theDst.NextLevel();)
-      {
-        if (!theSrc.Level(*theDst.Level())) throw runtime_error("Level not available in querydata");
-
-        for (theDst.ResetTime(); theDst.NextTime();)
-        {
-          if (!theSrc.Time(theDst.ValidTime()))
-            throw runtime_error("Time not available in querydata");
-
-          // copy point data quickly if all stations are kept
-          if (samePoints)
-          {
-            for (theDst.ResetLocation(), theSrc.ResetLocation();
-                 theDst.NextLocation() && theSrc.NextLocation();)
-              theDst.FloatValue(theSrc.FloatValue());
-          }
-          else
-          {
-            // slower version if stations are kept & removed
-            for (theDst.ResetLocation(); theDst.NextLocation();)
-            {
-              theSrc.Location(theDst.Location()->GetIdent());
-              theDst.FloatValue(theSrc.FloatValue());
-            }
-          }
-        }
-      }
-    }
-  }
+  // The stations are matched by their identities unless the station lists are identical
+  NFmiSlabCopyIndexes indexes(MakeCopyIndexes(theSrc, theDst, true));
+  CopyValues(theSrc, theDst, indexes);
 }
 
 // ----------------------------------------------------------------------
@@ -986,40 +1044,11 @@ void CopyNonGridData(NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst, bool
 
 void CopySameGridData(NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst)
 {
-  // Establish output timeindexes up front for speed. -1 implies time is not available
+  // Times not available in the source are left missing.
   // We assume there are no time interpolations.
 
-  unsigned long ntimes = theDst.SizeTimes();
-  std::vector<long> timeindexes(ntimes, -1);
-  for (unsigned long i = 0; i < ntimes; i++)
-  {
-    if (theDst.TimeIndex(i) && theSrc.Time(theDst.Time())) timeindexes[i] = theSrc.TimeIndex();
-  }
-
-  for (theDst.ResetParam(); theDst.NextParam();)
-  {
-    if (theSrc.Param(theDst.Param()))
-    {
-      for (theDst.ResetLevel(); theDst.NextLevel();)
-      {
-        if (!theSrc.Level(*theDst.Level())) throw runtime_error("Level not available in querydata");
-
-        for (theDst.ResetLocation(), theSrc.ResetLocation();
-             theDst.NextLocation() && theSrc.NextLocation();)
-        {
-          for (unsigned long i = 0; i < ntimes; i++)
-          {
-            if (timeindexes[i] >= 0)
-            {
-              theDst.TimeIndex(i);
-              theSrc.TimeIndex(timeindexes[i]);
-              theDst.FloatValue(theSrc.FloatValue());
-            }
-          }
-        }
-      }
-    }
-  }
+  NFmiSlabCopyIndexes indexes(MakeCopyIndexes(theSrc, theDst, false));
+  CopyValues(theSrc, theDst, indexes);
 }
 
 // ----------------------------------------------------------------------
@@ -1077,17 +1106,48 @@ void CopyDifferentGridData(NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy a subgrid of the input grid to output info
+ *
+ * The rows of the subgrid are copied as contiguous blocks. Returns
+ * false if the output cannot be copied directly, for example when
+ * time interpolation would be needed.
+ */
+// ----------------------------------------------------------------------
+
+bool CopySubGridData(
+    NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst, int x1, int y1, int dx, int dy)
+{
+  NFmiSlabCopyIndexes indexes;
+  if (!NFmiQueryDataUtil::MakeGridCropIndexes(theSrc, theDst, x1, y1, dx, dy, indexes))
+    return false;
+
+  for (auto index : indexes.itsTimeIndexes)
+    if (index == gMissingIndex) return false;
+
+  CopyValues(theSrc, theDst, indexes);
+  return true;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Copy grid data to output info
  */
 // ----------------------------------------------------------------------
 
-void CopyGridData(NFmiFastQueryInfo& theSrc, NFmiFastQueryInfo& theDst, bool same_area)
+void CopyGridData(NFmiFastQueryInfo& theSrc,
+                  NFmiFastQueryInfo& theDst,
+                  bool same_area,
+                  bool sub_grid,
+                  int x1,
+                  int y1,
+                  int dx,
+                  int dy)
 {
   if (same_area)
     CopySameGridData(theSrc, theDst);
-  else
+  else if (!sub_grid || !CopySubGridData(theSrc, theDst, x1, y1, dx, dy))
     CopyDifferentGridData(theSrc, theDst);
 }
 
@@ -1186,12 +1246,13 @@ int run(int argc, const char* argv[])
   std::string opt_missing_parameter;  // parameter to be checked (default = all)
 
   bool opt_multifile = false;  // -R enables multifile input
+  bool opt_memorymap = false;  // -D writes the output directly to a memory mapped file
 
   vector<NFmiTime> opt_crops;  // -S option
 
   // Read command line arguments
 
-  NFmiCmdLine cmdline(argc, argv, "hVg!G!P!p!r!a!A!l!t!T!d!w!W!i!I!z!Z!S!m!M!Rn!");
+  NFmiCmdLine cmdline(argc, argv, "hVg!G!P!p!r!a!A!l!t!T!d!w!W!i!I!z!Z!S!m!M!RDn!");
   if (cmdline.Status().IsError()) throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
 
   // help option must be checked before checking the number
@@ -1339,6 +1400,14 @@ int run(int argc, const char* argv[])
 
   if (cmdline.isOption('R')) opt_multifile = !opt_multifile;
 
+  if (cmdline.isOption('D')) opt_memorymap = !opt_memorymap;
+
+  if (opt_memorymap && opt_outfile == "-")
+    throw runtime_error("Option -D requires an output filename");
+
+  if (opt_memorymap && (opt_missing_limit > 0 || !opt_renamedparameters.empty()))
+    throw runtime_error("Option -D cannot be used with options -m and -n");
+
   if (!opt_parameters.empty() && !opt_delparameters.empty())
     throw runtime_error("Options -p and -r are mutually exclusive");
 
@@ -1421,34 +1490,58 @@ int run(int argc, const char* argv[])
 
   // now create new data based on the new descriptors
 
-  NFmiFastQueryInfo info(pdesc, tdesc, hdesc, vdesc, version);
-  boost::shared_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(info));
-  if (data.get() == 0) throw runtime_error("Could not allocate memory for result data");
+  // A memory mapped output is created under a temporary name so that a failed
+  // crop does not leave a partial file under the output name
 
-  NFmiFastQueryInfo dstinfo(data.get());
+  string tmpfile;
+  if (opt_memorymap)
+    tmpfile = boost::filesystem::unique_path(opt_outfile + ".%%%%-%%%%-%%%%-%%%%.tmp").string();
 
-  // finally fill the new data with values
+  NFmiFastQueryInfo info(pdesc, tdesc, hdesc, vdesc, version);
+  boost::shared_ptr<NFmiQueryData> data;
 
   bool same_stations = (opt_stations.empty() && opt_nostations.empty());
 
-  if (dstinfo.Grid())
+  try
   {
-    bool same_area =
-        (opt_geometry.empty() && opt_bounds.empty() && opt_steps.empty() && opt_proj.empty());
-    CopyGridData(*srcinfo, dstinfo, same_area);
-  }
-  else
-    CopyNonGridData(*srcinfo, dstinfo, same_stations);
+    data.reset(opt_memorymap ? NFmiQueryDataUtil::CreateEmptyData(info, tmpfile, true)
+                             : NFmiQueryDataUtil::CreateEmptyData(info));
+    if (data.get() == 0) throw runtime_error("Could not allocate memory for result data");
 
-  // Copy parameter values from origin time if necessary
+    NFmiFastQueryInfo dstinfo(data.get());
 
-  if (!opt_analysisparameters.empty())
-    CopyAnalysisParameters(*srcinfo, dstinfo, opt_analysisparameters, same_stations);
+    // finally fill the new data with values
+
+    if (dstinfo.Grid())
+    {
+      bool same_area =
+          (opt_geometry.empty() && opt_bounds.empty() && opt_steps.empty() && opt_proj.empty());
+      bool sub_grid = opt_proj.empty();
+      CopyGridData(*srcinfo, dstinfo, same_area, sub_grid, x1, y1, dx, dy);
+    }
+    else
+      CopyNonGridData(*srcinfo, dstinfo);
+
+    // Copy parameter values from origin time if necessary
+
+    if (!opt_analysisparameters.empty())
+      CopyAnalysisParameters(*srcinfo, dstinfo, opt_analysisparameters, same_stations);
+  }
+  catch (...)
+  {
+    if (opt_memorymap)
+    {
+      data.reset();
+      NFmiFileSystem::RemoveFile(tmpfile);
+    }
+    throw;
+  }
 
   // Remove timesteps with too much missing data
 
   if (opt_missing_limit > 0)
   {
+    NFmiFastQueryInfo dstinfo(data.get());
     set<NFmiMetTime> badtimes = FindBadTimes(dstinfo, opt_missing_limit, opt_missing_parameter);
     if (!badtimes.empty())
     {
@@ -1459,17 +1552,8 @@ int run(int argc, const char* argv[])
       if (data2 == 0) throw runtime_error("Could not allocate memory for result data");
       NFmiFastQueryInfo dstinfo2(data2);
 
-      for (dstinfo2.ResetParam(), dstinfo.ResetParam();
-           dstinfo2.NextParam() && dstinfo.NextParam();)
-        for (dstinfo2.ResetLevel(), dstinfo.ResetLevel();
-             dstinfo2.NextLevel() && dstinfo.NextLevel();)
-          for (dstinfo2.ResetTime(); dstinfo2.NextTime();)
-          {
-            dstinfo.Time(dstinfo2.ValidTime());
-            for (dstinfo2.ResetLocation(), dstinfo.ResetLocation();
-                 dstinfo2.NextLocation() && dstinfo.NextLocation();)
-              dstinfo2.FloatValue(dstinfo.FloatValue());
-          }
+      NFmiSlabCopyIndexes indexes(MakeCopyIndexes(dstinfo, dstinfo2, true));
+      NFmiQueryDataUtil::CopySlabs(dstinfo, dstinfo2, indexes, 0);
 
       data.reset(data2);
     }
@@ -1499,7 +1583,17 @@ int run(int argc, const char* argv[])
     }
   }
 
-  data->Write(opt_outfile);
+  if (!opt_memorymap)
+    data->Write(opt_outfile);
+  else
+  {
+    data.reset();  // flush and unmap before renaming
+    if (!NFmiFileSystem::RenameFile(tmpfile, opt_outfile))
+    {
+      NFmiFileSystem::RemoveFile(tmpfile);
+      throw runtime_error("Could not rename " + tmpfile + " to " + opt_outfile);
+    }
+  }
 
   delete srcinfo;
   delete qd;
@@ -45,6 +45,7 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -291,6 +292,80 @@ void print_change_analysis(NFmiFastQueryInfo& theQ1, NFmiFastQueryInfo& theQ2)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Find the data 2 times whose values have changed from data 1
+ *
+ * A time common to both datas has changed if a data 2 parameter is
+ * missing from data 1 or if any value differs on the first common
+ * level. As before, the values on the other levels are not compared.
+ * If levels_must_match is true, a data 2 level missing from data 1
+ * changes all common times too. The values are compared as whole
+ * time series per location, a time is not compared any further once
+ * a change has been found in it.
+ */
+// ----------------------------------------------------------------------
+
+vector<bool> find_changed_times(NFmiFastQueryInfo& theQ1,
+                                NFmiFastQueryInfo& theQ2,
+                                bool levels_must_match)
+{
+  vector<unsigned long> time_indexes;
+  for (theQ2.ResetTime(); theQ2.NextTime();)
+    time_indexes.push_back(theQ1.Time(theQ2.ValidTime()) ? theQ1.TimeIndex() : gMissingIndex);
+
+  bool level_found = false;
+  bool level_missing = false;
+  vector<unsigned long> level_indexes;
+  for (theQ2.ResetLevel(); theQ2.NextLevel();)
+  {
+    if (theQ1.Level(*theQ2.Level()))
+    {
+      level_indexes.push_back(level_found ? gMissingIndex : theQ1.LevelIndex());
+      level_found = true;
+    }
+    else
+    {
+      level_missing = true;
+      level_indexes.push_back(gMissingIndex);
+    }
+  }
+
+  map<FmiParameterName, bool> param_checked;
+  bool param_missing = false;
+  NFmiQueryDataUtil::ValueComparisonParams params;
+  for (theQ2.ResetParam(); theQ2.NextParam();)
+  {
+    FmiParameterName p = FmiParameterName(theQ2.Param().GetParam()->GetIdent());
+    if (param_checked[p] == true) continue;
+    param_checked[p] = true;
+
+    if (!theQ1.Param(theQ2.Param()))
+      param_missing = true;
+    else
+      params.emplace_back(boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theQ1)),
+                          boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theQ2)));
+  }
+
+  vector<bool> changed(time_indexes.size(), false);
+
+  // A missing level or parameter changes all common times
+
+  if ((levels_must_match && level_missing) || (level_found && param_missing))
+  {
+    for (size_t t = 0; t < time_indexes.size(); t++)
+      changed[t] = (time_indexes[t] != gMissingIndex);
+    return changed;
+  }
+
+  vector<NFmiValueDifference> differences =
+      NFmiQueryDataUtil::CompareValues(params, time_indexes, level_indexes, true);
+  for (size_t i = 0; i < differences.size(); i++)
+    if (differences[i].itsDifferentCount > 0) changed[i % time_indexes.size()] = true;
+
+  return changed;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Extract any changes
@@ -301,41 +376,13 @@ const NFmiTimeList extract_all(NFmiFastQueryInfo& theQ1, NFmiFastQueryInfo& theQ
 {
   NFmiTimeList times;
 
-  for (theQ2.ResetTime(); theQ2.NextTime();)
-  {
-    map<FmiParameterName, bool> param_checked;
+  vector<bool> changed = find_changed_times(theQ1, theQ2, true);
 
-    bool different = false;
+  unsigned long t = 0;
+  for (theQ2.ResetTime(); theQ2.NextTime(); t++)
+  {
     // If data 1 does not have the time, we must output it
-    if (!theQ1.Time(theQ2.ValidTime()))
-      different = true;
-    else
-    {
-      for (theQ2.ResetLevel(); !different && theQ2.NextLevel();)
-      {
-        if (!theQ1.Level(*theQ2.Level()))
-          different = true;
-        else
-        {
-          for (theQ2.ResetParam(); !different && theQ2.NextParam();)
-          {
-            FmiParameterName p = FmiParameterName(theQ2.Param().GetParam()->GetIdent());
-            if (param_checked[p] == true) continue;
-            param_checked[p] = true;
-
-            if (!theQ1.Param(theQ2.Param()))
-              different = true;
-            else
-            {
-              for (theQ2.ResetLocation(), theQ1.ResetLocation();
-                   !different && theQ2.NextLocation() && theQ1.NextLocation();)
-                different = (theQ1.FloatValue() != theQ2.FloatValue());
-            }
-          }
-        }
-      }
-    }
-    if (different)
+    if (changed[t] || !theQ1.Time(theQ2.ValidTime()))
     {
       if (options.verbose) cout << "Different time: " << theQ2.ValidTime() << endl;
       times.Add(new NFmiMetTime(theQ2.ValidTime()));
@@ -378,36 +425,12 @@ const NFmiTimeList extract_params(NFmiFastQueryInfo& theQ1, NFmiFastQueryInfo& t
 {
   NFmiTimeList times;
 
-  for (theQ2.ResetTime(); theQ2.NextTime();)
-  {
-    map<FmiParameterName, bool> param_checked;
+  vector<bool> changed = find_changed_times(theQ1, theQ2, false);
 
-    bool different = false;
-    if (theQ1.Time(theQ2.ValidTime()))
-    {
-      for (theQ2.ResetLevel(); !different && theQ2.NextLevel();)
-      {
-        if (theQ1.Level(*theQ2.Level()))
-        {
-          for (theQ2.ResetParam(); !different && theQ2.NextParam();)
-          {
-            FmiParameterName p = FmiParameterName(theQ2.Param().GetParam()->GetIdent());
-            if (param_checked[p] == true) continue;
-            param_checked[p] = true;
-
-            if (!theQ1.Param(theQ2.Param()))
-              different = true;
-            else
-            {
-              for (theQ2.ResetLocation(), theQ1.ResetLocation();
-                   !different && theQ2.NextLocation() && theQ1.NextLocation();)
-                different = (theQ1.FloatValue() != theQ2.FloatValue());
-            }
-          }
-        }
-      }
-    }
-    if (different)
+  unsigned long t = 0;
+  for (theQ2.ResetTime(); theQ2.NextTime(); t++)
+  {
+    if (changed[t])
     {
       if (options.verbose) cout << "Different time: " << theQ2.ValidTime() << endl;
       times.Add(new NFmiMetTime(theQ2.ValidTime()));
@@ -483,16 +506,14 @@ void process_difference()
 
   if (data.get() == 0) throw runtime_error("Could not allocate memory for result data");
 
-  // Copy the values
+  // Copy the values as raw data slabs
 
-  for (q.ResetLevel(), q2.ResetLevel(); q.NextLevel() && q2.NextLevel();)
-    for (q.ResetParam(), q2.ResetParam(); q.NextParam() && q2.NextParam();)
-      for (q.ResetTime(); q.NextTime();)
-      {
-        if (!q2.Time(q.ValidTime())) throw runtime_error("Failed to copy a required time");
-        for (q.ResetLocation(), q2.ResetLocation(); q.NextLocation() && q2.NextLocation();)
-          q.FloatValue(q2.FloatValue());
-      }
+  NFmiSlabCopyIndexes indexes;
+  if (!NFmiQueryDataUtil::MakeSlabCopyIndexes(q2, q, indexes))
+    throw runtime_error("Failed to map the changed timesteps for copying");
+  for (auto t : indexes.itsTimeIndexes)
+    if (t == gMissingIndex) throw runtime_error("Failed to copy a required time");
+  NFmiQueryDataUtil::CopySlabs(q2, q, indexes, 0);
 
   // And write the data
 
@@ -34,6 +34,7 @@
 #include <newbase/NFmiCmdLine.h>
 #include <newbase/NFmiEnumConverter.h>
 #include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiStreamQueryData.h>
 #include <newbase/NFmiStringTools.h>
 
@@ -360,6 +361,113 @@ double analyze_given_parameters_now(NFmiFastQueryInfo& theQ1, NFmiFastQueryInfo&
     return maxdiff;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parameter pairs of all parameters and sub parameters
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryDataUtil::ValueComparisonParams all_parameter_pairs(NFmiFastQueryInfo& theQ1,
+                                                             NFmiFastQueryInfo& theQ2)
+{
+  bool ignoresubs = false;
+  NFmiQueryDataUtil::ValueComparisonParams params;
+  for (theQ1.ResetParam(), theQ2.ResetParam();
+       theQ1.NextParam(ignoresubs) && theQ2.NextParam(ignoresubs);)
+    params.emplace_back(boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theQ1)),
+                        boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theQ2)));
+  return params;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parameter pairs of the parameters given with -P
+ *
+ * The pairs end at the first parameter missing from either file.
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryDataUtil::ValueComparisonParams given_parameter_pairs(NFmiFastQueryInfo& theQ1,
+                                                               NFmiFastQueryInfo& theQ2)
+{
+  NFmiQueryDataUtil::ValueComparisonParams params;
+  for (unsigned int i = 0; i < options.parameters.size(); i++)
+  {
+    if (!theQ1.Param(options.parameters[i]) || !theQ2.Param(options.parameters[i])) break;
+    params.emplace_back(boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theQ1)),
+                        boost::shared_ptr<NFmiFastQueryInfo>(new NFmiFastQueryInfo(theQ2)));
+  }
+  return params;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Compare the parameter pairs for all common times
+ *
+ * Times, levels and locations are paired by their indexes. The result
+ * is indexed by [parameter * time size of data 2 + time].
+ */
+// ----------------------------------------------------------------------
+
+vector<NFmiValueDifference> compare(const NFmiQueryDataUtil::ValueComparisonParams& theParams,
+                                    NFmiFastQueryInfo& theQ1,
+                                    NFmiFastQueryInfo& theQ2)
+{
+  vector<unsigned long> time_indexes;
+  for (unsigned long t = 0; t < theQ2.SizeTimes(); t++)
+    time_indexes.push_back(t < theQ1.SizeTimes() ? t : gMissingIndex);
+
+  vector<unsigned long> level_indexes;
+  for (unsigned long l = 0; l < theQ2.SizeLevels(); l++)
+    level_indexes.push_back(l < theQ1.SizeLevels() ? l : gMissingIndex);
+
+  return NFmiQueryDataUtil::CompareValues(theParams, time_indexes, level_indexes, false);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Combine the comparisons of the given parameter and time ranges
+ */
+// ----------------------------------------------------------------------
+
+NFmiValueDifference combine(const vector<NFmiValueDifference>& theDifferences,
+                            unsigned long theTimeSize,
+                            unsigned long theParamBegin,
+                            unsigned long theParamEnd,
+                            unsigned long theTimeBegin,
+                            unsigned long theTimeEnd)
+{
+  NFmiValueDifference result;
+  for (unsigned long p = theParamBegin; p < theParamEnd; p++)
+    for (unsigned long t = theTimeBegin; t < theTimeEnd; t++)
+    {
+      const NFmiValueDifference& difference = theDifferences[p * theTimeSize + t];
+      result.itsMaxDifference = max(result.itsMaxDifference, difference.itsMaxDifference);
+      result.itsValueCount += difference.itsValueCount;
+      result.itsDifferentCount += difference.itsDifferentCount;
+      result.fNaNDifference = result.fNaNDifference || difference.fNaNDifference;
+    }
+  return result;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The reported difference of a combined comparison
+ */
+// ----------------------------------------------------------------------
+
+double reported_difference(const NFmiValueDifference& theDifference)
+{
+  if (options.percentage)
+  {
+    int points = static_cast<int>(theDifference.itsValueCount);
+    int differentpoints = static_cast<int>(theDifference.itsDifferentCount);
+    return 100.0 * differentpoints / points;
+  }
+  else
+    return theDifference.itsMaxDifference;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Make sure the data is comparable
@@ -422,14 +530,36 @@ int domain(int argc, const char* argv[])
 
   NFmiEnumConverter converter;
 
-  // Establish what to do
+  // Establish what to do. The values are compared in bulk, the value by value
+  // analysis is used only when NaN differences make the maximum order dependent.
 
   double difference = 0.0;
   if (options.alltimesteps)
   {
-    for (q1->ResetTime(), q2->ResetTime(); q1->NextTime() && q2->NextTime();)
+    const unsigned long timesize = q2->SizeTimes();
+    NFmiQueryDataUtil::ValueComparisonParams params;
+    vector<NFmiValueDifference> differences;
+
+    unsigned long t = 0;
+    for (q1->ResetTime(), q2->ResetTime(); q1->NextTime() && q2->NextTime(); t++)
     {
-      if (options.parameters.empty())
+      if (t == 0)
+      {
+        if (options.parameters.empty())
+          params = all_parameter_pairs(*q1, *q2);
+        else
+        {
+          params = given_parameter_pairs(*q1, *q2);
+          if (params.size() < options.parameters.size())
+            throw runtime_error("The files must contain the parameters given with -P");
+        }
+        differences = compare(params, *q1, *q2);
+      }
+
+      NFmiValueDifference result = combine(differences, timesize, 0, params.size(), t, t + 1);
+      if (!result.fNaNDifference)
+        difference = reported_difference(result);
+      else if (options.parameters.empty())
         difference = analyze_all_parameters_now(*q1, *q2);
       else
         difference = analyze_given_parameters_now(*q1, *q2);
@@ -441,13 +571,23 @@ int domain(int argc, const char* argv[])
   }
   else
   {
+    const unsigned long timesize = q2->SizeTimes();
     if (options.allparams)
     {
+      NFmiQueryDataUtil::ValueComparisonParams params = all_parameter_pairs(*q1, *q2);
+      vector<NFmiValueDifference> differences = compare(params, *q1, *q2);
+
       bool ignoresubs = false;
+      unsigned long p = 0;
       for (q1->ResetParam(), q2->ResetParam();
-           q1->NextParam(ignoresubs) && q2->NextParam(ignoresubs);)
+           q1->NextParam(ignoresubs) && q2->NextParam(ignoresubs);
+           p++)
       {
-        difference = analyze_this_parameter(*q1, *q2);
+        NFmiValueDifference result = combine(differences, timesize, p, p + 1, 0, timesize);
+        if (!result.fNaNDifference)
+          difference = reported_difference(result);
+        else
+          difference = analyze_this_parameter(*q1, *q2);
         cout << converter.ToString(q1->Param().GetParamIdent()) << '\t' << difference << endl;
 
         if (options.epsilon > 0 && difference > options.epsilon)
@@ -456,18 +596,32 @@ int domain(int argc, const char* argv[])
     }
     else if (options.parameters.empty())
     {
-      difference = analyze_all_parameters(*q1, *q2);
+      NFmiQueryDataUtil::ValueComparisonParams params = all_parameter_pairs(*q1, *q2);
+      vector<NFmiValueDifference> differences = compare(params, *q1, *q2);
+
+      NFmiValueDifference result = combine(differences, timesize, 0, params.size(), 0, timesize);
+      if (!result.fNaNDifference)
+        difference = reported_difference(result);
+      else
+        difference = analyze_all_parameters(*q1, *q2);
       cout << difference << endl;
       if (options.epsilon > 0 && difference > options.epsilon)
         throw runtime_error("Error limit exceeded");
     }
     else
     {
+      NFmiQueryDataUtil::ValueComparisonParams params = given_parameter_pairs(*q1, *q2);
+      vector<NFmiValueDifference> differences = compare(params, *q1, *q2);
+
       for (unsigned int i = 0; i < options.parameters.size(); i++)
       {
         if (!q1->Param(options.parameters[i]) || !q2->Param(options.parameters[i]))
           throw runtime_error("The files must contain the parameters given with -P");
-        difference = analyze_this_parameter(*q1, *q2);
+        NFmiValueDifference result = combine(differences, timesize, i, i + 1, 0, timesize);
+        if (!result.fNaNDifference)
+          difference = reported_difference(result);
+        else
+          difference = analyze_this_parameter(*q1, *q2);
         cout << converter.ToString(q1->Param().GetParamIdent()) << '\t' << difference << endl;
         if (options.epsilon > 0 && difference > options.epsilon)
           throw runtime_error("Error limit exceeded");
@@ -60,6 +60,8 @@
  * <dd>Define the hour to be extracted (local time)</dd>
  * <dt>-I [hour,...]</dt>
  * <dd>Define the hour to be extracted (UTC time)</dd>
+ * <dt>-j [threads]</dt>
+ * <dd>Maximum number of threads used, by default a reasonable number</dd>
  * </dd>
  * </dl>
  *
@@ -94,10 +96,15 @@
 
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cmath>
 #include <deque>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace std;
 using namespace boost;
@@ -172,6 +179,9 @@ void usage()
        << "-I <hour>" << endl
        << "\tThe hour to be extracted (UTC time)" << endl
        << endl
+       << "-j <threads>" << endl
+       << "\tMaximum number of threads used (default: a reasonable number)" << endl
+       << endl
        << "For example, to calculate 06-18 UTC temperature maximum use" << endl
        << endl
        << "\tqdfilter -p Temperature -I 18 - -720 0 max filename.sqd > tmax.sqd" << endl
@@ -372,6 +382,329 @@ boost::shared_ptr<NFmiDataModifier> create_modifier(const string& theName)
   throw runtime_error("Unknown function: '" + theName + "'");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief The source time index range integrated for one output time
+ *
+ * NFmiDataIntegrator::Integrate returns a missing value if the start
+ * time is not in the data, otherwise it integrates from the start time
+ * up to the last time not after the end time, but always at least the
+ * start time itself.
+ */
+// ----------------------------------------------------------------------
+
+struct TimeWindow
+{
+  bool ok;
+  unsigned long start;
+  unsigned long end;  // inclusive
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the source time windows for all output times
+ *
+ * The windows are the same for all parameters, locations and levels,
+ * and both ends are nondecreasing since the output times are.
+ */
+// ----------------------------------------------------------------------
+
+vector<TimeWindow> make_time_windows(NFmiFastQueryInfo& theSrc,
+                                     NFmiFastQueryInfo& theDst,
+                                     int theStartOffset,
+                                     int theEndOffset)
+{
+  vector<TimeWindow> windows;
+  for (theDst.ResetTime(); theDst.NextTime();)
+  {
+    NFmiMetTime starttime = theDst.ValidTime();
+    NFmiMetTime endtime = theDst.ValidTime();
+    starttime.ChangeByMinutes(theStartOffset);
+    endtime.ChangeByMinutes(theEndOffset);
+
+    TimeWindow window{false, 0, 0};
+    if (theSrc.Time(starttime))
+    {
+      window.ok = true;
+      window.start = window.end = theSrc.TimeIndex();
+      while (theSrc.NextTime() && theSrc.Time() <= endtime)
+        window.end = theSrc.TimeIndex();
+    }
+    windows.push_back(window);
+  }
+  return windows;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sliding window filter for one contiguous time series
+ *
+ * min and max use monotonic deques and change only the window ends,
+ * median keeps the window values sorted while it slides. Each of them
+ * reproduces the corresponding modifier exactly. Other functions are
+ * accumulated in floats by the modifiers, and a running sum would round
+ * differently, so for them (and for median with NaNs or negative zeros,
+ * whose sort order is not unique) the modifier is fed from the series.
+ */
+// ----------------------------------------------------------------------
+
+class WindowFilter
+{
+ public:
+  WindowFilter(const string& theFunction, const vector<TimeWindow>& theWindows)
+      : itsFunction(theFunction), itsWindows(theWindows), itsModifier(create_modifier(theFunction))
+  {
+  }
+
+  void Filter(const vector<float>& theSeries, vector<float>& theResult)
+  {
+    theResult.assign(itsWindows.size(), kFloatMissing);
+    if (itsFunction == "min")
+      FilterExtremes(theSeries, theResult, false);
+    else if (itsFunction == "max")
+      FilterExtremes(theSeries, theResult, true);
+    else if (itsFunction == "change")
+      FilterChange(theSeries, theResult);
+    else if (itsFunction == "median" && !HasUnorderedValues(theSeries))
+      FilterMedian(theSeries, theResult);
+    else
+      FilterWithModifier(theSeries, theResult);
+  }
+
+ private:
+  static bool IsMissing(float theValue)
+  {
+    return theValue == kFloatMissing || theValue == kRadarPrecipitationMissing;
+  }
+
+  static bool HasUnorderedValues(const vector<float>& theSeries)
+  {
+    for (float value : theSeries)
+      if (value != value || (value == 0 && signbit(value))) return true;
+    return false;
+  }
+
+  void FilterWithModifier(const vector<float>& theSeries, vector<float>& theResult)
+  {
+    for (size_t i = 0; i < itsWindows.size(); i++)
+    {
+      const TimeWindow& window = itsWindows[i];
+      if (!window.ok) continue;
+      itsModifier->Clear();
+      for (unsigned long t = window.start; t <= window.end; t++)
+        itsModifier->Calculate(theSeries[t]);
+      theResult[i] = itsModifier->CalculationResult();
+    }
+  }
+
+  // NFmiDataModifierMin/Max start from +-3.4E+38 and accept only strictly better
+  // values, so unacceptable values can be replaced by the start value.
+  void FilterExtremes(const vector<float>& theSeries, vector<float>& theResult, bool isMax)
+  {
+    const float initvalue = (isMax ? -3.4E+38f : 3.4E+38f);
+    itsValues.resize(theSeries.size());
+    for (size_t t = 0; t < theSeries.size(); t++)
+    {
+      float value = theSeries[t];
+      bool accepted = !IsMissing(value) && (isMax ? value > initvalue : value < initvalue);
+      itsValues[t] = (accepted ? value : initvalue);
+    }
+
+    itsQueue.resize(theSeries.size());
+    size_t head = 0;
+    size_t tail = 0;
+    unsigned long next = 0;
+    for (size_t i = 0; i < itsWindows.size(); i++)
+    {
+      const TimeWindow& window = itsWindows[i];
+      if (!window.ok) continue;
+      next = max(next, window.start);
+      for (; next <= window.end; next++)
+      {
+        // Equal values stay in the queue so that the first one wins as in the modifiers
+        float value = itsValues[next];
+        while (tail > head && (isMax ? itsValues[itsQueue[tail - 1]] < value
+                                     : itsValues[itsQueue[tail - 1]] > value))
+          tail--;
+        itsQueue[tail++] = next;
+      }
+      while (itsQueue[head] < window.start)
+        head++;
+      float value = itsValues[itsQueue[head]];
+      theResult[i] = (value == initvalue ? kFloatMissing : value);
+    }
+  }
+
+  // Same as NFmiDataModifierChange
+  void FilterChange(const vector<float>& theSeries, vector<float>& theResult)
+  {
+    for (size_t i = 0; i < itsWindows.size(); i++)
+    {
+      const TimeWindow& window = itsWindows[i];
+      if (!window.ok) continue;
+      float first = theSeries[window.start];
+      float last = theSeries[window.end];
+      if (first == kFloatMissing)
+        theResult[i] = last;
+      else if (last == kFloatMissing)
+        theResult[i] = kFloatMissing;
+      else
+        theResult[i] = last - first;
+    }
+  }
+
+  // Same as NFmiDataModifierMedian with the default 50% limit
+  void FilterMedian(const vector<float>& theSeries, vector<float>& theResult)
+  {
+    itsSorted.clear();
+    unsigned long first = 0;
+    unsigned long next = 0;
+    for (size_t i = 0; i < itsWindows.size(); i++)
+    {
+      const TimeWindow& window = itsWindows[i];
+      if (!window.ok) continue;
+      if (next <= window.start)
+      {
+        itsSorted.clear();
+        first = next = window.start;
+      }
+      for (; first < window.start; first++)
+      {
+        float value = theSeries[first];
+        if (!IsMissing(value))
+          itsSorted.erase(lower_bound(itsSorted.begin(), itsSorted.end(), value));
+      }
+      for (; next <= window.end; next++)
+      {
+        float value = theSeries[next];
+        if (!IsMissing(value))
+          itsSorted.insert(upper_bound(itsSorted.begin(), itsSorted.end(), value), value);
+      }
+      if (!itsSorted.empty())
+        theResult[i] = itsSorted[static_cast<int>(itsSorted.size() * 50.f / 100.f)];
+    }
+  }
+
+  const string& itsFunction;
+  const vector<TimeWindow>& itsWindows;
+  boost::shared_ptr<NFmiDataModifier> itsModifier;
+  vector<unsigned long> itsQueue;
+  vector<float> itsValues;
+  vector<float> itsSorted;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter time series handed out by the range calculator
+ *
+ * A series is the full time series of one parameter, location and
+ * level, which is contiguous in the data. The infos are not moved,
+ * so all threads can share them.
+ */
+// ----------------------------------------------------------------------
+
+void filter_series(NFmiFastQueryInfo& theSrc,
+                   NFmiFastQueryInfo& theDst,
+                   const vector<pair<unsigned long, unsigned long> >& theParamIndexes,
+                   const string& theFunction,
+                   const vector<TimeWindow>& theWindows,
+                   NFmiLocationIndexRangeCalculator& theSeriesRange)
+{
+  WindowFilter filter(theFunction, theWindows);
+  const unsigned long locations = theDst.SizeLocations();
+  const unsigned long levels = theDst.SizeLevels();
+  vector<float> series;
+  vector<float> result;
+
+  unsigned long start = 0;
+  unsigned long end = 0;
+  while (theSeriesRange.GetCurrentLocationRange(start, end))
+  {
+    for (unsigned long i = start; i <= end; i++)
+    {
+      const unsigned long level = i % levels;
+      const unsigned long location = (i / levels) % locations;
+      const auto& params = theParamIndexes[i / levels / locations];
+
+      if (!theSrc.GetValues(
+              theSrc.Index(params.first, location, level, 0), 1, theSrc.SizeTimes(), series))
+        continue;
+
+      filter.Filter(series, result);
+
+      // NFmiFastQueryInfo::FloatValue did not set non-finite values
+      for (auto& value : result)
+        if (!FmiIsValidNumber(value)) value = kFloatMissing;
+
+      theDst.SetValues(theDst.Index(params.second, location, level, 0), 1, result.size(), result);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter all data one time series at a time
+ *
+ * Returns false if the data cannot be accessed as contiguous time series,
+ * in which case nothing has been done.
+ */
+// ----------------------------------------------------------------------
+
+bool filter_windowed(NFmiFastQueryInfo& theSrc,
+                     NFmiFastQueryInfo& theDst,
+                     const string& theFunction,
+                     int theStartOffset,
+                     int theEndOffset,
+                     unsigned int theMaxThreadCount)
+{
+  // Multifile infos have no single raw data
+
+  if (dynamic_cast<NFmiMultiQueryInfo*>(&theSrc) != nullptr) return false;
+
+  // Sub parameter values are calculated on the fly, not stored
+
+  vector<pair<unsigned long, unsigned long> > paramindexes;
+  for (theDst.ResetParam(); theDst.NextParam();)
+  {
+    if (!theSrc.Param(theDst.Param())) throw runtime_error("Internal error in parameter loop");
+    if (theSrc.IsSubParamUsed() || theDst.IsSubParamUsed()) return false;
+    paramindexes.push_back(make_pair(theSrc.ParamIndex(), theDst.ParamIndex()));
+  }
+
+  const vector<TimeWindow> windows =
+      make_time_windows(theSrc, theDst, theStartOffset, theEndOffset);
+
+  const unsigned long seriescount =
+      paramindexes.size() * theDst.SizeLocations() * theDst.SizeLevels();
+  if (seriescount == 0) return true;
+
+  // Chunks of a few hundred series keep the range calculator locking cheap
+  NFmiLocationIndexRangeCalculator seriesrange(seriescount, 256);
+
+  unsigned int threadcount = NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+      75, static_cast<unsigned int>(seriescount / 256 + 1));
+  if (theMaxThreadCount > 0) threadcount = min(threadcount, theMaxThreadCount);
+
+  if (threadcount <= 1)
+  {
+    filter_series(theSrc, theDst, paramindexes, theFunction, windows, seriesrange);
+    return true;
+  }
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadcount; i++)
+    threads.add_thread(new boost::thread(filter_series,
+                                         boost::ref(theSrc),
+                                         boost::ref(theDst),
+                                         boost::cref(paramindexes),
+                                         boost::cref(theFunction),
+                                         boost::cref(windows),
+                                         boost::ref(seriesrange)));
+  threads.join_all();
+
+  return true;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief The main work subroutine for the main program
@@ -397,10 +730,11 @@ int run(int argc, const char* argv[])
   int opt_endoffset = 0;
   string opt_function = "";
   string opt_outfile = "-";
+  unsigned int opt_threadcount = 0;  // 0 = reasonable default
 
   // Read command line arguments
 
-  NFmiCmdLine cmdline(argc, argv, "hQap!t!T!i!I!o!");
+  NFmiCmdLine cmdline(argc, argv, "hQap!t!T!i!I!o!j!");
   if (cmdline.Status().IsError()) throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
 
   // help option must be checked before checking the number
@@ -464,6 +798,9 @@ int run(int argc, const char* argv[])
 
   if (cmdline.isOption('a')) opt_lasttime = true;
 
+  if (cmdline.isOption('j'))
+    opt_threadcount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   if (opt_lasttime && (cmdline.isOption('t') || cmdline.isOption('T') || cmdline.isOption('i') ||
                        cmdline.isOption('I')))
     throw runtime_error("Cannot use option -a with options -tTiI");
@@ -526,6 +863,13 @@ int run(int argc, const char* argv[])
     if (opt_startoffset < -minutes) opt_startoffset = -minutes;
   }
 
+  if (filter_windowed(
+          *srcinfo, dstinfo, opt_function, opt_startoffset, opt_endoffset, opt_threadcount))
+  {
+    data->Write(opt_outfile);
+    return 0;
+  }
+
   // set the data modifier
   boost::shared_ptr<NFmiDataModifier> modifier = create_modifier(opt_function);
 
@@ -27,11 +27,6 @@
  *   - -T [zone] for specifying the timezone
  *   - -P [param1,param2..] for specifying the parameters
  *   - -Z do not print a result if the result is zero
- *
- * Note! The code relies on the g++ macro definition for NAN.
- * For other compilers we must define the constant by ourselves.
- * Note that the bit pattern is different on Big Endian and Little
- * Endian machines, better leave the problem to GCC.
  */
 // ======================================================================
 
@@ -42,6 +37,7 @@
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiFileSystem.h>
 #include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryDataUtil.h>
 #include <newbase/NFmiSettings.h>
 #include <newbase/NFmiStringTools.h>
 
@@ -51,11 +47,6 @@
 #include <stdexcept>
 #include <vector>
 
-// Windows _isnan definition is here
-#ifndef UNIX
-#include <float.h>
-#endif
-
 using namespace std;
 
 // ----------------------------------------------------------------------
@@ -204,34 +195,18 @@ bool parse_command_line(int argc, const char* argv[])
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values
+ * \brief Calculate percentage of missing values from all parameters
+ *
+ * \param theMissingCounts The missing counts of the parameters
+ * \param theValueCount The number of values analyzed from each parameter
  */
 // ----------------------------------------------------------------------
 
-int analyze_all_parameters(NFmiFastQueryInfo& theQ)
+int analyze_all_parameters(const vector<size_t>& theMissingCounts, size_t theValueCount)
 {
-  bool ignoresubs = false;
-  size_t total_count = 0;
-  size_t missing_count = 0;
-
-  for (theQ.ResetParam(); theQ.NextParam(ignoresubs);)
-    for (theQ.ResetLocation(); theQ.NextLocation();)
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-        for (theQ.ResetTime(); theQ.NextTime();)
-        {
-          ++total_count;
-          if (options.checknan)
-          {
-#ifdef UNIX
-            if (isnan(theQ.FloatValue()))
-#else
-            if (_isnan(theQ.FloatValue()))
-#endif
-              ++missing_count;
-          }
-          else if (theQ.FloatValue() == kFloatMissing)
-            ++missing_count;
-        }
+  size_t total_count = theMissingCounts.size() * theValueCount;
+  size_t missing_count =
+      accumulate(theMissingCounts.begin(), theMissingCounts.end(), static_cast<size_t>(0));
 
   if (options.checknan || options.printcount) return missing_count;
 
@@ -243,44 +218,29 @@ int analyze_all_parameters(NFmiFastQueryInfo& theQ)
 // ----------------------------------------------------------------------
 /*!
  * \brief Calculate percentage of missing values from specified parameters
+ *
+ * \param theMissingCounts The missing counts of the parameters
+ * \param theFound Whether each parameter was found in the data
+ * \param theValueCount The number of values analyzed from each parameter
+ * \param theNotFoundValue The value used for parameters not in the data
  */
 // ----------------------------------------------------------------------
 
-int analyze_given_parameters(NFmiFastQueryInfo& theQ)
+int analyze_given_parameters(const vector<size_t>& theMissingCounts,
+                             const vector<bool>& theFound,
+                             size_t theValueCount,
+                             float theNotFoundValue)
 {
   vector<float> percentages;
 
-  for (unsigned int i = 0; i < options.parameters.size(); i++)
+  for (unsigned int i = 0; i < theMissingCounts.size(); i++)
   {
-    if (!theQ.Param(options.parameters[i]))
-    {
-      if (options.printcount)
-        percentages.push_back(kFloatMissing);
-      else
-        percentages.push_back(100.0);
-    }
+    if (!theFound[i])
+      percentages.push_back(theNotFoundValue);
     else
     {
-      size_t total_count = 0;
-      size_t missing_count = 0;
-
-      for (theQ.ResetLocation(); theQ.NextLocation();)
-        for (theQ.ResetLevel(); theQ.NextLevel();)
-          for (theQ.ResetTime(); theQ.NextTime();)
-          {
-            ++total_count;
-            if (options.checknan)
-            {
-#ifdef UNIX
-              if (isnan(theQ.FloatValue()))
-#else
-              if (_isnan(theQ.FloatValue()))
-#endif
-                ++missing_count;
-            }
-            else if (theQ.FloatValue() == kFloatMissing)
-              ++missing_count;
-          }
+      size_t total_count = theValueCount;
+      size_t missing_count = theMissingCounts[i];
 
       if (options.checknan || options.printcount)
         percentages.push_back(missing_count);
@@ -293,10 +253,7 @@ int analyze_given_parameters(NFmiFastQueryInfo& theQ)
 
   if (percentages.size() == 0)
   {
-    if (options.checknan || options.printcount)
-      return 0;
-    else
-      return 100;
+    return (options.checknan || options.printcount ? 0 : 100);
   }
 
   float sum = accumulate(percentages.begin(), percentages.end(), 0.0);
@@ -308,200 +265,69 @@ int analyze_given_parameters(NFmiFastQueryInfo& theQ)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values for set station
+ * \brief Calculate the result for the given missing counts
+ *
+ * The value used for missing parameters differs for the whole data and
+ * for individual timesteps and stations.
  */
 // ----------------------------------------------------------------------
 
-int analyze_all_station_parameters(NFmiFastQueryInfo& theQ)
+int analyze(const NFmiMissingValueCounts& theCounts,
+            const vector<size_t>& theMissingCounts,
+            size_t theValueCount,
+            bool theWholeData)
 {
-  bool ignoresubs = false;
-  size_t total_count = 0;
-  size_t missing_count = 0;
+  if (options.parameters.empty()) return analyze_all_parameters(theMissingCounts, theValueCount);
 
-  for (theQ.ResetParam(); theQ.NextParam(ignoresubs);)
-    for (theQ.ResetLevel(); theQ.NextLevel();)
-      for (theQ.ResetTime(); theQ.NextTime();)
-      {
-        ++total_count;
-        if (options.checknan)
-        {
-#ifdef UNIX
-          if (isnan(theQ.FloatValue()))
-#else
-          if (_isnan(theQ.FloatValue()))
-#endif
-            ++missing_count;
-        }
-        else if (theQ.FloatValue() == kFloatMissing)
-          ++missing_count;
-      }
+  float notfound = 100.0;
+  if (theWholeData ? options.printcount : options.checknan)
+    notfound = (theWholeData ? kFloatMissing : 0);
 
-  if (options.checknan || options.printcount) return missing_count;
-
-  if (total_count == 0) return 100;
-
-  return static_cast<int>((100.0 * missing_count) / total_count);
+  return analyze_given_parameters(
+      theMissingCounts, theCounts.itsParamFound, theValueCount, notfound);
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values for set station and parameters
+ * \brief Missing counts of all parameters for the whole data
  */
 // ----------------------------------------------------------------------
 
-int analyze_given_station_parameters(NFmiFastQueryInfo& theQ)
+vector<size_t> missing_counts(const NFmiMissingValueCounts& theCounts)
 {
-  vector<float> percentages;
-
-  for (unsigned int i = 0; i < options.parameters.size(); i++)
-  {
-    if (!theQ.Param(options.parameters[i]))
-    {
-      if (options.checknan)
-        percentages.push_back(0);
-      else
-        percentages.push_back(100.0);
-    }
-    else
-    {
-      size_t total_count = 0;
-      size_t missing_count = 0;
-
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-        for (theQ.ResetTime(); theQ.NextTime();)
-        {
-          ++total_count;
-          if (options.checknan)
-          {
-#ifdef UNIX
-            if (isnan(theQ.FloatValue()))
-#else
-            if (_isnan(theQ.FloatValue()))
-#endif
-              ++missing_count;
-          }
-          else if (theQ.FloatValue() == kFloatMissing)
-            ++missing_count;
-        }
-
-      if (options.checknan || options.printcount)
-        percentages.push_back(missing_count);
-      else if (total_count == 0)
-        percentages.push_back(100.0);
-      else
-        percentages.push_back(100.0 * missing_count / total_count);
-    }
-  }
-
-  if (percentages.size() == 0)
-  {
-    return (options.checknan || options.printcount ? 0 : 100);
-  }
-
-  float sum = accumulate(percentages.begin(), percentages.end(), 0.0);
-  if (options.checknan || options.printcount)
-    return static_cast<int>(sum);
-  else
-    return static_cast<int>(sum / percentages.size());
+  vector<size_t> ret;
+  for (unsigned long p = 0; p < theCounts.itsParamFound.size(); p++)
+    ret.push_back(theCounts.ParamMissingCount(p));
+  return ret;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values now
+ * \brief Missing counts of all parameters for one timestep
  */
 // ----------------------------------------------------------------------
 
-int analyze_all_parameters_now(NFmiFastQueryInfo& theQ)
+vector<size_t> time_missing_counts(const NFmiMissingValueCounts& theCounts, unsigned long theTime)
 {
-  bool ignoresubs = false;
-  size_t total_count = 0;
-  size_t missing_count = 0;
-
-  for (theQ.ResetParam(); theQ.NextParam(ignoresubs);)
-    for (theQ.ResetLocation(); theQ.NextLocation();)
-      for (theQ.ResetLevel(); theQ.NextLevel();)
-      {
-        ++total_count;
-        if (options.checknan)
-        {
-#ifdef UNIX
-          if (isnan(theQ.FloatValue()))
-#else
-          if (_isnan(theQ.FloatValue()))
-#endif
-            ++missing_count;
-        }
-        else if (theQ.FloatValue() == kFloatMissing)
-          ++missing_count;
-      }
-
-  if (options.checknan || options.printcount) return missing_count;
-
-  if (total_count == 0) return 100;
-
-  return static_cast<int>((100.0 * missing_count) / total_count);
+  vector<size_t> ret;
+  for (unsigned long p = 0; p < theCounts.itsParamFound.size(); p++)
+    ret.push_back(theCounts.itsTimeCounts[p * theCounts.itsTimeSize + theTime]);
+  return ret;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Calculate percentage of missing values from specified parameters now
+ * \brief Missing counts of all parameters for one station
  */
 // ----------------------------------------------------------------------
 
-int analyze_given_parameters_now(NFmiFastQueryInfo& theQ)
+vector<size_t> location_missing_counts(const NFmiMissingValueCounts& theCounts,
+                                       unsigned long theLocation)
 {
-  vector<float> percentages;
-
-  for (unsigned int i = 0; i < options.parameters.size(); i++)
-  {
-    if (!theQ.Param(options.parameters[i]))
-    {
-      if (options.checknan)
-        percentages.push_back(0);
-      else
-        percentages.push_back(100.0);
-    }
-    else
-    {
-      size_t total_count = 0;
-      size_t missing_count = 0;
-
-      for (theQ.ResetLocation(); theQ.NextLocation();)
-        for (theQ.ResetLevel(); theQ.NextLevel();)
-        {
-          ++total_count;
-          if (options.checknan)
-          {
-#ifdef UNIX
-            if (isnan(theQ.FloatValue()))
-#else
-            if (_isnan(theQ.FloatValue()))
-#endif
-              ++missing_count;
-          }
-          else if (theQ.FloatValue() == kFloatMissing)
-            ++missing_count;
-        }
-
-      if (options.checknan || options.printcount)
-        percentages.push_back(missing_count);
-      else if (total_count == 0)
-        percentages.push_back(100.0);
-      else
-        percentages.push_back(100.0 * missing_count / total_count);
-    }
-  }
-
-  if (percentages.size() == 0)
-  {
-    return (options.checknan || options.printcount ? 0 : 100);
-  }
-
-  float sum = accumulate(percentages.begin(), percentages.end(), 0.0);
-  if (options.checknan || options.printcount)
-    return static_cast<int>(sum);
-  else
-    return static_cast<int>(sum / percentages.size());
+  vector<size_t> ret;
+  for (unsigned long p = 0; p < theCounts.itsParamFound.size(); p++)
+    ret.push_back(theCounts.itsLocationCounts[p * theCounts.itsLocationSize + theLocation]);
+  return ret;
 }
 
 // ----------------------------------------------------------------------
@@ -522,47 +348,74 @@ int run(int argc, const char* argv[])
   NFmiQueryData qd(options.inputfile);
   NFmiFastQueryInfo q(&qd);
 
-  // Establish what to do
+  // Establish what to do. The data is scanned in one pass, with -e the scan
+  // stops at the first timestep or station exceeding the limit.
+
+  NFmiMissingValueCounts counts;
+  const unsigned long levels = q.SizeLevels();
 
   if (options.alltimesteps)
   {
-    for (q.ResetTime(); q.NextTime();)
+    unsigned long next_time = 0;
+    auto print_times = [&](const NFmiMissingValueCounts& theCounts)
     {
-      if (options.parameters.empty())
-        percentage = analyze_all_parameters_now(q);
-      else
-        percentage = analyze_given_parameters_now(q);
+      for (; next_time < theCounts.itsScannedCount; next_time++)
+      {
+        percentage = analyze(theCounts,
+                             time_missing_counts(theCounts, next_time),
+                             theCounts.itsLocationSize * levels,
+                             false);
+
+        q.TimeIndex(next_time);
+        NFmiTime t = TimeTools::timezone_time(q.ValidTime(), options.timezone);
+        if (options.printzero || percentage != 0)
+          cout << t.ToStr(kYYYYMMDDHHMM).CharPtr() << ' ' << percentage << endl;
+        if (options.checkErrorLimit && percentage >= options.errorLimit) return false;
+      }
+      return true;
+    };
 
-      NFmiTime t = TimeTools::timezone_time(q.ValidTime(), options.timezone);
-      if (options.printzero || percentage != 0)
-        cout << t.ToStr(kYYYYMMDDHHMM).CharPtr() << ' ' << percentage << endl;
-      if (options.checkErrorLimit && percentage >= options.errorLimit)
-        throw runtime_error("Given error limit has been exceeded, exiting.");
-    }
+    NFmiQueryDataUtil::CountMissingValues(
+        q, options.parameters, options.checknan, true, counts, print_times);
+    if (next_time < counts.itsTimeSize)
+      throw runtime_error("Given error limit has been exceeded, exiting.");
   }
   else if (options.allstations)
   {
     if (q.IsGrid()) throw runtime_error("Option -w can be used only for point data");
-    for (q.ResetLocation(); q.NextLocation();)
+
+    unsigned long next_location = 0;
+    auto print_stations = [&](const NFmiMissingValueCounts& theCounts)
     {
-      if (options.parameters.empty())
-        percentage = analyze_all_station_parameters(q);
-      else
-        percentage = analyze_given_station_parameters(q);
-      const NFmiLocation* loc = q.Location();
-      if (options.printzero || percentage != 0)
-        cout << loc->GetIdent() << '\t' << loc->GetName().CharPtr() << '\t' << loc->GetLongitude()
-             << '\t' << loc->GetLatitude() << '\t' << percentage << endl;
-      if (options.checkErrorLimit && percentage >= options.errorLimit)
-        throw runtime_error("Given error limit has been exceeded, exiting.");
-    }
+      for (; next_location < theCounts.itsScannedCount; next_location++)
+      {
+        percentage = analyze(theCounts,
+                             location_missing_counts(theCounts, next_location),
+                             levels * theCounts.itsTimeSize,
+                             false);
+
+        q.LocationIndex(next_location);
+        const NFmiLocation* loc = q.Location();
+        if (options.printzero || percentage != 0)
+          cout << loc->GetIdent() << '\t' << loc->GetName().CharPtr() << '\t' << loc->GetLongitude()
+               << '\t' << loc->GetLatitude() << '\t' << percentage << endl;
+        if (options.checkErrorLimit && percentage >= options.errorLimit) return false;
+      }
+      return true;
+    };
+
+    NFmiQueryDataUtil::CountMissingValues(
+        q, options.parameters, options.checknan, false, counts, print_stations);
+    if (next_location < counts.itsLocationSize)
+      throw runtime_error("Given error limit has been exceeded, exiting.");
   }
   else
   {
-    if (options.parameters.empty())
-      percentage = analyze_all_parameters(q);
-    else
-      percentage = analyze_given_parameters(q);
+    NFmiQueryDataUtil::CountMissingValues(q, options.parameters, options.checknan, false, counts);
+    percentage = analyze(counts,
+                         missing_counts(counts),
+                         static_cast<size_t>(counts.itsLocationSize) * levels * counts.itsTimeSize,
+                         true);
     if (options.printzero || percentage != 0) cout << percentage << endl;
     if (options.checkErrorLimit && percentage >= options.errorLimit)
       throw runtime_error("Given error limit has been exceeded, exiting.");
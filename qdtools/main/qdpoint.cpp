@@ -19,9 +19,18 @@
  *  qdpoint -w -q havainnot.sqd -n 1
  *  qdpoint -p Helsinki -N 10 -d 100 -q havainnot.sqd -n 1
  *  qdpoint -u "mst.weatherproof.fi/gram.php" -p Helsinki -q ennuste.sqd
+ *  qdpoint --server -q ennuste.sqd < requests.txt
  *
  * \endcode
  *
+ * In server mode each line of the standard input is a request with
+ * the same options as the command line, the server options act as
+ * defaults for the requests. The querydata, coordinate and timezone
+ * files are loaded only once and the querydata is reloaded when the
+ * files are replaced. The requests are evaluated concurrently, the
+ * responses are printed in request order and each response ends with
+ * a "# END" line.
+ *
  */
 // ======================================================================
 
@@ -34,6 +43,8 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <ogr_geometry.h>
 #include <macgyver/StringConversion.h>
 #include <macgyver/WorldTimeZones.h>
@@ -42,6 +53,7 @@
 #include <newbase/NFmiDataModifierProb.h>
 #include <newbase/NFmiEnumConverter.h>
 #include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiGrid.h>
 #include <newbase/NFmiIndexMask.h>
 #include <newbase/NFmiIndexMaskTools.h>
 #include <newbase/NFmiLocation.h>
@@ -51,7 +63,13 @@
 #include <newbase/NFmiSettings.h>
 #include <newbase/NFmiStringTools.h>
 #include <newbase/NFmiValueString.h>
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <iostream>
 #include <list>
+#include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -65,9 +83,6 @@ using namespace std;
 //! Must be one single global instance for speed, constructing is expensive
 static NFmiEnumConverter converter;
 
-// WGS84 to FMI sphere conversion
-std::unique_ptr<OGRCoordinateTransformation> wgs84_to_latlon;
-
 // ----------------------------------------------------------------------
 // -l optiolla annetut sijainnit
 // ----------------------------------------------------------------------
@@ -157,10 +172,10 @@ struct Options
   LocationList locations;
   string missingvalue = "-";
   string uid;
+  bool server = false;
+  unsigned int threads = 0;
 };
 
-Options options;
-
 // ----------------------------------------------------------------------
 /*!
  * \brief Parse a list of station numbers
@@ -184,21 +199,73 @@ vector<int> parse_stations(const std::string& str)
   return ret;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief WGS84 to FMI sphere conversion
+ *
+ * The conversion is created once on first use. OGR transformations
+ * are not thread safe, lock the returned mutex while using it.
+ */
+// ----------------------------------------------------------------------
+
+boost::mutex wgs84_mutex;
+
+OGRCoordinateTransformation& WGS84ToLatLon()
+{
+  static std::unique_ptr<OGRCoordinateTransformation> wgs84_to_latlon;
+
+  boost::mutex::scoped_lock lock(wgs84_mutex);
+  if (wgs84_to_latlon) return *wgs84_to_latlon;
+
+  std::unique_ptr<OGRSpatialReference> wgs84_crs;
+  std::unique_ptr<OGRSpatialReference> fmi_crs;
+
+  wgs84_crs.reset(new OGRSpatialReference);
+  OGRErr err = wgs84_crs->SetFromUserInput("+proj=longlat +ellps=WGS84 +towgs84=0,0,0");
+  if (err != OGRERR_NONE) throw std::runtime_error("Failed to setup WGS84 spatial reference");
+
+  // TODO: WGS84 center may be 100 meters off, according to Wikipedia. Perhaps should not have
+  // zeros here?
+  fmi_crs.reset(new OGRSpatialReference);
+  err = fmi_crs->SetFromUserInput("+proj=longlat +a=6371220 +b=6371220 +towgs84=0,0,0 +no_defs");
+  if (err != OGRERR_NONE) throw std::runtime_error("Failed to setup FMI sphere spatial reference");
+
+  // copies crs's
+  wgs84_to_latlon.reset(OGRCreateCoordinateTransformation(wgs84_crs.get(), fmi_crs.get()));
+  if (!wgs84_to_latlon)
+    throw std::runtime_error("Failed to create WGS84 to FMI Sphere coordinate conversion");
+
+  return *wgs84_to_latlon;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy an option value if it was given on the command line
+ */
+// ----------------------------------------------------------------------
+
+template <typename T>
+bool copy_given(const boost::program_options::variables_map& opt, const char* name, T& target)
+{
+  if (opt.count(name) == 0 || opt[name].defaulted()) return false;
+  target = opt[name].as<T>();
+  return true;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Parse the command line options
+ *
+ * Only the options actually given are changed, hence in server mode
+ * the options of the server act as defaults for the requests.
  */
 // ----------------------------------------------------------------------
 
-bool parse_options(int argc, char* argv[])
+bool parse_options(const vector<string>& args, Options& options, ostream& out)
 {
   namespace po = boost::program_options;
   namespace fs = boost::filesystem;
 
-  string opt_stations;
-  string opt_places;
-  string opt_params;
-
 #ifdef UNIX
   struct winsize wsz;
   ioctl(STDOUT_FILENO, TIOCGWINSZ, &wsz);
@@ -209,120 +276,123 @@ bool parse_options(int argc, char* argv[])
 
   po::options_description desc("Available options", desc_width);
   desc.add_options()("help,h", "print out help message")(
-      "verbose,v", po::bool_switch(&options.verbose), "verbose mode")("version,V",
-                                                                      "display version number")(
-      "querydata,q", po::value(&options.queryfile), "input querydata (qdpoint::querydata_file)")(
-      "multidata,Q", po::bool_switch(&options.multimode), "use all files from input directories")(
+      "verbose,v", po::bool_switch(), "verbose mode")("version,V", "display version number")(
+      "querydata,q", po::value<string>(), "input querydata (qdpoint::querydata_file)")(
+      "multidata,Q", po::bool_switch(), "use all files from input directories")(
       "coordinatefile,c",
-      po::value(&options.coordinatefile),
+      po::value<string>(),
       "location configuration file (qdpoint::coordinates or "
-      "/smartmet/share/coordinates/default.txt)")("timezonefile,z",
-                                                  po::value(&options.timezonefile),
-                                                  "timezone configuration file (qdpoint::tzfile)")(
-      "timezone,t", po::value(&options.timezone), "timezone (qdpoint::timezone)")(
-      "params,P", po::value(&opt_params), "parameter name/number list")(
-      "places,p", po::value(&opt_places), "place name list")(
-      "longitude,x", po::value(&options.longitude), "longitude")(
-      "latitude,y", po::value(&options.latitude), "latitude")(
-      "wgs84", po::bool_switch(&options.wgs84), "coordinates are in WGS84")(
+      "/smartmet/share/coordinates/default.txt)")(
+      "timezonefile,z", po::value<string>(), "timezone configuration file (qdpoint::tzfile)")(
+      "timezone,t", po::value<string>(), "timezone (qdpoint::timezone)")(
+      "params,P", po::value<string>(), "parameter name/number list")(
+      "places,p", po::value<string>(), "place name list")(
+      "longitude,x", po::value<double>(), "longitude")(
+      "latitude,y", po::value<double>(), "latitude")(
+      "wgs84", po::bool_switch(), "coordinates are in WGS84")(
       "rows,n",
-      po::value(&options.rows)->default_value(-1)->implicit_value(1),
+      po::value<int>()->default_value(-1)->implicit_value(1),
       "number of data rows for each location")(
       "stations,w",
-      po::value(&opt_stations)->default_value("")->implicit_value("all"),
+      po::value<string>()->default_value("")->implicit_value("all"),
       "WMO numbers (plain -w or -w all implies all stations)")(
-      "list,s", po::bool_switch(&options.list_stations), "print station metadata")(
-      "locations,l", po::value(&options.locationfile), "file containing list of locations")(
-      "force,f", po::bool_switch(&options.force), "force print of empty rows too")(
-      "maxdist,d",
-      po::value(&options.max_distance),
-      "maximum search distance stations (default: 100 km)")(
-      "count,N",
-      po::value(&options.nearest_stations),
-      "maximum number of nearby stations (default: 1)")(
-      "validate,C", po::bool_switch(&options.validate), "validate rows")(
-      "missingvalue,m",
-      po::value(&options.missingvalue),
-      "string to print for missing values (default: '-')")(
+      "list,s", po::bool_switch(), "print station metadata")(
+      "locations,l", po::value<string>(), "file containing list of locations")(
+      "force,f", po::bool_switch(), "force print of empty rows too")(
+      "maxdist,d", po::value<double>(), "maximum search distance stations (default: 100 km)")(
+      "count,N", po::value<int>(), "maximum number of nearby stations (default: 1)")(
+      "validate,C", po::bool_switch(), "validate rows")(
+      "missingvalue,m", po::value<string>(), "string to print for missing values (default: '-')")(
       "maxgap,i",
-      po::value(&options.max_missing_gap),
+      po::value<int>(),
       "maximum time gap in minutes to fill with interpolation")(
-      "future,F", po::bool_switch(&options.future), "print only times in the future")(
-      "uid,u", po::value(&options.uid), "unused legacy option");
+      "future,F", po::bool_switch(), "print only times in the future")(
+      "uid,u", po::value<string>(), "unused legacy option")(
+      "server", po::bool_switch(), "answer requests given as command lines in standard input")(
+      "threads,j", po::value<unsigned int>(), "number of worker threads (default: all cores)");
 
   po::positional_options_description p;
   p.add("querydata", 1);
 
   po::variables_map opt;
-  po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), opt);
+  po::store(po::command_line_parser(args).options(desc).positional(p).run(), opt);
 
   po::notify(opt);
 
   if (opt.count("version") != 0)
   {
-    std::cout << "qdpoint v 2.0 (" << __DATE__ << ' ' << __TIME__ << ')' << std::endl;
+    out << "qdpoint v 2.0 (" << __DATE__ << ' ' << __TIME__ << ')' << std::endl;
   }
 
   if (opt.count("help"))
   {
-    std::cout << "Usage: qdpoint [options] querydata" << std::endl
-              << std::endl
-              << "Extract a timeseries from the input data" << std::endl
-              << std::endl
-              << desc << std::endl
-              << std::endl
-              << "Available meta parameters:" << std::endl
-              << std::endl
-              << " * MetaDST - 1/0 depending on whether daylight savings is on or not" << std::endl
-              << " * MetaElevationAngle - sun elevation angle" << std::endl
-              << " * MetaFeelsLike - feels like temperature" << std::endl
-              << " * MetaIsDark - 1/0 depending on the sun elevation angle" << std::endl
-              << " * MetaMoonIlluminatedFraction - fraction of moon visible to earth" << std::endl
-              << " * MetaN - total cloudiness in 8ths" << std::endl
-              << " * MetaNN - bottom/middle level cloudiness in 8ths" << std::endl
-              << " * MetaNorth - grid north direction" << std::endl
-              << " * MetaRainProbability - crude estimate of probability of precipitation"
-              << std::endl
-              << " * MetaSnowProb - crude estimate of probability of snow" << std::endl
-              << " * MetaSummerSimmer - the summer simmer index" << std::endl
-              << " * MetaSurfaceRadiation - estimated solar radiation" << std::endl
-              << " * MetaThetaE - theta-E from temperature, pressure and humidity" << std::endl
-              << " * MetaWindChill - wind chill factor" << std::endl
-              << std::endl;
+    out << "Usage: qdpoint [options] querydata" << std::endl
+        << std::endl
+        << "Extract a timeseries from the input data" << std::endl
+        << std::endl
+        << desc << std::endl
+        << std::endl
+        << "Available meta parameters:" << std::endl
+        << std::endl
+        << " * MetaDST - 1/0 depending on whether daylight savings is on or not" << std::endl
+        << " * MetaElevationAngle - sun elevation angle" << std::endl
+        << " * MetaFeelsLike - feels like temperature" << std::endl
+        << " * MetaIsDark - 1/0 depending on the sun elevation angle" << std::endl
+        << " * MetaMoonIlluminatedFraction - fraction of moon visible to earth" << std::endl
+        << " * MetaN - total cloudiness in 8ths" << std::endl
+        << " * MetaNN - bottom/middle level cloudiness in 8ths" << std::endl
+        << " * MetaNorth - grid north direction" << std::endl
+        << " * MetaRainProbability - crude estimate of probability of precipitation"
+        << std::endl
+        << " * MetaSnowProb - crude estimate of probability of snow" << std::endl
+        << " * MetaSummerSimmer - the summer simmer index" << std::endl
+        << " * MetaSurfaceRadiation - estimated solar radiation" << std::endl
+        << " * MetaThetaE - theta-E from temperature, pressure and humidity" << std::endl
+        << " * MetaWindChill - wind chill factor" << std::endl
+        << std::endl;
   }
 
-  if (!options.locationfile.empty()) options.locations = read_locationlist(options.locationfile);
+  copy_given(opt, "verbose", options.verbose);
+  copy_given(opt, "querydata", options.queryfile);
+  copy_given(opt, "multidata", options.multimode);
+  copy_given(opt, "coordinatefile", options.coordinatefile);
+  copy_given(opt, "timezonefile", options.timezonefile);
+  copy_given(opt, "timezone", options.timezone);
+  copy_given(opt, "longitude", options.longitude);
+  copy_given(opt, "latitude", options.latitude);
+  copy_given(opt, "wgs84", options.wgs84);
+  copy_given(opt, "rows", options.rows);
+  copy_given(opt, "list", options.list_stations);
+  copy_given(opt, "force", options.force);
+  copy_given(opt, "maxdist", options.max_distance);
+  copy_given(opt, "count", options.nearest_stations);
+  copy_given(opt, "validate", options.validate);
+  copy_given(opt, "missingvalue", options.missingvalue);
+  copy_given(opt, "maxgap", options.max_missing_gap);
+  copy_given(opt, "future", options.future);
+  copy_given(opt, "uid", options.uid);
+  copy_given(opt, "server", options.server);
+  copy_given(opt, "threads", options.threads);
+
+  if (copy_given(opt, "locations", options.locationfile))
+    options.locations = read_locationlist(options.locationfile);
 
-  if (opt_stations == "all")
-    options.all_stations = true;
-  else
-    options.stations = parse_stations(opt_stations);
+  string opt_stations;
+  if (copy_given(opt, "stations", opt_stations))
+  {
+    options.all_stations = (opt_stations == "all");
+    options.stations.clear();
+    if (!options.all_stations) options.stations = parse_stations(opt_stations);
+  }
 
-  options.params = NFmiStringTools::Split(opt_params);
-  options.places = NFmiStringTools::Split(opt_places);
+  string opt_params;
+  if (copy_given(opt, "params", opt_params)) options.params = NFmiStringTools::Split(opt_params);
+
+  string opt_places;
+  if (copy_given(opt, "places", opt_places)) options.places = NFmiStringTools::Split(opt_places);
 
   // Create WGS84 to latlon conversion only if necessary
-  if (options.wgs84)
-  {
-    std::unique_ptr<OGRSpatialReference> wgs84_crs;
-    std::unique_ptr<OGRSpatialReference> fmi_crs;
-
-    wgs84_crs.reset(new OGRSpatialReference);
-    OGRErr err = wgs84_crs->SetFromUserInput("+proj=longlat +ellps=WGS84 +towgs84=0,0,0");
-    if (err != OGRERR_NONE) throw std::runtime_error("Failed to setup WGS84 spatial reference");
-
-    // TODO: WGS84 center may be 100 meters off, according to Wikipedia. Perhaps should not have
-    // zeros here?
-    fmi_crs.reset(new OGRSpatialReference);
-    err = fmi_crs->SetFromUserInput("+proj=longlat +a=6371220 +b=6371220 +towgs84=0,0,0 +no_defs");
-    if (err != OGRERR_NONE)
-      throw std::runtime_error("Failed to setup FMI sphere spatial reference");
-
-    // copies crs's
-    wgs84_to_latlon.reset(OGRCreateCoordinateTransformation(wgs84_crs.get(), fmi_crs.get()));
-    if (!wgs84_to_latlon)
-      throw std::runtime_error("Failed to create WGS84 to FMI Sphere coordinate conversion");
-  }
+  if (options.wgs84) WGS84ToLatLon();
 
   return true;
 }
@@ -340,25 +410,30 @@ bool IsBad(const NFmiPoint& thePoint)
 // Convert from WGS84 to FMi Sphere if necessary
 // ----------------------------------------------------------------------
 
-NFmiPoint FixCoordinate(const NFmiPoint& thePoint)
+NFmiPoint FixCoordinate(const NFmiPoint& thePoint, const Options& options, ostream& out)
 {
   if (!options.wgs84) return thePoint;
 
   double x = thePoint.X();
   double y = thePoint.Y();
-  if (!wgs84_to_latlon->Transform(1, &x, &y))
-    throw std::runtime_error("Failed to transform input coordinate from WGS84 to FMI Sphere");
+  OGRCoordinateTransformation& wgs84_to_latlon = WGS84ToLatLon();
+  {
+    boost::mutex::scoped_lock lock(wgs84_mutex);
+    if (!wgs84_to_latlon.Transform(1, &x, &y))
+      throw std::runtime_error("Failed to transform input coordinate from WGS84 to FMI Sphere");
+  }
 
   if (options.verbose)
-    std::cout << "# Converted from " << thePoint.X() << "," << thePoint.Y() << " to " << x << ","
-              << y << " distance = "
-              << NFmiGeoTools::GeoDistance(thePoint.X(), thePoint.Y(), x, y) / 1000 << " km\n";
+    out << "# Converted from " << thePoint.X() << "," << thePoint.Y() << " to " << x << "," << y
+        << " distance = " << NFmiGeoTools::GeoDistance(thePoint.X(), thePoint.Y(), x, y) / 1000
+        << " km\n";
 
   return NFmiPoint(x, y);
 }
 
 // ----------------------------------------------------------------------
-// Etsii annetun nimisten pisteiden koordinaatit tietokannasta
+// Etsii annetun nimisten pisteiden koordinaatit tietokannasta. Kukin
+// tietokanta luetaan vain kerran, koska palvelin kytt niit toistuvasti.
 // ----------------------------------------------------------------------
 
 std::map<std::string, NFmiPoint> FindPlaces(const std::vector<std::string>& thePlaces,
@@ -368,12 +443,22 @@ std::map<std::string, NFmiPoint> FindPlaces(const std::vector<std::string>& theP
   typedef std::map<std::string, NFmiPoint> ReturnType;
   ReturnType ret;
 
-  if (!NFmiFileSystem::FileExists(theCoordFile))
-    throw std::runtime_error("File '" + theCoordFile + "' does not exist");
+  static boost::mutex mutex;
+  static std::map<std::string, boost::shared_ptr<NFmiLocationFinder> > finders;
+  boost::mutex::scoped_lock lock(mutex);
 
-  NFmiLocationFinder locfinder;
-  if (!locfinder.AddFile(theCoordFile, false))
-    throw std::runtime_error("Reading file " + theCoordFile + " failed");
+  boost::shared_ptr<NFmiLocationFinder>& finder = finders[theCoordFile];
+  if (!finder)
+  {
+    if (!NFmiFileSystem::FileExists(theCoordFile))
+      throw std::runtime_error("File '" + theCoordFile + "' does not exist");
+
+    boost::shared_ptr<NFmiLocationFinder> newfinder(new NFmiLocationFinder);
+    if (!newfinder->AddFile(theCoordFile, false))
+      throw std::runtime_error("Reading file " + theCoordFile + " failed");
+    finder = newfinder;
+  }
+  NFmiLocationFinder& locfinder = *finder;
 
   for (vector<string>::const_iterator it = thePlaces.begin(); it != thePlaces.end(); ++it)
   {
@@ -396,34 +481,8 @@ std::map<std::string, NFmiPoint> FindPlaces(const std::vector<std::string>& theP
 
 bool IsDst(NFmiFastQueryInfo& qd)
 {
-  NFmiMetTime t = qd.ValidTime();
-
-  struct ::tm utc;
-  utc.tm_sec = t.GetSec();
-  utc.tm_min = t.GetMin();
-  utc.tm_hour = t.GetHour();
-  utc.tm_mday = t.GetDay();
-  utc.tm_mon = t.GetMonth() - 1;     // tm months start from 0
-  utc.tm_year = t.GetYear() - 1900;  // tm years start from 1900
-  utc.tm_wday = -1;
-  utc.tm_yday = -1;
-  utc.tm_isdst = -1;
-
-  ::time_t epochtime = NFmiStaticTime::my_timegm(&utc);
-  struct ::tm tlocal;
-
-#ifdef _MSC_VER
-  // OBS! There are no thread safe localtime(_r) or gmtime(_r) functions in MSVC++ 2008 (or before).
-  // Closest things available are some what safer (but not thread safe) and with almost same
-  // function
-  // definitions are the localtime_s and gmtime_s -functions. Parameters are ordered otherway round
-  // and their return value is success status, not struct tm pointer.
-  ::localtime_s(&tlocal, &epochtime);
-#else
-  ::localtime_r(&epochtime, &tlocal);
-#endif
-
-  return (tlocal.tm_isdst == 1);
+  // The zone is the one in which the row time was printed
+  return TimeTools::is_dst(qd.ValidTime());
 }
 
 // ----------------------------------------------------------------------
@@ -876,14 +935,29 @@ long ParamLevel(const string& theParam)
   return NFmiStringTools::Convert<long>(parts[1]);
 }
 
+// ----------------------------------------------------------------------
+// Interpoloi hilan arvon pisteeseen. Jos pisteelle on jo laskettu
+// sijainti hilassa, projektiota ei tarvitse laskea joka arvolle erikseen.
+// ----------------------------------------------------------------------
+
+float PointValue(NFmiFastQueryInfo& qd,
+                 const NFmiPoint& lonlat,
+                 const NFmiLocationCache& locationcache)
+{
+  if (locationcache.NoValue()) return qd.InterpolatedValue(lonlat);
+  return qd.CachedInterpolation(locationcache);
+}
+
 // ----------------------------------------------------------------------
 // Testaa ovatko asetetun sijainnin ja ajan halutut parametrit valideja.
 // Yksi ainoa validi arvo riitt.
 // ----------------------------------------------------------------------
 
 bool ValidRow(NFmiFastQueryInfo& qd,
+              const Options& options,
               bool ignoresubs,
-              NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing))
+              NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing),
+              const NFmiLocationCache& locationcache = NFmiLocationCache())
 {
   bool valid = false;
 
@@ -899,7 +973,7 @@ bool ValidRow(NFmiFastQueryInfo& qd,
     {
       if (!qd.NextParam(ignoresubs)) break;
       if (qd.IsGrid())
-        value = qd.InterpolatedValue(lonlat);
+        value = PointValue(qd, lonlat, locationcache);
       else
         value = qd.FloatValue();
     }
@@ -933,7 +1007,7 @@ bool ValidRow(NFmiFastQueryInfo& qd,
           ++iter;
 
           if (qd.IsGrid())
-            value = qd.InterpolatedValue(lonlat);
+            value = PointValue(qd, lonlat, locationcache);
           else
             value = qd.FloatValue();
         }
@@ -996,9 +1070,12 @@ int MissingGap(NFmiFastQueryInfo& qd,
 // Laskee interpoloidun arvon annettuun koordinaaattiin
 // ----------------------------------------------------------------------
 
-float InterpolatedValue(NFmiFastQueryInfo& qd, int maxmissminutes, const NFmiPoint& lonlat)
+float InterpolatedValue(NFmiFastQueryInfo& qd,
+                        int maxmissminutes,
+                        const NFmiPoint& lonlat,
+                        const NFmiLocationCache& locationcache)
 {
-  float value = qd.InterpolatedValue(lonlat);
+  float value = PointValue(qd, lonlat, locationcache);
   if (maxmissminutes <= 0 || value != kFloatMissing) return value;
 
   // Try to interpolate the value
@@ -1032,9 +1109,12 @@ float InterpolatedValue(NFmiFastQueryInfo& qd, int maxmissminutes)
 // ----------------------------------------------------------------------
 
 void PrintRow(NFmiFastQueryInfo& qd,
+              const Options& options,
+              ostream& out,
               bool ignoresubs,
               const Fmi::WorldTimeZones& zones,
-              NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing))
+              NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing),
+              const NFmiLocationCache& locationcache = NFmiLocationCache())
 {
   // Kello nyt UTC-ajassa minuutin tarkkuudella
 
@@ -1060,7 +1140,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
 		 lonlat.X() < 32 &&
 		 lonlat.Y() > 59 &&
 		 lonlat.Y() < 71)
-		t = utctime.CorrectLocalTime();
+		t = TimeTools::local_time(utctime);
 	  else
 		t = utctime.LocalTime(static_cast<float>(lonlat.X()));
 #else
@@ -1071,7 +1151,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
   else
     t = TimeTools::timezone_time(utctime, options.timezone);
 
-  cout << t.ToStr(kYYYYMMDDHHMM).CharPtr();
+  out << t.ToStr(kYYYYMMDDHHMM).CharPtr();
 
   qd.ResetParam();
 
@@ -1088,7 +1168,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
       precision = qd.Param().GetParam()->Precision();
 
       if (qd.IsGrid())
-        value = InterpolatedValue(qd, options.max_missing_gap, lonlat);
+        value = InterpolatedValue(qd, options.max_missing_gap, lonlat, locationcache);
       else
         value = InterpolatedValue(qd, options.max_missing_gap);
     }
@@ -1122,7 +1202,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
         precision = qd.Param().GetParam()->Precision();
 
         if (qd.IsGrid())
-          value = InterpolatedValue(qd, options.max_missing_gap, lonlat);
+          value = InterpolatedValue(qd, options.max_missing_gap, lonlat, locationcache);
         else
           value = InterpolatedValue(qd, options.max_missing_gap);
       }
@@ -1143,9 +1223,9 @@ void PrintRow(NFmiFastQueryInfo& qd,
     else
       tmp = NFmiValueString(value, precision);
 
-    cout << " " << tmp.CharPtr();
+    out << " " << tmp.CharPtr();
   }
-  cout << endl;
+  out << endl;
 }
 
 // ----------------------------------------------------------------------
@@ -1156,6 +1236,7 @@ void PrintRow(NFmiFastQueryInfo& qd,
 // ----------------------------------------------------------------------
 
 void PrintLocationInfo(QueryDataManager& theMgr,
+                       ostream& out,
                        bool printdist = false,
                        const NFmiPoint lonlat = NFmiPoint(kFloatMissing, kFloatMissing))
 {
@@ -1163,13 +1244,13 @@ void PrintLocationInfo(QueryDataManager& theMgr,
 
   const char separator = '\t';
   string wmostr = NFmiValueString(static_cast<long>(qd.Location()->GetIdent()), "%05d").CharPtr();
-  cout << "# StationName" << separator << wmostr << separator << qd.Location()->GetName().CharPtr()
-       << endl;
-  cout << "# StationLoc" << separator << wmostr << separator << qd.Location()->GetLongitude()
-       << separator << qd.Location()->GetLatitude() << endl;
+  out << "# StationName" << separator << wmostr << separator << qd.Location()->GetName().CharPtr()
+      << endl;
+  out << "# StationLoc" << separator << wmostr << separator << qd.Location()->GetLongitude()
+      << separator << qd.Location()->GetLatitude() << endl;
   if (printdist)
-    cout << "# StationDist" << separator << wmostr << separator
-         << qd.Location()->Distance(lonlat) / 1000 << endl;
+    out << "# StationDist" << separator << wmostr << separator
+        << qd.Location()->Distance(lonlat) / 1000 << endl;
 }
 
 // ----------------------------------------------------------------------
@@ -1180,7 +1261,7 @@ void PrintLocationInfo(QueryDataManager& theMgr,
  */
 // ----------------------------------------------------------------------
 
-void ReportTimes(QueryDataManager& theMgr)
+void ReportTimes(QueryDataManager& theMgr, ostream& out)
 {
   if (!theMgr.isset()) return;
 
@@ -1190,38 +1271,42 @@ void ReportTimes(QueryDataManager& theMgr)
 
   // Oma kopio, jotta voidaan siirty ensimmiseen/viimeiseen aikaan
   qd.FirstTime();
-  NFmiTime t1 = qd.Time().CorrectLocalTime();
+  NFmiTime t1 = TimeTools::local_time(qd.Time());
 
   while (qd.NextTime())
     ;
   qd.PreviousTime();
   // qd.LastTime();
 
-  NFmiTime t2 = qd.Time().CorrectLocalTime();
+  NFmiTime t2 = TimeTools::local_time(qd.Time());
 
-  cout << "# TimeStart" << separator << t1.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
-       << "# TimeEnd" << separator << t2.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
-       << "# TimeStep" << separator << qd.TimeResolution() << endl
-       << "# TimeSteps" << separator << qd.SizeTimes() << endl;
+  out << "# TimeStart" << separator << t1.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
+      << "# TimeEnd" << separator << t2.ToStr(kYYYYMMDDHHMM).CharPtr() << endl
+      << "# TimeStep" << separator << qd.TimeResolution() << endl
+      << "# TimeSteps" << separator << qd.SizeTimes() << endl;
 }
 
 // ----------------------------------------------------------------------
 // Print location info for the user
 // ----------------------------------------------------------------------
 
-void ReportStations(QueryDataManager& theMgr, const vector<int> theWmos, const NFmiPoint& theLonLat)
+void ReportStations(QueryDataManager& theMgr,
+                    const Options& options,
+                    ostream& out,
+                    const vector<int> theWmos,
+                    const NFmiPoint& theLonLat)
 {
   if (theWmos.empty())
-    PrintLocationInfo(theMgr, !IsBad(theLonLat), theLonLat);
+    PrintLocationInfo(theMgr, out, !IsBad(theLonLat), theLonLat);
   else
   {
-    if (options.verbose) cout << "# Stations " << theWmos.size() << endl;
+    if (options.verbose) out << "# Stations " << theWmos.size() << endl;
     vector<int>::const_iterator begin = theWmos.begin();
     vector<int>::const_iterator end = theWmos.end();
     for (vector<int>::const_iterator iter = begin; iter != end; ++iter)
     {
       theMgr.setstation(*iter);
-      PrintLocationInfo(theMgr, !IsBad(theLonLat), theLonLat);
+      PrintLocationInfo(theMgr, out, !IsBad(theLonLat), theLonLat);
     }
   }
 }
@@ -1231,14 +1316,15 @@ void ReportStations(QueryDataManager& theMgr, const vector<int> theWmos, const N
 // ----------------------------------------------------------------------
 
 void ReportParams(QueryDataManager& theMgr,
+                  ostream& out,
                   const vector<int>& theWmos,
                   const vector<string>& theParams)
 {
   if (!theMgr.isset()) return;
 
   int sarake = 1;
-  if (!theWmos.empty()) cout << "# Column " << sarake++ << ": WMO-number" << endl;
-  cout << "# Column " << sarake++ << ": Local time" << endl;
+  if (!theWmos.empty()) out << "# Column " << sarake++ << ": WMO-number" << endl;
+  out << "# Column " << sarake++ << ": Local time" << endl;
 
   NFmiFastQueryInfo& qd = theMgr.info();
 
@@ -1257,8 +1343,8 @@ void ReportParams(QueryDataManager& theMgr,
       NFmiString name = qd.Param().GetParamName();
       long ident = qd.Param().GetParamIdent();
       string name2 = converter.ToString(ident);
-      cout << "# Column " << sarake++ << ": " << name.CharPtr() << " ( kFmi" << name2.c_str()
-           << " = " << ident << " )" << endl;
+      out << "# Column " << sarake++ << ": " << name.CharPtr() << " ( kFmi" << name2.c_str()
+          << " = " << ident << " )" << endl;
       i++;
     }
   }
@@ -1288,40 +1374,245 @@ void ReportParams(QueryDataManager& theMgr,
         ident = qd.Param().GetParamIdent();
         name2 = "kFmi" + converter.ToString(ident);
       }
-      cout << "# Column " << sarake++ << ": " << name << " ( " << name2 << " = " << ident << " )"
-           << endl;
+      out << "# Column " << sarake++ << ": " << name << " ( " << name2 << " = " << ident << " )"
+          << endl;
       i++;
     }
   }
 }
 
 // ----------------------------------------------------------------------
-// Paaohjelma
-//
-// 1. Luetaan optiot
-// 2. Konvertoidaan mahdollinen paikannimi koordinaateiksi
-// 3. Tarkistetaan koordinaattien jarkevyys
-// 4. Luetaan data
+// Luetun aikavyhyketiedoston palautus. Kukin tiedosto luetaan vain
+// kerran, koska palvelin kytt niit toistuvasti.
 // ----------------------------------------------------------------------
 
-int run(int argc, char* argv[])
+const Fmi::WorldTimeZones& TimeZones(const string& theFile)
 {
-  if (!parse_options(argc, argv)) return 0;
+  static boost::mutex mutex;
+  static std::map<string, boost::shared_ptr<Fmi::WorldTimeZones> > zones;
+  boost::mutex::scoped_lock lock(mutex);
 
-  typedef map<string, NFmiPoint> PlacesType;
-  PlacesType places;
+  boost::shared_ptr<Fmi::WorldTimeZones>& ret = zones[theFile];
+  if (!ret) ret.reset(new Fmi::WorldTimeZones(theFile));
+  return *ret;
+}
 
-  // Initialize the querydata manager
+// ----------------------------------------------------------------------
+// Tulostettava piste. Otsikko tulostetaan ennen pisteen aikasarjaa ja
+// etuliite jokaisen rivin alkuun.
+// ----------------------------------------------------------------------
 
-  QueryDataManager qmgr;
-  qmgr.searchpath(NFmiSettings::Optional<string>("qdpoint::querydata_path", "."));
-  qmgr.addfiles(NFmiStringTools::Split(options.queryfile));
+struct Place
+{
+  string header;
+  string prefix;
+  NFmiPoint latlon;
+};
 
-  if (options.multimode) qmgr.multimode();
+typedef vector<Place> Places;
+
+// ----------------------------------------------------------------------
+// Tulostaa yhden pisteen aikasarjan. Pisteen sijainti hilassa lasketaan
+// kerran, eik jokaiselle parametrille ja ajalle erikseen.
+// ----------------------------------------------------------------------
+
+void PrintPlace(QueryDataManager& qmgr,
+                const Options& options,
+                ostream& out,
+                const Fmi::WorldTimeZones& zones,
+                const Place& place)
+{
+  const bool ignoresubs = false;
+
+  if (!place.header.empty()) out << "Location: " << place.header << endl;
+
+  NFmiPoint lonlat = FixCoordinate(place.latlon, options, out);
+
+  NFmiFastQueryInfo* qi;
+  try
+  {
+    qmgr.setpoint(lonlat, 1000 * options.max_distance);
+    qi = &qmgr.info();
+  }
+  catch (...)
+  {
+    if (options.force) return;
+    throw;
+  }
+
+  NFmiLocationCache locationcache;
+  if (qi->IsGrid()) locationcache = qi->CalcLocationCache(lonlat);
+
+  qi->FirstLevel();
+  if (options.rows < 0)
+  {
+    qi->ResetTime();
+    while (qi->NextTime())
+    {
+      out << place.prefix;
+      PrintRow(*qi, options, out, ignoresubs, zones, lonlat, locationcache);
+    }
+  }
+  else
+  {
+    while (qi->NextTime())
+      ;
+    qi->PreviousTime();
+    // qi->LastTime()
+    int rows = options.rows;
+    do
+    {
+      if (options.max_missing_gap > 0 ||
+          ValidRow(*qi, options, ignoresubs, lonlat, locationcache))
+      {
+        out << place.prefix;
+        PrintRow(*qi, options, out, ignoresubs, zones, lonlat, locationcache);
+        --rows;
+      }
+    } while (rows > 0 && qi->PreviousTime());
+    if (rows > 0 && options.verbose)
+      out << "# Warning: " << rows << " missing rows due to insufficient data in the queryfile"
+          << endl;
+  }
+}
+
+// ----------------------------------------------------------------------
+// Pisteiden tulosteet lasketaan sikeiss paloittain. Kirjoittaja
+// tulostaa valmiit palat jrjestyksess, ja sikeet saavat olla vain
+// rajoitetun mrn paloja kirjoittajan edell.
+// ----------------------------------------------------------------------
+
+struct PlaceChunks
+{
+  boost::mutex mutex;
+  boost::condition_variable changed;
+  std::size_t next = 0;     // seuraavaksi laskettava pala
+  std::size_t written = 0;  // tulostettujen palojen mr
+  bool failed = false;      // jokin pala eponnistui, loppuja ei tarvita
+  std::map<std::size_t, std::pair<string, std::exception_ptr> > done;
+};
+
+void PrintPlaceChunks(PlaceChunks& theChunks,
+                      const QueryDataManager& theManager,
+                      const Options& options,
+                      const Fmi::WorldTimeZones& zones,
+                      const Places& places,
+                      std::size_t chunksize,
+                      std::size_t maxpending)
+{
+  // Oma kopio, jotta sikeet eivt jaa asetettua sijaintia
+  QueryDataManager qmgr(theManager);
+
+  while (true)
+  {
+    std::size_t chunk;
+    {
+      boost::mutex::scoped_lock lock(theChunks.mutex);
+      while (!theChunks.failed && theChunks.next * chunksize < places.size() &&
+             theChunks.next >= theChunks.written + maxpending)
+        theChunks.changed.wait(lock);
+      if (theChunks.failed || theChunks.next * chunksize >= places.size()) return;
+      chunk = theChunks.next++;
+    }
+
+    ostringstream out;
+    std::exception_ptr error;
+    try
+    {
+      std::size_t end = std::min(places.size(), (chunk + 1) * chunksize);
+      for (std::size_t i = chunk * chunksize; i < end; i++)
+        PrintPlace(qmgr, options, out, zones, places[i]);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+
+    boost::mutex::scoped_lock lock(theChunks.mutex);
+    if (error) theChunks.failed = true;
+    theChunks.done[chunk] = std::make_pair(out.str(), error);
+    theChunks.changed.notify_all();
+  }
+}
+
+// ----------------------------------------------------------------------
+// Tulostaa pisteiden aikasarjat pisteiden jrjestyksess. Virheen
+// sattuessa tulostetaan virhett edeltv tuloste ja heitetn virhe
+// kuten yhdellkin sikeell.
+// ----------------------------------------------------------------------
+
+void PrintPlaces(QueryDataManager& qmgr,
+                 const Options& options,
+                 ostream& out,
+                 const Fmi::WorldTimeZones& zones,
+                 const Places& places)
+{
+  std::size_t threads = options.threads;
+  if (threads == 0) threads = std::max(1u, boost::thread::hardware_concurrency());
+  threads = std::min(threads, places.size());
+
+  if (threads <= 1)
+  {
+    for (Places::const_iterator it = places.begin(); it != places.end(); ++it)
+      PrintPlace(qmgr, options, out, zones, *it);
+    return;
+  }
+
+  const std::size_t chunksize =
+      std::max<std::size_t>(1, std::min<std::size_t>(100, places.size() / (4 * threads)));
+  const std::size_t chunks = (places.size() + chunksize - 1) / chunksize;
+
+  PlaceChunks work;
+  boost::thread_group workers;
+  for (std::size_t i = 0; i < threads; i++)
+    workers.add_thread(new boost::thread(PrintPlaceChunks,
+                                         boost::ref(work),
+                                         boost::cref(qmgr),
+                                         boost::cref(options),
+                                         boost::cref(zones),
+                                         boost::cref(places),
+                                         chunksize,
+                                         4 * threads));
+
+  for (std::size_t chunk = 0; chunk < chunks; chunk++)
+  {
+    std::pair<string, std::exception_ptr> result;
+    {
+      boost::mutex::scoped_lock lock(work.mutex);
+      while (work.done.find(chunk) == work.done.end())
+        work.changed.wait(lock);
+      result.swap(work.done[chunk]);
+      work.done.erase(chunk);
+      work.written = chunk + 1;
+      work.changed.notify_all();
+    }
+
+    out << result.first;
+    if (result.second)
+    {
+      workers.join_all();
+      std::rethrow_exception(result.second);
+    }
+  }
+  workers.join_all();
+}
+
+// ----------------------------------------------------------------------
+// Vastaa yhteen kyselyyn
+//
+// 1. Konvertoidaan mahdollinen paikannimi koordinaateiksi
+// 2. Tarkistetaan koordinaattien jarkevyys
+// 3. Tulostetaan data
+// ----------------------------------------------------------------------
+
+int query(Options& options, QueryDataManager& qmgr, ostream& out)
+{
+  typedef map<string, NFmiPoint> PlacesType;
+  PlacesType places;
 
   // Initialize timezone finder
 
-  Fmi::WorldTimeZones zones(options.timezonefile);
+  const Fmi::WorldTimeZones& zones = TimeZones(options.timezonefile);
 
   // Muodostetaan paikka -x ja -y koordinaateista
 
@@ -1345,7 +1636,7 @@ int run(int argc, char* argv[])
     if (options.verbose)
     {
       for (map<string, NFmiPoint>::const_iterator it = places.begin(); it != places.end(); ++it)
-        cout << "# Location: " << it->first << endl
+        out << "# Location: " << it->first << endl
              << "# Coordinate: " << it->second.X() << ' ' << it->second.Y() << endl;
     }
   }
@@ -1391,16 +1682,16 @@ int run(int argc, char* argv[])
   if (options.list_stations || options.verbose)
   {
     if (!places.empty()) qmgr.setpoint(places.begin()->second, 1000 * options.max_distance);
-    ReportStations(qmgr, options.stations, referencelonlat);
+    ReportStations(qmgr, options, out, options.stations, referencelonlat);
   }
 
   // Nytetn aika-askeleet, jos -v on annettu
 
-  if (options.verbose) ReportTimes(qmgr);
+  if (options.verbose) ReportTimes(qmgr, out);
 
   // Nytetn parametrinimet, jos -v on annettu
 
-  if (options.verbose) ReportParams(qmgr, options.stations, options.params);
+  if (options.verbose) ReportParams(qmgr, out, options.stations, options.params);
 
   // Jos options.rows > 0, halutaan N viimeisint aikaa, muutoin kaikki ajat
 
@@ -1421,7 +1712,7 @@ int run(int argc, char* argv[])
 
       if (!qi->Location(*iter)) continue;
 
-      NFmiPoint lonlat = FixCoordinate(qi->Location()->GetLocation());
+      NFmiPoint lonlat = FixCoordinate(qi->Location()->GetLocation(), options, out);
 
       if (options.rows < 0)
       {
@@ -1430,8 +1721,8 @@ int run(int argc, char* argv[])
         {
           // Taaksepin yhteensopivuus vaatii, ett
           // tulostetaan WMO-numero vain kun niit on useita
-          if (options.stations.size() > 1) cout << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
-          PrintRow(*qi, ignoresubs, zones, lonlat);
+          if (options.stations.size() > 1) out << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
+          PrintRow(*qi, options, out, ignoresubs, zones, lonlat);
         }
       }
       else
@@ -1444,114 +1735,224 @@ int run(int argc, char* argv[])
         int rows = options.rows;
         do
         {
-          if (options.max_missing_gap > 0 || ValidRow(*qi, ignoresubs))
+          if (options.max_missing_gap > 0 || ValidRow(*qi, options, ignoresubs))
           {
-            cout << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
-            PrintRow(*qi, ignoresubs, zones, lonlat);
+            out << NFmiValueString(*iter, "%05d").CharPtr() << ' ';
+            PrintRow(*qi, options, out, ignoresubs, zones, lonlat);
             --rows;
           }
         } while (rows > 0 && qi->PreviousTime());
         if (rows > 0 && options.verbose)
-          cout << "# Warning: " << rows << " missing rows for WMO-number " << *iter
+          out << "# Warning: " << rows << " missing rows for WMO-number " << *iter
                << " due to insufficient data in the queryfile" << endl;
       }
     }
   }
-  else if (!options.locations.empty())
+  else
   {
-    for (LocationList::const_iterator it = options.locations.begin(); it != options.locations.end();
-         ++it)
+    Places points;
+    if (!options.locations.empty())
     {
-      NFmiPoint lonlat = FixCoordinate(it->latlon);
-      try
+      for (LocationList::const_iterator it = options.locations.begin();
+           it != options.locations.end();
+           ++it)
       {
-        qmgr.setpoint(lonlat, 1000 * options.max_distance);
-        qi = &qmgr.info();
+        Place place;
+        place.prefix = it->name + ' ';
+        place.latlon = it->latlon;
+        points.push_back(place);
       }
-      catch (...)
+    }
+    else
+    {
+      for (PlacesType::const_iterator it = places.begin(); it != places.end(); ++it)
       {
-        if (options.force) continue;
-        throw;
+        Place place;
+        if (places.size() > 1) place.header = it->first;
+        place.latlon = it->second;
+        points.push_back(place);
       }
+    }
+    PrintPlaces(qmgr, options, out, zones, points);
+  }
 
-      qi->FirstLevel();
-      if (options.rows < 0)
-      {
-        qi->ResetTime();
-        while (qi->NextTime())
-        {
-          cout << it->name << ' ';
-          PrintRow(*qi, ignoresubs, zones, lonlat);
-        }
-      }
-      else
-      {
-        while (qi->NextTime())
-          ;
-        qi->PreviousTime();
-        // qi->LastTime()
-        int rows = options.rows;
-        do
-        {
-          if (options.max_missing_gap > 0 || ValidRow(*qi, ignoresubs, lonlat))
-          {
-            cout << it->name << ' ';
-            PrintRow(*qi, ignoresubs, zones, lonlat);
-            --rows;
-          }
-        } while (rows > 0 && qi->PreviousTime());
-        if (rows > 0 && options.verbose)
-          cout << "# Warning: " << rows << " missing rows due to insufficient data in the queryfile"
-               << endl;
-      }
+  return 0;
+}
+
+// ----------------------------------------------------------------------
+// Palauttaa palvelimen kyselylle oman kopion yhteisest datasta. Kukin
+// tiedosto ladataan vasta tarvittaessa ja vain kerran kaikille kopioille,
+// ja uudelleen vain jos tiedostot on vaihdettu
+// (tarkistetaan korkeintaan kerran sekunnissa). Kesken olevat kyselyt
+// kyttvt vanhaa dataa loppuun asti.
+// ----------------------------------------------------------------------
+
+boost::shared_ptr<QueryDataManager> SharedQueryData(const Options& options)
+{
+  struct Entry
+  {
+    boost::shared_ptr<QueryDataManager> manager;
+    std::time_t checktime = 0;
+  };
+
+  static boost::mutex mutex;
+  static std::map<string, Entry> datas;
+  boost::mutex::scoped_lock lock(mutex);
+
+  Entry& entry = datas[options.queryfile];
+  std::time_t now = std::time(nullptr);
+  if (!entry.manager || (now != entry.checktime && entry.manager->modified()))
+  {
+    boost::shared_ptr<QueryDataManager> qmgr(new QueryDataManager);
+    qmgr->searchpath(NFmiSettings::Optional<string>("qdpoint::querydata_path", "."));
+    qmgr->addfiles(NFmiStringTools::Split(options.queryfile));
+    entry.manager = qmgr;
+  }
+  entry.checktime = now;
+
+  boost::shared_ptr<QueryDataManager> ret(new QueryDataManager(*entry.manager));
+  if (options.multimode) ret->multimode();
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+// Palvelimen kyselyjono. Lukija lis kyselyt jonoon, tysikeet
+// vastaavat niihin ja kirjoittaja tulostaa vastaukset kyselyjen
+// jrjestyksess.
+// ----------------------------------------------------------------------
+
+struct RequestQueue
+{
+  boost::mutex mutex;
+  boost::condition_variable changed;
+  std::deque<std::pair<std::size_t, string> > requests;
+  std::map<std::size_t, string> responses;
+  std::size_t count = 0;   // luettujen kyselyjen mr
+  bool finished = false;  // syte on loppunut
+};
+
+// ----------------------------------------------------------------------
+// Vastaa yhteen palvelimen kyselyyn. Palvelimen optiot ovat kyselyn
+// optioiden oletusarvoja.
+// ----------------------------------------------------------------------
+
+string Answer(const string& theRequest, const Options& theDefaults)
+{
+  ostringstream out;
+  try
+  {
+    Options options = theDefaults;
+    if (parse_options(boost::program_options::split_unix(theRequest), options, out))
+    {
+      boost::shared_ptr<QueryDataManager> qmgr = SharedQueryData(options);
+      query(options, *qmgr, out);
     }
   }
-  else
+  catch (const std::exception& e)
+  {
+    out << "Error: " << e.what() << endl;
+  }
+  catch (...)
+  {
+    out << "Error: An unknown exception occurred" << endl;
+  }
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+// Tysie: vastaa jonon kyselyihin kunnes syte loppuu
+// ----------------------------------------------------------------------
+
+void AnswerRequests(RequestQueue& theQueue, const Options& theDefaults)
+{
+  while (true)
   {
-    for (PlacesType::const_iterator it = places.begin(); it != places.end(); ++it)
+    std::pair<std::size_t, string> request;
     {
-      if (places.size() > 1) cout << "Location: " << it->first << endl;
+      boost::mutex::scoped_lock lock(theQueue.mutex);
+      while (theQueue.requests.empty() && !theQueue.finished)
+        theQueue.changed.wait(lock);
+      if (theQueue.requests.empty()) return;
+      request = theQueue.requests.front();
+      theQueue.requests.pop_front();
+    }
 
-      NFmiPoint lonlat = FixCoordinate(it->second);
-      try
-      {
-        qmgr.setpoint(lonlat, 1000 * options.max_distance);
-        qi = &qmgr.info();
-      }
-      catch (...)
-      {
-        if (options.force) continue;
-        throw;
-      }
+    string response = Answer(request.second, theDefaults);
 
-      qi->FirstLevel();
-      if (options.rows < 0)
-      {
-        qi->ResetTime();
-        while (qi->NextTime())
-          PrintRow(*qi, ignoresubs, zones, lonlat);
-      }
-      else
-      {
-        while (qi->NextTime())
-          ;
-        qi->PreviousTime();
-        // qi->LastTime()
-        int rows = options.rows;
-        do
-        {
-          if (options.max_missing_gap > 0 || ValidRow(*qi, ignoresubs, lonlat))
-          {
-            PrintRow(*qi, ignoresubs, zones, lonlat);
-            --rows;
-          }
-        } while (rows > 0 && qi->PreviousTime());
-        if (rows > 0 && options.verbose)
-          cout << "# Warning: " << rows << " missing rows due to insufficient data in the queryfile"
-               << endl;
-      }
+    boost::mutex::scoped_lock lock(theQueue.mutex);
+    theQueue.responses[request.first].swap(response);
+    theQueue.changed.notify_all();
+  }
+}
+
+// ----------------------------------------------------------------------
+// Tulostaa vastaukset kyselyjen jrjestyksess
+// ----------------------------------------------------------------------
+
+void WriteResponses(RequestQueue& theQueue)
+{
+  for (std::size_t next = 0;; ++next)
+  {
+    string response;
+    {
+      boost::mutex::scoped_lock lock(theQueue.mutex);
+      while (theQueue.responses.find(next) == theQueue.responses.end() &&
+             !(theQueue.finished && next >= theQueue.count))
+        theQueue.changed.wait(lock);
+      std::map<std::size_t, string>::iterator it = theQueue.responses.find(next);
+      if (it == theQueue.responses.end()) return;
+      response.swap(it->second);
+      theQueue.responses.erase(it);
     }
+    // endl flushes the response to the waiting client
+    cout << response << "# END" << endl;
   }
+}
+
+// ----------------------------------------------------------------------
+// Palvelintila: vastaa standardisytteen riveill annettuihin kyselyihin
+// ----------------------------------------------------------------------
+
+int serve(const Options& theOptions)
+{
+  // Luetaan yhteiset asetukset heti, jotta virheet huomataan kynnistettess.
+  // Querydata ladataan vasta kyselyjen tarvitessa sit.
+
+  if (!theOptions.queryfile.empty()) SharedQueryData(theOptions);
+  TimeZones(theOptions.timezonefile);
+
+  unsigned int threads = theOptions.threads;
+  if (threads == 0) threads = std::max(1u, boost::thread::hardware_concurrency());
+
+  // Kyselyt ovat jo rinnakkain, joten kukin kysely lasketaan yhdell sikeell
+
+  Options defaults = theOptions;
+  defaults.server = false;
+  defaults.threads = 1;
+
+  RequestQueue queue;
+  boost::thread_group workers;
+  for (unsigned int i = 0; i < threads; i++)
+    workers.add_thread(
+        new boost::thread(AnswerRequests, boost::ref(queue), boost::cref(defaults)));
+  boost::thread writer(WriteResponses, boost::ref(queue));
+
+  string line;
+  while (getline(cin, line))
+  {
+    if (!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+    boost::mutex::scoped_lock lock(queue.mutex);
+    queue.requests.push_back(std::make_pair(queue.count++, line));
+    queue.changed.notify_all();
+  }
+
+  {
+    boost::mutex::scoped_lock lock(queue.mutex);
+    queue.finished = true;
+    queue.changed.notify_all();
+  }
+  workers.join_all();
+  writer.join();
 
   return 0;
 }
@@ -1560,9 +1961,30 @@ int run(int argc, char* argv[])
 // Paaohjelma
 //
 // 1. Luetaan optiot
-// 2. Konvertoidaan mahdollinen paikannimi koordinaateiksi
-// 3. Tarkistetaan koordinaattien jarkevyys
-// 4. Luetaan data
+// 2. Palvelintilassa vastataan standardisytteen kyselyihin
+// 3. Muutoin vastataan komentorivin kyselyyn
+// ----------------------------------------------------------------------
+
+int run(int argc, char* argv[])
+{
+  Options options;
+  if (!parse_options(vector<string>(argv + 1, argv + argc), options, cout)) return 0;
+
+  if (options.server) return serve(options);
+
+  // Initialize the querydata manager
+
+  QueryDataManager qmgr;
+  qmgr.searchpath(NFmiSettings::Optional<string>("qdpoint::querydata_path", "."));
+  qmgr.addfiles(NFmiStringTools::Split(options.queryfile));
+
+  if (options.multimode) qmgr.multimode();
+
+  return query(options, qmgr, cout);
+}
+
+// ----------------------------------------------------------------------
+// Paaohjelma
 // ----------------------------------------------------------------------
 
 int main(int argc, char* argv[])
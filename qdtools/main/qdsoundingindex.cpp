@@ -23,12 +23,13 @@ static void Usage(const std::string& theExecutableName)
             << std::endl
             << "\t-n producer-name <default=qdin-producer-name>\tSets producer name." << std::endl
             << "\t-t thread count <default=all>\tHow many worker threads will be doing the calculations." << std::endl
+            << "\t-x\tUse the exact iterative moist adiabat solvers instead of lookup tables." << std::endl
             << std::endl;
 }
 
 static void run(int argc, const char* argv[])
 {
-  NFmiCmdLine cmdLine(argc, argv, "n!t!");
+  NFmiCmdLine cmdLine(argc, argv, "n!t!x");
   if (cmdLine.NumberofParameters() < 2)
   {
     Usage(argv[0]);
@@ -45,6 +46,8 @@ static void run(int argc, const char* argv[])
   int workerThreadCount = 0;
   if (cmdLine.isOption('t')) workerThreadCount = std::stoi(cmdLine.OptionValue('t'));
 
+  if (cmdLine.isOption('x')) NFmiSoundingFunctions::UseExactSolvers(true);
+
   std::cerr << "starting the " << argv[0] << " execution" << std::endl;
 
   NFmiMilliSecondTimer debugTimer;
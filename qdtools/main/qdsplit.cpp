@@ -21,8 +21,8 @@
  *   - -h for help information
  *   - -v for verbose mode
  *   - -s use timestamp only in the name, not the original name
- *   - -t [n] split several times simultaneously
- *   - -T [n] split several times simultaneously using memory mapping
+ *   - -t [n] split several times simultaneously in separate threads
+ *   - -T [n] split several times simultaneously writing directly to memory mapped files
  *   - -m limit for assigning a limit on the amount of missing data (%)
  *   - -O set origin time equal to output valid time
  *
@@ -39,8 +39,12 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
+#include <exception>
 #include <fstream>
+#include <map>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -176,7 +180,7 @@ bool parse_command_line(int argc, const char* argv[])
  */
 // ----------------------------------------------------------------------
 
-NFmiTimeDescriptor make_timedescriptor(const NFmiFastQueryInfo theQ)
+NFmiTimeDescriptor make_timedescriptor(const NFmiFastQueryInfo& theQ)
 {
   NFmiTimeList times;
   times.Add(new NFmiMetTime(theQ.ValidTime()));
@@ -222,210 +226,218 @@ float calc_missing(NFmiFastQueryInfo& info)
 // ----------------------------------------------------------------------
 /*!
  * \brief Establish final and temporary names for the querydata
+ *
+ * The suffix is the input file name, or ".sqd" with short names.
  */
 // ----------------------------------------------------------------------
 
-pair<string, string> make_outnames(NFmiFastQueryInfo& info)
+pair<string, string> make_outnames(const NFmiMetTime& theTime, const string& theSuffix)
 {
-  string outname = (options.outputdir + '/' + info.ValidTime().ToStr(kYYYYMMDDHHMM).CharPtr());
+  string outname = (options.outputdir + '/' + theTime.ToStr(kYYYYMMDDHHMM).CharPtr());
 
 #ifdef UNIX
-  string tmpname = (options.outputdir + "/." + info.ValidTime().ToStr(kYYYYMMDDHHMM).CharPtr());
+  string tmpname = (options.outputdir + "/." + theTime.ToStr(kYYYYMMDDHHMM).CharPtr());
 #else
-  string tmpname =
-      (options.outputdir + "/" + info.ValidTime().ToStr(kYYYYMMDDHHMM).CharPtr()) + ".tmp";
+  string tmpname = (options.outputdir + "/" + theTime.ToStr(kYYYYMMDDHHMM).CharPtr()) + ".tmp";
 #endif
 
-  if (options.shortnames)
-  {
-    outname += ".sqd";
-    tmpname += ".sqd";
-  }
-  else
-  {
-    std::string suffix =
-        '_' + NFmiFileSystem::BaseName(NFmiFileSystem::FindQueryData(options.inputfile));
-    outname += suffix;
-    tmpname += suffix;
-  }
+  outname += theSuffix;
+  tmpname += theSuffix;
 
   return make_pair(outname, tmpname);
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Extract the active time from the querydata
+ * \brief Create the data container for the time at the given index
  */
 // ----------------------------------------------------------------------
 
-void extract_time(NFmiFastQueryInfo& theQ)
+NFmiFastQueryInfo make_info(NFmiFastQueryInfo& theQ, unsigned long theTimeIndex)
 {
-  // create new data container
-
+  theQ.TimeIndex(theTimeIndex);
   NFmiTimeDescriptor tdesc = make_timedescriptor(theQ);
-
-  NFmiFastQueryInfo info(
+  return NFmiFastQueryInfo(
       theQ.ParamDescriptor(), tdesc, theQ.HPlaceDescriptor(), theQ.VPlaceDescriptor());
+}
 
-  unique_ptr<NFmiQueryData> data(NFmiQueryDataUtil::CreateEmptyData(info));
-  NFmiFastQueryInfo dstinfo(data.get());
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract the time at the given index from the querydata
+ *
+ * The outputs differ only by time, hence the same copy indexes are
+ * used for all of them. Only the time index is changed.
+ *
+ * \return The message to print in verbose mode
+ */
+// ----------------------------------------------------------------------
+
+string extract_time(NFmiFastQueryInfo& theQ,
+                    NFmiSlabCopyIndexes& theIndexes,
+                    unsigned long theTimeIndex,
+                    const string& theSuffix)
+{
+  NFmiFastQueryInfo tmpinfo = make_info(theQ, theTimeIndex);
+  pair<string, string> names = make_outnames(theQ.ValidTime(), theSuffix);
+  const string& outname = names.first;
+  const string& tmpname = names.second;
+
+  // create new data container, possibly directly into the output file
+
+  unique_ptr<NFmiQueryData> data;
+  if (!options.memorymapping)
+    data.reset(NFmiQueryDataUtil::CreateEmptyData(tmpinfo));
+  else
+    data.reset(NFmiQueryDataUtil::CreateEmptyData(tmpinfo, tmpname, false));
 
   if (data.get() == 0) throw runtime_error("Could not allocate memory for result data");
 
-  // copy the data for time selected time
+  NFmiFastQueryInfo info(data.get());
 
-  for (dstinfo.ResetParam(), theQ.ResetParam(); dstinfo.NextParam() && theQ.NextParam();)
-  {
-    for (dstinfo.ResetLocation(), theQ.ResetLocation();
-         dstinfo.NextLocation() && theQ.NextLocation();)
-    {
-      for (dstinfo.ResetLevel(), theQ.ResetLevel(); dstinfo.NextLevel() && theQ.NextLevel();)
-      {
-        float value = theQ.FloatValue();
-        dstinfo.FloatValue(value);
-      }
-    }
-  }
+  // copy the data for the selected time
+
+  theIndexes.itsTimeIndexes.assign(1, theTimeIndex);
+  NFmiQueryDataUtil::CopySlabs(theQ, info, theIndexes);
 
   // Count the amount of missing values if needed
 
-  float misses = calc_missing(dstinfo);
+  float misses = calc_missing(info);
 
-  pair<string, string> names = make_outnames(dstinfo);
-  const string& outname = names.first;
-  const string& tmpname = names.second;
+  ostringstream message;
 
   if (options.missinglimit < 100 && misses > options.missinglimit)
   {
     if (options.verbose)
-      cout << "Skipping " << outname << " since missing percentage is " << misses << endl;
+      message << "Skipping " << outname << " since missing percentage is " << misses << endl;
+    data.reset();
+    if (options.memorymapping) boost::filesystem::remove(tmpname);
   }
   else
   {
     // write the data out
 
-    if (options.verbose) cout << "Writing '" << outname << " (missing " << misses << "%)" << endl;
+    if (options.verbose)
+    {
+      if (misses >= 0)
+        message << "Writing '" << outname << " (missing " << misses << "%)" << endl;
+      else
+        message << "Writing '" << outname << endl;
+    }
 
     // Use dotfile to prevent for example roadmodel crashes
 
-    data->Write(tmpname);
+    if (!options.memorymapping) data->Write(tmpname);
+    data.reset();
+
     if (boost::filesystem::exists(outname)) boost::filesystem::remove(outname);
     boost::filesystem::rename(tmpname, outname);
   }
+
+  return message.str();
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Extract the given time indices from the querydata
+ * \brief Shared state of the threads splitting the data
+ *
+ * Each thread extracts one time at a time, hence the memory use is
+ * bounded by the number of threads. The messages are printed in
+ * time order by the main thread.
  */
 // ----------------------------------------------------------------------
 
-void extract_times(NFmiFastQueryInfo& theQ, unsigned long index1, unsigned long index2)
+struct SplitQueue
 {
-  // Make sure we're within limits (one beyond last possible index)
-  index2 = std::min(index2, theQ.SizeTimes());
-
-  // create new data containers
-
-  std::vector<NFmiQueryData*> datas;
-  std::vector<NFmiFastQueryInfo*> infos;
-
-  for (unsigned long idx = index1; idx < index2; ++idx)
-  {
-    theQ.TimeIndex(idx);
-    NFmiTimeDescriptor tdesc = make_timedescriptor(theQ);
-
-    NFmiFastQueryInfo tmpinfo(
-        theQ.ParamDescriptor(), tdesc, theQ.HPlaceDescriptor(), theQ.VPlaceDescriptor());
-
-    NFmiQueryData* qd = 0;
-
-    if (!options.memorymapping)
-      qd = NFmiQueryDataUtil::CreateEmptyData(tmpinfo);
-    else
-    {
-      pair<string, string> names = make_outnames(theQ);
-      qd = NFmiQueryDataUtil::CreateEmptyData(tmpinfo, names.second, false);
-    }
-
-    NFmiFastQueryInfo* info = new NFmiFastQueryInfo(qd);
-
-    datas.push_back(qd);
-    infos.push_back(info);
-  }
+  boost::mutex mutex;
+  boost::condition_variable changed;
+  unsigned long next = 0;         // next time index to extract
+  unsigned int running = 0;       // number of active threads
+  map<unsigned long, string> messages;
+  std::exception_ptr error;
+};
 
-  // copy the data for time selected times
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract times in a thread until all are done or one fails
+ */
+// ----------------------------------------------------------------------
 
-  for (theQ.ResetParam(); theQ.NextParam();)
+void split_times_in_thread(SplitQueue& theQueue,
+                           NFmiQueryData& theData,
+                           const NFmiSlabCopyIndexes& theIndexes,
+                           const string& theSuffix)
+{
+  try
   {
-    for (std::size_t i = 0; i < infos.size(); i++)
-      infos[i]->ParamIndex(theQ.ParamIndex());
+    NFmiFastQueryInfo qi(&theData);
+    NFmiSlabCopyIndexes indexes = theIndexes;
 
-    for (theQ.ResetLocation(); theQ.NextLocation();)
+    while (true)
     {
-      for (std::size_t i = 0; i < infos.size(); i++)
-        infos[i]->LocationIndex(theQ.LocationIndex());
-
-      for (theQ.ResetLevel(); theQ.NextLevel();)
+      unsigned long timeindex;
       {
-        for (std::size_t i = 0; i < infos.size(); i++)
-          infos[i]->LevelIndex(theQ.LevelIndex());
-        {
-          for (unsigned long i = index1; i < index2; ++i)
-          {
-            theQ.TimeIndex(i);
-            float value = theQ.FloatValue();
-            infos[i - index1]->FloatValue(value);
-          }
-        }
+        boost::mutex::scoped_lock lock(theQueue.mutex);
+        if (theQueue.error || theQueue.next >= qi.SizeTimes()) break;
+        timeindex = theQueue.next++;
       }
-    }
-  }
 
-  // Write the datas
+      string message = extract_time(qi, indexes, timeindex, theSuffix);
 
-  for (std::size_t i = 0; i < datas.size(); i++)
+      boost::mutex::scoped_lock lock(theQueue.mutex);
+      theQueue.messages[timeindex].swap(message);
+      theQueue.changed.notify_all();
+    }
+  }
+  catch (...)
   {
-    // Count the amount of missing values if needed
+    boost::mutex::scoped_lock lock(theQueue.mutex);
+    if (!theQueue.error) theQueue.error = std::current_exception();
+  }
 
-    float misses = calc_missing(*infos[i]);
+  boost::mutex::scoped_lock lock(theQueue.mutex);
+  --theQueue.running;
+  theQueue.changed.notify_all();
+}
 
-    infos[i]->FirstTime();
-    pair<string, string> names = make_outnames(*infos[i]);
-    const string& outname = names.first;
-    const string& tmpname = names.second;
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract all the times using the given number of threads
+ */
+// ----------------------------------------------------------------------
 
-    if (options.missinglimit < 100 && misses > options.missinglimit)
-    {
-      if (options.verbose)
-      {
-        cout << "Skipping " << outname << " since missing percentage is " << misses << endl;
-        if (options.memorymapping) boost::filesystem::remove(tmpname);
-      }
-    }
-    else
+void split_times(NFmiQueryData& theData,
+                 const NFmiSlabCopyIndexes& theIndexes,
+                 const string& theSuffix,
+                 unsigned int theThreadCount)
+{
+  SplitQueue queue;
+  queue.running = theThreadCount;
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < theThreadCount; i++)
+    threads.add_thread(new boost::thread(split_times_in_thread,
+                                         boost::ref(queue),
+                                         boost::ref(theData),
+                                         boost::cref(theIndexes),
+                                         boost::cref(theSuffix)));
+
+  for (unsigned long timeindex = 0;; ++timeindex)
+  {
+    string message;
     {
-      // write the data out
-
-      if (options.verbose)
-      {
-        if (misses >= 0)
-          cout << "Writing '" << outname << " (missing " << misses << "%)" << endl;
-        else
-          cout << "Writing '" << outname << endl;
-      }
-
-      // Use dotfile to prevent for example roadmodel crashes
-
-      if (!options.memorymapping) datas[i]->Write(tmpname);
-
-      if (boost::filesystem::exists(outname)) boost::filesystem::remove(outname);
-      boost::filesystem::rename(tmpname, outname);
+      boost::mutex::scoped_lock lock(queue.mutex);
+      while (queue.messages.find(timeindex) == queue.messages.end() && queue.running > 0)
+        queue.changed.wait(lock);
+      map<unsigned long, string>::iterator it = queue.messages.find(timeindex);
+      if (it == queue.messages.end()) break;
+      message.swap(it->second);
+      queue.messages.erase(it);
     }
-
-    delete datas[i];
-    delete infos[i];
+    cout << message << flush;
   }
+
+  threads.join_all();
+  if (queue.error) std::rethrow_exception(queue.error);
 }
 
 // ----------------------------------------------------------------------
@@ -443,13 +455,32 @@ int run(int argc, const char* argv[])
   NFmiQueryData qd(options.inputfile);
   NFmiFastQueryInfo qi(&qd);
 
+  if (qi.SizeTimes() == 0) return 0;
+
+  string suffix = ".sqd";
+  if (!options.shortnames)
+    suffix = '_' + NFmiFileSystem::BaseName(NFmiFileSystem::FindQueryData(options.inputfile));
+
+  // The outputs differ from each other only by time, hence the copy
+  // indexes are calculated only once
+
+  NFmiSlabCopyIndexes indexes;
+  NFmiFastQueryInfo tmpinfo = make_info(qi, 0);
+  if (!NFmiQueryDataUtil::MakeSlabCopyIndexes(qi, tmpinfo, indexes))
+    throw runtime_error("Failed to match the output descriptors to the querydata");
+
   // Process all the timesteps
 
-  for (unsigned long index1 = 0; index1 < qi.SizeTimes(); index1 += options.simultaneoustimes)
+  unsigned int threads =
+      static_cast<unsigned int>(std::min<unsigned long>(options.simultaneoustimes, qi.SizeTimes()));
+
+  if (threads <= 1)
   {
-    unsigned long index2 = index1 + options.simultaneoustimes;
-    extract_times(qi, index1, index2);
+    for (unsigned long timeindex = 0; timeindex < qi.SizeTimes(); ++timeindex)
+      cout << extract_time(qi, indexes, timeindex, suffix);
   }
+  else
+    split_times(qd, indexes, suffix, threads);
 
   return 0;
 }
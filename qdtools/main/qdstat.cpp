@@ -3,6 +3,7 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread.hpp>
 #include <fmt/format.h>
 #include <macgyver/StringConversion.h>
 #include <macgyver/TimeParser.h>
@@ -11,6 +12,7 @@
 #include <newbase/NFmiMetTime.h>
 #include <newbase/NFmiParameterName.h>
 #include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryDataUtil.h>
 #include <cmath>
 #include <iomanip>
 #include <limits>
@@ -20,6 +22,8 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #ifdef UNIX
 #include <sys/ioctl.h>
@@ -53,6 +57,7 @@ struct Options
   bool distribution = false;
   std::size_t bins = 20;
   std::size_t barsize = 60;
+  unsigned int threads = 0;  // 0 = reasonable default
   double ignored_value = std::numeric_limits<double>::quiet_NaN();  // never compares ==
 
   std::set<boost::posix_time::ptime> these_times;
@@ -195,6 +200,9 @@ bool parse_options(int argc, char* argv[])
       "ignore,I", po::value(&options.ignored_value), "ignore this value in statistics")(
       "bins,b", po::value(&options.bins), "max number of bins in the distribution")(
       "barsize,B", po::value(&options.barsize), "width of the bar distribution")(
+      "threads,j",
+      po::value(&options.threads),
+      "maximum number of threads, 0 for a reasonable default")(
       "times,t", po::value(&opt_stamps), "times to process")(
       "params,p", po::value(&opt_params), "parameters to process")(
       "stations,w", po::value(&opt_stations), "stations to process")(
@@ -270,6 +278,8 @@ class Stats
  public:
   Stats();
   void operator()(double value);
+  void operator()(const std::vector<float>& values);
+  void merge(const Stats& other);
   static std::string header();
   std::string report() const;
   void param(FmiParameterName theParam) { itsParam = theParam; }
@@ -285,7 +295,7 @@ class Stats
   double itsSum;
   double itsMin;
   double itsMax;
-  std::map<double, std::size_t> itsCounts;
+  std::unordered_map<double, std::size_t> itsCounts;
 };
 
 Stats::Stats()
@@ -331,6 +341,117 @@ void Stats::operator()(double value)
   if (options.distribution && std::isfinite(value) && value != kFloatMissing) ++itsCounts[value];
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect a block of values
+ *
+ * Equivalent to calling operator() for each value in order, but the
+ * classification runs in local variables and the distribution is
+ * counted in a separate pass which reuses the previous bin for runs
+ * of equal values.
+ */
+// ----------------------------------------------------------------------
+
+void Stats::operator()(const std::vector<float>& values)
+{
+  const double ignored = options.ignored_value;
+
+  std::size_t count = 0;
+  std::size_t valid = 0;
+  std::size_t missing = 0;
+  std::size_t nans = 0;
+  std::size_t infs = 0;
+
+  // -0 is the identity for addition, so the sum is bit identical to the one value at a time
+  double sum = (itsValidCount > 0 ? itsSum : -0.0);
+  double minimum = (itsValidCount > 0 ? itsMin : std::numeric_limits<double>::infinity());
+  double maximum = (itsValidCount > 0 ? itsMax : -std::numeric_limits<double>::infinity());
+
+  for (float v : values)
+  {
+    const double value = v;
+    if (value == ignored) continue;
+    ++count;
+    if (value == kFloatMissing)
+      ++missing;
+    else if (std::isnan(value))
+      ++nans;
+    else if (std::isinf(value))
+      ++infs;
+    else
+    {
+      ++valid;
+      sum += value;
+      if (value < minimum) minimum = value;
+      if (value > maximum) maximum = value;
+    }
+  }
+
+  itsCount += count;
+  itsMissingCount += missing;
+  itsNaNCount += nans;
+  itsInfCount += infs;
+
+  if (valid > 0)
+  {
+    itsValidCount += valid;
+    itsSum = sum;
+    itsMin = minimum;
+    itsMax = maximum;
+  }
+
+  if (!options.distribution || valid == 0) return;
+
+  std::size_t* bin = nullptr;
+  double binvalue = 0;
+
+  for (float v : values)
+  {
+    const double value = v;
+    if (value == ignored || !std::isfinite(value) || value == kFloatMissing) continue;
+    if (bin == nullptr || value != binvalue)
+    {
+      bin = &itsCounts[value];
+      binvalue = value;
+    }
+    ++*bin;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add statistics collected from values following the ones seen so far
+ */
+// ----------------------------------------------------------------------
+
+void Stats::merge(const Stats& other)
+{
+  itsCount += other.itsCount;
+  itsMissingCount += other.itsMissingCount;
+  itsNaNCount += other.itsNaNCount;
+  itsInfCount += other.itsInfCount;
+
+  if (other.itsValidCount > 0)
+  {
+    if (itsValidCount == 0)
+    {
+      itsMin = other.itsMin;
+      itsMax = other.itsMax;
+      itsSum = other.itsSum;
+    }
+    else
+    {
+      itsMin = std::min(itsMin, other.itsMin);
+      itsMax = std::max(itsMax, other.itsMax);
+      itsSum += other.itsSum;
+    }
+    itsValidCount += other.itsValidCount;
+  }
+
+  for (const auto& value_count : other.itsCounts)
+    itsCounts[value_count.first] += value_count.second;
+}
+
 std::string Stats::header()
 {
   std::ostringstream out;
@@ -1017,9 +1138,10 @@ std::string Stats::report() const
 
     if (itsCounts.size() < options.bins || itsCounts.size() < max_parameter_values)
     {
-      const int precision = estimate_precision(itsCounts);
+      const std::map<double, std::size_t> counts(itsCounts.begin(), itsCounts.end());
+      const int precision = estimate_precision(counts);
 
-      for (const auto& value_count : itsCounts)
+      for (const auto& value_count : counts)
       {
         double value = value_count.first;
         std::size_t count = value_count.second;
@@ -1046,21 +1168,40 @@ std::string Stats::report() const
       int precision;
       autoscale(itsMin, itsMax, options.bins, binmin, binmax, tick, precision);
 
+      std::vector<double> minvalues;
       for (std::size_t i = 0;; i++)
       {
         double minvalue = binmin + i * tick;
         if (minvalue >= itsMax) break;
-        double maxvalue = minvalue + tick;
-        std::size_t count = 0;
-        for (const auto& value_count : itsCounts)
+        minvalues.push_back(minvalue);
+      }
+
+      // Each value is tested only against the bins next to its estimated position, the
+      // exact tests below decide the bin just like testing against all bins would
+      std::vector<std::size_t> bincounts(minvalues.size(), 0);
+      for (const auto& value_count : itsCounts)
+      {
+        double value = value_count.first;
+        const double guess = std::floor((value - binmin) / tick);
+        const long first = static_cast<long>(std::max(guess - 1, 0.0));
+        const long last = static_cast<long>(std::min(guess + 1, minvalues.size() - 1.0));
+        for (long i = first; i <= last; i++)
         {
-          double value = value_count.first;
+          double minvalue = minvalues[i];
+          double maxvalue = minvalue + tick;
           // The max value must be counted into the last bin
           if ((value >= minvalue && value < maxvalue))
-            count += value_count.second;
+            bincounts[i] += value_count.second;
           else if (value == itsMax && value == maxvalue)
-            count += value_count.second;
+            bincounts[i] += value_count.second;
         }
+      }
+
+      for (std::size_t i = 0; i < minvalues.size(); i++)
+      {
+        double minvalue = minvalues[i];
+        double maxvalue = minvalue + tick;
+        std::size_t count = bincounts[i];
 
         std::ostringstream range;
         range << std::fixed << std::setprecision(precision) << minvalue << "..." << maxvalue;
@@ -1147,6 +1288,131 @@ void set_level(NFmiFastQueryInfo& qi, float levelvalue)
                            " not available in the data");
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Number of values in one unit of work when collecting in parallel
+ *
+ * Blocks are always reduced in the same order, so the results do not
+ * depend on the number of threads.
+ */
+// ----------------------------------------------------------------------
+
+const std::size_t block_size = 256 * 1024;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Merges block statistics in block order as they complete
+ */
+// ----------------------------------------------------------------------
+
+class BlockReducer
+{
+ public:
+  BlockReducer(Stats& theTotal) : itsTotal(theTotal) {}
+  void done(std::size_t theBlock, Stats& theStats);
+
+ private:
+  Stats& itsTotal;
+  std::size_t itsNextBlock = 0;
+  std::map<std::size_t, Stats> itsPending;
+  boost::mutex itsMutex;
+};
+
+void BlockReducer::done(std::size_t theBlock, Stats& theStats)
+{
+  boost::mutex::scoped_lock lock(itsMutex);
+  std::swap(itsPending[theBlock], theStats);
+
+  for (auto it = itsPending.begin(); it != itsPending.end() && it->first == itsNextBlock;)
+  {
+    itsTotal.merge(it->second);
+    it = itsPending.erase(it);
+    ++itsNextBlock;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect the blocks handed out by the range calculator
+ */
+// ----------------------------------------------------------------------
+
+void collect_blocks(const NFmiFastQueryInfo& qi,
+                    std::size_t start,
+                    std::size_t step,
+                    std::size_t count,
+                    NFmiLocationIndexRangeCalculator& theBlockRange,
+                    BlockReducer& theReducer)
+{
+  std::vector<float> values;
+
+  unsigned long first = 0;
+  unsigned long last = 0;
+  while (theBlockRange.GetCurrentLocationRange(first, last))
+  {
+    for (unsigned long block = first; block <= last; block++)
+    {
+      const std::size_t offset = block * block_size;
+      if (!qi.GetValues(start + offset * step, step, std::min(block_size, count - offset), values))
+        throw std::runtime_error("Failed to read values from the querydata");
+
+      Stats stats;
+      stats(values);
+      theReducer.done(block, stats);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Collect statistics on raw data values start, start+step, ...
+ *
+ * Short runs are collected directly, longer ones in blocks using
+ * multiple threads.
+ */
+// ----------------------------------------------------------------------
+
+void collect(Stats& stats,
+             const NFmiFastQueryInfo& qi,
+             std::size_t start,
+             std::size_t step,
+             std::size_t count)
+{
+  if (count <= block_size)
+  {
+    std::vector<float> values;
+    if (!qi.GetValues(start, step, count, values))
+      throw std::runtime_error("Failed to read values from the querydata");
+    stats(values);
+    return;
+  }
+
+  const std::size_t blocks = (count + block_size - 1) / block_size;
+  NFmiLocationIndexRangeCalculator blockrange(blocks, 1);
+  BlockReducer reducer(stats);
+
+  unsigned int threadcount =
+      NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75, static_cast<unsigned int>(blocks));
+  if (options.threads > 0) threadcount = std::min(threadcount, options.threads);
+
+  if (threadcount <= 1)
+  {
+    collect_blocks(qi, start, step, count, blockrange, reducer);
+    return;
+  }
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadcount; i++)
+    threads.add_thread(new boost::thread(collect_blocks,
+                                         boost::cref(qi),
+                                         start,
+                                         step,
+                                         count,
+                                         boost::ref(blockrange),
+                                         boost::ref(reducer)));
+  threads.join_all();
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Analysis over all locations and times
@@ -1177,10 +1443,20 @@ void stat_locations_times(NFmiFastQueryInfo& qi)
       Stats stats;
       stats.param(p);
 
-      for (qi.ResetLocation(); qi.NextLocation();)
-        for (qi.ResetLevel(); qi.NextLevel();)
-          for (qi.ResetTime(); qi.NextTime();)
-            stats(qi.FloatValue());
+      // The values of a parameter are stored location, level and time wise in this order
+      if (qi.IsSubParamUsed())
+      {
+        for (qi.ResetLocation(); qi.NextLocation();)
+          for (qi.ResetLevel(); qi.NextLevel();)
+            for (qi.ResetTime(); qi.NextTime();)
+              stats(qi.FloatValue());
+      }
+      else
+        collect(stats,
+                qi,
+                qi.Index(qi.ParamIndex(), 0, 0, 0),
+                1,
+                qi.SizeLocations() * qi.SizeLevels() * qi.SizeTimes());
       std::cout << std::setw(param_width) << name << stats.report() << std::endl;
     }
     else
@@ -1192,9 +1468,21 @@ void stat_locations_times(NFmiFastQueryInfo& qi)
         Stats stats;
         stats.param(p);
 
-        for (qi.ResetLocation(); qi.NextLocation();)
-          for (qi.ResetTime(); qi.NextTime();)
-            stats(qi.FloatValue());
+        if (qi.IsSubParamUsed())
+        {
+          for (qi.ResetLocation(); qi.NextLocation();)
+            for (qi.ResetTime(); qi.NextTime();)
+              stats(qi.FloatValue());
+        }
+        else
+        {
+          for (unsigned long loc = 0; loc < qi.SizeLocations(); loc++)
+            collect(stats,
+                    qi,
+                    qi.Index(qi.ParamIndex(), loc, qi.LevelIndex(), 0),
+                    1,
+                    qi.SizeTimes());
+        }
         std::cout << std::setw(param_width) << name << std::setw(column_width) << levelvalue
                   << stats.report() << std::endl;
       }
@@ -1230,16 +1518,25 @@ void stat_locations_these_times(NFmiFastQueryInfo& qi)
     for (const auto& pt : options.these_times)
     {
       NFmiMetTime t = pt;
-      qi.Time(t);
+      const bool bulk = (qi.Time(t) && !qi.IsSubParamUsed());
 
       if (options.these_levels.empty())
       {
         Stats stats;
         stats.param(p);
 
-        for (qi.ResetLocation(); qi.NextLocation();)
-          for (qi.ResetLevel(); qi.NextLevel();)
-            stats(qi.FloatValue());
+        if (!bulk)
+        {
+          for (qi.ResetLocation(); qi.NextLocation();)
+            for (qi.ResetLevel(); qi.NextLevel();)
+              stats(qi.FloatValue());
+        }
+        else
+          collect(stats,
+                  qi,
+                  qi.Index(qi.ParamIndex(), 0, 0, qi.TimeIndex()),
+                  qi.SizeTimes(),
+                  qi.SizeLocations() * qi.SizeLevels());
 
         std::cout << std::setw(param_width) << std::right << name << std::setw(18) << std::right
                   << to_iso_string(t.PosixTime()) << stats.report() << std::endl;
@@ -1253,8 +1550,17 @@ void stat_locations_these_times(NFmiFastQueryInfo& qi)
           Stats stats;
           stats.param(p);
 
-          for (qi.ResetLocation(); qi.NextLocation();)
-            stats(qi.FloatValue());
+          if (!bulk)
+          {
+            for (qi.ResetLocation(); qi.NextLocation();)
+              stats(qi.FloatValue());
+          }
+          else
+            collect(stats,
+                    qi,
+                    qi.Index(qi.ParamIndex(), 0, qi.LevelIndex(), qi.TimeIndex()),
+                    qi.SizeLevels() * qi.SizeTimes(),
+                    qi.SizeLocations());
 
           std::cout << std::setw(param_width) << std::right << name << std::setw(column_width)
                     << levelvalue << std::setw(18) << std::right << to_iso_string(t.PosixTime())
@@ -1287,19 +1593,28 @@ void stat_these_stations_these_times(NFmiFastQueryInfo& qi)
 
     for (int wmo : options.these_stations)
     {
-      qi.Location(wmo);
+      const bool found = qi.Location(wmo);
 
       std::cout << "  " << station_header(qi) << std::endl;
 
       for (const auto& pt : options.these_times)
       {
         NFmiMetTime t = pt;
-        qi.Time(t);
+        const bool bulk = (qi.Time(t) && found && !qi.IsSubParamUsed());
 
         Stats stats;
         stats.param(p);
-        for (qi.ResetLevel(); qi.NextLevel();)
-          stats(qi.FloatValue());
+        if (!bulk)
+        {
+          for (qi.ResetLevel(); qi.NextLevel();)
+            stats(qi.FloatValue());
+        }
+        else
+          collect(stats,
+                  qi,
+                  qi.Index(qi.ParamIndex(), qi.LocationIndex(), 0, qi.TimeIndex()),
+                  qi.SizeTimes(),
+                  qi.SizeLevels());
         std::cout << "    " << to_iso_string(t.PosixTime()) << ' ' << stats.report() << std::endl;
       }
     }
@@ -1330,14 +1645,23 @@ void stat_these_stations_times(NFmiFastQueryInfo& qi)
 
     for (int wmo : options.these_stations)
     {
-      qi.Location(wmo);
+      const bool bulk = (qi.Location(wmo) && !qi.IsSubParamUsed());
 
       Stats stats;
       stats.param(p);
 
-      for (qi.ResetLevel(); qi.NextLevel();)
-        for (qi.ResetTime(); qi.NextTime();)
-          stats(qi.FloatValue());
+      if (!bulk)
+      {
+        for (qi.ResetLevel(); qi.NextLevel();)
+          for (qi.ResetTime(); qi.NextTime();)
+            stats(qi.FloatValue());
+      }
+      else
+        collect(stats,
+                qi,
+                qi.Index(qi.ParamIndex(), qi.LocationIndex(), 0, 0),
+                1,
+                qi.SizeLevels() * qi.SizeTimes());
       std::cout << std::setw(station_width) << std::right << station_header(qi)
                 << std::setw(param_width + 1) << std::right << name << stats.report() << std::endl;
     }
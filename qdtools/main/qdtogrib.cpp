@@ -5,6 +5,7 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread.hpp>
 #include <macgyver/StringConversion.h>
 #include <newbase/NFmiArea.h>
 #include <newbase/NFmiCmdLine.h>
@@ -15,8 +16,11 @@
 #include <newbase/NFmiRotatedLatLonArea.h>
 #include <newbase/NFmiStereographicArea.h>
 #include <cassert>
+#include <cinttypes>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <exception>
 #include <grib_api.h>
 #include <map>
 #include <string>
@@ -57,6 +61,8 @@ struct Options
   bool list_centres = false;       // -L --list-centres
   NFmiLevel level;                 // -l --level
   ParamChangeTable ptable;         // -c --config
+  unsigned int threads = 1;        // -j --threads
+  std::string indexfile = "";      // -x --index
 };
 
 Options options;
@@ -300,7 +306,9 @@ bool parse_options(int argc, char *argv[])
       "use first valid time instead of origin time as the forecast time")(
       "split,s", po::bool_switch(&options.split), "split individual timesteps")(
       "level,l", po::value(&level), "level to extract")(
-      "config,c", po::value(&config), msg1.c_str());
+      "config,c", po::value(&config), msg1.c_str())(
+      "threads,j", po::value(&options.threads), "number of encoding threads (default = 1, requires a thread safe grib_api/eccodes build)")(
+      "index,x", po::value(&options.indexfile), "write a field index (number, file, offset, length, param, leveltype, level, validtime) to the given file");
   // clang-format on
 
   po::positional_options_description p;
@@ -354,6 +362,10 @@ bool parse_options(int argc, char *argv[])
 
   if (!options.grib1) options.grib2 = true;
 
+  // Dumps would be interleaved if encoded in parallel
+
+  if (options.dump) options.threads = 1;
+
   // Read the configuration file
 
   if (!config.empty()) options.ptable = ReadGribConf(config);
@@ -904,10 +916,9 @@ bool copy_values(NFmiFastQueryInfo &theInfo,
     i++;
   }
 
-  if (missingValuesExist)
-  {
-    grib_set_long(gribHandle, "bitmapPresent", 1);
-  }
+  // The bitmap is set for every field, since the same handle is reused for
+  // several fields and the result must not depend on the previous ones
+  grib_set_long(gribHandle, "bitmapPresent", missingValuesExist ? 1 : 0);
   grib_set_double_array(gribHandle, "values", &theValueArray[0], theValueArray.size());
 
   return true;
@@ -915,16 +926,6 @@ bool copy_values(NFmiFastQueryInfo &theInfo,
 
 // ----------------------------------------------------------------------
 
-void write_grib(FILE *out, grib_handle *gribHandle)
-{
-  const void *mesg;
-  size_t mesg_len;
-  grib_get_message(gribHandle, &mesg, &mesg_len);
-  fwrite(mesg, 1, mesg_len, out);
-}
-
-// ----------------------------------------------------------------------
-
 std::string make_file_suffix(NFmiFastQueryInfo &theInfo)
 {
   std::string str;
@@ -936,44 +937,304 @@ std::string make_file_suffix(NFmiFastQueryInfo &theInfo)
 }
 
 // ----------------------------------------------------------------------
+/*!
+ * \brief One output GRIB field
+ *
+ * The parameter is stored as an ordinal of the NextParam(false) iteration
+ * so that sub parameters can be activated again in any iterator copy.
+ */
+// ----------------------------------------------------------------------
+
+struct GribField
+{
+  unsigned long itsParamOrdinal;
+  unsigned long itsLevelIndex;
+  unsigned long itsTimeIndex;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief List the fields to be written in output order
+ */
+// ----------------------------------------------------------------------
 
-void write_grib(NFmiFastQueryInfo &theInfo, grib_handle *gribHandle, const std::string &theFileName)
+std::vector<GribField> list_fields(NFmiFastQueryInfo &theInfo)
 {
-  std::string fullSplitFileName(theFileName);
-  fullSplitFileName += ::make_file_suffix(theInfo);
-  FILE *out = fopen(fullSplitFileName.c_str(), "wb");
-  if (!out) throw std::runtime_error("ERROR: cannot open file for writing: " + fullSplitFileName);
-
-  const void *mesg;
-  size_t mesg_len;
-  grib_get_message(gribHandle, &mesg, &mesg_len);
-  fwrite(mesg, 1, mesg_len, out);
-  fclose(out);
+  std::vector<GribField> fields;
+
+  for (theInfo.ResetLevel(); theInfo.NextLevel();)
+  {
+    unsigned long ordinal = 0;
+    for (theInfo.ResetParam(); theInfo.NextParam(false); ++ordinal)
+    {
+      if (ignore_param(theInfo.Param().GetParamIdent()))
+      {
+        // if(options.verbose)
+        std::cout << "Ignoring parameter " << theInfo.Param().GetParamName().CharPtr() << " ("
+                  << theInfo.Param().GetParamIdent() << ")" << std::endl;
+      }
+      else
+      {
+        for (theInfo.ResetTime(); theInfo.NextTime();)
+        {
+          GribField field = {ordinal, theInfo.LevelIndex(), theInfo.TimeIndex()};
+          fields.push_back(field);
+        }
+      }
+    }
+  }
+  return fields;
 }
 
 // ----------------------------------------------------------------------
+/*!
+ * \brief Activate the parameter, level and time of a field
+ */
+// ----------------------------------------------------------------------
 
-int run(const int argc, char *argv[])
+bool activate_field(NFmiFastQueryInfo &theInfo, const GribField &theField)
 {
-  if (!parse_options(argc, argv)) return 0;
+  theInfo.ResetParam();
+  for (unsigned long i = 0; i <= theField.itsParamOrdinal; i++)
+    if (!theInfo.NextParam(false)) return false;
 
-  if (options.verbose) std::cout << "Opening file '" << options.infile << "'" << std::endl;
+  return (theInfo.LevelIndex(theField.itsLevelIndex) && theInfo.TimeIndex(theField.itsTimeIndex));
+}
 
-  NFmiQueryData qd(options.infile);
-  NFmiFastQueryInfo qi(&qd);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Writes GRIB messages and the optional field index
+ */
+// ----------------------------------------------------------------------
 
-  // TODO: This function is deprecated, use grib_handle_new_from_samples instead
+class GribWriter
+{
+ public:
+  GribWriter() : itsOut(0), itsIndex(0), itsOffset(0), itsMessageCount(0)
+  {
+    if (!options.split)
+    {
+      itsOut = fopen(options.outfile.c_str(), "wb");
+      if (!itsOut)
+        throw std::runtime_error("ERROR: cannot open file for writing: " + options.outfile);
+    }
+    if (!options.indexfile.empty())
+    {
+      itsIndex = fopen(options.indexfile.c_str(), "w");
+      if (!itsIndex)
+      {
+        Close();
+        throw std::runtime_error("ERROR: cannot open file for writing: " + options.indexfile);
+      }
+    }
+  }
 
-  grib_context *context = grib_context_get_default();
+  ~GribWriter() { Close(); }
 
-  grib_handle *gribHandle;
-  if (options.grib1)
-    gribHandle = grib_handle_new_from_samples(context, "GRIB1");
-  else if (options.grib2)
-    gribHandle = grib_handle_new_from_samples(context, "GRIB2");
-  else
-    throw std::runtime_error("Invalid GRIB format selected");  // never happens
+  // Writes the message of the active field of theInfo
+  void Write(NFmiFastQueryInfo &theInfo, const void *mesg, size_t mesg_len)
+  {
+    std::string filename = options.outfile;
+    std::uint64_t offset = itsOffset;
+
+    if (!options.split)
+    {
+      fwrite(mesg, 1, mesg_len, itsOut);
+      itsOffset += mesg_len;
+    }
+    else
+    {
+      filename += ::make_file_suffix(theInfo);
+      FILE *out = fopen(filename.c_str(), "wb");
+      if (!out) throw std::runtime_error("ERROR: cannot open file for writing: " + filename);
+      fwrite(mesg, 1, mesg_len, out);
+      fclose(out);
+      offset = 0;
+    }
+
+    ++itsMessageCount;
+
+    if (itsIndex)
+    {
+      const NFmiLevel &level = *theInfo.Level();
+      fprintf(itsIndex,
+              "%lu\t%s\t%" PRIu64 "\t%" PRIu64 "\t%lu\t%d\t%g\t%s\n",
+              itsMessageCount,
+              filename.c_str(),
+              offset,
+              static_cast<std::uint64_t>(mesg_len),
+              static_cast<unsigned long>(theInfo.Param().GetParamIdent()),
+              static_cast<int>(level.LevelType()),
+              static_cast<double>(level.LevelValue()),
+              theInfo.ValidTime().ToStr("YYYYMMDDHHmm").CharPtr());
+    }
+  }
+
+  void Close()
+  {
+    if (itsOut) fclose(itsOut);
+    if (itsIndex) fclose(itsIndex);
+    itsOut = 0;
+    itsIndex = 0;
+  }
+
+ private:
+  GribWriter(const GribWriter &);
+  GribWriter &operator=(const GribWriter &);
+
+  FILE *itsOut;
+  FILE *itsIndex;
+  std::uint64_t itsOffset;  // unsigned long is only 32 bits on Windows
+  unsigned long itsMessageCount;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encoded GRIB message of one field
+ */
+// ----------------------------------------------------------------------
+
+struct EncodedGribField
+{
+  bool fWritten = false;  // false if the field was skipped
+  std::string itsMessage;
+  std::exception_ptr itsError;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hands out fields to the encoders and returns the results in order
+ *
+ * The encoders may run at most theMaxInFlight fields ahead of the writer
+ * so that memory use stays bounded.
+ */
+// ----------------------------------------------------------------------
+
+class GribEncodeQueue
+{
+ public:
+  GribEncodeQueue(size_t theFieldCount, size_t theMaxInFlight)
+      : itsMutex(),
+        itsCondition(),
+        itsResults(),
+        itsFieldCount(theFieldCount),
+        itsMaxInFlight(theMaxInFlight),
+        itsNextField(0),
+        itsNextWrite(0),
+        fStopped(false)
+  {
+  }
+
+  bool NextField(size_t &theIndex)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    while (!fStopped && itsNextField < itsFieldCount &&
+           itsNextField >= itsNextWrite + itsMaxInFlight)
+      itsCondition.wait(lock);
+    if (fStopped || itsNextField >= itsFieldCount) return false;
+    theIndex = itsNextField++;
+    return true;
+  }
+
+  void PushResult(size_t theIndex, EncodedGribField &theField)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    itsResults[theIndex] = std::move(theField);
+    itsCondition.notify_all();
+  }
+
+  bool PopResult(size_t theIndex, EncodedGribField &theField)
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    for (;;)
+    {
+      if (fStopped) return false;
+      std::map<size_t, EncodedGribField>::iterator it = itsResults.find(theIndex);
+      if (it != itsResults.end())
+      {
+        theField = std::move(it->second);
+        itsResults.erase(it);
+        itsNextWrite = theIndex + 1;
+        itsCondition.notify_all();
+        return true;
+      }
+      itsCondition.wait(lock);
+    }
+  }
+
+  void Stop()
+  {
+    boost::mutex::scoped_lock lock(itsMutex);
+    fStopped = true;
+    itsCondition.notify_all();
+  }
+
+ private:
+  boost::mutex itsMutex;
+  boost::condition_variable itsCondition;
+  std::map<size_t, EncodedGribField> itsResults;
+  size_t itsFieldCount;
+  size_t itsMaxInFlight;
+  size_t itsNextField;
+  size_t itsNextWrite;
+  bool fStopped;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encode fields in a worker thread using a handle cloned from the template
+ */
+// ----------------------------------------------------------------------
+
+void encode_fields_in_thread(const NFmiFastQueryInfo &theInfo,
+                             grib_handle *gribHandle,
+                             size_t theValueCount,
+                             const std::vector<GribField> &theFields,
+                             bool use_minutes,
+                             GribEncodeQueue &theQueue)
+{
+  NFmiFastQueryInfo info(theInfo);
+  std::vector<double> valueArray(theValueCount);
+
+  size_t index = 0;
+  while (theQueue.NextField(index))
+  {
+    EncodedGribField result;
+    try
+    {
+      if (!activate_field(info, theFields[index]))
+        throw std::runtime_error("Failed to activate field in querydata");
+
+      if (copy_values(info, gribHandle, valueArray, use_minutes))
+      {
+        const void *mesg;
+        size_t mesg_len;
+        grib_get_message(gribHandle, &mesg, &mesg_len);
+        result.itsMessage.assign(static_cast<const char *>(mesg), mesg_len);
+        result.fWritten = true;
+      }
+    }
+    catch (...)
+    {
+      result.itsError = std::current_exception();
+    }
+    theQueue.PushResult(index, result);
+  }
+}
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encode the fields serially with a single handle
+ */
+// ----------------------------------------------------------------------
+
+void encode_fields(NFmiFastQueryInfo &theInfo,
+                   grib_handle *gribHandle,
+                   std::vector<double> &theValueArray,
+                   const std::vector<GribField> &theFields,
+                   bool use_minutes,
+                   GribWriter &theWriter)
+{
 #ifdef SOME_OTHER_VERSION
   int option_flags = GRIB_DUMP_FLAG_VALUES | GRIB_DUMP_FLAG_OPTIONAL | GRIB_DUMP_FLAG_READ_ONLY;
 #else
@@ -981,66 +1242,142 @@ int run(const int argc, char *argv[])
   int option_flags = GRIB_DUMP_FLAG_VALUES | GRIB_DUMP_FLAG_READ_ONLY;
 #endif
 
-  if (gribHandle == 0) throw std::runtime_error("ERROR: Unable to create grib handle\n");
+  for (size_t i = 0; i < theFields.size(); i++)
+  {
+    if (!activate_field(theInfo, theFields[i]))
+      throw std::runtime_error("Failed to activate field in querydata");
 
-  if (qi.IsGrid() == false)
-    throw std::runtime_error("ERROR: data wasn't grid data, but station data.\n");
+    if (copy_values(theInfo, gribHandle, theValueArray, use_minutes))
+    {
+      if (options.dump) grib_dump_content(gribHandle, stdout, "serialize", option_flags, nullptr);
+
+      const void *mesg;
+      size_t mesg_len;
+      grib_get_message(gribHandle, &mesg, &mesg_len);
+      theWriter.Write(theInfo, mesg, mesg_len);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encode the fields in worker threads and write them in order
+ */
+// ----------------------------------------------------------------------
+
+void encode_fields_in_parallel(NFmiFastQueryInfo &theInfo,
+                               grib_handle *gribHandle,
+                               size_t theValueCount,
+                               const std::vector<GribField> &theFields,
+                               bool use_minutes,
+                               GribWriter &theWriter)
+{
+  const unsigned int threadcount = options.threads;
+
+  GribEncodeQueue queue(theFields.size(), 4 * threadcount);
 
-  FILE *out = 0;
-  if (!options.split)
+  // Clone the handles before starting the threads, the template is not used concurrently
+
+  std::vector<grib_handle *> handles;
+  for (unsigned int i = 0; i < threadcount; i++)
   {
-    out = fopen(options.outfile.c_str(), "wb");
-    if (!out) throw std::runtime_error("ERROR: cannot open file for writing: " + options.outfile);
+    grib_handle *h = grib_handle_clone(gribHandle);
+    if (h == 0)
+    {
+      for (size_t j = 0; j < handles.size(); j++)
+        grib_handle_delete(handles[j]);
+      throw std::runtime_error("ERROR: Unable to clone grib handle");
+    }
+    handles.push_back(h);
   }
 
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadcount; i++)
+    threads.add_thread(new boost::thread(encode_fields_in_thread,
+                                         boost::cref(theInfo),
+                                         handles[i],
+                                         theValueCount,
+                                         boost::cref(theFields),
+                                         use_minutes,
+                                         boost::ref(queue)));
+
+  std::exception_ptr error;
   try
   {
-    qi.First();
-    std::vector<double> valueArray;  // tt vektoria kytetn siirtmn dataa querydatasta
-                                     // gribiin (aina saman kokoinen)
-    set_producer(gribHandle);
-    set_packing(gribHandle);
-    set_geometry(qi, gribHandle, valueArray);
-    const long timestep = get_smallest_timestep(qi);
-    const bool use_minutes = (timestep < 60);
-    set_times(qi, gribHandle, use_minutes);
-
-    if (options.verbose) std::cout << "Smallest timestep = " << timestep << std::endl;
-
-    for (qi.ResetLevel(); qi.NextLevel();)
+    EncodedGribField field;
+    for (size_t i = 0; i < theFields.size(); i++)
     {
-      for (qi.ResetParam(); qi.NextParam(false);)
-      {
-        if (ignore_param(qi.Param().GetParamIdent()))
-        {
-          // if(options.verbose)
-          std::cout << "Ignoring parameter " << qi.Param().GetParamName().CharPtr() << " ("
-                    << qi.Param().GetParamIdent() << ")" << std::endl;
-        }
-        else
-        {
-          for (qi.ResetTime(); qi.NextTime();)
-          {
-            if (copy_values(qi, gribHandle, valueArray, use_minutes))
-            {
-              if (options.dump)
-                grib_dump_content(gribHandle, stdout, "serialize", option_flags, nullptr);
-              if (!options.split)
-                write_grib(out, gribHandle);
-              else
-                write_grib(qi, gribHandle, options.outfile);
-            }
-          }
-        }
-      }
+      if (!queue.PopResult(i, field)) break;
+      if (field.itsError) std::rethrow_exception(field.itsError);
+      if (!field.fWritten) continue;
+      activate_field(theInfo, theFields[i]);
+      theWriter.Write(theInfo, field.itsMessage.data(), field.itsMessage.size());
     }
   }
   catch (...)
   {
-    if (out) fclose(out);  // suljetaan outputfile mys virhe tilanteessa
-    throw;                 // paiskataan kiinniotettu poikkeus edelleen matkaan
+    error = std::current_exception();
+    queue.Stop();
   }
-  if (out) fclose(out);  // lopuksi suljetaan outputfile
+
+  threads.join_all();
+
+  for (size_t i = 0; i < handles.size(); i++)
+    grib_handle_delete(handles[i]);
+
+  if (error) std::rethrow_exception(error);
+}
+
+// ----------------------------------------------------------------------
+
+int run(const int argc, char *argv[])
+{
+  if (!parse_options(argc, argv)) return 0;
+
+  if (options.verbose) std::cout << "Opening file '" << options.infile << "'" << std::endl;
+
+  NFmiQueryData qd(options.infile);
+  NFmiFastQueryInfo qi(&qd);
+
+  // TODO: This function is deprecated, use grib_handle_new_from_samples instead
+
+  grib_context *context = grib_context_get_default();
+
+  grib_handle *gribHandle;
+  if (options.grib1)
+    gribHandle = grib_handle_new_from_samples(context, "GRIB1");
+  else if (options.grib2)
+    gribHandle = grib_handle_new_from_samples(context, "GRIB2");
+  else
+    throw std::runtime_error("Invalid GRIB format selected");  // never happens
+
+  if (gribHandle == 0) throw std::runtime_error("ERROR: Unable to create grib handle\n");
+
+  if (qi.IsGrid() == false)
+    throw std::runtime_error("ERROR: data wasn't grid data, but station data.\n");
+
+  GribWriter writer;
+
+  qi.First();
+  std::vector<double> valueArray;  // tt vektoria kytetn siirtmn dataa querydatasta
+                                   // gribiin (aina saman kokoinen)
+  set_producer(gribHandle);
+  set_packing(gribHandle);
+  set_geometry(qi, gribHandle, valueArray);
+  const long timestep = get_smallest_timestep(qi);
+  const bool use_minutes = (timestep < 60);
+  set_times(qi, gribHandle, use_minutes);
+
+  if (options.verbose) std::cout << "Smallest timestep = " << timestep << std::endl;
+
+  const std::vector<GribField> fields = list_fields(qi);
+
+  if (options.threads <= 1)
+    encode_fields(qi, gribHandle, valueArray, fields, use_minutes, writer);
+  else
+    encode_fields_in_parallel(qi, gribHandle, valueArray.size(), fields, use_minutes, writer);
+
+  writer.Close();  // lopuksi suljetaan outputfile
 
   return 0;
 }
@@ -3,6 +3,8 @@
 // lytyvt SYNOP-koodit tulkitaan ja niist muodostetaan
 // querydata, miss on yhdistettyn kaikki tulkitut synop-havainnot.
 
+#include "MessageDecoder.h"
+
 #include <fstream>
 
 #include <macgyver/TimeParser.h>
@@ -966,6 +968,7 @@ void Usage(void)
        << "\t-S \tUse this to convert SHIP-messages to qd (not with B-option)." << endl
        << "\t-B \tUse this to convert BUOY-messages to qd (not with S-option)." << endl
        << "\t-r <date>\tReference date to be used instead of the wall clock time." << endl
+       << "\t-j threads\tNumber of decoding threads (default=0, use most of the cores)." << endl
        << endl
        << "Note: qdconversion comes with a SYNOP stations file stored in" << endl
        << endl
@@ -982,46 +985,68 @@ struct PointerDestroyer
   }
 };
 
-static NFmiTimeList MakeTimeList(std::set<NFmiMetTime> &theTimes)
+static NFmiTimeList MakeTimeList(const std::vector<NFmiMetTime> &theTimes)
 {
   NFmiTimeList times;
-  std::set<NFmiMetTime>::iterator it = theTimes.begin();
+  std::vector<NFmiMetTime>::const_iterator it = theTimes.begin();
   for (; it != theTimes.end(); ++it)
     times.Add(new NFmiMetTime(*it));
   return times;
 }
 
-struct TimeCollector
+// ----------------------------------------------------------------------
+// Yhden tiedoston purun tulokset. Tiedostot puretaan rinnakkain omiin
+// puskureihinsa, jotka lopuksi yhdistetn tiedostojen jrjestyksess.
+// ----------------------------------------------------------------------
+
+struct SynopBuffer
 {
-  void operator()(const NFmiSynopCode &theSynopCode) { itsTimes.insert(theSynopCode.Time()); }
-  std::set<NFmiMetTime> itsTimes;
+  std::vector<NFmiSynopCode> itsSynops;  // jrjestetty SynopCellLess:in mukaan
+  std::vector<NFmiStation> itsStations;  // jrjestetty ja uniikki
+  std::vector<NFmiMetTime> itsTimes;     // jrjestetty ja uniikki
+  std::set<unsigned long> itsUnknownWmoIds;
 };
 
-struct LocationCollector
+// Synopit jrjestetn sen mukaan mihin querydatan asemaan ja aikaan ne
+// tytetn (laivat nimen mukaan, muut wmo-id:n mukaan). Jrjestys on
+// stabiili, joten saman aseman ja ajan sanomat pysyvt luku jrjestyksess.
+struct SynopCellLess
 {
-  void operator()(const NFmiSynopCode &theSynopCode)
+  SynopCellLess(bool doShipMessages) : fDoShipMessages(doShipMessages) {}
+  bool operator()(const NFmiSynopCode &theSynop1, const NFmiSynopCode &theSynop2) const
   {
-    itsLocations.insert(theSynopCode.Station());
+    if (fDoShipMessages)
+    {
+      if (theSynop1.Station().GetName() != theSynop2.Station().GetName())
+        return theSynop1.Station().GetName() < theSynop2.Station().GetName();
+    }
+    else if (theSynop1.Station().GetIdent() != theSynop2.Station().GetIdent())
+      return theSynop1.Station().GetIdent() < theSynop2.Station().GetIdent();
+    return theSynop1.Time() < theSynop2.Time();
   }
-
-  std::set<NFmiStation> itsLocations;
+  bool fDoShipMessages;
 };
 
-static NFmiTimeList MakeTimeListForSynop(const std::vector<NFmiSynopCode> &theSynops)
+static void SortSynopBuffer(SynopBuffer &theBuffer, bool fDoShipMessages)
 {
-  TimeCollector collector;
-  collector = std::for_each(theSynops.begin(), theSynops.end(), TimeCollector());
-
-  return MakeTimeList(collector.itsTimes);
+  const std::vector<NFmiSynopCode> &synops = theBuffer.itsSynops;
+  for (size_t i = 0; i < synops.size(); i++)
+  {
+    theBuffer.itsStations.push_back(synops[i].Station());
+    theBuffer.itsTimes.push_back(synops[i].Time());
+  }
+  MessageDecoder::SortUnique(theBuffer.itsStations);
+  MessageDecoder::SortUnique(theBuffer.itsTimes);
+  std::stable_sort(
+      theBuffer.itsSynops.begin(), theBuffer.itsSynops.end(), SynopCellLess(fDoShipMessages));
 }
 
-static NFmiLocationBag MakeLocationBag(std::set<NFmiStation> &theStations, bool fDoShipMessages)
+static NFmiLocationBag MakeLocationBag(std::vector<NFmiStation> &theStations, bool fDoShipMessages)
 {
   unsigned long shipMessageStationId =
       122000;  // tm on vain jokin alkuid arvo jota kasvatetaan jokaiselle eri laivalle
   NFmiLocationBag locations;
-  //	std::set<T>::iterator it = theStations.begin();
-  std::set<NFmiStation>::iterator it = theStations.begin();
+  std::vector<NFmiStation>::iterator it = theStations.begin();
   unsigned long ind = 0;
   std::set<NFmiPoint> points;
   std::vector<unsigned long> equalLocationIndexies;
@@ -1050,15 +1075,6 @@ static NFmiLocationBag MakeLocationBag(std::set<NFmiStation> &theStations, bool
   return locations;
 }
 
-static NFmiLocationBag MakeLocationBagForSynop(const std::vector<NFmiSynopCode> &theSynops,
-                                               bool fDoShipMessages)
-{
-  LocationCollector collector;
-  collector = std::for_each(theSynops.begin(), theSynops.end(), LocationCollector());
-
-  return MakeLocationBag(collector.itsLocations, fDoShipMessages);
-}
-
 static NFmiParamBag MakeSynopParamBag(const NFmiProducer &theWantedProducer,
                                       bool fDoShipMessages,
                                       bool fDoBuoyMessages)
@@ -1101,6 +1117,8 @@ static NFmiParamBag MakeSynopParamBag(const NFmiProducer &theWantedProducer,
 }
 
 static NFmiQueryInfo *MakeNewInnerInfoForSYNOP(const std::vector<NFmiSynopCode> &theSynops,
+                                               std::vector<NFmiStation> &theStations,
+                                               const std::vector<NFmiMetTime> &theTimes,
                                                const NFmiProducer &theWantedProducer,
                                                bool fDoShipMessages,
                                                bool fDoBuoyMessages)
@@ -1108,11 +1126,11 @@ static NFmiQueryInfo *MakeNewInnerInfoForSYNOP(const std::vector<NFmiSynopCode>
   NFmiQueryInfo *info = 0;
   if (theSynops.size() > 0)
   {
-    NFmiTimeList times(MakeTimeListForSynop(theSynops));
+    NFmiTimeList times(MakeTimeList(theTimes));
     NFmiMetTime origTime;
     NFmiTimeDescriptor timeDesc(origTime, times);
 
-    NFmiLocationBag locations(MakeLocationBagForSynop(theSynops, fDoShipMessages));
+    NFmiLocationBag locations(MakeLocationBag(theStations, fDoShipMessages));
     NFmiHPlaceDescriptor hPlaceDesc(locations);
 
     NFmiParamBag params(MakeSynopParamBag(theWantedProducer, fDoShipMessages, fDoBuoyMessages));
@@ -1755,6 +1773,14 @@ static bool SetLocationWithCache(
   return info.LocationIndex(usedLocationIndex);
 }
 
+static bool SameSynopStation(const NFmiSynopCode &theSynop1,
+                             const NFmiSynopCode &theSynop2,
+                             bool fDoShipMessages)
+{
+  if (fDoShipMessages) return theSynop1.Station().GetName() == theSynop2.Station().GetName();
+  return theSynop1.Station().GetIdent() == theSynop2.Station().GetIdent();
+}
+
 static void FillData(const std::vector<NFmiSynopCode> &theSynopCodeVector,
                      bool fDoShipMessages,
                      bool fDoBuoyMessages,
@@ -1772,21 +1798,24 @@ static void FillData(const std::vector<NFmiSynopCode> &theSynopCodeVector,
     else
       synopStationIdLocationCache = ::MakeSynopStationIdLocationCache(infoIter);
 
+    // Synopit ovat asemittain jrjestyksess, joten asema asetetaan vain kun se vaihtuu
+    const NFmiSynopCode *previousSynop = 0;
+    bool locationOk = false;
     size_t ssize = theSynopCodeVector.size();
     for (size_t k = 0; k < ssize; k++)
     {
       const NFmiSynopCode &synopCode = theSynopCodeVector[k];
-      if (infoIter.Time(synopCode.Time()))
+      if (previousSynop == 0 || !::SameSynopStation(*previousSynop, synopCode, fDoShipMessages))
       {
-        if (::SetLocationWithCache(infoIter,
-                                   synopCode,
-                                   fDoShipMessages,
-                                   shipNameLocationCache,
-                                   synopStationIdLocationCache))
-        {
-          ::FillParamValues(infoIter, synopCode, fillSeaParams);
-        }
+        locationOk = ::SetLocationWithCache(infoIter,
+                                            synopCode,
+                                            fDoShipMessages,
+                                            shipNameLocationCache,
+                                            synopStationIdLocationCache);
+        previousSynop = &synopCode;
       }
+      if (locationOk && infoIter.Time(synopCode.Time()))
+        ::FillParamValues(infoIter, synopCode, fillSeaParams);
     }
     // kun synop data on tytetty, lasketaan mahd. puuttuva kosteus arvo dataan T ja Td avulla
     ::FillMissingHumidityValues(infoIter);
@@ -1795,14 +1824,20 @@ static void FillData(const std::vector<NFmiSynopCode> &theSynopCodeVector,
 
 NFmiQueryData *MakeQueryDataFromSynopCodeDataVector(
     const std::vector<NFmiSynopCode> &theSynopCodeVector,
+    std::vector<NFmiStation> &theStations,
+    const std::vector<NFmiMetTime> &theTimes,
     const NFmiProducer &theWantedProducer,
     bool fDoShipMessages,
     bool fDoBuoyMessages)
 {
   NFmiQueryData *newData = 0;
 
-  NFmiQueryInfo *innerInfo = MakeNewInnerInfoForSYNOP(
-      theSynopCodeVector, theWantedProducer, fDoShipMessages, fDoBuoyMessages);
+  NFmiQueryInfo *innerInfo = MakeNewInnerInfoForSYNOP(theSynopCodeVector,
+                                                      theStations,
+                                                      theTimes,
+                                                      theWantedProducer,
+                                                      fDoShipMessages,
+                                                      fDoBuoyMessages);
   std::unique_ptr<NFmiQueryInfo> innerInfoPtr(innerInfo);
   if (innerInfo)
   {
@@ -1817,7 +1852,7 @@ void Domain(int argc, const char *argv[])
 {
   NFmiMilliSecondTimer timer;
 
-  NFmiCmdLine cmdline(argc, argv, "s!p!tvSBfr!");
+  NFmiCmdLine cmdline(argc, argv, "s!p!tvSBfr!j!");
 
   // Tarkistetaan optioiden oikeus:
 
@@ -1889,6 +1924,10 @@ void Domain(int argc, const char *argv[])
   bool roundTimesToNearestSynopticTimes = false;
   if (cmdline.isOption('t')) roundTimesToNearestSynopticTimes = true;
 
+  unsigned int threadCount = 0;
+  if (cmdline.isOption('j'))
+    threadCount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   //	1. Lue n kpl filefiltereit listaan
   vector<string> fileFilterList;
   for (int i = 1; i <= numOfParams; i++)
@@ -1896,42 +1935,70 @@ void Domain(int argc, const char *argv[])
     fileFilterList.push_back(cmdline.Parameter(i));
   }
 
-  std::set<unsigned long> unknownWmoIdsInOut;
-  bool foundAnyFiles = false;
-  std::vector<NFmiSynopCode> synopCodeVector;
+  //	2. Hae jokaista filefilteri vastaavat tiedostonimet omaan listaan
+  std::vector<std::string> fileNames;
+  std::vector<std::string> filePaths;
   for (unsigned int j = 0; j < fileFilterList.size(); j++)
   {
-    //	2. Hae jokaista filefilteri vastaavat tiedostonimet omaan listaan
     std::string filePatternStr = fileFilterList[j];
     std::string usedPath = NFmiFileSystem::PathFromPattern(filePatternStr);
     list<string> fileList = NFmiFileSystem::PatternFiles(filePatternStr);
     for (list<string>::iterator it = fileList.begin(); it != fileList.end(); ++it)
     {
-      //	3. Lue listan tiedostot vuorollaan sisn ja tulkitse siit sanomat
-      // synopCode-vektoriin
-      std::string finalFileName = usedPath + *it;
-      foundAnyFiles = true;
-      string synopFileContent;
-      if (NFmiFileSystem::ReadFile2String(finalFileName, synopFileContent))
-      {
-        string errorStr;
-        ::FillSynopCodeDataVectorFromSYNOPStr(referenceTime,
-                                              synopCodeVector,
-                                              synopFileContent,
-                                              aviStationInfoSystem,
-                                              roundTimesToNearestSynopticTimes,
-                                              verbose,
-                                              doShipMessages,
-                                              doBuoyMessages,
-                                              unknownWmoIdsInOut,
-                                              *it);
-      }
-      else
-        cerr << "Warning, couldn't read the file: '" << finalFileName
-             << "', continuing to next file..." << endl;
+      fileNames.push_back(*it);
+      filePaths.push_back(usedPath + *it);
     }
   }
-  if (foundAnyFiles == false) throw runtime_error("Error: Didn't find any files to read.");
+  if (fileNames.empty()) throw runtime_error("Error: Didn't find any files to read.");
+
+  //	3. Lue tiedostot rinnakkain sisn ja tulkitse niist sanomat kunkin tiedoston omaan
+  // puskuriin
+  std::vector<SynopBuffer> buffers(fileNames.size());
+  MessageDecoder::Decode(
+      fileNames.size(),
+      [&](unsigned long i)
+      {
+        string synopFileContent;
+        if (NFmiFileSystem::ReadFile2String(filePaths[i], synopFileContent))
+        {
+          ::FillSynopCodeDataVectorFromSYNOPStr(referenceTime,
+                                                buffers[i].itsSynops,
+                                                synopFileContent,
+                                                aviStationInfoSystem,
+                                                roundTimesToNearestSynopticTimes,
+                                                verbose,
+                                                doShipMessages,
+                                                doBuoyMessages,
+                                                buffers[i].itsUnknownWmoIds,
+                                                fileNames[i]);
+          ::SortSynopBuffer(buffers[i], doShipMessages);
+        }
+        else
+          cerr << "Warning, couldn't read the file: '" + filePaths[i] +
+                      "', continuing to next file...\n";
+      },
+      threadCount);
+
+  //	4. Yhdist puskurit tiedostojen jrjestyksess
+  std::vector<std::vector<NFmiSynopCode> > synopBuffers(buffers.size());
+  std::vector<std::vector<NFmiStation> > stationBuffers(buffers.size());
+  std::vector<std::vector<NFmiMetTime> > timeBuffers(buffers.size());
+  std::set<unsigned long> unknownWmoIdsInOut;
+  for (size_t i = 0; i < buffers.size(); i++)
+  {
+    synopBuffers[i].swap(buffers[i].itsSynops);
+    stationBuffers[i].swap(buffers[i].itsStations);
+    timeBuffers[i].swap(buffers[i].itsTimes);
+    unknownWmoIdsInOut.insert(buffers[i].itsUnknownWmoIds.begin(),
+                              buffers[i].itsUnknownWmoIds.end());
+  }
+  buffers.clear();
+
+  std::vector<NFmiSynopCode> synopCodeVector =
+      MessageDecoder::Merge(synopBuffers, SynopCellLess(doShipMessages), threadCount);
+  std::vector<NFmiStation> stations = MessageDecoder::MergeUnique(stationBuffers, threadCount);
+  std::vector<NFmiMetTime> times = MessageDecoder::MergeUnique(timeBuffers, threadCount);
+
   if (synopCodeVector.empty())
     throw runtime_error("Error: Couldn't decode any synops from any files.");
   if (verbose && unknownWmoIdsInOut.size() > 0)
@@ -1946,7 +2013,7 @@ void Domain(int argc, const char *argv[])
   }
   //	6. Tee synopCode-vektorista lopullinen data kerralla
   NFmiQueryData *data = ::MakeQueryDataFromSynopCodeDataVector(
-      synopCodeVector, wantedProducer, doShipMessages, doBuoyMessages);
+      synopCodeVector, stations, times, wantedProducer, doShipMessages, doBuoyMessages);
 
   //	7. talleta querydata output:iin
   if (data)
@@ -3,6 +3,8 @@
 // lytyvt TEMP-luotaus koodit tulkitaan ja niist muodostetaan
 // querydata, miss on yhdistettyn kaikki tulkitut luotaukset.
 
+#include "MessageDecoder.h"
+
 #include <iostream>
 
 #include <newbase/NFmiArea.h>
@@ -18,10 +20,23 @@
 #include <smarttools/NFmiAviationStationInfoSystem.h>
 #include <smarttools/NFmiTEMPCode.h>
 
+#include <boost/thread/mutex.hpp>
+
 using namespace std;
 
 const char *default_stations_file = "/usr/share/smartmet/stations.csv";
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Serializes calls to the TEMP decoder
+ *
+ * The decoder looks up dictionary strings via NFmiSettings, which
+ * re-reads its shared settings map whenever smartmet.conf is missing.
+ */
+// ----------------------------------------------------------------------
+
+static boost::mutex gDecodeTEMPMutex;
+
 void Domain(int argc, const char *argv[]);
 void Usage(void);
 
@@ -58,6 +73,7 @@ void Usage(void)
        << default_stations_file << ")" << endl
        << "\t-p <1005,UAIR>\tMake result datas producer id and name as wanted." << endl
        << "\t-t \tPut sounding times to nearest synoptic times." << endl
+       << "\t-j threads\tNumber of decoding threads (default=0, use most of the cores)." << endl
        << endl;
 }
 
@@ -102,7 +118,37 @@ static void FillCombinedSoundingData(vector<NFmiQueryData *> &theDataList,
   }
 }
 
+// ----------------------------------------------------------------------
+// Yhden tiedoston purun tulokset. Tiedostot puretaan rinnakkain omiin
+// puskureihinsa, jotka lopuksi yhdistetn tiedostojen jrjestyksess.
+// ----------------------------------------------------------------------
+
+struct TEMPBuffer
+{
+  TEMPBuffer(void) : itsData(0) {}
+
+  NFmiQueryData *itsData;           // 0 jos tiedostosta ei lytynyt luotauksia
+  vector<NFmiStation> itsStations;  // jrjestetty ja uniikki
+  vector<NFmiMetTime> itsTimes;     // jrjestetty ja uniikki
+};
+
+// Kertn datan asemat ja ajat jrjestettyin, jotta ne voidaan yhdist suoraan
+static void CollectStationsAndTimes(TEMPBuffer &theBuffer)
+{
+  NFmiFastQueryInfo info(theBuffer.itsData);
+
+  for (info.ResetTime(); info.NextTime();)
+    theBuffer.itsTimes.push_back(info.Time());
+  for (info.ResetLocation(); info.NextLocation();)
+    theBuffer.itsStations.push_back(*(static_cast<const NFmiStation *>(info.Location())));
+
+  MessageDecoder::SortUnique(theBuffer.itsTimes);
+  MessageDecoder::SortUnique(theBuffer.itsStations);
+}
+
 static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
+                                           const vector<NFmiStation> &theStations,
+                                           const vector<NFmiMetTime> &theTimes,
                                            const NFmiProducer &theWantedProducer)
 {
   if (theDataList.size() == 0)
@@ -110,8 +156,6 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
 
   if (theDataList.size() == 1) return *(theDataList[0]->Info());
 
-  set<NFmiMetTime> allTimes;
-  set<NFmiStation> allStations;
   unsigned int maxLevelSize = 0;
 
   const NFmiVPlaceDescriptor *maxLevelVPlaceDesc =
@@ -120,23 +164,16 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
   NFmiMetTime originTime;  // otetaan vain currentti aika origin timeksi
   for (unsigned int i = 0; i < theDataList.size(); i++)
   {
-    NFmiFastQueryInfo info(theDataList[i]);
-
-    for (info.ResetTime(); info.NextTime();)
-      allTimes.insert(info.Time());
-    for (info.ResetLocation(); info.NextLocation();)
-      allStations.insert(*(static_cast<const NFmiStation *>(info.Location())));
-
-    if (maxLevelSize < info.SizeLevels())
+    if (maxLevelSize < theDataList[i]->Info()->SizeLevels())
     {
-      maxLevelSize = info.SizeLevels();
+      maxLevelSize = theDataList[i]->Info()->SizeLevels();
       maxLevelVPlaceDesc = &(theDataList[i]->Info()->VPlaceDescriptor());
     }
   }
 
   // Tehdn kaikkia datoja yhdistv timeDescriptor
   NFmiTimeList timeList;
-  for (set<NFmiMetTime>::iterator it1 = allTimes.begin(); it1 != allTimes.end(); ++it1)
+  for (vector<NFmiMetTime>::const_iterator it1 = theTimes.begin(); it1 != theTimes.end(); ++it1)
     timeList.Add(new NFmiMetTime(*it1));
   NFmiTimeDescriptor timeDesc(originTime, timeList);
 
@@ -146,7 +183,8 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
   paramDesc.SetProducer(theWantedProducer);
 
   NFmiLocationBag locationBag;
-  for (set<NFmiStation>::iterator it2 = allStations.begin(); it2 != allStations.end(); ++it2)
+  for (vector<NFmiStation>::const_iterator it2 = theStations.begin(); it2 != theStations.end();
+       ++it2)
     locationBag.AddLocation(*it2, false);
   NFmiHPlaceDescriptor hplaceDesc(locationBag);
 
@@ -155,9 +193,12 @@ static NFmiQueryInfo MakeCombinedInnerInfo(vector<NFmiQueryData *> &theDataList,
 }
 
 static NFmiQueryData *CombineQueryDatas(vector<NFmiQueryData *> &theDataList,
+                                        const vector<NFmiStation> &theStations,
+                                        const vector<NFmiMetTime> &theTimes,
                                         const NFmiProducer &theWantedProducer)
 {
-  NFmiQueryInfo innerInfo(MakeCombinedInnerInfo(theDataList, theWantedProducer));
+  NFmiQueryInfo innerInfo(
+      MakeCombinedInnerInfo(theDataList, theStations, theTimes, theWantedProducer));
   NFmiQueryData *data = NFmiQueryDataUtil::CreateEmptyData(innerInfo);
   if (data)
   {
@@ -171,7 +212,7 @@ static NFmiQueryData *CombineQueryDatas(vector<NFmiQueryData *> &theDataList,
 
 void Domain(int argc, const char *argv[])
 {
-  NFmiCmdLine cmdline(argc, argv, "s!p!t");
+  NFmiCmdLine cmdline(argc, argv, "s!p!tj!");
 
   // Tarkistetaan optioiden oikeus:
 
@@ -216,6 +257,10 @@ void Domain(int argc, const char *argv[])
   bool roundTimesToNearestSynopticTimes = false;
   if (cmdline.isOption('t')) roundTimesToNearestSynopticTimes = true;
 
+  unsigned int threadCount = 0;
+  if (cmdline.isOption('j'))
+    threadCount = NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'));
+
   //	1. Lue n kpl filefiltereit listaan
   vector<string> fileFilterList;
   for (int i = 1; i <= numOfParams; i++)
@@ -224,48 +269,68 @@ void Domain(int argc, const char *argv[])
   }
 
   NFmiPoint startingLatlonForUnknownStation = NFmiPoint::gMissingLatlon;
-  bool foundAnyFiles = false;
-  bool couldDecodeSoundings = false;
-  vector<NFmiQueryData *> qDataList;
+
+  //	2. Hae jokaista filefilteri vastaavat tiedostonimet omaan listaan
+  vector<string> fileNames;
   for (unsigned int j = 0; j < fileFilterList.size(); j++)
   {
-    //	2. Hae jokaista filefilteri vastaavat tiedostonimet omaan listaan
     std::string filePatternStr = fileFilterList[j];
     std::string usedPath = NFmiFileSystem::PathFromPattern(filePatternStr);
     list<string> fileList = NFmiFileSystem::PatternFiles(filePatternStr);
     for (list<string>::iterator it = fileList.begin(); it != fileList.end(); ++it)
-    {
-      //	3. Lue listan tiedostot vuorollaan sisn ja tulkitse siit mahdolliset TEMPit
-      // querydataksi
-      std::string finalFileName = usedPath + *it;
-      foundAnyFiles = true;
-      string tempFileContent;
-      //			if(NFmiFileSystem::ReadFile2String(wantedPath + fileListVec[k],
-      // tempFileContent))
-      if (NFmiFileSystem::ReadFile2String(finalFileName, tempFileContent))
+      fileNames.push_back(usedPath + *it);
+  }
+  if (fileNames.empty()) throw runtime_error("Error: Didn't find any files to read.");
+
+  //	3. Lue tiedostot rinnakkain sisn ja tulkitse niist mahdolliset TEMPit querydataksi
+  vector<TEMPBuffer> buffers(fileNames.size());
+  MessageDecoder::Decode(
+      fileNames.size(),
+      [&](unsigned long i)
       {
-        //	4. tulkitse siit mahdolliset TEMPit querydataksi
-        string errorStr;
-        NFmiQueryData *data = DecodeTEMP::MakeNewDataFromTEMPStr(tempFileContent,
-                                                                 errorStr,
-                                                                 stationInfoSystem,
-                                                                 startingLatlonForUnknownStation,
-                                                                 wantedProducer,
-                                                                 roundTimesToNearestSynopticTimes);
-        //	5. talleta syntyneet querydatat listaan
-        if (data)
+        string tempFileContent;
+        if (NFmiFileSystem::ReadFile2String(fileNames[i], tempFileContent))
         {
-          qDataList.push_back(data);
-          couldDecodeSoundings = true;
+          //	4. tulkitse siit mahdolliset TEMPit querydataksi
+          string errorStr;
+          {
+            boost::mutex::scoped_lock lock(gDecodeTEMPMutex);
+            buffers[i].itsData =
+                DecodeTEMP::MakeNewDataFromTEMPStr(tempFileContent,
+                                                   errorStr,
+                                                   stationInfoSystem,
+                                                   startingLatlonForUnknownStation,
+                                                   wantedProducer,
+                                                   roundTimesToNearestSynopticTimes);
+          }
+          if (buffers[i].itsData) ::CollectStationsAndTimes(buffers[i]);
         }
-      }
+      },
+      threadCount);
+
+  //	5. talleta syntyneet querydatat listaan tiedostojen jrjestyksess
+  vector<NFmiQueryData *> qDataList;
+  vector<vector<NFmiStation> > stationBuffers;
+  vector<vector<NFmiMetTime> > timeBuffers;
+  for (size_t i = 0; i < buffers.size(); i++)
+  {
+    if (buffers[i].itsData)
+    {
+      qDataList.push_back(buffers[i].itsData);
+      stationBuffers.push_back(vector<NFmiStation>());
+      stationBuffers.back().swap(buffers[i].itsStations);
+      timeBuffers.push_back(vector<NFmiMetTime>());
+      timeBuffers.back().swap(buffers[i].itsTimes);
     }
   }
-  if (foundAnyFiles == false) throw runtime_error("Error: Didn't find any files to read.");
-  if (couldDecodeSoundings == false)
+  if (qDataList.empty())
     throw runtime_error("Error: Couldn't decode any soundings from any files.");
+
+  vector<NFmiStation> stations = MessageDecoder::MergeUnique(stationBuffers, threadCount);
+  vector<NFmiMetTime> times = MessageDecoder::MergeUnique(timeBuffers, threadCount);
+
   //	6. yhdist lopuksi querydata yhdeksi kokonaisuudeksi
-  NFmiQueryData *bigQData = ::CombineQueryDatas(qDataList, wantedProducer);
+  NFmiQueryData *bigQData = ::CombineQueryDatas(qDataList, stations, times, wantedProducer);
 
   //	7. talleta querydata output:iin
   if (bigQData)
@@ -1,6 +1,7 @@
 // FmiNetCdfQueryData.cpp
 
 #include "FmiNetCdfQueryData.h"
+#include "nctools.h"
 #include <newbase/NFmiAreaFactory.h>
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiLatLonArea.h>
@@ -107,6 +108,7 @@ static NFmiQueryData *MakeQueryData(NcFile &theNcFile,
 
   NFmiQueryData *qData = NFmiQueryDataUtil::CreateEmptyData(theMetaInfo);
   NFmiFastQueryInfo fInfo(qData);
+  std::vector<float> values;
 
   for (size_t i = 0; i < theVarInfos.size(); i++)
   {
@@ -126,20 +128,12 @@ static NFmiQueryData *MakeQueryData(NcFile &theNcFile,
         int timeInd = 0;
         for (fInfo.ResetTime(); fInfo.NextTime(); timeInd++)  // juoksutetaan aika dimensiota
         {
-          NcValues *vals = varPtr->get_rec(timeInd);
-          long counter = 0;
-          for (fInfo.ResetLevel(); fInfo.NextLevel();)  // juoksutetaan level dimensiota
-          {
-            for (fInfo.ResetLocation(); fInfo.NextLocation();)
-            {
-              float value = vals->as_float(counter);
-              // jos ei ole fill-value, laitetaan arvo queryDataan, jos oli, jtetn qDatan missing
-              // arvo voimaan (data luodan alustettuna puuttuvilla arvoilla)
-              if (value != theVarInfos[i].itsFillValue) fInfo.FloatValue(value);
-              counter++;
-            }
-          }
-          delete vals;
+          if (!nctools::read_record(varPtr, timeInd, values)) continue;
+          // jos on fill-value, jtetn qDatan missing arvo voimaan (data luodan alustettuna
+          // puuttuvilla arvoilla)
+          for (float &value : values)
+            if (value == theVarInfos[i].itsFillValue) value = kFloatMissing;
+          nctools::set_record_values(fInfo, values);
         }
       }
     }
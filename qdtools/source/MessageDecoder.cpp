@@ -0,0 +1,104 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of namespace MessageDecoder
+ */
+// ======================================================================
+
+#include "MessageDecoder.h"
+#include <newbase/NFmiQueryDataUtil.h>
+#include <boost/thread.hpp>
+#include <exception>
+
+namespace MessageDecoder
+{
+namespace
+{
+void decode_in_thread(NFmiTimeIndexCalculator &theCalculator,
+                      const boost::function<void(unsigned long)> &theDecoder,
+                      boost::mutex &theMutex,
+                      std::exception_ptr &theError)
+{
+  unsigned long unit = 0;
+  while (theCalculator.GetCurrentTimeIndex(unit))
+  {
+    try
+    {
+      theDecoder(unit);
+    }
+    catch (...)
+    {
+      boost::mutex::scoped_lock lock(theMutex);
+      if (!theError) theError = std::current_exception();
+      return;
+    }
+  }
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Number of worker threads to use
+ *
+ * \param theWantedCount Thread count given by the user, 0 for automatic
+ * \param theUnitCount Number of units to decode
+ * \return The thread count, at least one
+ */
+// ----------------------------------------------------------------------
+
+unsigned int ThreadCount(unsigned int theWantedCount, unsigned long theUnitCount)
+{
+  if (theWantedCount > 0) return theWantedCount;
+  if (theUnitCount == 0) return 1;
+  return NFmiQueryDataUtil::GetReasonableWorkingThreadCount(
+      75, static_cast<unsigned int>(theUnitCount));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Decode units in worker threads
+ *
+ * The decoder is called once for each unit index. Different units
+ * may be decoded simultaneously, hence the decoder should write only
+ * into the buffer of its own unit. The first exception thrown by the
+ * decoder is rethrown once all threads have finished.
+ *
+ * \param theUnitCount Number of units
+ * \param theDecoder The decoder for one unit
+ * \param theThreadCount Number of worker threads, 0 for automatic
+ */
+// ----------------------------------------------------------------------
+
+void Decode(unsigned long theUnitCount,
+            const boost::function<void(unsigned long)> &theDecoder,
+            unsigned int theThreadCount)
+{
+  if (theUnitCount == 0) return;
+
+  unsigned int threadCount = ThreadCount(theThreadCount, theUnitCount);
+  if (threadCount > theUnitCount) threadCount = static_cast<unsigned int>(theUnitCount);
+
+  NFmiTimeIndexCalculator calculator(theUnitCount);
+  boost::mutex mutex;
+  std::exception_ptr error;
+
+  if (threadCount == 1)
+    decode_in_thread(calculator, theDecoder, mutex, error);
+  else
+  {
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < threadCount; i++)
+      threads.add_thread(new boost::thread(decode_in_thread,
+                                           boost::ref(calculator),
+                                           boost::cref(theDecoder),
+                                           boost::ref(mutex),
+                                           boost::ref(error)));
+    threads.join_all();
+  }
+
+  if (error) std::rethrow_exception(error);
+}
+
+}  // namespace MessageDecoder
+
+// ======================================================================
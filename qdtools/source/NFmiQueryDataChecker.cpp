@@ -28,6 +28,7 @@
 #include <newbase/NFmiFastQueryInfo.h>
 #include <newbase/NFmiDataModifier.h>
 #include <newbase/NFmiDataModifierMinMax.h>
+#include <newbase/NFmiQueryDataUtil.h>
 
 #include <time.h>
 #include <set>
@@ -216,8 +217,63 @@ bool NFmiQueryDataChecker::DoMissingDataCheck(void)
   NFmiDataModifierDataMissing modifier;
   itsCheckOperationIndex = 1;
 
+  if (ScanMissingData()) return true;
   return GoThroughData(&modifier);
 }
+
+//--------------------------------------------------------
+// ScanMissingData
+//--------------------------------------------------------
+// Puuttuvan datan tarkastus yhdell datan lpikynnill, kun tarkastetaan datan kaikki ajat
+// kaikista tai satunnaisista paikoista. GoThroughData ky lpi vain 1. levelin, joten
+// monilevel-datat ja halutut paikat/ajat tarkastetaan edelleen modifierilla.
+bool NFmiQueryDataChecker::ScanMissingData(void)
+{
+  if (!itsInfo || fCheckOnlyWantedTimes || itsLocationCheckType == 1) return false;
+  if (itsInfo->SizeLevels() != 1 || itsCheckedTimeDescriptor.Size() != itsInfo->SizeTimes())
+    return false;
+
+  std::vector<FmiParameterName> params;
+  for (itsParamBag.Reset(); itsParamBag.Next(false);)
+  {
+    if (itsParamBag.Current(false)->IsActive())
+      params.push_back(FmiParameterName(itsParamBag.Current(false)->GetParamIdent()));
+  }
+
+  NFmiMissingValueCounts counts;
+  NFmiQueryDataUtil::CountMissingValues(*itsInfo, params, false, false, counts);
+  itsInfo->First();
+
+  for (size_t i = 0; i < params.size(); i++)
+  {
+    int itsParamIdIndex = itsOhjausData->ParamIdIndex(params[i]);
+    if (!counts.itsParamFound[i] || itsParamIdIndex < 0) continue;
+
+    int checkedCount = 0;
+    int foundCount = 0;
+    if (itsLocationCheckType == 2)
+    {
+      for (int locationIndex : itsRandomLocationIndexies)
+      {
+        if (locationIndex < 0 || locationIndex >= static_cast<int>(counts.itsLocationSize))
+          continue;
+        checkedCount += counts.itsTimeSize;
+        foundCount += counts.itsLocationCounts[i * counts.itsLocationSize + locationIndex];
+      }
+    }
+    else
+    {
+      checkedCount = counts.itsLocationSize * counts.itsTimeSize;
+      foundCount = counts.ParamMissingCount(i);
+    }
+
+    // Sama laskenta kuin NFmiDataModifierDataChecking::CalculationResult:issa
+    float result = checkedCount ? foundCount / float(checkedCount) * 100 : kFloatMissing;
+    itsOhjausData->itsParamIdCheckList[itsParamIdIndex].itsCheckedParamMissingDataMaxProcent =
+        result;
+  }
+  return true;
+}
 //--------------------------------------------------------
 // DoStraightDataCheck
 //--------------------------------------------------------
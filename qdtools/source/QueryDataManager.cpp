@@ -12,8 +12,12 @@
 #include "QueryDataManager.h"
 
 #include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiLocation.h>
 #include <newbase/NFmiQueryData.h>
 
+#include <boost/filesystem/operations.hpp>
+
+#include <fstream>
 #include <sstream>
 #include <stdexcept>
 
@@ -47,6 +51,130 @@ bool locationvalid(NFmiFastQueryInfo& theQD)
   }
   return false;
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The name of the station index file of a querydata file
+ *
+ * The index is a hidden file so that FindQueryData never mistakes
+ * it for querydata.
+ */
+// ----------------------------------------------------------------------
+
+std::string indexfile(const std::string& theFile)
+{
+  return (NFmiFileSystem::DirName(theFile) + "/." + NFmiFileSystem::BaseName(theFile) +
+          ".stations");
+}
+
+const char* indexheader = "QueryDataManager station index 2";
+const char* indexfooter = "end";
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Margin for distance rounding differences in the index
+ *
+ * The querydata searches stations with chord lengths, the index
+ * with great circle distances. Files within the margin are loaded
+ * and the querydata makes the final decision.
+ */
+// ----------------------------------------------------------------------
+
+const double distancemargin = 1.0;  // meters
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the station index from the given file
+ *
+ * \param theFile The index file
+ * \param theModTime The modification time of the querydata file
+ * An index is accepted only if it is for the given modification time
+ * and it is complete and well formed up to the end marker.
+ *
+ * \return True, if a complete index for the given data was read
+ */
+// ----------------------------------------------------------------------
+
+bool QueryDataManager::StationIndex::read(const std::string& theFile, std::time_t theModTime)
+{
+  std::ifstream in(theFile.c_str());
+  if (!in) return false;
+
+  std::string header;
+  std::getline(in, header);
+  if (header != indexheader) return false;
+
+  long long modtime;
+  int isgrid;
+  std::size_t count;
+  if (!(in >> modtime >> isgrid >> count)) return false;
+  if (modtime != static_cast<long long>(theModTime)) return false;
+  if (isgrid != 0 && isgrid != 1) return false;
+  if (isgrid == 1 && count != 0) return false;
+
+  // Validate the index fully before using it
+
+  std::vector<std::pair<long, NFmiPoint> > tmp;
+  for (std::size_t i = 0; i < count; i++)
+  {
+    long wmo;
+    double lon, lat;
+    if (!(in >> wmo >> lon >> lat)) return false;
+    if (!(lon >= -360 && lon <= 360 && lat >= -90 && lat <= 90)) return false;
+    tmp.push_back(std::make_pair(wmo, NFmiPoint(lon, lat)));
+  }
+
+  std::string footer;
+  if (!(in >> footer) || footer != indexfooter) return false;
+  if (in >> footer) return false;
+
+  grid = (isgrid == 1);
+  stations.swap(tmp);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the station index to the given file
+ *
+ * The index is only an optimization, hence failures are ignored.
+ * The index is written to a uniquely named temporary file first so
+ * that concurrent writers never mix their output and other processes
+ * never see a partial index.
+ *
+ * \param theFile The index file
+ * \param theModTime The modification time of the querydata file
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::StationIndex::write(const std::string& theFile,
+                                           std::time_t theModTime) const
+{
+  try
+  {
+    const std::string tmpfile =
+        boost::filesystem::unique_path(theFile + ".%%%%-%%%%-%%%%-%%%%").string();
+    bool ok;
+    {
+      std::ofstream out(tmpfile.c_str());
+      if (!out) return;
+      out.precision(17);
+      out << indexheader << '\n'
+          << static_cast<long long>(theModTime) << ' ' << (grid ? 1 : 0) << ' '
+          << stations.size() << '\n';
+      for (std::size_t i = 0; i < stations.size(); i++)
+        out << stations[i].first << ' ' << stations[i].second.X() << ' '
+            << stations[i].second.Y() << '\n';
+      out << indexfooter << '\n';
+      out.close();
+      ok = !out.fail();
+    }
+    if (!ok || !NFmiFileSystem::RenameFile(tmpfile, theFile)) NFmiFileSystem::RemoveFile(tmpfile);
+  }
+  catch (...)
+  {
+  }
 }
 
 // ----------------------------------------------------------------------
@@ -57,29 +185,43 @@ bool locationvalid(NFmiFastQueryInfo& theQD)
  */
 // ----------------------------------------------------------------------
 
-QueryDataManager::QueryDataManager() : itsSearchPath(), itsData(), itsCurrentData()
+QueryDataManager::QueryDataManager()
+    : itsSearchPath(), itsMultiMode(false), itsData(), itsCurrentData()
 {
   itsCurrentData = itsData.end();
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Destructor
+ * \brief Copy constructor
  *
- * The destructor explicitly destroys all internal NFmiStreamQueryData
- * objects.
+ * The copy shares the querydata files with the original, including
+ * data loaded later by either one, but gets its own query infos so
+ * that the copy can be used in another thread.
+ * The current location is not copied.
  */
 // ----------------------------------------------------------------------
 
-QueryDataManager::~QueryDataManager()
+QueryDataManager::QueryDataManager(const QueryDataManager& theManager)
+    : itsSearchPath(theManager.itsSearchPath),
+      itsMultiMode(theManager.itsMultiMode),
+      itsData(theManager.itsData),
+      itsCurrentData()
 {
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
-  {
-    delete it->get<1>();  // querydata
-    delete it->get<2>();  // fastqueryinfo
-  }
+    it->get<2>().reset();
+  itsCurrentData = itsData.end();
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Destructor
+ *
+ * The querydata is destroyed once no copy of the manager uses it.
+ */
+// ----------------------------------------------------------------------
+
+QueryDataManager::~QueryDataManager() {}
 // ----------------------------------------------------------------------
 /*!
  * \brief Set the data search path
@@ -113,7 +255,8 @@ void QueryDataManager::searchpath(const std::string& theSearchPath)
 
 void QueryDataManager::addfile(const std::string& theFile)
 {
-  itsData.push_back(value_type(theFile, 0));
+  boost::shared_ptr<DataFile> file(new DataFile);
+  itsData.push_back(value_type(theFile, file, boost::shared_ptr<NFmiFastQueryInfo>()));
 }
 
 // ----------------------------------------------------------------------
@@ -132,6 +275,157 @@ void QueryDataManager::addfiles(const std::vector<std::string>& theFiles)
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Load all the querydata files now
+ *
+ * Normally the files are loaded only when a query resolves to them.
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::load()
+{
+  for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
+    require(it);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether any loaded querydata file has been replaced
+ *
+ * A file has been replaced if a newer file is found from the same
+ * directory, or if the modification time of the file has changed.
+ * Files which cannot be found at the moment are not considered
+ * replaced, the loaded data remains in use.
+ *
+ * \return True, if the data should be reloaded
+ */
+// ----------------------------------------------------------------------
+
+bool QueryDataManager::modified() const
+{
+  for (storage_type::const_iterator it = itsData.begin(); it != itsData.end(); ++it)
+  {
+    std::string file;
+    std::time_t modtime;
+    {
+      DataFile& df = *it->get<1>();
+      boost::mutex::scoped_lock lock(df.mutex);
+      if (df.file.empty()) continue;
+      file = df.file;
+      modtime = df.modtime;
+    }
+    try
+    {
+      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
+      std::string datafile = NFmiFileSystem::FindQueryData(filename);
+      if (datafile != file || NFmiFileSystem::FileModificationTime(datafile) != modtime)
+        return true;
+    }
+    catch (...)
+    {
+    }
+  }
+  return false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Resolve the querydata file if not resolved yet
+ *
+ * The caller must hold the lock of the file.
+ *
+ * \param theName The name of the file as given by the user
+ * \param theFile The file to resolve
+ */
+// ----------------------------------------------------------------------
+
+void QueryDataManager::resolve(const std::string& theName, DataFile& theFile) const
+{
+  if (theFile.file.empty())
+  {
+    std::string filename = NFmiFileSystem::FileComplete(theName, itsSearchPath);
+    std::string datafile = NFmiFileSystem::FindQueryData(filename);
+    theFile.modtime = NFmiFileSystem::FileModificationTime(datafile);
+    theFile.file = datafile;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Load the querydata of the given file if not loaded yet
+ *
+ * The data is loaded once for all copies of the manager, each copy
+ * then creates its own query info for it.
+ *
+ * \param it The file to load
+ * \return The query info of the file
+ */
+// ----------------------------------------------------------------------
+
+NFmiFastQueryInfo& QueryDataManager::require(storage_type::iterator it)
+{
+  if (!it->get<2>())
+  {
+    DataFile& df = *it->get<1>();
+    boost::mutex::scoped_lock lock(df.mutex);
+    if (!df.data)
+    {
+      resolve(it->get<0>(), df);
+      df.data.reset(new NFmiQueryData(df.file));
+    }
+    it->get<2>().reset(new NFmiFastQueryInfo(df.data.get()));
+  }
+  return *it->get<2>();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return the station index of the given file
+ *
+ * The index is read from the index file next to the querydata if
+ * it is up to date, otherwise the querydata is loaded and the index
+ * file is rewritten.
+ *
+ * \param it The file
+ * \return The station index of the file
+ */
+// ----------------------------------------------------------------------
+
+const QueryDataManager::StationIndex& QueryDataManager::index(storage_type::iterator it)
+{
+  DataFile& df = *it->get<1>();
+
+  std::string filename;
+  std::time_t modtime;
+  {
+    boost::mutex::scoped_lock lock(df.mutex);
+    if (df.index) return *df.index;
+    resolve(it->get<0>(), df);
+    filename = indexfile(df.file);
+    modtime = df.modtime;
+  }
+
+  boost::shared_ptr<StationIndex> idx(new StationIndex);
+  if (!idx->read(filename, modtime))
+  {
+    NFmiFastQueryInfo& qi = require(it);
+    idx->grid = qi.IsGrid();
+    idx->stations.clear();
+    if (!idx->grid)
+    {
+      for (qi.ResetLocation(); qi.NextLocation();)
+        idx->stations.push_back(
+            std::make_pair(qi.Location()->GetIdent(), qi.Location()->GetLocation()));
+    }
+    idx->write(filename, modtime);
+  }
+
+  boost::mutex::scoped_lock lock(df.mutex);
+  if (!df.index) df.index = idx;
+  return *df.index;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Test if the location has been set
@@ -178,15 +472,14 @@ void QueryDataManager::setstation(int theWmoNumber)
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
+    const StationIndex& idx = index(it);
+
+    bool found = false;
+    for (std::size_t i = 0; !found && i < idx.stations.size(); i++)
+      found = (idx.stations[i].first == theWmoNumber);
+    if (!found) continue;
 
-    if (it->get<2>()->Location(theWmoNumber))
+    if (require(it).Location(theWmoNumber))
     {
       itsCurrentData = it;
       return;
@@ -217,15 +510,32 @@ void QueryDataManager::setpoint(const NFmiPoint& theLonLat, double theMaxDistanc
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
+    const StationIndex& idx = index(it);
+
+    // Point data is loaded only if some station is close enough
+
+    if (!idx.grid)
     {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
+      if (idx.stations.empty()) continue;
+
+      double distance = -1;
+      for (std::size_t i = 0; i < idx.stations.size(); i++)
+      {
+        double dist = NFmiLocation(idx.stations[i].second).Distance(theLonLat);
+        if (distance < 0 || dist < distance) distance = dist;
+      }
+
+      if (distance > theMaxDistance + distancemargin)
+      {
+        if (smallest_distance < 0)
+          smallest_distance = distance;
+        else
+          smallest_distance = std::min(smallest_distance, distance);
+        continue;
+      }
     }
 
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    NFmiFastQueryInfo& qi = require(it);
 
     if (qi.NearestLocation(theLonLat, theMaxDistance))
     {
@@ -262,15 +572,16 @@ std::set<int> QueryDataManager::stations()
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
+    const StationIndex& idx = index(it);
+
+    if (!idx.grid)
     {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
+      for (std::size_t i = 0; i < idx.stations.size(); i++)
+        ret.insert(idx.stations[i].first);
+      continue;
     }
 
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    NFmiFastQueryInfo& qi = require(it);
 
     qi.ResetLocation();
     while (qi.NextLocation())
@@ -309,27 +620,26 @@ std::map<double, int> QueryDataManager::nearest(const NFmiPoint& theLonLat,
 
   for (storage_type::iterator it = itsData.begin(); it != itsData.end(); ++it)
   {
-    if (!it->get<1>())
-    {
-      std::string filename = NFmiFileSystem::FileComplete(it->get<0>(), itsSearchPath);
-      NFmiQueryData* qd = new NFmiQueryData(filename);
-      it->get<1>() = qd;
-      it->get<2>() = new NFmiFastQueryInfo(qd);
-    }
-
-    NFmiFastQueryInfo& qi = *(it->get<2>());
+    const StationIndex& idx = index(it);
 
     // Won't find nearest points from grids
-    if (qi.IsGrid()) continue;
+    if (idx.grid) continue;
 
-    qi.ResetLocation();
-    while (qi.NextLocation())
+    for (std::size_t i = 0; i < idx.stations.size(); i++)
     {
-      int wmo = qi.Location()->GetIdent();
-      double dist = qi.Location()->Distance(theLonLat);
+      int wmo = idx.stations[i].first;
+      double dist = NFmiLocation(idx.stations[i].second).Distance(theLonLat);
       if (dist <= theMaxDistance)
-        if (!theCheckingFlag || locationvalid(qi))
-          ret.insert(std::map<double, int>::value_type(dist, wmo));
+      {
+        // The data is loaded only when the station must be validated
+        if (theCheckingFlag)
+        {
+          NFmiFastQueryInfo& qi = require(it);
+          qi.LocationIndex(i);
+          if (!locationvalid(qi)) continue;
+        }
+        ret.insert(std::map<double, int>::value_type(dist, wmo));
+      }
     }
   }
 
@@ -7,23 +7,62 @@
 
 #include "TimeTools.h"
 #include <cstdlib>
+#include <map>
+#include <mutex>
 
 using namespace std;
 
 namespace TimeTools
 {
-// ----------------------------------------------------------------------
-/*!
- * \brief Convert UTC time to local time using current TZ
- *
- * \param theUtcTime The UTC time
- * \return The local time
- */
-// ----------------------------------------------------------------------
+namespace
+{
+// TZ is process wide, so it may be changed only while holding the mutex.
+// putenv keeps a pointer to the string, hence one permanent string per zone.
 
-const NFmiTime toLocalTime(const NFmiTime &theUtcTime)
+std::mutex tzmutex;
+map<string, string> tzvalues;
+
+// The zone of the latest timezone_time call of each thread
+thread_local string tzcurrent;
+
+// The TZ of the process before the first change
+bool tzsaved = false;
+string tzoriginal;
+
+void set_timezone(const string &theZone)
+{
+  if (!tzsaved)
+  {
+    const char *tz = getenv("TZ");
+    if (tz != nullptr) tzoriginal = "TZ=" + string(tz);
+    tzsaved = true;
+  }
+
+  string &tzvalue = tzvalues[theZone];
+  if (tzvalue.empty()) tzvalue = "TZ=" + theZone;
+  putenv(const_cast<char *>(tzvalue.c_str()));
+  tzset();
+}
+
+void restore_timezone()
+{
+  if (!tzsaved) return;
+
+  if (!tzoriginal.empty())
+    putenv(const_cast<char *>(tzoriginal.c_str()));
+  else
+  {
+#ifdef _MSC_VER
+    _putenv("TZ=");
+#else
+    unsetenv("TZ");
+#endif
+  }
+  tzset();
+}
+
+::time_t epoch_time(const NFmiTime &theUtcTime)
 {
-  // The UTC time
   struct ::tm utc;
   utc.tm_sec = theUtcTime.GetSec();
   utc.tm_min = theUtcTime.GetMin();
@@ -35,7 +74,23 @@ const NFmiTime toLocalTime(const NFmiTime &theUtcTime)
   utc.tm_yday = -1;
   utc.tm_isdst = -1;
 
-  ::time_t epochtime = NFmiStaticTime::my_timegm(&utc);
+  return NFmiStaticTime::my_timegm(&utc);
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert UTC time to local time using current TZ
+ *
+ * \param theUtcTime The UTC time
+ * \return The local time
+ */
+// ----------------------------------------------------------------------
+
+const NFmiTime toLocalTime(const NFmiTime &theUtcTime)
+{
+  // The UTC time
+  ::time_t epochtime = epoch_time(theUtcTime);
 
   struct ::tm local;
   ::localtime_r(&epochtime, &local);
@@ -71,10 +126,58 @@ const NFmiTime timezone_time(const NFmiTime &theUTCTime, const string &theZone)
   else if (theZone == "utc")
     zone = "UTC";
 
-  static string tzvalue = "TZ=" + zone;
-  putenv(const_cast<char *>(tzvalue.c_str()));
-  tzset();
+  std::lock_guard<std::mutex> lock(tzmutex);
+  set_timezone(zone);
+  tzcurrent = zone;
 
   return toLocalTime(theUTCTime);
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert UTC time to local time in the original TZ of the process
+ *
+ * Same as NFmiMetTime::CorrectLocalTime, but safe to use while other
+ * threads call timezone_time.
+ *
+ * \param theUtcTime The UTC time
+ * \return The local time
+ */
+// ----------------------------------------------------------------------
+
+const NFmiTime local_time(const NFmiMetTime &theUtcTime)
+{
+  std::lock_guard<std::mutex> lock(tzmutex);
+  restore_timezone();
+  return theUtcTime.CorrectLocalTime();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether daylight saving time is in effect
+ *
+ * The zone is the one used in the latest timezone_time call of the
+ * calling thread, or the current TZ if there has been no such call.
+ *
+ * \param theUtcTime The UTC time
+ * \return True if daylight saving time is in effect
+ */
+// ----------------------------------------------------------------------
+
+bool is_dst(const NFmiTime &theUtcTime)
+{
+  ::time_t epochtime = epoch_time(theUtcTime);
+
+  std::lock_guard<std::mutex> lock(tzmutex);
+  if (!tzcurrent.empty()) set_timezone(tzcurrent);
+
+  struct ::tm local;
+#ifdef _MSC_VER
+  ::localtime_s(&local, &epochtime);
+#else
+  ::localtime_r(&epochtime, &local);
+#endif
+
+  return (local.tm_isdst == 1);
+}
 }
@@ -2,6 +2,7 @@
 #include "nctools.h"
 
 #include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiQueryDataUtil.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -9,6 +10,10 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include <functional>
+#include <numeric>
 
 namespace
 {
@@ -23,6 +28,10 @@ std::map<std::string, int>
     unknownParIdMap;  // jos sallitaan tuntemattomien parametrien kytt, ne talletetaan thn
 int unknownParIdCounter = 1200;  // jos tuntematon paramtri, aloitetaan niiden id:t tst ja
                                  // kasvatetaan aina yhdell kun tulee uusia
+
+// NetCDF kirjasto ei ole thread-safe, joten lukemiset tehdn vuorotellen
+
+boost::mutex netcdf_mutex;
 }
 
 namespace nctools
@@ -476,6 +485,262 @@ bool is_name_in_list(const std::list<std::string> &nameList, const std::string n
   return false;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read one record of a variable into a contiguous buffer
+ *
+ * The record is the given index of the first dimension, as in get_rec.
+ * The values are read with a single hyperslab read instead of extracting
+ * them one at a time from NcValues.
+ */
+// ----------------------------------------------------------------------
+
+bool read_record(NcVar *var, long index, std::vector<float> &values)
+{
+  const int ndims = var->num_dims();
+  if (ndims <= 0) return false;
+
+  long *edges = var->edges();
+  std::vector<long> counts(edges, edges + ndims);
+  delete[] edges;
+
+  if (index < 0 || index >= counts[0]) return false;
+  counts[0] = 1;
+
+  const long size = std::accumulate(counts.begin(), counts.end(), 1L, std::multiplies<long>());
+  values.resize(size);
+  if (size == 0) return true;
+
+  std::vector<long> cur(ndims, 0);
+  cur[0] = index;
+
+  if (var->set_cur(&cur[0]) && var->get(&values[0], &counts[0])) return true;
+
+  // Fall back to NcValues if the library refuses to convert the values to floats
+
+  NcValues *vals = var->get_rec(index);
+  if (vals == 0) return false;
+  for (long i = 0; i < size; i++)
+    values[i] = vals->as_float(i);
+  delete vals;
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store one record into the active parameter and time
+ *
+ * NetCDF data ordering within a record is level, rows from bottom row
+ * to top row, left-right order in row, which matches the newbase
+ * location order. Hence each level is stored with a single call.
+ */
+// ----------------------------------------------------------------------
+
+void set_record_values(NFmiFastQueryInfo &info, const std::vector<float> &values)
+{
+  const unsigned long locations = info.SizeLocations();
+  if (locations == 0) return;
+
+  const unsigned long levels = std::min<unsigned long>(info.SizeLevels(), values.size() / locations);
+
+  std::vector<float> levelvalues(locations);
+
+  for (unsigned long level = 0; level < levels; level++)
+  {
+    const size_t idx = info.Index(info.ParamIndex(), 0, level, info.TimeIndex());
+    const size_t step = info.Index(info.ParamIndex(), 1, level, info.TimeIndex()) - idx;
+
+    std::copy(values.begin() + level * locations,
+              values.begin() + (level + 1) * locations,
+              levelvalues.begin());
+    info.SetValues(idx, step, locations, levelvalues);
+  }
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the records of one parameter in a worker thread
+ *
+ * Each thread gets its own copy of the record copier so that the
+ * read buffers are not shared.
+ */
+// ----------------------------------------------------------------------
+
+template <typename RecordCopier>
+void copy_records_in_thread(const NFmiFastQueryInfo &info,
+                            NFmiTimeIndexCalculator &calculator,
+                            RecordCopier copier)
+{
+  NFmiFastQueryInfo threadinfo(info);
+
+  unsigned long timeindex = 0;
+  while (calculator.GetCurrentTimeIndex(timeindex))
+  {
+    if (threadinfo.TimeIndex(timeindex)) copier(threadinfo, timeindex);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy all time records of the active parameter in parallel
+ */
+// ----------------------------------------------------------------------
+
+template <typename RecordCopier>
+void copy_records(const NFmiFastQueryInfo &info, const RecordCopier &copier)
+{
+  const unsigned long timesize = info.SizeTimes();
+  if (timesize == 0) return;
+
+  NFmiTimeIndexCalculator calculator(timesize);
+  const unsigned int threadcount =
+      NFmiQueryDataUtil::GetReasonableWorkingThreadCount(75, timesize);
+
+  boost::thread_group threads;
+  for (unsigned int i = 0; i < threadcount; i++)
+    threads.add_thread(new boost::thread(copy_records_in_thread<RecordCopier>,
+                                         boost::cref(info),
+                                         boost::ref(calculator),
+                                         copier));
+  threads.join_all();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copies regular variable records with scale, offset and unit conversions
+ */
+// ----------------------------------------------------------------------
+
+class RegularRecordCopier
+{
+ public:
+  RegularRecordCopier(NcVar *var, const std::string &units, bool ignoreUnitChange)
+      : itsVar(var),
+        itsMissingValue(nctools::get_missingvalue(var)),
+        itsScale(nctools::get_scale(var)),
+        itsOffset(nctools::get_offset(var)),
+        fIgnoreUnitChange(ignoreUnitChange),
+        fKelvin(units == "K"),
+        fPascal(units == "Pa"),
+        itsValues()
+  {
+  }
+
+  void operator()(NFmiFastQueryInfo &info, unsigned long timeindex)
+  {
+    {
+      boost::mutex::scoped_lock lock(netcdf_mutex);
+      if (!nctools::read_record(itsVar, timeindex, itsValues)) return;
+    }
+
+    for (float &value : itsValues)
+      value = convert(value);
+
+    nctools::set_record_values(info, itsValues);
+  }
+
+ private:
+  // Same as normalize_units(scale * value + offset, units) with missing value checks
+  float convert(float value) const
+  {
+    if (nctools::IsMissingValue(value, itsMissingValue)) return kFloatMissing;
+    if (fIgnoreUnitChange) return value;
+
+    value = itsScale * value + itsOffset;
+    if (value == kFloatMissing) return value;
+    if (fKelvin) return value - 273.15f;
+    if (fPascal) return value / 100.0f;
+    return value;
+  }
+
+  NcVar *itsVar;
+  float itsMissingValue;
+  float itsScale;
+  float itsOffset;
+  bool fIgnoreUnitChange;
+  bool fKelvin;
+  bool fPascal;
+  std::vector<float> itsValues;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copies speed or direction records calculated from X- and Y-components
+ */
+// ----------------------------------------------------------------------
+
+class WindRecordCopier
+{
+ public:
+  WindRecordCopier(NcVar *xvar, NcVar *yvar, bool isspeed)
+      : itsXVar(xvar),
+        itsYVar(yvar),
+        itsXMissingValue(nctools::get_missingvalue(xvar)),
+        itsXScale(nctools::get_scale(xvar)),
+        itsXOffset(nctools::get_offset(xvar)),
+        itsYMissingValue(nctools::get_missingvalue(yvar)),
+        itsYScale(nctools::get_scale(yvar)),
+        itsYOffset(nctools::get_offset(yvar)),
+        fIsSpeed(isspeed),
+        itsXValues(),
+        itsYValues()
+  {
+  }
+
+  void operator()(NFmiFastQueryInfo &info, unsigned long timeindex)
+  {
+    {
+      boost::mutex::scoped_lock lock(netcdf_mutex);
+      if (!nctools::read_record(itsXVar, timeindex, itsXValues)) return;
+      if (!nctools::read_record(itsYVar, timeindex, itsYValues)) return;
+    }
+
+    const size_t n = std::min(itsXValues.size(), itsYValues.size());
+    itsXValues.resize(n);
+
+    const float pi = 3.14159265358979326f;
+
+    for (size_t i = 0; i < n; i++)
+    {
+      float x = itsXValues[i];
+      float y = itsYValues[i];
+      if (x != itsXMissingValue && y != itsYMissingValue)
+      {
+        x = itsXScale * x + itsXOffset;
+        y = itsYScale * y + itsYOffset;
+
+        // We assume everything is in m/s here and all is fine
+
+        if (fIsSpeed)
+          itsXValues[i] = sqrt(x * x + y * y);
+        else
+          itsXValues[i] = 180 * atan2(x, y) / pi;
+      }
+      else
+        itsXValues[i] = kFloatMissing;
+    }
+
+    nctools::set_record_values(info, itsXValues);
+  }
+
+ private:
+  NcVar *itsXVar;
+  NcVar *itsYVar;
+  float itsXMissingValue;
+  float itsXScale;
+  float itsXOffset;
+  float itsYMissingValue;
+  float itsYScale;
+  float itsYOffset;
+  bool fIsSpeed;
+  std::vector<float> itsXValues;
+  std::vector<float> itsYValues;
+};
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * Copy regular variable data into querydata
@@ -494,33 +759,8 @@ void copy_values(const Options &options, NcVar *var, NFmiFastQueryInfo &info)
 
   report_units(var, units, options);
 
-  float missingvalue = get_missingvalue(var);
-  float scale = get_scale(var);
-  float offset = get_offset(var);
-
   // NetCDF data ordering: time, level, rows from bottom row to top row, left-right order in row
-  int timeindex = 0;
-  for (info.ResetTime(); info.NextTime(); ++timeindex)
-  {
-    // must delete
-    NcValues *vals = var->get_rec(timeindex);
-
-    long counter = 0;
-    for (info.ResetLevel(); info.NextLevel();)
-    {
-      for (info.ResetLocation(); info.NextLocation();)
-      {
-        float value = vals->as_float(counter);
-        if (!IsMissingValue(value, missingvalue))
-        {
-          if (!ignoreUnitChange) value = normalize_units(scale * value + offset, units);
-          info.FloatValue(value);
-        }
-        ++counter;
-      }
-    }
-    delete vals;
-  }
+  copy_records(info, RegularRecordCopier(var, units, ignoreUnitChange));
 }
 
 // ----------------------------------------------------------------------
@@ -531,53 +771,13 @@ void copy_values(const Options &options, NcVar *var, NFmiFastQueryInfo &info)
 
 void copy_values(const NcFile &ncfile, NFmiFastQueryInfo &info, const ParamInfo &pinfo)
 {
-  const float pi = 3.14159265358979326f;
-
   NcVar *xvar = find_variable(ncfile, pinfo.x_component);
   NcVar *yvar = find_variable(ncfile, pinfo.y_component);
 
   if (xvar == NULL || yvar == NULL) return;
 
-  float xmissingvalue = get_missingvalue(xvar);
-  float xscale = get_scale(xvar);
-  float xoffset = get_offset(xvar);
-
-  float ymissingvalue = get_missingvalue(yvar);
-  float yscale = get_scale(yvar);
-  float yoffset = get_offset(yvar);
-
   // NetCDF data ordering: time, level, y, x
-  int timeindex = 0;
-  for (info.ResetTime(); info.NextTime(); ++timeindex)
-  {
-    // must delete
-    NcValues *xvals = xvar->get_rec(timeindex);
-    NcValues *yvals = yvar->get_rec(timeindex);
-
-    long counter = 0;
-    for (info.ResetLevel(); info.NextLevel();)
-      for (info.ResetLocation(); info.NextLocation();)
-      {
-        float x = xvals->as_float(counter);
-        float y = yvals->as_float(counter);
-        if (x != xmissingvalue && y != ymissingvalue)
-        {
-          x = xscale * x + xoffset;
-          y = yscale * y + yoffset;
-
-          // We assume everything is in m/s here and all is fine
-
-          if (pinfo.isspeed)
-            info.FloatValue(sqrt(x * x + y * y));
-          else
-            info.FloatValue(180 * atan2(x, y) / pi);
-        }
-        ++counter;
-      }
-
-    delete xvals;
-    delete yvals;
-  }
+  copy_records(info, WindRecordCopier(xvar, yvar, pinfo.isspeed));
 }
 
 // ----------------------------------------------------------------------
@@ -432,6 +432,145 @@ static unsigned int mask[] = {0, 1, 3, 7, 15, 31, 63, 127, 255};
 static unsigned int map_masks[8] = {128, 64, 32, 16, 8, 4, 2, 1};
 static double shift[9] = {1.0, 2.0, 4.0, 8.0, 16.0, 32.0, 64.0, 128.0, 256.0};
 
+/*
+ * Fast unpacking of packed integers, used by BDS_unpack for n_bits <= 24.
+ *
+ * Every value is extracted independently of the previous one (no running
+ * bit buffer), so the loops can be vectorized by the compiler. The byte
+ * aligned widths 8, 16 and 24 and the common 12 bit width have their own
+ * loops, other widths read the 32 bits containing the value and shift it
+ * into place. The last values are unpacked one byte at a time so that no
+ * bytes after the packed data are read.
+ */
+
+static void unpack_ints(float *flt, const unsigned char *bits, int n_bits, int n)
+{
+  int i;
+
+  switch (n_bits)
+  {
+    case 8:
+      for (i = 0; i < n; i++)
+        flt[i] = static_cast<float>(bits[i]);
+      break;
+    case 16:
+      for (i = 0; i < n; i++)
+        flt[i] = static_cast<float>((bits[2 * i] << 8) | bits[2 * i + 1]);
+      break;
+    case 24:
+      for (i = 0; i < n; i++)
+        flt[i] = static_cast<float>((bits[3 * i] << 16) | (bits[3 * i + 1] << 8) |
+                                    bits[3 * i + 2]);
+      break;
+    case 12:
+      /* two values in three bytes */
+      for (i = 0; i < n / 2; i++)
+      {
+        const unsigned char *b = bits + 3 * i;
+        flt[2 * i] = static_cast<float>((b[0] << 4) | (b[1] >> 4));
+        flt[2 * i + 1] = static_cast<float>(((b[1] & 15) << 8) | b[2]);
+      }
+      if (n & 1)
+      {
+        const unsigned char *b = bits + 3 * (n / 2);
+        flt[n - 1] = static_cast<float>((b[0] << 4) | (b[1] >> 4));
+      }
+      break;
+    default:
+    {
+      unsigned int jmask = (1 << n_bits) - 1;
+      /* bytes in the packed data, value i needs bytes [i*n_bits/8, i*n_bits/8+3] */
+      long n_bytes = (static_cast<long>(n) * n_bits + 7) / 8;
+      int n_fast = 0;
+      if (n_bytes >= 4)
+        n_fast = static_cast<int>(std::min<long>(n, ((n_bytes - 4) * 8) / n_bits + 1));
+      for (i = 0; i < n_fast; i++)
+      {
+        long pos = static_cast<long>(i) * n_bits;
+        const unsigned char *b = bits + (pos >> 3);
+        unsigned int word =
+            (static_cast<unsigned int>(b[0]) << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+        flt[i] = static_cast<float>((word >> (32 - n_bits - (pos & 7))) & jmask);
+      }
+      for (; i < n; i++)
+      {
+        long pos = static_cast<long>(i) * n_bits;
+        const unsigned char *b = bits + (pos >> 3);
+        int t_bits = static_cast<int>(pos & 7) + n_bits;
+        unsigned int tbits = 0;
+        for (int k = 0; k < t_bits; k += 8)
+          tbits = (tbits << 8) | *b++;
+        t_bits = ((t_bits + 7) & ~7) - t_bits;
+        flt[i] = static_cast<float>((tbits >> t_bits) & jmask);
+      }
+      break;
+    }
+  }
+}
+
+static int count_bits(unsigned int x)
+{
+  int count = 0;
+  for (; x; count++)
+    x &= x - 1;
+  return count;
+}
+
+/*
+ * Unpack with a bitmap: the defined values are first unpacked to the end
+ * of the output array, and then scaled while expanding them forwards to
+ * their places. Whole bitmap bytes with all or no points defined are
+ * handled eight points at a time.
+ */
+
+static void unpack_with_bitmap(float *flt,
+                               const unsigned char *bits,
+                               const unsigned char *bitmap,
+                               int n_bits,
+                               int n,
+                               double ref,
+                               double scale)
+{
+  int i, k, defined = 0;
+
+  for (i = 0; i < n / 8; i++)
+    defined += count_bits(bitmap[i]);
+  if (n & 7) defined += count_bits(bitmap[n / 8] & (0xff00 >> (n & 7)) & 0xff);
+
+  float *packed = flt + (n - defined);
+  unpack_ints(packed, bits, n_bits, defined);
+
+  /* read position k never falls behind write position i */
+  k = n - defined;
+  for (i = 0; i < n;)
+  {
+    unsigned int bbits = bitmap[i >> 3];
+    if (bbits == 0xff && i + 8 <= n)
+    {
+      for (int j = 0; j < 8; j++)
+        flt[i + j] = static_cast<float>(ref + scale * flt[k + j]);
+      i += 8;
+      k += 8;
+    }
+    else if (bbits == 0 && i + 8 <= n)
+    {
+      for (int j = 0; j < 8; j++)
+        flt[i + j] = static_cast<float>(UNDEFINED);
+      i += 8;
+    }
+    else
+    {
+      for (int j = 0; j < 8 && i < n; j++, i++)
+      {
+        if (bbits & map_masks[j])
+          flt[i] = static_cast<float>(ref + scale * flt[k++]);
+        else
+          flt[i] = static_cast<float>(UNDEFINED);
+      }
+    }
+  }
+}
+
 void BDS_unpack(float *flt,
                 unsigned char *bds,
                 unsigned char *bitmap,
@@ -460,8 +599,21 @@ void BDS_unpack(float *flt,
 
   tbits = bbits = 0;
 
+  if (n_bits <= 24)
+  {
+    if (bitmap)
+      unpack_with_bitmap(flt, bits, bitmap, n_bits, n, ref, scale);
+    else
+    {
+      unpack_ints(flt, bits, n_bits, n);
+      for (i = 0; i < n; i++)
+      {
+        flt[i] = static_cast<float>(ref + scale * flt[i]);
+      }
+    }
+  }
   /* assume integer has 32+ bits */
-  if (n_bits <= 25)
+  else if (n_bits <= 25)
   {
     jmask = (1 << n_bits) - 1;
     t_bits = 0;
@@ -0,0 +1,174 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Regression test for NFmiQueryDataUtil::DoAreaFiltering
+ *
+ * Compares the grid box filter of DoAreaFiltering with the original
+ * iterator based implementation. All parameters are compared including
+ * the subparameters of combined parameters such as TotalWind and
+ * WeatherAndCloudiness.
+ *
+ * Usage: areafilter <querydata> <filterid> <xsize> <ysize>
+ *
+ * Prints OK if the results match, otherwise the first difference.
+ * The avg and sum filters accumulate in double precision instead of
+ * float, hence their results may differ by float rounding.
+ */
+// ======================================================================
+
+#include <newbase/NFmiCalculator.h>
+#include <newbase/NFmiDataModifierAvg.h>
+#include <newbase/NFmiDataModifierMax.h>
+#include <newbase/NFmiDataModifierMin.h>
+#include <newbase/NFmiDataModifierSum.h>
+#include <newbase/NFmiFastQueryInfo.h>
+#include <newbase/NFmiQueryData.h>
+#include <newbase/NFmiQueryDataUtil.h>
+#include <newbase/NFmiRelativeDataIterator.h>
+#include <newbase/NFmiSuperSmartInfo.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief The original iterator based area filter
+ */
+// ----------------------------------------------------------------------
+
+NFmiQueryData *reference_filter(NFmiQueryData &theSourceData,
+                                int theFilterId,
+                                int theXCount,
+                                int theYCount)
+{
+  boost::shared_ptr<NFmiDataModifier> modifier;
+  switch (theFilterId)
+  {
+    case 0:
+      modifier.reset(new NFmiDataModifierAvg());
+      break;
+    case 1:
+      modifier.reset(new NFmiDataModifierMax());
+      break;
+    case 2:
+      modifier.reset(new NFmiDataModifierMin());
+      break;
+    case 5:
+      modifier.reset(new NFmiDataModifierSum());
+      break;
+    default:
+      throw std::runtime_error("Unsupported filter id " +
+                               boost::lexical_cast<std::string>(theFilterId));
+  }
+
+  NFmiQueryData *data = theSourceData.Clone();
+  NFmiFastQueryInfo destInfo(data);
+  NFmiSuperSmartInfo sourceInfo(&theSourceData);
+  NFmiRelativeDataIterator areaIterator(&sourceInfo, theXCount, theYCount);
+  NFmiCalculator calculator(&areaIterator, modifier.get());
+  sourceInfo.SetCalculator(&calculator);
+
+  for (destInfo.ResetParam(), sourceInfo.ResetParam();
+       destInfo.NextParam() && sourceInfo.NextParam();)
+  {
+    for (destInfo.ResetLocation(), sourceInfo.ResetLocation();
+         destInfo.NextLocation() && sourceInfo.NextLocation();)
+    {
+      for (destInfo.ResetLevel(), sourceInfo.ResetLevel();
+           destInfo.NextLevel() && sourceInfo.NextLevel();)
+      {
+        for (destInfo.ResetTime(), sourceInfo.ResetTime();
+             destInfo.NextTime() && sourceInfo.NextTime();)
+        {
+          float value = sourceInfo.FloatValue(false, true, false, false);
+          destInfo.FloatValue(value);
+        }
+      }
+    }
+  }
+  return data;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether two filtered values match
+ */
+// ----------------------------------------------------------------------
+
+bool same_value(float theValue1, float theValue2, bool allowRounding)
+{
+  if (theValue1 == theValue2) return true;
+  if (!allowRounding || theValue1 == kFloatMissing || theValue2 == kFloatMissing) return false;
+  return std::fabs(theValue1 - theValue2) <= 1e-4 * std::max(1.0f, std::fabs(theValue2));
+}
+
+}  // namespace
+
+int main(int argc, const char *argv[])
+{
+  try
+  {
+    if (argc != 5)
+    {
+      std::cerr << "Usage: areafilter <querydata> <filterid> <xsize> <ysize>" << std::endl;
+      return 1;
+    }
+
+    const int filterid = boost::lexical_cast<int>(argv[2]);
+    const int xsize = boost::lexical_cast<int>(argv[3]);
+    const int ysize = boost::lexical_cast<int>(argv[4]);
+
+    NFmiQueryData source(argv[1]);
+
+    std::unique_ptr<NFmiQueryData> result(
+        NFmiQueryDataUtil::DoAreaFiltering(&source, filterid, 2, xsize, ysize));
+    std::unique_ptr<NFmiQueryData> expected(
+        reference_filter(source, filterid, xsize / 2, ysize / 2));
+
+    if (!result)
+    {
+      std::cout << "DoAreaFiltering returned no data" << std::endl;
+      return 1;
+    }
+
+    const bool allowRounding = (filterid == 0 || filterid == 5);
+
+    NFmiFastQueryInfo info1(result.get());
+    NFmiFastQueryInfo info2(expected.get());
+
+    // Iterate subparameters too, they are what the combined parameters unpack to
+    for (info1.ResetParam(), info2.ResetParam(); info1.NextParam(false) && info2.NextParam(false);)
+      for (info1.ResetLocation(), info2.ResetLocation();
+           info1.NextLocation() && info2.NextLocation();)
+        for (info1.ResetLevel(), info2.ResetLevel(); info1.NextLevel() && info2.NextLevel();)
+          for (info1.ResetTime(), info2.ResetTime(); info1.NextTime() && info2.NextTime();)
+          {
+            float value1 = info1.FloatValue();
+            float value2 = info2.FloatValue();
+            if (!same_value(value1, value2, allowRounding))
+            {
+              std::cout << "Param " << info1.Param().GetParamIdent() << " location "
+                        << info1.LocationIndex() << " level " << info1.LevelIndex() << " time "
+                        << info1.TimeIndex() << ": " << value1 << " <> " << value2 << std::endl;
+              return 1;
+            }
+          }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+  }
+  catch (std::exception &e)
+  {
+    std::cout << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,224 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Regression test for the GRIB1 simple packing unpacker
+ *
+ * Compares BDS_unpack byte by byte with the original wgrib unpacker
+ * on generated packed data.
+ *
+ * Usage: wgrib_unpack <n_bits> <bitmap|nobitmap>
+ *
+ * Prints OK if all cases are identical, otherwise the first case
+ * which differs.
+ */
+// ======================================================================
+
+#include "wgrib_functions.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief The original wgrib unpacker for n_bits <= 25
+ */
+// ----------------------------------------------------------------------
+
+void reference_unpack(float *flt,
+                      const unsigned char *bits,
+                      const unsigned char *bitmap,
+                      int n_bits,
+                      int n,
+                      double ref,
+                      double scale)
+{
+  static const unsigned int map_masks[8] = {128, 64, 32, 16, 8, 4, 2, 1};
+
+  int i, mask_idx, t_bits;
+  unsigned int j, tbits, jmask, bbits;
+
+  tbits = bbits = 0;
+  jmask = (1 << n_bits) - 1;
+  t_bits = 0;
+
+  if (bitmap)
+  {
+    for (i = 0; i < n; i++)
+    {
+      /* check bitmap */
+      mask_idx = i & 7;
+      if (mask_idx == 0) bbits = *bitmap++;
+      if ((bbits & map_masks[mask_idx]) == 0)
+      {
+        *flt++ = static_cast<float>(UNDEFINED);
+        continue;
+      }
+
+      while (t_bits < n_bits)
+      {
+        tbits = (tbits * 256) + *bits++;
+        t_bits += 8;
+      }
+      t_bits -= n_bits;
+      j = (tbits >> t_bits) & jmask;
+      *flt++ = static_cast<float>(ref + scale * j);
+    }
+  }
+  else
+  {
+    for (i = 0; i < n; i++)
+    {
+      while (t_bits < n_bits)
+      {
+        tbits = (tbits * 256) + *bits++;
+        t_bits += 8;
+      }
+      t_bits -= n_bits;
+      flt[i] = static_cast<float>((tbits >> t_bits) & jmask);
+    }
+    for (i = 0; i < n; i++)
+    {
+      flt[i] = static_cast<float>(ref + scale * flt[i]);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Deterministic pseudo random numbers
+ */
+// ----------------------------------------------------------------------
+
+unsigned int seed = 12345;
+
+unsigned int next_random()
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Generate a bitmap for n points
+ *
+ * The patterns are random points, all points, no points and
+ * runs of defined and undefined points.
+ */
+// ----------------------------------------------------------------------
+
+std::vector<unsigned char> make_bitmap(int n, int pattern)
+{
+  std::vector<unsigned char> bitmap((n + 7) / 8, 0);
+  bool defined = true;
+  for (int i = 0; i < n; i++)
+  {
+    switch (pattern)
+    {
+      case 0:
+        defined = (next_random() & 1);
+        break;
+      case 1:
+        defined = true;
+        break;
+      case 2:
+        defined = false;
+        break;
+      default:
+        if (next_random() % 13 == 0) defined = !defined;
+        break;
+    }
+    if (defined) bitmap[i / 8] |= static_cast<unsigned char>(128 >> (i & 7));
+  }
+  return bitmap;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Compare the unpackers for one case
+ */
+// ----------------------------------------------------------------------
+
+bool test_case(int n_bits, int n, const std::vector<unsigned char> *bitmap)
+{
+  int defined = n;
+  if (bitmap)
+  {
+    defined = 0;
+    for (int i = 0; i < n; i++)
+      if ((*bitmap)[i / 8] & (128 >> (i & 7))) defined++;
+  }
+
+  // The BDS is allocated exactly so that reading past the packed
+  // data can be detected with memory checkers
+
+  const int header = 11;
+  std::vector<unsigned char> bds(header + (static_cast<long>(defined) * n_bits + 7) / 8);
+  for (std::size_t i = header; i < bds.size(); i++)
+    bds[i] = static_cast<unsigned char>(next_random());
+
+  const double ref = -273.15;
+  const double scale = 0.0123;
+
+  unsigned char *map = (bitmap ? const_cast<unsigned char *>(&(*bitmap)[0]) : nullptr);
+
+  std::vector<float> expected(n + 1), result(n + 1);
+  reference_unpack(&expected[0], &bds[header], map, n_bits, n, ref, scale);
+  BDS_unpack(&result[0], &bds[0], map, n_bits, n, ref, scale);
+
+  return (std::memcmp(&expected[0], &result[0], n * sizeof(float)) == 0);
+}
+}  // namespace
+
+int main(int argc, const char *argv[])
+{
+  if (argc != 3)
+  {
+    std::cerr << "Usage: wgrib_unpack <n_bits> <bitmap|nobitmap>" << std::endl;
+    return 1;
+  }
+
+  const int n_bits = std::stoi(argv[1]);
+  const bool use_bitmap = (std::string(argv[2]) == "bitmap");
+
+  // All short lengths cover the tail handling, the long ones the main loops
+
+  std::vector<int> sizes;
+  for (int n = 1; n <= 80; n++)
+    sizes.push_back(n);
+  sizes.push_back(1000);
+  sizes.push_back(1001);
+  sizes.push_back(4099);
+
+  for (std::size_t i = 0; i < sizes.size(); i++)
+  {
+    const int n = sizes[i];
+    if (!use_bitmap)
+    {
+      if (!test_case(n_bits, n, nullptr))
+      {
+        std::cout << "FAILED: n_bits=" << n_bits << " n=" << n << std::endl;
+        return 1;
+      }
+    }
+    else
+    {
+      for (int pattern = 0; pattern < 4; pattern++)
+      {
+        std::vector<unsigned char> bitmap = make_bitmap(n, pattern);
+        if (!test_case(n_bits, n, &bitmap))
+        {
+          std::cout << "FAILED: n_bits=" << n_bits << " n=" << n << " bitmap pattern=" << pattern
+                    << std::endl;
+          return 1;
+        }
+      }
+    }
+  }
+
+  std::cout << "OK" << std::endl;
+  return 0;
+}